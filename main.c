@@ -20,6 +20,8 @@
 #include "base/misc.h"
 #include <libcaer/events/frame.h>
 #include <libcaer/events/imu6.h>
+#include <libcaer/events/point2d.h>
+#include <libcaer/events/point4d.h>
 
 // Devices support.
 #ifdef DVS128
@@ -40,22 +42,53 @@
 #include "modules/misc/in/net_tcp.h"
 #include "modules/misc/in/unix_socket.h"
 #endif
+#ifdef ENABLE_SHARED_MEMORY_INPUT
+#include "modules/misc/in/shm.h"
+#endif
+#ifdef ENABLE_PACKETMERGE
+#include "modules/packetmerge/packetmerge.h"
+#endif
 
-#ifdef ENABLE_FILE_OUTPUT
+#if defined(ENABLE_FILE_OUTPUT) || defined(ENABLE_FLIGHT_RECORDER_OUTPUT)
 #include "modules/misc/out/file.h"
 #endif
 #ifdef ENABLE_NETWORK_OUTPUT
 #include "modules/misc/out/net_tcp_server.h"
 #include "modules/misc/out/net_tcp.h"
+#include "modules/misc/out/net_tcp_mux.h"
 #include "modules/misc/out/net_udp.h"
 #include "modules/misc/out/unix_socket_server.h"
 #include "modules/misc/out/unix_socket.h"
 #endif
+#ifdef ENABLE_SHARED_MEMORY_OUTPUT
+#include "modules/misc/out/shm.h"
+#endif
 
 // Common filters support.
+#ifdef ENABLE_HOTPIXELFILTER
+#include "modules/hotpixelfilter/hotpixelfilter.h"
+#endif
+#ifdef ENABLE_ROIFILTER
+#include "modules/roifilter/roifilter.h"
+#endif
 #ifdef ENABLE_BAFILTER
 #include "modules/backgroundactivityfilter/backgroundactivityfilter.h"
 #endif
+#ifdef ENABLE_REFRACTORYFILTER
+#include "modules/refractoryfilter/refractoryfilter.h"
+#endif
+#ifdef ENABLE_PACKETCOMPACTION
+#include "modules/packetcompaction/packetcompaction.h"
+#endif
+#ifdef ENABLE_CORNERDETECTOR
+#include "modules/cornerdetector/cornerdetector.h"
+#endif
+#ifdef ENABLE_CLUSTERTRACKER
+#include "modules/clustertracker/clustertracker.h"
+#endif
+#ifdef ENABLE_ACCUMULATOR
+#include "modules/accumulator/accumulator.h"
+#endif
 #ifdef ENABLE_CAMERACALIBRATION
 #include "modules/cameracalibration/cameracalibration.h"
 #endif
@@ -64,6 +97,7 @@
 #endif
 #ifdef ENABLE_OPTICFLOW
 #include "modules/opticflow/opticflow.h"
+#include "modules/opticflow/ventralflow.h"
 #include "modules/opticflow/flowEvent.h"
 #endif
 #ifdef ENABLE_STATISTICS
@@ -96,8 +130,13 @@ static bool mainloop_1(void) {
 	caerPolarityEventPacket polarity = NULL;
 	caerFrameEventPacket frame = NULL;
 	caerIMU6EventPacket imu = NULL;
+	caerPoint2DEventPacket corners = NULL;
+	caerPoint2DEventPacket clusters = NULL;
+	caerPoint4DEventPacket tracks = NULL;
+	caerFrameEventPacket accumulated = NULL;
 
 	FlowEventPacket flow = NULL;
+	caerPoint4DEventPacket ventralFlow = NULL;
 
 	// Input modules grab data from outside sources (like devices, files, ...)
 	// and put events into an event packet.
@@ -115,6 +154,13 @@ static bool mainloop_1(void) {
 #ifdef DAVISFX3
 	container = caerInputDAVISFX3(1);
 #endif
+#if defined(ENABLE_PACKETMERGE) && defined(DAVISFX3)
+	// A second camera, for stereo: both are merged into one time-ordered stream,
+	// as if coming from one sensor twice as wide. Cameras must be time-synchronized.
+	// Special and IMU6 events stay per camera, the ones below are the first camera's.
+	caerEventPacketContainer container2 = caerInputDAVISFX3(26);
+	container = caerPacketMerge(27, 2, container, container2);
+#endif
 #if defined(DAVISFX2) || defined(DAVISFX3)
 	// Typed EventPackets contain events of a certain type.
 	special = (caerSpecialEventPacket) caerEventPacketContainerGetEventPacket(container, SPECIAL_EVENT);
@@ -131,7 +177,10 @@ static bool mainloop_1(void) {
 #ifdef ENABLE_NETWORK_INPUT
 	container = caerInputNetTCP(11);
 #endif
-#if defined(ENABLE_FILE_INPUT) || defined(ENABLE_NETWORK_INPUT)
+#ifdef ENABLE_SHARED_MEMORY_INPUT
+	container = caerInputSharedMemory(12);
+#endif
+#if defined(ENABLE_FILE_INPUT) || defined(ENABLE_NETWORK_INPUT) || defined(ENABLE_SHARED_MEMORY_INPUT)
 	// Typed EventPackets contain events of a certain type.
 	// We search for them by type here, because input modules may not have all or any of them.
 	special = (caerSpecialEventPacket) caerEventPacketContainerGetEventPacketForType(container, SPECIAL_EVENT);
@@ -143,10 +192,56 @@ static bool mainloop_1(void) {
 	// Filters process event packets: for example to suppress certain events,
 	// like with the Background Activity Filter, which suppresses events that
 	// look to be uncorrelated with real scene changes (noise reduction).
+	// Hot pixels go first, so no other filter has to look at their events.
+#ifdef ENABLE_HOTPIXELFILTER
+	caerHotPixelFilter(17, polarity);
+#endif
+
+	// Keep only the regions of interest, and put a bound on the event rate.
+#ifdef ENABLE_ROIFILTER
+	caerROIFilter(19, polarity);
+#endif
+
 #ifdef ENABLE_BAFILTER
 	caerBackgroundActivityFilter(2, polarity);
 #endif
 
+	// Limit how often a pixel (or a block of pixels) may fire, and drop what's
+	// filtered from the packet, to cut the load on all later modules.
+#ifdef ENABLE_REFRACTORYFILTER
+	caerRefractoryFilter(18, polarity);
+#endif
+
+	// Once filters have invalidated enough events, remove them from the packets,
+	// so all following modules walk dense arrays. Add more where useful.
+#ifdef ENABLE_PACKETCOMPACTION
+	caerPacketCompaction(30, 1, polarity);
+#endif
+
+	// Detect corners on the event stream, as features for tracking.
+#ifdef ENABLE_CORNERDETECTOR
+	corners = caerCornerDetector(31, polarity);
+	#ifdef ENABLE_VISUALIZER
+		caerVisualizer(68, "Corners", &caerVisualizerRendererPoint2DEvents, NULL, (caerEventPacketHeader) corners);
+	#endif
+#endif
+
+	// Track moving objects as clusters of events.
+#ifdef ENABLE_CLUSTERTRACKER
+	caerClusterTracker(23, polarity, &clusters, &tracks);
+	#ifdef ENABLE_VISUALIZER
+		caerVisualizer(69, "Clusters", &caerVisualizerRendererPoint2DEvents, NULL, (caerEventPacketHeader) clusters);
+	#endif
+#endif
+
+	// Accumulate events into time surface or event count frames, at a fixed rate.
+#ifdef ENABLE_ACCUMULATOR
+	accumulated = caerAccumulator(25, polarity);
+	#ifdef ENABLE_VISUALIZER
+		caerVisualizer(67, "Accumulator", &caerVisualizerRendererFrameEvents, NULL, (caerEventPacketHeader) accumulated);
+	#endif
+#endif
+
 	// Filters can also extract information from event packets: for example
 	// to show statistics about the current event-rate.
 #if defined(ENABLE_STATISTICS) && !defined(ENABLE_OPTICFLOW)
@@ -167,10 +262,15 @@ static bool mainloop_1(void) {
 #ifdef ENABLE_OPTICFLOW
 	flow = flowEventPacketInitFromPolarity(polarity);
 	caerOpticFlowFilter(20, flow);
+	// Estimate ego-motion (ventral flow, divergence) from the flow field.
+	caerVentralFlowEstimator(28, flow, &ventralFlow);
 	#ifdef ENABLE_VISUALIZER
 		caerVisualizer(63, "Flow", &caerVisualizerRendererFlowEvents, NULL, (caerEventPacketHeader) flow);
 	#endif
-	flowEventPacketFree(flow);
+	// Keep the flow packet until the end of this run, so outputs can send it too.
+	if (flow != NULL) {
+		caerMainloopFreeAfterLoop((void (*)(void *)) &flowEventPacketFree, flow);
+	}
 #endif
 
 	//Enable camera pose estimation
@@ -189,7 +289,18 @@ static bool mainloop_1(void) {
 
 #ifdef ENABLE_FILE_OUTPUT
 	// Enable output to file (AEDAT 3.X format).
-	caerOutputFile(7, 4, polarity, frame, imu, special);
+	#ifdef ENABLE_OPTICFLOW
+		// Flow events are just another packet type there (FLOW_EVENT_TYPE).
+		caerOutputFile(7, 5, polarity, frame, imu, special, flow);
+	#else
+		caerOutputFile(7, 4, polarity, frame, imu, special);
+	#endif
+#endif
+
+#ifdef ENABLE_FLIGHT_RECORDER_OUTPUT
+	// Keep the last seconds of data in memory, and only write them to file,
+	// together with what follows, when triggered by an external input event.
+	caerOutputFlightRecorder(14, 4, polarity, frame, imu, special);
 #endif
 
 #ifdef ENABLE_NETWORK_OUTPUT
@@ -201,6 +312,29 @@ static bool mainloop_1(void) {
 
 	// And also send them via UDP. This is fast, as it doesn't care what is on the other side.
 	caerOutputNetUDP(9, 4, polarity, frame, imu, special);
+
+	// Or multiplex several channels over a single TCP connection. Both modules
+	// share the server on port 7778. The frame channel has a higher 'priority'
+	// value, so it doesn't delay the events.
+	caerOutputNetTCPMux(15, 1, 3, polarity, imu, special);
+	caerOutputNetTCPMux(16, 2, 1, frame);
+
+	#ifdef ENABLE_CLUSTERTRACKER
+		// Tracks are tiny, give them their own channel, for low latency.
+		caerOutputNetTCPMux(24, 0, 1, tracks);
+	#endif
+
+	#ifdef ENABLE_OPTICFLOW
+		// Same for the ego-motion estimates, which a controller consumes.
+		caerOutputNetTCPMux(29, 0, 1, ventralFlow);
+	#endif
+#endif
+
+#ifdef ENABLE_SHARED_MEMORY_OUTPUT
+	// Make packets available to other processes on this machine via shared memory.
+	// Only one copy is made, and slow consumers never block the pipeline: if all
+	// slots are in use, the newest data is dropped.
+	caerOutputSharedMemory(13, 4, polarity, frame, imu, special);
 #endif
 
 #ifdef ENABLE_IMAGEGENERATOR
@@ -264,7 +398,7 @@ static bool mainloop_1(void) {
 	caerFrameEventPacket imagestreamer = NULL;
 	caerFrameEventPacket imagestreamer_frame = NULL;
 
-#if defined(DAVISFX2) || defined(DAVISFX3) || defined(ENABLE_FILE_INPUT) || defined(ENABLE_NETWORK_INPUT)
+#if defined(DAVISFX2) || defined(DAVISFX3) || defined(ENABLE_FILE_INPUT) || defined(ENABLE_NETWORK_INPUT) || defined(ENABLE_SHARED_MEMORY_INPUT)
 	unsigned char ** frame_img_ptr = calloc(sizeof(unsigned char *), 1);
 	// generate images
 	caerImageGenerator(20, polarity, file_strings_classify, (int) MAX_IMG_QTY, CLASSIFY_IMG_SIZE, display_img_ptr, frame, &imagestreamer, &imagestreamer_frame, frame_img_ptr);
@@ -291,7 +425,7 @@ static bool mainloop_1(void) {
 
 #if defined(ENABLE_VISUALIZER) && defined(ENABLE_IMAGEGENERATOR)
 	caerVisualizer(65, "ImageStreamerHist", &caerVisualizerRendererFrameEvents, NULL, (caerEventPacketHeader) imagestreamer);
-#if defined(DAVISFX2) || defined(DAVISFX3) || defined(ENABLE_FILE_INPUT) || defined(ENABLE_NETWORK_INPUT)
+#if defined(DAVISFX2) || defined(DAVISFX3) || defined(ENABLE_FILE_INPUT) || defined(ENABLE_NETWORK_INPUT) || defined(ENABLE_SHARED_MEMORY_INPUT)
 	// add allegro bips
 	// display accumulated spike image in hist
 	caerVisualizer(64, "ImageStreamerFrame", &caerVisualizerRendererFrameEvents, NULL, (caerEventPacketHeader) imagestreamer_frame);
@@ -0,0 +1,457 @@
+/*
+ * accumulator.c
+ *
+ * Both representations are kept per pixel and polarity, next to the time of
+ * the pixel's last update, and only decayed when needed (lazily):
+ * - time surface: the value is exp(-age / decayTime), so only the timestamp
+ *   of the last event is stored;
+ * - event count: the count is decayed to the time of a new event before
+ *   adding it, and to the frame time when a frame is made.
+ *
+ * Making a frame is a few passes over contiguous arrays, without branches,
+ * using a polynomial exp2() approximation, so the compiler can vectorize it.
+ * The same code is also compiled for AVX2/FMA, and picked at runtime if the
+ * CPU supports it.
+ */
+
+#include "accumulator.h"
+#include "base/mainloop.h"
+#include "base/module.h"
+#include <math.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+	#define ACCUMULATOR_X86_SIMD 1
+#endif
+
+// Ages are capped at this (about 18 minutes), so they never wrap around
+// in 32 bits, even for pixels that don't fire for hours.
+#define ACCUMULATOR_MAX_AGE (1 << 30)
+
+enum AccumulatorMode {
+	ACCUMULATOR_TIME_SURFACE, ACCUMULATOR_EVENT_COUNT,
+};
+
+struct Accumulator_state {
+	/// Row-major maps, one per polarity: lower 32 bits of the 64-bit timestamp
+	/// of the last update, and decayed event count as of then (event count mode only).
+	uint32_t *timestampMap[2];
+	float *countMap[2];
+	/// Scratch space for the per-polarity values of a frame, in [0, 1].
+	float *valueMap[2];
+	size_t sizeX;
+	size_t sizeY;
+	/// Event time of the last frame, and of the next.
+	int64_t frameTimestamp;
+	int64_t nextFrameTimestamp;
+	enum AccumulatorMode mode;
+	int32_t decayTime;
+	/// -1 / (decayTime * ln(2)), to decay by exp2(age * decayRate).
+	float decayRate;
+	/// Age at which values are fully decayed (2^-126), at most ACCUMULATOR_MAX_AGE.
+	uint32_t maxAge;
+	float countScale;
+	int32_t frameInterval;
+	bool colorOutput;
+	caerFrameEventPacket frame;
+};
+
+typedef struct Accumulator_state *AccumulatorState;
+
+static bool caerAccumulatorInit(caerModuleData moduleData);
+static void caerAccumulatorRun(caerModuleData moduleData, size_t argsNumber, va_list args);
+static void caerAccumulatorConfig(caerModuleData moduleData);
+static void caerAccumulatorExit(caerModuleData moduleData);
+static void updateConfig(caerModuleData moduleData);
+static bool allocateMaps(AccumulatorState state, int16_t sourceID, int64_t firstTimestamp);
+static void freeMaps(AccumulatorState state);
+static inline float fastExp2(float x);
+static inline float decayFactor(uint32_t age, uint32_t maxAge, float decayRate);
+static void renderFrame(AccumulatorState state, uint32_t timestamp, uint16_t *pixels);
+static void renderFrameGeneric(AccumulatorState state, uint32_t timestamp, uint16_t *pixels);
+#if defined(ACCUMULATOR_X86_SIMD)
+static void renderFrameAVX2(AccumulatorState state, uint32_t timestamp, uint16_t *pixels);
+#endif
+
+static struct caer_module_functions caerAccumulatorFunctions = { .moduleInit = &caerAccumulatorInit, .moduleRun =
+	&caerAccumulatorRun, .moduleConfig = &caerAccumulatorConfig, .moduleExit = &caerAccumulatorExit };
+
+caerFrameEventPacket caerAccumulator(uint16_t moduleID, caerPolarityEventPacket polarity) {
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "Accumulator");
+	if (moduleData == NULL) {
+		return (NULL);
+	}
+
+	caerFrameEventPacket frame = NULL;
+
+	caerModuleSM(&caerAccumulatorFunctions, moduleData, sizeof(struct Accumulator_state), 2, polarity, &frame);
+
+	return (frame);
+}
+
+static bool caerAccumulatorInit(caerModuleData moduleData) {
+	sshsNodePutStringIfAbsent(moduleData->moduleNode, "mode", "timeSurface"); // or "eventCount"
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "decayTime", 30000); // in µs, time constant
+	sshsNodePutFloatIfAbsent(moduleData->moduleNode, "countScale", 5.0f); // events for full brightness
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "frameInterval", 33333); // in µs of event time
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "colorOutput", false);
+
+	updateConfig(moduleData);
+
+	// Add config listeners last, to avoid having them dangling if Init doesn't succeed.
+	sshsNodeAddAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	// Nothing that can fail here.
+	return (true);
+}
+
+static void caerAccumulatorRun(caerModuleData moduleData, size_t argsNumber, va_list args) {
+	UNUSED_ARGUMENT(argsNumber);
+
+	// Interpret variable arguments (same as above in main function).
+	caerPolarityEventPacket polarity = va_arg(args, caerPolarityEventPacket);
+	caerFrameEventPacket *frame = va_arg(args, caerFrameEventPacket *);
+
+	// Only process packets with content.
+	if (polarity == NULL || caerEventPacketHeaderGetEventValid(&polarity->packetHeader) == 0) {
+		return;
+	}
+
+	AccumulatorState state = moduleData->moduleState;
+
+	int16_t sourceID = caerEventPacketHeaderGetEventSource(&polarity->packetHeader);
+
+	// If the maps are not allocated yet, do it.
+	if (state->timestampMap[0] == NULL) {
+		if (!allocateMaps(state, sourceID,
+			caerPolarityEventGetTimestamp64(caerPolarityEventPacketGetEvent(polarity, 0), polarity))) {
+			// Failed to allocate memory, nothing to do.
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate memory for maps.");
+			return;
+		}
+	}
+
+	size_t sizeX = state->sizeX;
+	float decayRate = state->decayRate;
+	uint32_t maxAge = state->maxAge;
+	int64_t lastTimestamp = 0;
+
+	if (state->mode == ACCUMULATOR_EVENT_COUNT) {
+		CAER_POLARITY_ITERATOR_VALID_START(polarity)
+			size_t index = (size_t) caerPolarityEventGetY(caerPolarityIteratorElement) * sizeX
+				+ caerPolarityEventGetX(caerPolarityIteratorElement);
+			size_t pol = caerPolarityEventGetPolarity(caerPolarityIteratorElement);
+			lastTimestamp = caerPolarityEventGetTimestamp64(caerPolarityIteratorElement, polarity);
+
+			// Decay the count to now, then add this event.
+			float decay = decayFactor(U32T(lastTimestamp) - state->timestampMap[pol][index], maxAge, decayRate);
+
+			state->countMap[pol][index] = (state->countMap[pol][index] * decay) + 1.0f;
+			state->timestampMap[pol][index] = U32T(lastTimestamp);
+		CAER_POLARITY_ITERATOR_VALID_END
+	}
+	else {
+		CAER_POLARITY_ITERATOR_VALID_START(polarity)
+			size_t index = (size_t) caerPolarityEventGetY(caerPolarityIteratorElement) * sizeX
+				+ caerPolarityEventGetX(caerPolarityIteratorElement);
+			size_t pol = caerPolarityEventGetPolarity(caerPolarityIteratorElement);
+			lastTimestamp = caerPolarityEventGetTimestamp64(caerPolarityIteratorElement, polarity);
+
+			state->timestampMap[pol][index] = U32T(lastTimestamp);
+		CAER_POLARITY_ITERATOR_VALID_END
+	}
+
+	// Time went backwards (timestamp reset): start the frame grid over.
+	if (lastTimestamp < state->frameTimestamp) {
+		state->frameTimestamp = lastTimestamp;
+		state->nextFrameTimestamp = lastTimestamp + state->frameInterval;
+	}
+
+	// Not time for a frame yet.
+	if (lastTimestamp < state->nextFrameTimestamp) {
+		return;
+	}
+
+	if (state->frame == NULL) {
+		state->frame = caerFrameEventPacketAllocate(1, sourceID, 0, I32T(state->sizeX), I32T(state->sizeY), RGB);
+		if (state->frame == NULL) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate frame event packet.");
+			return;
+		}
+	}
+
+	caerFrameEventPacket framePacket = state->frame;
+	caerFrameEvent frameEvent = caerFrameEventPacketGetEvent(framePacket, 0);
+
+	// Reuse the packet, resetting it to contain one fresh frame.
+	frameEvent->info = 0;
+	caerEventPacketHeaderSetEventNumber(&framePacket->packetHeader, 0);
+	caerEventPacketHeaderSetEventValid(&framePacket->packetHeader, 0);
+	int32_t tsOverflow = caerEventPacketHeaderGetEventTSOverflow(&polarity->packetHeader);
+	caerEventPacketHeaderSetEventTSOverflow(&framePacket->packetHeader, tsOverflow);
+
+	caerFrameEventSetLengthXLengthYChannelNumber(frameEvent, I32T(state->sizeX), I32T(state->sizeY),
+		(state->colorOutput) ? (RGB) : (GRAYSCALE), framePacket);
+	caerFrameEventSetPositionX(frameEvent, 0);
+	caerFrameEventSetPositionY(frameEvent, 0);
+
+	// Frame timestamps are relative to the packet's overflow period; a frame
+	// that started in the previous one starts at the beginning of this one.
+	int64_t periodStart = I64T(U64T(tsOverflow) << TS_OVERFLOW_SHIFT);
+	int32_t startTimestamp =
+		(state->frameTimestamp > periodStart) ? (I32T(state->frameTimestamp - periodStart)) : (0);
+
+	caerFrameEventSetTSStartOfFrame(frameEvent, startTimestamp);
+	caerFrameEventSetTSStartOfExposure(frameEvent, startTimestamp);
+	caerFrameEventSetTSEndOfExposure(frameEvent, I32T(lastTimestamp - periodStart));
+	caerFrameEventSetTSEndOfFrame(frameEvent, I32T(lastTimestamp - periodStart));
+
+	renderFrame(state, U32T(lastTimestamp), caerFrameEventGetPixelArrayUnsafe(frameEvent));
+
+	caerEventPacketHeaderSetEventNumber(&framePacket->packetHeader, 1);
+	caerFrameEventValidate(frameEvent, framePacket);
+
+	// Frames are made at the end of the packet that reaches the next frame
+	// time, but stay on a fixed grid. Intervals that passed completely within
+	// one packet are skipped.
+	state->frameTimestamp = lastTimestamp;
+	state->nextFrameTimestamp += state->frameInterval;
+
+	if (lastTimestamp >= state->nextFrameTimestamp) {
+		state->nextFrameTimestamp = lastTimestamp + state->frameInterval;
+	}
+
+	*frame = framePacket;
+}
+
+static void caerAccumulatorConfig(caerModuleData moduleData) {
+	caerModuleConfigUpdateReset(moduleData);
+
+	AccumulatorState state = moduleData->moduleState;
+
+	enum AccumulatorMode oldMode = state->mode;
+
+	updateConfig(moduleData);
+
+	// Maps mean something else in the other mode, start over on next run.
+	if (state->mode != oldMode) {
+		freeMaps(state);
+	}
+}
+
+static void caerAccumulatorExit(caerModuleData moduleData) {
+	// Remove listener, which can reference invalid memory in userData.
+	sshsNodeRemoveAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	AccumulatorState state = moduleData->moduleState;
+
+	// Ensure maps and frame are freed.
+	freeMaps(state);
+
+	free(state->frame);
+	state->frame = NULL;
+}
+
+static void updateConfig(caerModuleData moduleData) {
+	AccumulatorState state = moduleData->moduleState;
+
+	char *modeString = sshsNodeGetString(moduleData->moduleNode, "mode");
+
+	state->mode = (caerStrEquals(modeString, "eventCount")) ? (ACCUMULATOR_EVENT_COUNT) : (ACCUMULATOR_TIME_SURFACE);
+
+	free(modeString);
+
+	state->decayTime = sshsNodeGetInt(moduleData->moduleNode, "decayTime");
+	state->countScale = sshsNodeGetFloat(moduleData->moduleNode, "countScale");
+	state->frameInterval = sshsNodeGetInt(moduleData->moduleNode, "frameInterval");
+	state->colorOutput = sshsNodeGetBool(moduleData->moduleNode, "colorOutput");
+
+	if (state->decayTime < 1) {
+		state->decayTime = 1;
+	}
+
+	if (state->countScale < 1.0f) {
+		state->countScale = 1.0f;
+	}
+
+	if (state->frameInterval < 0) {
+		state->frameInterval = 0;
+	}
+
+	state->decayRate = -1.0f / ((float) state->decayTime * 0.693147181f);
+
+	float maxAge = -126.0f / state->decayRate;
+	state->maxAge = (maxAge < (float) ACCUMULATOR_MAX_AGE) ? (U32T(maxAge)) : (U32T(ACCUMULATOR_MAX_AGE));
+}
+
+static bool allocateMaps(AccumulatorState state, int16_t sourceID, int64_t firstTimestamp) {
+	// Get size information from source.
+	sshsNode sourceInfoNode = caerMainloopGetSourceInfo(U16T(sourceID));
+	if (sourceInfoNode == NULL) {
+		// This should never happen, but we handle it gracefully.
+		caerLog(CAER_LOG_ERROR, __func__, "Failed to get source info to allocate maps.");
+		return (false);
+	}
+
+	state->sizeX = (size_t) sshsNodeGetShort(sourceInfoNode, "dvsSizeX");
+	state->sizeY = (size_t) sshsNodeGetShort(sourceInfoNode, "dvsSizeY");
+
+	size_t mapSize = state->sizeX * state->sizeY;
+
+	// Time surfaces start fully decayed, counts at zero.
+	uint32_t startTimestamp =
+		(state->mode == ACCUMULATOR_TIME_SURFACE) ?
+			(U32T(firstTimestamp) - U32T(ACCUMULATOR_MAX_AGE)) : (U32T(firstTimestamp));
+
+	for (size_t pol = 0; pol < 2; pol++) {
+		state->timestampMap[pol] = malloc(mapSize * sizeof(uint32_t));
+		state->countMap[pol] = calloc(mapSize, sizeof(float));
+		state->valueMap[pol] = malloc(mapSize * sizeof(float));
+
+		if (state->timestampMap[pol] == NULL || state->countMap[pol] == NULL || state->valueMap[pol] == NULL) {
+			freeMaps(state);
+			return (false);
+		}
+
+		for (size_t i = 0; i < mapSize; i++) {
+			state->timestampMap[pol][i] = startTimestamp;
+		}
+	}
+
+	state->frameTimestamp = firstTimestamp;
+	state->nextFrameTimestamp = firstTimestamp + state->frameInterval;
+
+	return (true);
+}
+
+static void freeMaps(AccumulatorState state) {
+	for (size_t pol = 0; pol < 2; pol++) {
+		free(state->timestampMap[pol]);
+		state->timestampMap[pol] = NULL;
+
+		free(state->countMap[pol]);
+		state->countMap[pol] = NULL;
+
+		free(state->valueMap[pol]);
+		state->valueMap[pol] = NULL;
+	}
+}
+
+/**
+ * 2^x for -126 <= x <= 0, with a relative error below 2e-4: split x into
+ * integer and fractional part, build 2^integer directly as float exponent
+ * bits, and approximate 2^fraction with a cubic polynomial. Only arithmetic,
+ * so loops using it vectorize.
+ */
+static inline float fastExp2(float x) {
+	// Truncation is floor for positive numbers, so shift x up for it.
+	int32_t integer = (int32_t) (x + 127.0f) - 127;
+
+	float fraction = x - (float) integer;
+
+	float poly = 1.0f
+		+ fraction * (0.6960656421638072f + fraction * (0.224494337302845f + fraction * 0.07944023841053369f));
+
+	int32_t exponentBits = (integer + 127) << 23;
+	float exponent;
+	memcpy(&exponent, &exponentBits, sizeof(float));
+
+	return (poly * exponent);
+}
+
+/**
+ * Decay over 'age' µs. Ages are capped at 'maxAge', where the decay is
+ * complete anyway, which also keeps fastExp2() in range.
+ */
+static inline float decayFactor(uint32_t age, uint32_t maxAge, float decayRate) {
+	age = (age > maxAge) ? (maxAge) : (age);
+
+	return (fastExp2((float) I32T(age) * decayRate));
+}
+
+static void renderFrame(AccumulatorState state, uint32_t timestamp, uint16_t *pixels) {
+#if defined(ACCUMULATOR_X86_SIMD)
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		renderFrameAVX2(state, timestamp, pixels);
+		return;
+	}
+#endif
+
+	renderFrameGeneric(state, timestamp, pixels);
+}
+
+/**
+ * Compute the frame's pixels at time 'timestamp'. First the value of every
+ * pixel per polarity, then their combination into the output format. All
+ * loops go straight over the maps, without data-dependent branches.
+ */
+static inline __attribute__((always_inline)) void renderFrameBody(AccumulatorState state, uint32_t timestamp,
+	uint16_t *pixels) {
+	size_t mapSize = state->sizeX * state->sizeY;
+	float decayRate = state->decayRate;
+	uint32_t maxAge = state->maxAge;
+
+	for (size_t pol = 0; pol < 2; pol++) {
+		uint32_t *restrict timestamps = state->timestampMap[pol];
+		float *restrict counts = state->countMap[pol];
+		float *restrict values = state->valueMap[pol];
+
+		if (state->mode == ACCUMULATOR_EVENT_COUNT) {
+			float countScale = 1.0f / state->countScale;
+
+			// Decay counts to now and store them back: decay is memoryless, so
+			// this changes nothing, but keeps all ages short.
+			for (size_t i = 0; i < mapSize; i++) {
+				float count = counts[i] * decayFactor(timestamp - timestamps[i], maxAge, decayRate);
+
+				counts[i] = count;
+				timestamps[i] = timestamp;
+
+				float value = count * countScale;
+				values[i] = (value > 1.0f) ? (1.0f) : (value);
+			}
+		}
+		else {
+			for (size_t i = 0; i < mapSize; i++) {
+				uint32_t age = timestamp - timestamps[i];
+
+				// Keep ages bounded, see ACCUMULATOR_MAX_AGE.
+				age = (age > maxAge) ? (maxAge) : (age);
+				timestamps[i] = timestamp - age;
+
+				float value = fastExp2((float) I32T(age) * decayRate);
+				values[i] = (value > 1.0f) ? (1.0f) : (value);
+			}
+		}
+	}
+
+	const float *restrict offValues = state->valueMap[0];
+	const float *restrict onValues = state->valueMap[1];
+
+	if (state->colorOutput) {
+		for (size_t i = 0; i < mapSize; i++) {
+			pixels[(i * 3) + 0] = htole16(U16T(offValues[i] * (float) UINT16_MAX));
+			pixels[(i * 3) + 1] = htole16(U16T(onValues[i] * (float) UINT16_MAX));
+			pixels[(i * 3) + 2] = 0;
+		}
+	}
+	else {
+		for (size_t i = 0; i < mapSize; i++) {
+			float value = 0.5f + (0.5f * (onValues[i] - offValues[i]));
+
+			pixels[i] = htole16(U16T(value * (float) UINT16_MAX));
+		}
+	}
+}
+
+static void renderFrameGeneric(AccumulatorState state, uint32_t timestamp, uint16_t *pixels) {
+	renderFrameBody(state, timestamp, pixels);
+}
+
+#if defined(ACCUMULATOR_X86_SIMD)
+
+__attribute__((target("avx2,fma"))) static void renderFrameAVX2(AccumulatorState state, uint32_t timestamp,
+	uint16_t *pixels) {
+	renderFrameBody(state, timestamp, pixels);
+}
+
+#endif
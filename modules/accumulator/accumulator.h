@@ -0,0 +1,29 @@
+/*
+ * accumulator.h
+ *
+ * Turns polarity events into frames, at a fixed rate: either exponentially
+ * decaying time surfaces, or exponentially decaying event counts, per
+ * polarity. Meant as the common input representation for frame-based
+ * consumers (CNNs, visualization, pose estimation, ...).
+ */
+
+#ifndef ACCUMULATOR_H_
+#define ACCUMULATOR_H_
+
+#include "main.h"
+
+#include <libcaer/events/frame.h>
+#include <libcaer/events/polarity.h>
+
+/**
+ * Returns a packet with one new frame, every 'frameInterval' µs of event
+ * time, and NULL in between. The packet is owned by the module, and stays
+ * valid until it runs again.
+ *
+ * Grayscale frames are mid-gray where there is no activity, brighter for
+ * ON and darker for OFF events. Color frames (RGB) have OFF events in the
+ * red and ON events in the green channel.
+ */
+caerFrameEventPacket caerAccumulator(uint16_t moduleID, caerPolarityEventPacket polarity);
+
+#endif /* ACCUMULATOR_H_ */
@@ -8,12 +8,78 @@
 #include "backgroundactivityfilter.h"
 #include "base/mainloop.h"
 #include "base/module.h"
-#include "ext/buffers.h"
+#ifdef HAVE_PTHREADS
+	#include "ext/c11threads_posix.h"
+#endif
+
+/**
+ * Timestamps are stored relative to 'timestampBase', as 32-bit values, to
+ * halve the memory traffic. 0 means no event was ever seen there. When the
+ * relative timestamps grow too big, all values are rebased by 2^31 µs (~35
+ * minutes), which keeps all the ones that are still recent enough to matter,
+ * as deltaT can never be bigger than that.
+ */
+#define BA_TIMESTAMP_REBASE_THRESHOLD INT64_C(0xC0000000)
+#define BA_TIMESTAMP_REBASE_SHIFT UINT32_C(0x80000000)
+
+/// Padding rows above and below each tile: one for the neighbour updates, one
+/// more for the updates done by events in the halo rows.
+#define BA_TILE_PADDING_ROWS 2
+
+struct BAFilter_state;
+
+/**
+ * A horizontal band of the timestamp map, owned by one thread. In serial mode,
+ * there is just one tile, covering all rows.
+ */
+struct BAFilter_tile {
+	/// Row-major map of relative timestamps, padded on all sides, so that neighbour
+	/// updates never need bounds checks. The padding is only written to, never read.
+	uint32_t *timestampMap;
+	/// First map row belonging to this tile, and how many rows it has.
+	size_t firstRow;
+	size_t rows;
+	/// Worker thread (not used by tile 0, which runs on the mainloop thread).
+	thrd_t workerThread;
+	struct BAFilter_state *state;
+};
+
+typedef struct BAFilter_tile *BAFilterTile;
 
 struct BAFilter_state {
-	simple2DBufferLong timestampMap;
+	/// Timestamp map tiles.
+	BAFilterTile tiles;
+	size_t tilesNumber;
+	size_t timestampMapSizeX;
+	size_t timestampMapSizeY;
+	size_t timestampMapStride;
+	/// Sub-sampling and threads the map was set up for.
+	int8_t timestampMapSubSampleBy;
+	int8_t timestampMapThreads;
+	/// All timestamps in the map are relative to this.
+	int64_t timestampBase;
 	int32_t deltaT;
 	int8_t subSampleBy;
+	int8_t threads;
+	/// Parallel mode: the events being worked on (only the valid ones), split
+	/// into arrays of map coordinates, relative timestamps and indexes into the
+	/// packet, plus the result per event, written only by the tile owning it.
+	size_t batchSize;
+	size_t batchCapacity;
+	uint16_t *batchX;
+	uint16_t *batchY;
+	uint32_t *batchTimestamps;
+	int32_t *batchIndexes;
+	uint8_t *batchInvalid;
+	/// Parallel mode: worker synchronization.
+	mtx_t workLock;
+	cnd_t workStart;
+	cnd_t workDone;
+	uint64_t workGeneration;
+	size_t workPending;
+	bool workRunning;
+	/// Worker threads actually started, for tiles 1 to workersNumber.
+	size_t workersNumber;
 };
 
 typedef struct BAFilter_state *BAFilterState;
@@ -22,7 +88,18 @@ static bool caerBackgroundActivityFilterInit(caerModuleData moduleData);
 static void caerBackgroundActivityFilterRun(caerModuleData moduleData, size_t argsNumber, va_list args);
 static void caerBackgroundActivityFilterConfig(caerModuleData moduleData);
 static void caerBackgroundActivityFilterExit(caerModuleData moduleData);
-static bool allocateTimestampMap(BAFilterState state, int16_t sourceID);
+static void filterPacketSerial(BAFilterState state, caerPolarityEventPacket polarity);
+static void filterPacketParallel(BAFilterState state, caerPolarityEventPacket polarity);
+static void filterTileBatch(BAFilterState state, BAFilterTile tile);
+static int filterTileWorker(void *tileArg);
+static bool allocateTimestampMap(caerModuleData moduleData, BAFilterState state, int16_t sourceID);
+static void freeTimestampMap(BAFilterState state);
+static bool growBatch(BAFilterState state, size_t size);
+static void rebaseTimestampMap(BAFilterState state, int64_t timestamp);
+static inline bool needsRebase(BAFilterState state, int64_t timestamp);
+static inline uint32_t getRelativeTimestamp(BAFilterState state, int64_t timestamp);
+static inline uint32_t updateTimestampMap(uint32_t *timestampMap, size_t stride, size_t index, uint32_t timestamp,
+	int32_t deltaT);
 
 static struct caer_module_functions caerBackgroundActivityFilterFunctions = { .moduleInit =
 	&caerBackgroundActivityFilterInit, .moduleRun = &caerBackgroundActivityFilterRun, .moduleConfig =
@@ -40,11 +117,13 @@ void caerBackgroundActivityFilter(uint16_t moduleID, caerPolarityEventPacket pol
 static bool caerBackgroundActivityFilterInit(caerModuleData moduleData) {
 	sshsNodePutIntIfAbsent(moduleData->moduleNode, "deltaT", 30000);
 	sshsNodePutByteIfAbsent(moduleData->moduleNode, "subSampleBy", 0);
+	sshsNodePutByteIfAbsent(moduleData->moduleNode, "threads", 1); // >1 splits the sensor into tiles
 
 	BAFilterState state = moduleData->moduleState;
 
 	state->deltaT = sshsNodeGetInt(moduleData->moduleNode, "deltaT");
 	state->subSampleBy = sshsNodeGetByte(moduleData->moduleNode, "subSampleBy");
+	state->threads = sshsNodeGetByte(moduleData->moduleNode, "threads");
 
 	// Add config listeners last, to avoid having them dangling if Init doesn't succeed.
 	sshsNodeAddAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
@@ -67,66 +146,188 @@ static void caerBackgroundActivityFilterRun(caerModuleData moduleData, size_t ar
 	BAFilterState state = moduleData->moduleState;
 
 	// If the map is not allocated yet, do it.
-	if (state->timestampMap == NULL) {
-		if (!allocateTimestampMap(state, caerEventPacketHeaderGetEventSource(&polarity->packetHeader))) {
+	if (state->tiles == NULL) {
+		if (!allocateTimestampMap(moduleData, state, caerEventPacketHeaderGetEventSource(&polarity->packetHeader))) {
 			// Failed to allocate memory, nothing to do.
 			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate memory for timestampMap.");
 			return;
 		}
 	}
 
+	if (state->tilesNumber > 1) {
+		filterPacketParallel(state, polarity);
+	}
+	else {
+		filterPacketSerial(state, polarity);
+	}
+}
+
+static void filterPacketSerial(BAFilterState state, caerPolarityEventPacket polarity) {
+	uint32_t *timestampMap = state->tiles[0].timestampMap;
+	size_t stride = state->timestampMapStride;
+	int32_t deltaT = state->deltaT;
+	int8_t subSampleBy = state->subSampleBy;
+	int32_t invalidNumber = 0;
+
 	// Iterate over events and filter out ones that are not supported by other
 	// events within a certain region in the specified timeframe.
 	CAER_POLARITY_ITERATOR_VALID_START(polarity)
 		// Get values on which to operate.
-		int64_t ts = caerPolarityEventGetTimestamp64(caerPolarityIteratorElement, polarity);
+		uint32_t ts = getRelativeTimestamp(state,
+			caerPolarityEventGetTimestamp64(caerPolarityIteratorElement, polarity));
 		uint16_t x = caerPolarityEventGetX(caerPolarityIteratorElement);
 		uint16_t y = caerPolarityEventGetY(caerPolarityIteratorElement);
 
-		// Apply sub-sampling.
-		x = U16T(x >> state->subSampleBy);
-		y = U16T(y >> state->subSampleBy);
+		// Apply sub-sampling, then skip padding.
+		size_t index = ((size_t) (y >> subSampleBy) + BA_TILE_PADDING_ROWS) * stride
+			+ ((size_t) (x >> subSampleBy) + 1);
 
-		// Get value from map.
-		int64_t lastTS = state->timestampMap->buffer2d[x][y];
+		uint32_t invalid = updateTimestampMap(timestampMap, stride, index, ts, deltaT);
 
-		if ((I64T(ts - lastTS) >= I64T(state->deltaT)) || (lastTS == 0)) {
-			// Filter out invalid.
-			caerPolarityEventInvalidate(caerPolarityIteratorElement, polarity);
-		}
+		// Filter out invalid, without branching: clear the valid mark (bit 0) directly.
+		caerPolarityIteratorElement->data &= htole32(~invalid);
+		invalidNumber += I32T(invalid);
+	CAER_POLARITY_ITERATOR_VALID_END
+
+	caerEventPacketHeaderSetEventValid(&polarity->packetHeader,
+		caerEventPacketHeaderGetEventValid(&polarity->packetHeader) - invalidNumber);
+}
 
-		// Update neighboring region.
-		size_t sizeMaxX = (state->timestampMap->sizeX - 1);
-		size_t sizeMaxY = (state->timestampMap->sizeY - 1);
+/**
+ * Parallel mode: gather the valid events into a batch, let all tiles work on it
+ * at the same time, then write the results back into the packet.
+ * Each tile goes through the events in the same order as the serial code, and
+ * applies all those that touch its rows, including the ones from the one-row
+ * halo around it, so its part of the map sees exactly the same updates as in
+ * the serial case, and thus gives the same results. A rebase must happen with
+ * all tiles idle, so it splits the packet into multiple batches.
+ */
+static void filterPacketParallel(BAFilterState state, caerPolarityEventPacket polarity) {
+	int32_t eventNumber = caerEventPacketHeaderGetEventNumber(&polarity->packetHeader);
+
+	if (!growBatch(state, (size_t) eventNumber)) {
+		caerLog(CAER_LOG_ERROR, __func__, "Failed to allocate memory for event batch.");
+		return;
+	}
+
+	int8_t subSampleBy = state->subSampleBy;
+	int32_t invalidNumber = 0;
+	int32_t eventIndex = 0;
+
+	while (eventIndex < eventNumber) {
+		state->batchSize = 0;
+
+		for (; eventIndex < eventNumber; eventIndex++) {
+			caerPolarityEvent event = caerPolarityEventPacketGetEvent(polarity, eventIndex);
+			if (!caerPolarityEventIsValid(event)) {
+				continue;
+			}
+
+			int64_t ts = caerPolarityEventGetTimestamp64(event, polarity);
 
-		if (x > 0) {
-			state->timestampMap->buffer2d[x - 1][y] = ts;
+			// Finish the current batch before rebasing.
+			if (state->batchSize > 0 && needsRebase(state, ts)) {
+				break;
+			}
+
+			size_t i = state->batchSize++;
+
+			state->batchTimestamps[i] = getRelativeTimestamp(state, ts);
+			state->batchX[i] = U16T(caerPolarityEventGetX(event) >> subSampleBy);
+			state->batchY[i] = U16T(caerPolarityEventGetY(event) >> subSampleBy);
+			state->batchIndexes[i] = eventIndex;
+			state->batchInvalid[i] = 0;
 		}
-		if (x < sizeMaxX) {
-			state->timestampMap->buffer2d[x + 1][y] = ts;
+
+		// Start workers, do tile 0 here, and wait for the others.
+		mtx_lock(&state->workLock);
+		state->workPending = state->tilesNumber - 1;
+		state->workGeneration++;
+		cnd_broadcast(&state->workStart);
+		mtx_unlock(&state->workLock);
+
+		filterTileBatch(state, &state->tiles[0]);
+
+		mtx_lock(&state->workLock);
+		while (state->workPending > 0) {
+			cnd_wait(&state->workDone, &state->workLock);
 		}
+		mtx_unlock(&state->workLock);
+
+		// Write results back, same as in serial mode.
+		for (size_t i = 0; i < state->batchSize; i++) {
+			uint32_t invalid = state->batchInvalid[i];
 
-		if (y > 0) {
-			state->timestampMap->buffer2d[x][y - 1] = ts;
+			caerPolarityEventPacketGetEvent(polarity, state->batchIndexes[i])->data &= htole32(~invalid);
+			invalidNumber += I32T(invalid);
 		}
-		if (y < sizeMaxY) {
-			state->timestampMap->buffer2d[x][y + 1] = ts;
+	}
+
+	caerEventPacketHeaderSetEventValid(&polarity->packetHeader,
+		caerEventPacketHeaderGetEventValid(&polarity->packetHeader) - invalidNumber);
+}
+
+static void filterTileBatch(BAFilterState state, BAFilterTile tile) {
+	uint32_t *timestampMap = tile->timestampMap;
+	size_t stride = state->timestampMapStride;
+	int32_t deltaT = state->deltaT;
+	int32_t firstRow = I32T(tile->firstRow);
+	int32_t rows = I32T(tile->rows);
+
+	for (size_t i = 0; i < state->batchSize; i++) {
+		int32_t row = I32T(state->batchY[i]) - firstRow;
+
+		// Route: only events in this tile's rows, or in the halo rows right
+		// above and below, update this tile's map.
+		if (row < -1 || row > rows) {
+			continue;
 		}
 
-		if (x > 0 && y > 0) {
-			state->timestampMap->buffer2d[x - 1][y - 1] = ts;
+		size_t index = (size_t) (row + BA_TILE_PADDING_ROWS) * stride + ((size_t) state->batchX[i] + 1);
+
+		uint32_t invalid = updateTimestampMap(timestampMap, stride, index, state->batchTimestamps[i], deltaT);
+
+		// Only the owning tile decides validity, halo rows are in the padding.
+		if (row >= 0 && row < rows) {
+			state->batchInvalid[i] = U8T(invalid);
 		}
-		if (x < sizeMaxX && y < sizeMaxY) {
-			state->timestampMap->buffer2d[x + 1][y + 1] = ts;
+	}
+}
+
+static int filterTileWorker(void *tileArg) {
+	BAFilterTile tile = tileArg;
+	BAFilterState state = tile->state;
+
+	uint64_t lastGeneration = 0;
+
+	mtx_lock(&state->workLock);
+
+	while (true) {
+		while (state->workRunning && state->workGeneration == lastGeneration) {
+			cnd_wait(&state->workStart, &state->workLock);
 		}
 
-		if (x > 0 && y < sizeMaxY) {
-			state->timestampMap->buffer2d[x - 1][y + 1] = ts;
+		if (!state->workRunning) {
+			break;
 		}
-		if (x < sizeMaxX && y > 0) {
-			state->timestampMap->buffer2d[x + 1][y - 1] = ts;
+
+		lastGeneration = state->workGeneration;
+
+		mtx_unlock(&state->workLock);
+
+		filterTileBatch(state, tile);
+
+		mtx_lock(&state->workLock);
+
+		state->workPending--;
+		if (state->workPending == 0) {
+			cnd_signal(&state->workDone);
 		}
-	CAER_POLARITY_ITERATOR_VALID_END
+	}
+
+	mtx_unlock(&state->workLock);
+
+	return (thrd_success);
 }
 
 static void caerBackgroundActivityFilterConfig(caerModuleData moduleData) {
@@ -136,6 +337,13 @@ static void caerBackgroundActivityFilterConfig(caerModuleData moduleData) {
 
 	state->deltaT = sshsNodeGetInt(moduleData->moduleNode, "deltaT");
 	state->subSampleBy = sshsNodeGetByte(moduleData->moduleNode, "subSampleBy");
+	state->threads = sshsNodeGetByte(moduleData->moduleNode, "threads");
+
+	// Map size depends on sub-sampling and tiles, re-allocate it on next run.
+	if (state->tiles != NULL
+		&& (state->subSampleBy != state->timestampMapSubSampleBy || state->threads != state->timestampMapThreads)) {
+		freeTimestampMap(state);
+	}
 }
 
 static void caerBackgroundActivityFilterExit(caerModuleData moduleData) {
@@ -145,10 +353,10 @@ static void caerBackgroundActivityFilterExit(caerModuleData moduleData) {
 	BAFilterState state = moduleData->moduleState;
 
 	// Ensure map is freed.
-	simple2DBufferFreeLong(state->timestampMap);
+	freeTimestampMap(state);
 }
 
-static bool allocateTimestampMap(BAFilterState state, int16_t sourceID) {
+static bool allocateTimestampMap(caerModuleData moduleData, BAFilterState state, int16_t sourceID) {
 	// Get size information from source.
 	sshsNode sourceInfoNode = caerMainloopGetSourceInfo(U16T(sourceID));
 	if (sourceInfoNode == NULL) {
@@ -160,11 +368,233 @@ static bool allocateTimestampMap(BAFilterState state, int16_t sourceID) {
 	int16_t sizeX = sshsNodeGetShort(sourceInfoNode, "dvsSizeX");
 	int16_t sizeY = sshsNodeGetShort(sourceInfoNode, "dvsSizeY");
 
-	state->timestampMap = simple2DBufferInitLong((size_t) sizeX, (size_t) sizeY);
-	if (state->timestampMap == NULL) {
+	// Sub-sampled coordinates go from 0 to ((size - 1) >> subSampleBy).
+	state->timestampMapSizeX = ((size_t) (sizeX - 1) >> state->subSampleBy) + 1;
+	state->timestampMapSizeY = ((size_t) (sizeY - 1) >> state->subSampleBy) + 1;
+	state->timestampMapStride = state->timestampMapSizeX + 2;
+
+	// Split rows evenly between tiles, one per thread.
+	size_t tilesNumber = (state->threads > 1) ? ((size_t) state->threads) : (1);
+	if (tilesNumber > state->timestampMapSizeY) {
+		tilesNumber = state->timestampMapSizeY;
+	}
+
+	size_t tileRows = (state->timestampMapSizeY + tilesNumber - 1) / tilesNumber;
+	tilesNumber = (state->timestampMapSizeY + tileRows - 1) / tileRows;
+
+	state->tiles = calloc(tilesNumber, sizeof(struct BAFilter_tile));
+	if (state->tiles == NULL) {
+		return (false);
+	}
+
+	state->tilesNumber = tilesNumber;
+
+	for (size_t i = 0; i < tilesNumber; i++) {
+		BAFilterTile tile = &state->tiles[i];
+
+		tile->firstRow = i * tileRows;
+		tile->rows = (tile->firstRow + tileRows <= state->timestampMapSizeY) ?
+			(tileRows) : (state->timestampMapSizeY - tile->firstRow);
+		tile->state = state;
+
+		tile->timestampMap = calloc(state->timestampMapStride * (tile->rows + (2 * BA_TILE_PADDING_ROWS)),
+			sizeof(uint32_t));
+		if (tile->timestampMap == NULL) {
+			// Tiles not reached yet have a NULL map, freeing them is fine.
+			freeTimestampMap(state);
+			return (false);
+		}
+	}
+
+	state->timestampMapSubSampleBy = state->subSampleBy;
+	state->timestampMapThreads = state->threads;
+	state->timestampBase = 0;
+
+	// Start worker threads for all tiles but the first.
+	if (tilesNumber > 1) {
+		mtx_init(&state->workLock, mtx_plain);
+		cnd_init(&state->workStart);
+		cnd_init(&state->workDone);
+
+		state->workGeneration = 0;
+		state->workPending = 0;
+		state->workRunning = true;
+		state->workersNumber = 0;
+
+		for (size_t i = 1; i < tilesNumber; i++) {
+			if (thrd_create(&state->tiles[i].workerThread, &filterTileWorker, &state->tiles[i]) != thrd_success) {
+				// Stops only the threads that were started, but frees all tiles.
+				freeTimestampMap(state);
+				return (false);
+			}
+
+			state->workersNumber = i;
+		}
+
+		caerLog(CAER_LOG_DEBUG, moduleData->moduleSubSystemString, "Parallel mode with %zu tiles of %zu rows.",
+			tilesNumber, tileRows);
+	}
+
+	return (true);
+}
+
+static void freeTimestampMap(BAFilterState state) {
+	if (state->tiles == NULL) {
+		return;
+	}
+
+	// Stop worker threads, if any.
+	if (state->workRunning) {
+		mtx_lock(&state->workLock);
+		state->workRunning = false;
+		cnd_broadcast(&state->workStart);
+		mtx_unlock(&state->workLock);
+
+		for (size_t i = 1; i <= state->workersNumber; i++) {
+			thrd_join(state->tiles[i].workerThread, NULL);
+		}
+
+		state->workersNumber = 0;
+
+		cnd_destroy(&state->workDone);
+		cnd_destroy(&state->workStart);
+		mtx_destroy(&state->workLock);
+	}
+
+	for (size_t i = 0; i < state->tilesNumber; i++) {
+		free(state->tiles[i].timestampMap);
+	}
+
+	free(state->tiles);
+	state->tiles = NULL;
+	state->tilesNumber = 0;
+
+	free(state->batchX);
+	free(state->batchY);
+	free(state->batchTimestamps);
+	free(state->batchIndexes);
+	free(state->batchInvalid);
+
+	state->batchX = NULL;
+	state->batchY = NULL;
+	state->batchTimestamps = NULL;
+	state->batchIndexes = NULL;
+	state->batchInvalid = NULL;
+	state->batchCapacity = 0;
+}
+
+static bool growBatch(BAFilterState state, size_t size) {
+	if (size <= state->batchCapacity) {
+		return (true);
+	}
+
+	uint16_t *batchX = realloc(state->batchX, size * sizeof(uint16_t));
+	if (batchX != NULL) {
+		state->batchX = batchX;
+	}
+
+	uint16_t *batchY = realloc(state->batchY, size * sizeof(uint16_t));
+	if (batchY != NULL) {
+		state->batchY = batchY;
+	}
+
+	uint32_t *batchTimestamps = realloc(state->batchTimestamps, size * sizeof(uint32_t));
+	if (batchTimestamps != NULL) {
+		state->batchTimestamps = batchTimestamps;
+	}
+
+	int32_t *batchIndexes = realloc(state->batchIndexes, size * sizeof(int32_t));
+	if (batchIndexes != NULL) {
+		state->batchIndexes = batchIndexes;
+	}
+
+	uint8_t *batchInvalid = realloc(state->batchInvalid, size * sizeof(uint8_t));
+	if (batchInvalid != NULL) {
+		state->batchInvalid = batchInvalid;
+	}
+
+	if (batchX == NULL || batchY == NULL || batchTimestamps == NULL || batchIndexes == NULL || batchInvalid == NULL) {
 		return (false);
 	}
 
-	// TODO: size the map differently if subSampleBy is set!
+	state->batchCapacity = size;
+
 	return (true);
 }
+
+/**
+ * Make 'timestamp' representable relative to the base again. Either shift
+ * everything down by BA_TIMESTAMP_REBASE_SHIFT, or, if time jumped backwards
+ * (timestamp reset) or too far forward, just start over with an empty map.
+ */
+static void rebaseTimestampMap(BAFilterState state, int64_t timestamp) {
+	int64_t relativeTimestamp = timestamp - state->timestampBase;
+	bool shift = (relativeTimestamp > 0 && (relativeTimestamp - BA_TIMESTAMP_REBASE_SHIFT) < BA_TIMESTAMP_REBASE_THRESHOLD);
+
+	for (size_t t = 0; t < state->tilesNumber; t++) {
+		uint32_t *timestampMap = state->tiles[t].timestampMap;
+		size_t mapSize = state->timestampMapStride * (state->tiles[t].rows + (2 * BA_TILE_PADDING_ROWS));
+
+		if (shift) {
+			for (size_t i = 0; i < mapSize; i++) {
+				uint32_t value = timestampMap[i];
+
+				timestampMap[i] = (value > BA_TIMESTAMP_REBASE_SHIFT) ? (value - BA_TIMESTAMP_REBASE_SHIFT) : (0);
+			}
+		}
+		else {
+			memset(timestampMap, 0, mapSize * sizeof(uint32_t));
+		}
+	}
+
+	if (shift) {
+		state->timestampBase += BA_TIMESTAMP_REBASE_SHIFT;
+	}
+	else {
+		// Relative timestamps start at 1, 0 is reserved for 'never'.
+		state->timestampBase = timestamp - 1;
+	}
+}
+
+static inline bool needsRebase(BAFilterState state, int64_t timestamp) {
+	int64_t relativeTimestamp = timestamp - state->timestampBase;
+
+	return (relativeTimestamp <= 0 || relativeTimestamp >= BA_TIMESTAMP_REBASE_THRESHOLD);
+}
+
+static inline uint32_t getRelativeTimestamp(BAFilterState state, int64_t timestamp) {
+	if (needsRebase(state, timestamp)) {
+		rebaseTimestampMap(state, timestamp);
+	}
+
+	return (U32T(timestamp - state->timestampBase));
+}
+
+/**
+ * Check an event against its map entry, and update the 8 neighbours with its
+ * timestamp: two 3-wide stores to the rows above and below, plus the left and
+ * right pixels. The event's own pixel is not updated, it must be supported by
+ * a different pixel to be valid.
+ * Returns 1 if the event has no support and must be invalidated, 0 otherwise.
+ */
+static inline uint32_t updateTimestampMap(uint32_t *timestampMap, size_t stride, size_t index, uint32_t timestamp,
+	int32_t deltaT) {
+	uint32_t lastTS = timestampMap[index];
+
+	uint32_t invalid = (lastTS == 0) | ((I64T(timestamp) - I64T(lastTS)) >= deltaT);
+
+	uint32_t *above = timestampMap + index - stride - 1;
+	above[0] = timestamp;
+	above[1] = timestamp;
+	above[2] = timestamp;
+
+	timestampMap[index - 1] = timestamp;
+	timestampMap[index + 1] = timestamp;
+
+	uint32_t *below = timestampMap + index + stride - 1;
+	below[0] = timestamp;
+	below[1] = timestamp;
+	below[2] = timestamp;
+
+	return (invalid);
+}
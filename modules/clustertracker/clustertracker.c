@@ -0,0 +1,589 @@
+/*
+ * clustertracker.c
+ *
+ * Each event is assigned to the closest cluster that contains it, which then
+ * moves a bit towards the event and adapts its size. Events that don't fall
+ * into any cluster start a new one, as long as there is space. Clusters are
+ * squares (max-norm distance). Their mass is the number of events they got,
+ * decaying exponentially with 'clusterLifetime' as time constant, and they
+ * are only put out while it is above 'visibleMass', so that noise, which
+ * slowly collects in clusters too, doesn't show up as objects. After each
+ * packet, clusters without events for 'clusterLifetime' are removed, and the
+ * ones that overlap are merged.
+ *
+ * To find the clusters an event could belong to, the pixel array is divided
+ * into a coarse grid. Every grid cell keeps a bit-mask of the clusters that
+ * overlap it, so only those are looked at, no matter how many clusters exist.
+ * Masks are only updated when a cluster's extent crosses a cell boundary.
+ */
+
+#include "clustertracker.h"
+#include "base/mainloop.h"
+#include "base/module.h"
+#include <math.h>
+
+// Bit-masks of clusters are 64 bits wide.
+#define CT_MAX_CLUSTERS 64
+// Track IDs go into the 7-bit event type.
+#define CT_MAX_TRACK_ID 128
+// Grid cells are 2^CT_GRID_SHIFT pixels wide and high.
+#define CT_GRID_SHIFT 4
+#define CT_MIN_RADIUS 2.0f
+// Mean max-norm distance of events uniformly spread over a square of
+// half-size R is 2R/3, so scale that by 1.5 to estimate R.
+#define CT_RADIUS_GAIN 1.5f
+// How much a new velocity measurement counts against the old estimate.
+#define CT_VELOCITY_MIXING 0.5f
+
+struct ClusterTracker_cluster {
+	float x;
+	float y;
+	/// Velocity in pixels per second.
+	float vx;
+	float vy;
+	/// Half-size of the square, in pixels.
+	float radius;
+	/// Position and time the velocity was last measured from.
+	float velocityX;
+	float velocityY;
+	int64_t velocityTimestamp;
+	int64_t firstTimestamp;
+	int64_t lastTimestamp;
+	/// Decaying event count, as of 'lastTimestamp'.
+	float mass;
+	/// Grid cells currently marked as overlapped by this cluster (inclusive).
+	uint16_t cellX0;
+	uint16_t cellY0;
+	uint16_t cellX1;
+	uint16_t cellY1;
+	uint8_t trackID;
+};
+
+struct ClusterTracker_state {
+	struct ClusterTracker_cluster clusters[CT_MAX_CLUSTERS];
+	/// One bit per slot in 'clusters', set when in use.
+	uint64_t activeClusters;
+	/// Row-major grid, with the mask of clusters overlapping each cell.
+	uint64_t *grid;
+	size_t gridSizeX;
+	size_t gridSizeY;
+	uint8_t nextTrackID;
+	int32_t maxClusters;
+	float initialRadius;
+	float maxRadius;
+	float mixingFactor;
+	float visibleMass;
+	int32_t clusterLifetime;
+	int32_t velocityTime;
+	bool mergeClusters;
+	caerPoint2DEventPacket clusterPacket;
+	caerPoint4DEventPacket trackPacket;
+};
+
+typedef struct ClusterTracker_state *ClusterTrackerState;
+
+static bool caerClusterTrackerInit(caerModuleData moduleData);
+static void caerClusterTrackerRun(caerModuleData moduleData, size_t argsNumber, va_list args);
+static void caerClusterTrackerConfig(caerModuleData moduleData);
+static void caerClusterTrackerExit(caerModuleData moduleData);
+static void updateConfig(caerModuleData moduleData);
+static bool allocateGrid(ClusterTrackerState state, int16_t sourceID);
+static void updateClusterCells(ClusterTrackerState state, size_t index);
+static void markClusterCells(ClusterTrackerState state, size_t index, bool mark);
+static void addCluster(ClusterTrackerState state, float x, float y, int64_t timestamp);
+static void removeCluster(ClusterTrackerState state, size_t index);
+static void updateCluster(ClusterTrackerState state, size_t index, float x, float y, int64_t timestamp);
+static void mergeClusters(ClusterTrackerState state);
+static inline float getClusterMass(ClusterTrackerState state, const struct ClusterTracker_cluster *cluster,
+	int64_t timestamp);
+static inline int32_t getPacketTimestamp(int64_t timestamp, int32_t tsOverflow);
+
+static struct caer_module_functions caerClusterTrackerFunctions = { .moduleInit = &caerClusterTrackerInit,
+	.moduleRun = &caerClusterTrackerRun, .moduleConfig = &caerClusterTrackerConfig, .moduleExit =
+		&caerClusterTrackerExit };
+
+void caerClusterTracker(uint16_t moduleID, caerPolarityEventPacket polarity, caerPoint2DEventPacket *clusters,
+	caerPoint4DEventPacket *tracks) {
+	// Nothing to put out by default.
+	*clusters = NULL;
+	*tracks = NULL;
+
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "ClusterTracker");
+	if (moduleData == NULL) {
+		return;
+	}
+
+	caerModuleSM(&caerClusterTrackerFunctions, moduleData, sizeof(struct ClusterTracker_state), 3, polarity, clusters,
+		tracks);
+}
+
+static bool caerClusterTrackerInit(caerModuleData moduleData) {
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "maxClusters", 16); // up to 64
+	sshsNodePutFloatIfAbsent(moduleData->moduleNode, "initialRadius", 10.0f); // in pixels
+	sshsNodePutFloatIfAbsent(moduleData->moduleNode, "maxRadius", 40.0f); // in pixels
+	sshsNodePutFloatIfAbsent(moduleData->moduleNode, "mixingFactor", 0.05f); // how much one event moves a cluster
+	sshsNodePutFloatIfAbsent(moduleData->moduleNode, "visibleMass", 30.0f); // recent events to be put out
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "clusterLifetime", 100000); // in µs, also mass decay time
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "velocityTime", 10000); // in µs between velocity updates
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "mergeClusters", true);
+
+	updateConfig(moduleData);
+
+	// Add config listeners last, to avoid having them dangling if Init doesn't succeed.
+	sshsNodeAddAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	// Nothing that can fail here.
+	return (true);
+}
+
+static void caerClusterTrackerRun(caerModuleData moduleData, size_t argsNumber, va_list args) {
+	UNUSED_ARGUMENT(argsNumber);
+
+	// Interpret variable arguments (same as above in main function).
+	caerPolarityEventPacket polarity = va_arg(args, caerPolarityEventPacket);
+	caerPoint2DEventPacket *clusters = va_arg(args, caerPoint2DEventPacket *);
+	caerPoint4DEventPacket *tracks = va_arg(args, caerPoint4DEventPacket *);
+
+	// Only process packets with content.
+	if (polarity == NULL || caerEventPacketHeaderGetEventValid(&polarity->packetHeader) == 0) {
+		return;
+	}
+
+	ClusterTrackerState state = moduleData->moduleState;
+
+	int16_t sourceID = caerEventPacketHeaderGetEventSource(&polarity->packetHeader);
+
+	// If the grid is not allocated yet, do it.
+	if (state->grid == NULL) {
+		if (!allocateGrid(state, sourceID)) {
+			// Failed to allocate memory, nothing to do.
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate memory for grid.");
+			return;
+		}
+	}
+
+	// Output packets hold at most one event per cluster, so they never need to grow.
+	if (state->clusterPacket == NULL) {
+		state->clusterPacket = caerPoint2DEventPacketAllocate(CT_MAX_CLUSTERS, sourceID, 0);
+		if (state->clusterPacket == NULL) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate clusters event packet.");
+			return;
+		}
+	}
+
+	if (state->trackPacket == NULL) {
+		state->trackPacket = caerPoint4DEventPacketAllocate(CT_MAX_CLUSTERS, sourceID, 0);
+		if (state->trackPacket == NULL) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate tracks event packet.");
+			return;
+		}
+	}
+
+	uint64_t *grid = state->grid;
+	size_t gridSizeX = state->gridSizeX;
+	int64_t lastTimestamp = 0;
+
+	CAER_POLARITY_ITERATOR_VALID_START(polarity)
+		uint16_t x = caerPolarityEventGetX(caerPolarityIteratorElement);
+		uint16_t y = caerPolarityEventGetY(caerPolarityIteratorElement);
+		lastTimestamp = caerPolarityEventGetTimestamp64(caerPolarityIteratorElement, polarity);
+
+		float eventX = (float) x;
+		float eventY = (float) y;
+
+		// Find the closest of the clusters overlapping this event's grid cell.
+		uint64_t candidates = grid[(size_t) (y >> CT_GRID_SHIFT) * gridSizeX + (size_t) (x >> CT_GRID_SHIFT)];
+		size_t closest = CT_MAX_CLUSTERS;
+		float closestDistance = INFINITY;
+
+		while (candidates != 0) {
+			size_t i = (size_t) __builtin_ctzll(candidates);
+			candidates &= candidates - 1;
+
+			struct ClusterTracker_cluster *cluster = &state->clusters[i];
+
+			float distance = fmaxf(fabsf(eventX - cluster->x), fabsf(eventY - cluster->y));
+
+			if (distance <= cluster->radius && distance < closestDistance) {
+				closest = i;
+				closestDistance = distance;
+			}
+		}
+
+		if (closest < CT_MAX_CLUSTERS) {
+			updateCluster(state, closest, eventX, eventY, lastTimestamp);
+		}
+		else if (__builtin_popcountll(state->activeClusters) < state->maxClusters) {
+			addCluster(state, eventX, eventY, lastTimestamp);
+		}
+	CAER_POLARITY_ITERATOR_VALID_END
+
+	// Remove clusters that didn't get events for too long.
+	for (uint64_t active = state->activeClusters; active != 0; active &= active - 1) {
+		size_t i = (size_t) __builtin_ctzll(active);
+
+		if ((lastTimestamp - state->clusters[i].lastTimestamp) > state->clusterLifetime) {
+			removeCluster(state, i);
+		}
+	}
+
+	if (state->mergeClusters) {
+		mergeClusters(state);
+	}
+
+	// Put out all visible clusters.
+	caerPoint2DEventPacket clusterPacket = state->clusterPacket;
+	caerPoint4DEventPacket trackPacket = state->trackPacket;
+	int32_t tsOverflow = caerEventPacketHeaderGetEventTSOverflow(&polarity->packetHeader);
+	int32_t visibleNumber = 0;
+
+	caerEventPacketHeaderSetEventTSOverflow(&clusterPacket->packetHeader, tsOverflow);
+	caerEventPacketHeaderSetEventTSOverflow(&trackPacket->packetHeader, tsOverflow);
+
+	for (uint64_t active = state->activeClusters; active != 0; active &= active - 1) {
+		struct ClusterTracker_cluster *cluster = &state->clusters[__builtin_ctzll(active)];
+
+		if (getClusterMass(state, cluster, lastTimestamp) < state->visibleMass) {
+			continue;
+		}
+
+		// Fresh events have 'info' cleared, so the type and validity can be OR'ed in.
+		caerPoint2DEvent point = caerPoint2DEventPacketGetEvent(clusterPacket, visibleNumber);
+		point->info = 0;
+
+		caerPoint2DEventSetX(point, cluster->x);
+		caerPoint2DEventSetY(point, cluster->y);
+		caerPoint2DEventSetTimestamp(point, getPacketTimestamp(cluster->lastTimestamp, tsOverflow));
+		caerPoint2DEventSetType(point, cluster->trackID);
+		point->info |= htole32(1U); // Valid mark, counted once below.
+
+		caerPoint4DEvent track = caerPoint4DEventPacketGetEvent(trackPacket, visibleNumber);
+		track->info = 0;
+
+		caerPoint4DEventSetX(track, cluster->x);
+		caerPoint4DEventSetY(track, cluster->y);
+		caerPoint4DEventSetZ(track, cluster->vx);
+		caerPoint4DEventSetW(track, cluster->vy);
+		caerPoint4DEventSetTimestamp(track, getPacketTimestamp(cluster->firstTimestamp, tsOverflow));
+		caerPoint4DEventSetType(track, cluster->trackID);
+		track->info |= htole32(1U); // Valid mark, counted once below.
+
+		visibleNumber++;
+	}
+
+	caerEventPacketHeaderSetEventNumber(&clusterPacket->packetHeader, visibleNumber);
+	caerEventPacketHeaderSetEventValid(&clusterPacket->packetHeader, visibleNumber);
+	caerEventPacketHeaderSetEventNumber(&trackPacket->packetHeader, visibleNumber);
+	caerEventPacketHeaderSetEventValid(&trackPacket->packetHeader, visibleNumber);
+
+	*clusters = clusterPacket;
+	*tracks = trackPacket;
+}
+
+static void caerClusterTrackerConfig(caerModuleData moduleData) {
+	caerModuleConfigUpdateReset(moduleData);
+
+	ClusterTrackerState state = moduleData->moduleState;
+
+	updateConfig(moduleData);
+
+	// Drop clusters above the new limit, highest slots first.
+	while (__builtin_popcountll(state->activeClusters) > state->maxClusters) {
+		removeCluster(state, (size_t) (63 - __builtin_clzll(state->activeClusters)));
+	}
+}
+
+static void caerClusterTrackerExit(caerModuleData moduleData) {
+	// Remove listener, which can reference invalid memory in userData.
+	sshsNodeRemoveAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	ClusterTrackerState state = moduleData->moduleState;
+
+	// Ensure grid and output packets are freed.
+	free(state->grid);
+	state->grid = NULL;
+
+	free(state->clusterPacket);
+	state->clusterPacket = NULL;
+
+	free(state->trackPacket);
+	state->trackPacket = NULL;
+}
+
+static void updateConfig(caerModuleData moduleData) {
+	ClusterTrackerState state = moduleData->moduleState;
+
+	state->maxClusters = sshsNodeGetInt(moduleData->moduleNode, "maxClusters");
+	state->initialRadius = sshsNodeGetFloat(moduleData->moduleNode, "initialRadius");
+	state->maxRadius = sshsNodeGetFloat(moduleData->moduleNode, "maxRadius");
+	state->mixingFactor = sshsNodeGetFloat(moduleData->moduleNode, "mixingFactor");
+	state->visibleMass = sshsNodeGetFloat(moduleData->moduleNode, "visibleMass");
+	state->clusterLifetime = sshsNodeGetInt(moduleData->moduleNode, "clusterLifetime");
+	state->velocityTime = sshsNodeGetInt(moduleData->moduleNode, "velocityTime");
+	state->mergeClusters = sshsNodeGetBool(moduleData->moduleNode, "mergeClusters");
+
+	if (state->clusterLifetime < 1) {
+		state->clusterLifetime = 1;
+	}
+
+	if (state->velocityTime < 1) {
+		state->velocityTime = 1;
+	}
+
+	if (state->maxClusters > CT_MAX_CLUSTERS) {
+		state->maxClusters = CT_MAX_CLUSTERS;
+	}
+
+	if (state->maxRadius < CT_MIN_RADIUS) {
+		state->maxRadius = CT_MIN_RADIUS;
+	}
+
+	if (state->initialRadius < CT_MIN_RADIUS) {
+		state->initialRadius = CT_MIN_RADIUS;
+	}
+
+	if (state->initialRadius > state->maxRadius) {
+		state->initialRadius = state->maxRadius;
+	}
+}
+
+static bool allocateGrid(ClusterTrackerState state, int16_t sourceID) {
+	// Get size information from source.
+	sshsNode sourceInfoNode = caerMainloopGetSourceInfo(U16T(sourceID));
+	if (sourceInfoNode == NULL) {
+		// This should never happen, but we handle it gracefully.
+		caerLog(CAER_LOG_ERROR, __func__, "Failed to get source info to allocate grid.");
+		return (false);
+	}
+
+	int16_t sizeX = sshsNodeGetShort(sourceInfoNode, "dvsSizeX");
+	int16_t sizeY = sshsNodeGetShort(sourceInfoNode, "dvsSizeY");
+
+	state->gridSizeX = ((size_t) (sizeX - 1) >> CT_GRID_SHIFT) + 1;
+	state->gridSizeY = ((size_t) (sizeY - 1) >> CT_GRID_SHIFT) + 1;
+
+	state->grid = calloc(state->gridSizeX * state->gridSizeY, sizeof(uint64_t));
+	if (state->grid == NULL) {
+		return (false);
+	}
+
+	return (true);
+}
+
+/**
+ * Mass of the cluster at the given time, decayed since its last update.
+ */
+static inline float getClusterMass(ClusterTrackerState state, const struct ClusterTracker_cluster *cluster,
+	int64_t timestamp) {
+	return (cluster->mass * expf(-(float) (timestamp - cluster->lastTimestamp) / (float) state->clusterLifetime));
+}
+
+/**
+ * Timestamp for an output event in a packet with the given overflow counter.
+ * Times from before the packet's overflow period are clamped to its start.
+ */
+static inline int32_t getPacketTimestamp(int64_t timestamp, int32_t tsOverflow) {
+	int64_t periodStart = I64T(U64T(tsOverflow) << TS_OVERFLOW_SHIFT);
+
+	return ((timestamp > periodStart) ? (I32T(timestamp - periodStart)) : (0));
+}
+
+static inline uint16_t getCell(float position, size_t gridSize) {
+	if (position <= 0) {
+		return (0);
+	}
+
+	size_t cell = (size_t) position >> CT_GRID_SHIFT;
+
+	return (U16T((cell < gridSize) ? (cell) : (gridSize - 1)));
+}
+
+/**
+ * Move the cluster's bit in the grid to the cells it overlaps now,
+ * if they changed.
+ */
+static void updateClusterCells(ClusterTrackerState state, size_t index) {
+	struct ClusterTracker_cluster *cluster = &state->clusters[index];
+
+	uint16_t cellX0 = getCell(cluster->x - cluster->radius, state->gridSizeX);
+	uint16_t cellY0 = getCell(cluster->y - cluster->radius, state->gridSizeY);
+	uint16_t cellX1 = getCell(cluster->x + cluster->radius, state->gridSizeX);
+	uint16_t cellY1 = getCell(cluster->y + cluster->radius, state->gridSizeY);
+
+	if (cellX0 == cluster->cellX0 && cellY0 == cluster->cellY0 && cellX1 == cluster->cellX1
+		&& cellY1 == cluster->cellY1) {
+		return;
+	}
+
+	markClusterCells(state, index, false);
+
+	cluster->cellX0 = cellX0;
+	cluster->cellY0 = cellY0;
+	cluster->cellX1 = cellX1;
+	cluster->cellY1 = cellY1;
+
+	markClusterCells(state, index, true);
+}
+
+static void markClusterCells(ClusterTrackerState state, size_t index, bool mark) {
+	struct ClusterTracker_cluster *cluster = &state->clusters[index];
+	uint64_t bit = UINT64_C(1) << index;
+
+	for (size_t y = cluster->cellY0; y <= cluster->cellY1; y++) {
+		uint64_t *gridRow = state->grid + (y * state->gridSizeX);
+
+		for (size_t x = cluster->cellX0; x <= cluster->cellX1; x++) {
+			gridRow[x] = (mark) ? (gridRow[x] | bit) : (gridRow[x] & ~bit);
+		}
+	}
+}
+
+static void addCluster(ClusterTrackerState state, float x, float y, int64_t timestamp) {
+	size_t index = (size_t) __builtin_ctzll(~state->activeClusters);
+
+	// Find a track ID no live cluster uses. With at most 64 clusters
+	// and 128 IDs, there always is one.
+	uint8_t trackID = state->nextTrackID;
+	bool inUse;
+
+	do {
+		inUse = false;
+
+		for (uint64_t active = state->activeClusters; active != 0; active &= active - 1) {
+			if (state->clusters[__builtin_ctzll(active)].trackID == trackID) {
+				inUse = true;
+				trackID = U8T((trackID + 1) % CT_MAX_TRACK_ID);
+				break;
+			}
+		}
+	}
+	while (inUse);
+
+	state->nextTrackID = U8T((trackID + 1) % CT_MAX_TRACK_ID);
+
+	struct ClusterTracker_cluster *cluster = &state->clusters[index];
+
+	memset(cluster, 0, sizeof(struct ClusterTracker_cluster));
+
+	cluster->x = x;
+	cluster->y = y;
+	cluster->radius = state->initialRadius;
+	cluster->velocityX = x;
+	cluster->velocityY = y;
+	cluster->velocityTimestamp = timestamp;
+	cluster->firstTimestamp = timestamp;
+	cluster->lastTimestamp = timestamp;
+	cluster->mass = 1;
+	cluster->trackID = trackID;
+
+	cluster->cellX0 = getCell(x - cluster->radius, state->gridSizeX);
+	cluster->cellY0 = getCell(y - cluster->radius, state->gridSizeY);
+	cluster->cellX1 = getCell(x + cluster->radius, state->gridSizeX);
+	cluster->cellY1 = getCell(y + cluster->radius, state->gridSizeY);
+
+	markClusterCells(state, index, true);
+
+	state->activeClusters |= UINT64_C(1) << index;
+}
+
+static void removeCluster(ClusterTrackerState state, size_t index) {
+	markClusterCells(state, index, false);
+
+	state->activeClusters &= ~(UINT64_C(1) << index);
+}
+
+static void updateCluster(ClusterTrackerState state, size_t index, float x, float y, int64_t timestamp) {
+	struct ClusterTracker_cluster *cluster = &state->clusters[index];
+	float mixingFactor = state->mixingFactor;
+
+	float distance = fmaxf(fabsf(x - cluster->x), fabsf(y - cluster->y));
+
+	cluster->x += mixingFactor * (x - cluster->x);
+	cluster->y += mixingFactor * (y - cluster->y);
+	cluster->radius += mixingFactor * ((CT_RADIUS_GAIN * distance) - cluster->radius);
+	cluster->radius = fminf(fmaxf(cluster->radius, CT_MIN_RADIUS), state->maxRadius);
+
+	cluster->mass = getClusterMass(state, cluster, timestamp) + 1;
+	cluster->lastTimestamp = timestamp;
+
+	// Measure velocity over a fixed time, to not divide by tiny intervals.
+	int64_t velocityDelta = timestamp - cluster->velocityTimestamp;
+
+	if (velocityDelta >= state->velocityTime) {
+		float deltaSeconds = (float) velocityDelta * 1e-6f;
+
+		cluster->vx += CT_VELOCITY_MIXING * (((cluster->x - cluster->velocityX) / deltaSeconds) - cluster->vx);
+		cluster->vy += CT_VELOCITY_MIXING * (((cluster->y - cluster->velocityY) / deltaSeconds) - cluster->vy);
+
+		cluster->velocityX = cluster->x;
+		cluster->velocityY = cluster->y;
+		cluster->velocityTimestamp = timestamp;
+	}
+
+	updateClusterCells(state, index);
+}
+
+/**
+ * Merge clusters that overlap. The one with more mass keeps its track ID,
+ * the merged cluster gets the weighted mean position and velocity, and the
+ * larger size.
+ */
+static void mergeClusters(ClusterTrackerState state) {
+	for (uint64_t outer = state->activeClusters; outer != 0; outer &= outer - 1) {
+		size_t i = (size_t) __builtin_ctzll(outer);
+
+		// Cluster 'i' may have been merged away already.
+		if ((state->activeClusters & (UINT64_C(1) << i)) == 0) {
+			continue;
+		}
+
+		uint64_t inner = state->activeClusters & ~((UINT64_C(2) << i) - 1);
+
+		for (; inner != 0; inner &= inner - 1) {
+			size_t j = (size_t) __builtin_ctzll(inner);
+
+			struct ClusterTracker_cluster *a = &state->clusters[i];
+			struct ClusterTracker_cluster *b = &state->clusters[j];
+
+			float distance = fmaxf(fabsf(a->x - b->x), fabsf(a->y - b->y));
+
+			if (distance >= (a->radius + b->radius)) {
+				continue;
+			}
+
+			// Compare masses at the same time, the newer last update.
+			int64_t now = (a->lastTimestamp > b->lastTimestamp) ? (a->lastTimestamp) : (b->lastTimestamp);
+			float massA = getClusterMass(state, a, now);
+			float massB = getClusterMass(state, b, now);
+
+			size_t keep = (massA >= massB) ? (i) : (j);
+			size_t drop = (keep == i) ? (j) : (i);
+
+			struct ClusterTracker_cluster *k = &state->clusters[keep];
+			struct ClusterTracker_cluster *d = &state->clusters[drop];
+
+			float weight = ((keep == i) ? (massB) : (massA)) / (massA + massB);
+
+			k->x += weight * (d->x - k->x);
+			k->y += weight * (d->y - k->y);
+			k->vx += weight * (d->vx - k->vx);
+			k->vy += weight * (d->vy - k->vy);
+			k->radius = fmaxf(k->radius, d->radius);
+			k->mass = massA + massB;
+
+			// Keep the age of the older, and the last update of the newer.
+			if (d->firstTimestamp < k->firstTimestamp) {
+				k->firstTimestamp = d->firstTimestamp;
+			}
+			k->lastTimestamp = now;
+
+			removeCluster(state, drop);
+			updateClusterCells(state, keep);
+
+			// If 'i' itself was dropped, it can't merge with anything else.
+			if (drop == i) {
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,37 @@
+/*
+ * clustertracker.h
+ *
+ * Tracks moving objects as clusters of events, directly on the event stream,
+ * like jAER's RectangularClusterTracker. After every packet, the visible
+ * clusters are put out in two forms: their position as Point2D events, for
+ * the visualizer, and as compact tracks, as Point4D events, for the outputs.
+ */
+
+#ifndef CLUSTERTRACKER_H_
+#define CLUSTERTRACKER_H_
+
+#include "main.h"
+
+#include <libcaer/events/polarity.h>
+#include <libcaer/events/point2d.h>
+#include <libcaer/events/point4d.h>
+
+/**
+ * Clusters are Point2D events with x and y being the cluster position (in
+ * pixels); the event type is the track ID, the timestamp the time of its
+ * last update.
+ *
+ * Tracks are Point4D events with x and y being the cluster position (in
+ * pixels), z and w its velocity (in pixels per second); the event type is
+ * the track ID (unique among live tracks), the timestamp the time the track
+ * started, so its age is the packet's time minus that. Tracks that started
+ * before the packet's timestamp overflow period get its start instead.
+ *
+ * Both returned packets are owned by the module, and stay valid until it
+ * runs again. They are set to NULL if the module is not running or there
+ * was no input.
+ */
+void caerClusterTracker(uint16_t moduleID, caerPolarityEventPacket polarity, caerPoint2DEventPacket *clusters,
+	caerPoint4DEventPacket *tracks);
+
+#endif /* CLUSTERTRACKER_H_ */
@@ -0,0 +1,411 @@
+/*
+ * cornerdetector.c
+ *
+ * eFAST (Mueggler et al., BMVC 2017). For every event, look at the Surface of
+ * Active Events (SAE) of its polarity on two circles around it, of radius 3
+ * (16 pixels) and radius 4 (20 pixels). The event is a corner if, on both
+ * circles, a contiguous arc of 3 to 6 (resp. 4 to 8) pixels is strictly newer
+ * than all the other pixels on that circle.
+ *
+ * The SAE only takes an event if the pixel was quiet for 'filterTime' µs, or
+ * if it fired with the other polarity in the meantime. Like that, a single
+ * edge passing by updates it once, and not for every event it generates.
+ *
+ * The circle test reads the circle pixels into a small array first, through
+ * precomputed offsets, and then only uses fixed-size loops over that array
+ * without data-dependent branches, which the compiler can vectorize.
+ *
+ * Timestamps are stored relative to 'timestampBase', as 32-bit values, like
+ * in the background activity filter. Relative timestamps are kept between
+ * 2^30 and 3 * 2^30 µs, so a pixel that never fired (0) is always at least
+ * 2^30 µs (~18 minutes) old. When they grow too big, all values are rebased
+ * by 2^31 µs, and the ones older than that saturate to 0: for the ages, all
+ * pixels untouched for that long are just as old as never.
+ */
+
+#include "cornerdetector.h"
+#include "base/mainloop.h"
+#include "base/module.h"
+
+// Events closer than this to the border have incomplete circles, and are skipped.
+#define CORNER_BORDER 4
+
+#define CORNER_TIMESTAMP_REBASE_MIN INT64_C(0x40000000)
+#define CORNER_TIMESTAMP_REBASE_THRESHOLD INT64_C(0xC0000000)
+#define CORNER_TIMESTAMP_REBASE_SHIFT UINT32_C(0x80000000)
+
+#define CORNER_CIRCLE3_SIZE 16
+#define CORNER_CIRCLE3_MIN_ARC 3
+#define CORNER_CIRCLE3_MAX_ARC 6
+#define CORNER_CIRCLE4_SIZE 20
+#define CORNER_CIRCLE4_MIN_ARC 4
+#define CORNER_CIRCLE4_MAX_ARC 8
+
+#define CORNER_CIRCLE_MAX_SIZE CORNER_CIRCLE4_SIZE
+#define CORNER_ARC_MAX_LENGTH CORNER_CIRCLE4_MAX_ARC
+
+// Circle pixels, in order around the center, as {x, y} offsets.
+static const int8_t circle3[CORNER_CIRCLE3_SIZE][2] = { { 0, 3 }, { 1, 3 }, { 2, 2 }, { 3, 1 }, { 3, 0 }, { 3, -1 }, {
+	2, -2 }, { 1, -3 }, { 0, -3 }, { -1, -3 }, { -2, -2 }, { -3, -1 }, { -3, 0 }, { -3, 1 }, { -2, 2 }, { -1, 3 } };
+static const int8_t circle4[CORNER_CIRCLE4_SIZE][2] = { { 0, 4 }, { 1, 4 }, { 2, 3 }, { 3, 2 }, { 4, 1 }, { 4, 0 }, {
+	4, -1 }, { 3, -2 }, { 2, -3 }, { 1, -4 }, { 0, -4 }, { -1, -4 }, { -2, -3 }, { -3, -2 }, { -4, -1 }, { -4, 0 },
+	{ -4, 1 }, { -3, 2 }, { -2, 3 }, { -1, 4 } };
+
+struct CornerDetector_state {
+	/// Row-major maps of relative timestamps, one per polarity: the filtered
+	/// SAE, and the last event seen at each pixel.
+	uint32_t *saeMap[2];
+	uint32_t *lastEventMap[2];
+	int64_t timestampBase;
+	size_t sizeX;
+	size_t sizeY;
+	/// Circle offsets in the maps, computed once the map width is known.
+	ptrdiff_t circle3Offsets[CORNER_CIRCLE3_SIZE];
+	ptrdiff_t circle4Offsets[CORNER_CIRCLE4_SIZE];
+	int32_t filterTime;
+	caerPoint2DEventPacket corners;
+};
+
+typedef struct CornerDetector_state *CornerDetectorState;
+
+static bool caerCornerDetectorInit(caerModuleData moduleData);
+static void caerCornerDetectorRun(caerModuleData moduleData, size_t argsNumber, va_list args);
+static void caerCornerDetectorConfig(caerModuleData moduleData);
+static void caerCornerDetectorExit(caerModuleData moduleData);
+static bool allocateMaps(CornerDetectorState state, int16_t sourceID);
+static void freeMaps(CornerDetectorState state);
+static void rebaseMaps(CornerDetectorState state, int64_t timestamp);
+static inline uint32_t getRelativeTimestamp(CornerDetectorState state, int64_t timestamp);
+static inline bool isCornerOnCircle(const uint32_t *sae, const ptrdiff_t *offsets, uint32_t timestamp,
+	size_t circleSize, size_t minArc, size_t maxArc);
+
+static struct caer_module_functions caerCornerDetectorFunctions = { .moduleInit = &caerCornerDetectorInit,
+	.moduleRun = &caerCornerDetectorRun, .moduleConfig = &caerCornerDetectorConfig, .moduleExit =
+		&caerCornerDetectorExit };
+
+caerPoint2DEventPacket caerCornerDetector(uint16_t moduleID, caerPolarityEventPacket polarity) {
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "CornerDetector");
+	if (moduleData == NULL) {
+		return (NULL);
+	}
+
+	caerPoint2DEventPacket corners = NULL;
+
+	caerModuleSM(&caerCornerDetectorFunctions, moduleData, sizeof(struct CornerDetector_state), 2, polarity,
+		&corners);
+
+	return (corners);
+}
+
+static bool caerCornerDetectorInit(caerModuleData moduleData) {
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "filterTime", 50000); // in µs, 0 to take all events into the SAE
+
+	CornerDetectorState state = moduleData->moduleState;
+
+	state->filterTime = sshsNodeGetInt(moduleData->moduleNode, "filterTime");
+
+	// Add config listeners last, to avoid having them dangling if Init doesn't succeed.
+	sshsNodeAddAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	// Nothing that can fail here.
+	return (true);
+}
+
+static void caerCornerDetectorRun(caerModuleData moduleData, size_t argsNumber, va_list args) {
+	UNUSED_ARGUMENT(argsNumber);
+
+	// Interpret variable arguments (same as above in main function).
+	caerPolarityEventPacket polarity = va_arg(args, caerPolarityEventPacket);
+	caerPoint2DEventPacket *corners = va_arg(args, caerPoint2DEventPacket *);
+
+	// Only process packets with content.
+	if (polarity == NULL || caerEventPacketHeaderGetEventValid(&polarity->packetHeader) == 0) {
+		return;
+	}
+
+	CornerDetectorState state = moduleData->moduleState;
+
+	// If the maps are not allocated yet, do it.
+	if (state->saeMap[0] == NULL) {
+		if (!allocateMaps(state, caerEventPacketHeaderGetEventSource(&polarity->packetHeader))) {
+			// Failed to allocate memory, nothing to do.
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate memory for SAE maps.");
+			return;
+		}
+	}
+
+	// Every valid event can be a corner at most once, so that's the most
+	// space the output can ever need. The packet is kept and reused.
+	int32_t maxCorners = caerEventPacketHeaderGetEventValid(&polarity->packetHeader);
+
+	if (state->corners == NULL) {
+		state->corners = caerPoint2DEventPacketAllocate(maxCorners,
+			caerEventPacketHeaderGetEventSource(&polarity->packetHeader), 0);
+		if (state->corners == NULL) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate corners event packet.");
+			return;
+		}
+	}
+	else if (caerEventPacketHeaderGetEventCapacity(&state->corners->packetHeader) < maxCorners) {
+		caerPoint2DEventPacket grownCorners = (caerPoint2DEventPacket) caerGenericEventPacketGrow(
+			&state->corners->packetHeader, maxCorners);
+		if (grownCorners == NULL) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to grow corners event packet.");
+			return;
+		}
+
+		state->corners = grownCorners;
+	}
+
+	caerPoint2DEventPacket cornerPacket = state->corners;
+	caerEventPacketHeaderSetEventTSOverflow(&cornerPacket->packetHeader,
+		caerEventPacketHeaderGetEventTSOverflow(&polarity->packetHeader));
+
+	size_t sizeX = state->sizeX;
+	size_t sizeY = state->sizeY;
+	uint32_t filterTime = (state->filterTime > 0) ? (U32T(state->filterTime)) : (0);
+	int32_t cornerNumber = 0;
+
+	// Validating the corners counts them again.
+	caerEventPacketHeaderSetEventValid(&cornerPacket->packetHeader, 0);
+
+	CAER_POLARITY_ITERATOR_VALID_START(polarity)
+		uint16_t x = caerPolarityEventGetX(caerPolarityIteratorElement);
+		uint16_t y = caerPolarityEventGetY(caerPolarityIteratorElement);
+		size_t pol = caerPolarityEventGetPolarity(caerPolarityIteratorElement);
+		uint32_t ts = getRelativeTimestamp(state, caerPolarityEventGetTimestamp64(caerPolarityIteratorElement, polarity));
+
+		size_t index = (size_t) y * sizeX + x;
+
+		uint32_t *sae = state->saeMap[pol];
+
+		// Only update the SAE on the first event of an edge: when this pixel
+		// was quiet for long enough, or fired with the other polarity since.
+		uint32_t lastAge = ts - state->lastEventMap[pol][index];
+		uint32_t otherAge = ts - state->lastEventMap[pol ^ 1][index];
+
+		state->lastEventMap[pol][index] = ts;
+
+		if (lastAge <= filterTime && otherAge >= lastAge) {
+			continue;
+		}
+
+		sae[index] = ts;
+
+		// Circles must lie completely inside the array.
+		if (x < CORNER_BORDER || x >= (sizeX - CORNER_BORDER) || y < CORNER_BORDER || y >= (sizeY - CORNER_BORDER)) {
+			continue;
+		}
+
+		if (!isCornerOnCircle(sae + index, state->circle3Offsets, ts, CORNER_CIRCLE3_SIZE, CORNER_CIRCLE3_MIN_ARC,
+			CORNER_CIRCLE3_MAX_ARC)) {
+			continue;
+		}
+
+		if (!isCornerOnCircle(sae + index, state->circle4Offsets, ts, CORNER_CIRCLE4_SIZE, CORNER_CIRCLE4_MIN_ARC,
+			CORNER_CIRCLE4_MAX_ARC)) {
+			continue;
+		}
+
+		// It's a corner, add it to the output. Fresh events have 'info' cleared,
+		// so the type (polarity) and validity can be OR'ed in.
+		caerPoint2DEvent corner = caerPoint2DEventPacketGetEvent(cornerPacket, cornerNumber++);
+		corner->info = 0;
+
+		caerPoint2DEventSetX(corner, (float) x);
+		caerPoint2DEventSetY(corner, (float) y);
+		caerPoint2DEventSetTimestamp(corner, caerPolarityEventGetTimestamp(caerPolarityIteratorElement));
+		caerPoint2DEventSetType(corner, U8T(pol));
+		caerPoint2DEventValidate(corner, cornerPacket);
+	CAER_POLARITY_ITERATOR_VALID_END
+
+	caerEventPacketHeaderSetEventNumber(&cornerPacket->packetHeader, cornerNumber);
+
+	*corners = cornerPacket;
+}
+
+static void caerCornerDetectorConfig(caerModuleData moduleData) {
+	caerModuleConfigUpdateReset(moduleData);
+
+	CornerDetectorState state = moduleData->moduleState;
+
+	state->filterTime = sshsNodeGetInt(moduleData->moduleNode, "filterTime");
+}
+
+static void caerCornerDetectorExit(caerModuleData moduleData) {
+	// Remove listener, which can reference invalid memory in userData.
+	sshsNodeRemoveAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	CornerDetectorState state = moduleData->moduleState;
+
+	// Ensure maps and output packet are freed.
+	freeMaps(state);
+
+	free(state->corners);
+	state->corners = NULL;
+}
+
+static bool allocateMaps(CornerDetectorState state, int16_t sourceID) {
+	// Get size information from source.
+	sshsNode sourceInfoNode = caerMainloopGetSourceInfo(U16T(sourceID));
+	if (sourceInfoNode == NULL) {
+		// This should never happen, but we handle it gracefully.
+		caerLog(CAER_LOG_ERROR, __func__, "Failed to get source info to allocate SAE maps.");
+		return (false);
+	}
+
+	state->sizeX = (size_t) sshsNodeGetShort(sourceInfoNode, "dvsSizeX");
+	state->sizeY = (size_t) sshsNodeGetShort(sourceInfoNode, "dvsSizeY");
+
+	size_t mapSize = state->sizeX * state->sizeY;
+
+	for (size_t pol = 0; pol < 2; pol++) {
+		// 0 is never, so the first events always update the SAE, and
+		// untouched pixels are always the oldest.
+		state->saeMap[pol] = calloc(mapSize, sizeof(uint32_t));
+		state->lastEventMap[pol] = calloc(mapSize, sizeof(uint32_t));
+
+		if (state->saeMap[pol] == NULL || state->lastEventMap[pol] == NULL) {
+			freeMaps(state);
+			return (false);
+		}
+	}
+
+	state->timestampBase = 0;
+
+	ptrdiff_t stride = (ptrdiff_t) state->sizeX;
+
+	for (size_t i = 0; i < CORNER_CIRCLE3_SIZE; i++) {
+		state->circle3Offsets[i] = (circle3[i][1] * stride) + circle3[i][0];
+	}
+
+	for (size_t i = 0; i < CORNER_CIRCLE4_SIZE; i++) {
+		state->circle4Offsets[i] = (circle4[i][1] * stride) + circle4[i][0];
+	}
+
+	return (true);
+}
+
+static void freeMaps(CornerDetectorState state) {
+	for (size_t pol = 0; pol < 2; pol++) {
+		free(state->saeMap[pol]);
+		state->saeMap[pol] = NULL;
+
+		free(state->lastEventMap[pol]);
+		state->lastEventMap[pol] = NULL;
+	}
+}
+
+/**
+ * Make 'timestamp' representable relative to the base again. Either shift
+ * everything down by CORNER_TIMESTAMP_REBASE_SHIFT, or, if time jumped
+ * backwards (timestamp reset) or too far forward, just start over with empty
+ * maps.
+ */
+static void rebaseMaps(CornerDetectorState state, int64_t timestamp) {
+	int64_t relativeTimestamp = timestamp - state->timestampBase;
+	bool shift = (relativeTimestamp >= CORNER_TIMESTAMP_REBASE_THRESHOLD
+		&& (relativeTimestamp - CORNER_TIMESTAMP_REBASE_SHIFT) < CORNER_TIMESTAMP_REBASE_THRESHOLD);
+
+	size_t mapSize = state->sizeX * state->sizeY;
+
+	for (size_t pol = 0; pol < 2; pol++) {
+		uint32_t *maps[2] = { state->saeMap[pol], state->lastEventMap[pol] };
+
+		for (size_t m = 0; m < 2; m++) {
+			if (shift) {
+				for (size_t i = 0; i < mapSize; i++) {
+					uint32_t value = maps[m][i];
+
+					maps[m][i] = (value > CORNER_TIMESTAMP_REBASE_SHIFT) ? (value - CORNER_TIMESTAMP_REBASE_SHIFT) : (0);
+				}
+			}
+			else {
+				memset(maps[m], 0, mapSize * sizeof(uint32_t));
+			}
+		}
+	}
+
+	if (shift) {
+		state->timestampBase += CORNER_TIMESTAMP_REBASE_SHIFT;
+	}
+	else {
+		// Start in the middle of the range, so 'never' is old right away.
+		state->timestampBase = timestamp - CORNER_TIMESTAMP_REBASE_SHIFT;
+	}
+}
+
+static inline uint32_t getRelativeTimestamp(CornerDetectorState state, int64_t timestamp) {
+	int64_t relativeTimestamp = timestamp - state->timestampBase;
+
+	if (relativeTimestamp < CORNER_TIMESTAMP_REBASE_MIN || relativeTimestamp >= CORNER_TIMESTAMP_REBASE_THRESHOLD) {
+		rebaseMaps(state, timestamp);
+	}
+
+	return (U32T(timestamp - state->timestampBase));
+}
+
+/**
+ * Check if the circle around 'center' has a contiguous arc, of length between
+ * 'minArc' and 'maxArc', whose pixels are all strictly newer than the rest.
+ *
+ * Works on ages (time since 'timestamp'). Since the arc lengths are tested in order,
+ * the youngest pixel of the rest of the circle and the oldest pixel of the
+ * arc can both be updated with a single min/max per length, for all starting
+ * positions at once.
+ */
+static inline bool isCornerOnCircle(const uint32_t *center, const ptrdiff_t *offsets, uint32_t timestamp,
+	size_t circleSize, size_t minArc, size_t maxArc) {
+	// The circle is stored twice, one after the other, so every arc is contiguous.
+	uint32_t ages[2 * CORNER_CIRCLE_MAX_SIZE];
+
+	for (size_t i = 0; i < circleSize; i++) {
+		ages[i] = timestamp - center[offsets[i]];
+		ages[i + circleSize] = ages[i];
+	}
+
+	// Youngest age on the rest of the circle, for each arc length and start.
+	// For an arc of 'len' starting at 'i', the rest goes from 'i + len' to 'i + circleSize - 1'.
+	uint32_t restMinAge[CORNER_ARC_MAX_LENGTH + 1][CORNER_CIRCLE_MAX_SIZE];
+
+	for (size_t i = 0; i < circleSize; i++) {
+		restMinAge[maxArc][i] = UINT32_MAX;
+	}
+
+	for (size_t j = maxArc; j < circleSize; j++) {
+		for (size_t i = 0; i < circleSize; i++) {
+			restMinAge[maxArc][i] = (ages[i + j] < restMinAge[maxArc][i]) ? (ages[i + j]) : (restMinAge[maxArc][i]);
+		}
+	}
+
+	for (size_t len = maxArc - 1; len >= minArc; len--) {
+		for (size_t i = 0; i < circleSize; i++) {
+			restMinAge[len][i] = (ages[i + len] < restMinAge[len + 1][i]) ? (ages[i + len]) : (restMinAge[len + 1][i]);
+		}
+	}
+
+	// Oldest age on the arc, for each start, growing the arc one pixel at a time.
+	uint32_t arcMaxAge[CORNER_CIRCLE_MAX_SIZE];
+
+	for (size_t i = 0; i < circleSize; i++) {
+		arcMaxAge[i] = 0;
+	}
+
+	for (size_t j = 0; j < minArc - 1; j++) {
+		for (size_t i = 0; i < circleSize; i++) {
+			arcMaxAge[i] = (ages[i + j] > arcMaxAge[i]) ? (ages[i + j]) : (arcMaxAge[i]);
+		}
+	}
+
+	uint32_t found = 0;
+
+	for (size_t len = minArc; len <= maxArc; len++) {
+		for (size_t i = 0; i < circleSize; i++) {
+			arcMaxAge[i] = (ages[i + len - 1] > arcMaxAge[i]) ? (ages[i + len - 1]) : (arcMaxAge[i]);
+
+			found |= (arcMaxAge[i] < restMinAge[len][i]);
+		}
+	}
+
+	return (found != 0);
+}
@@ -0,0 +1,24 @@
+/*
+ * cornerdetector.h
+ *
+ * Detects corners directly on the event stream (eFAST), using a Surface of
+ * Active Events per polarity. Every event that lies on a corner produces a
+ * Point2D event at its address, which can be drawn by the visualizer or used
+ * as input for feature tracking.
+ */
+
+#ifndef CORNERDETECTOR_H_
+#define CORNERDETECTOR_H_
+
+#include "main.h"
+
+#include <libcaer/events/polarity.h>
+#include <libcaer/events/point2d.h>
+
+/**
+ * The returned packet is owned by the module, and stays valid until it runs
+ * again. Returns NULL if the module is not running or there was no input.
+ */
+caerPoint2DEventPacket caerCornerDetector(uint16_t moduleID, caerPolarityEventPacket polarity);
+
+#endif /* CORNERDETECTOR_H_ */
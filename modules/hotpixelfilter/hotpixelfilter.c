@@ -0,0 +1,666 @@
+/*
+ * hotpixelfilter.c
+ *
+ * Per-pixel event counts are kept for the two halves of a sliding window.
+ * Each time half the window has passed, pixels whose rate over the whole
+ * window is both above an absolute minimum and a multiple of the average
+ * rate of all active pixels are marked hot. Their events are invalidated
+ * from then on. The mask is published in the 'hotPixels' configuration
+ * key, so it's persisted and loaded back at the next start, and the hottest
+ * pixels are also given to the device's hardware pixel filter, if present.
+ */
+
+#include "hotpixelfilter.h"
+#include "base/mainloop.h"
+#include "base/module.h"
+
+/// Number of pixels the DAVIS hardware pixel filter can suppress.
+#define HOTPIXEL_HARDWARE_PIXELS 8
+
+struct HotPixelFilter_state {
+	/// Event counts per pixel (row-major), for the current [0] and previous [1]
+	/// half of the sliding window. Saturating, a hot pixel can't overflow them.
+	uint16_t *windowCounts[2];
+	/// One bit per pixel, set if the pixel is hot.
+	uint64_t *hotPixelMap;
+	size_t mapSizeX;
+	size_t mapSizeY;
+	/// Current hot pixels as map indexes, hottest first.
+	int32_t *hotPixels;
+	size_t hotPixelsNumber;
+	/// Scratch lists for the next evaluation, same size as above.
+	int32_t *candidatePixels;
+	uint32_t *candidateCounts;
+	size_t hotPixelsCapacity;
+	/// End of the current half-window, -1 if not yet started.
+	int64_t windowEnd;
+	int32_t halfWindowTime;
+	/// True once both halves hold a full half-window of data.
+	bool windowFull;
+	/// Device DVS configuration node, if the device has a hardware pixel filter.
+	sshsNode hardwareNode;
+	int16_t hardwareSizeX;
+	int16_t hardwareSizeY;
+	/// Hot pixels given to the hardware filter. They don't produce events
+	/// anymore, so they stay hot until released.
+	int32_t hardwarePixels[HOTPIXEL_HARDWARE_PIXELS];
+	size_t hardwarePixelsNumber;
+	/// Configuration.
+	int32_t windowTime;
+	int32_t minHotRate;
+	float hotRatio;
+	int16_t maxHotPixels;
+	bool learn;
+	bool hardwareFilter;
+};
+
+typedef struct HotPixelFilter_state *HotPixelFilterState;
+
+static bool caerHotPixelFilterInit(caerModuleData moduleData);
+static void caerHotPixelFilterRun(caerModuleData moduleData, size_t argsNumber, va_list args);
+static void caerHotPixelFilterConfig(caerModuleData moduleData);
+static void caerHotPixelFilterExit(caerModuleData moduleData);
+static void caerHotPixelFilterConfigListener(sshsNode node, void *userData, enum sshs_node_attribute_events event,
+	const char *changeKey, enum sshs_node_attr_value_type changeType, union sshs_node_attr_value changeValue);
+static bool allocateMaps(caerModuleData moduleData, HotPixelFilterState state, int16_t sourceID);
+static void freeMaps(HotPixelFilterState state);
+static sshsNode findHardwareNode(sshsNode sourceInfoNode);
+static void updateWindow(caerModuleData moduleData, HotPixelFilterState state, int64_t timestamp);
+static void evaluateHotPixels(caerModuleData moduleData, HotPixelFilterState state);
+static void insertCandidate(HotPixelFilterState state, size_t *candidatesNumber, int32_t index, uint32_t count);
+static void setHotPixels(caerModuleData moduleData, HotPixelFilterState state, size_t candidatesNumber);
+static void loadHotPixels(caerModuleData moduleData, HotPixelFilterState state);
+static void publishHotPixels(caerModuleData moduleData, HotPixelFilterState state);
+static void resetHotPixels(caerModuleData moduleData, HotPixelFilterState state);
+static void fillHardwarePixels(HotPixelFilterState state);
+static void releaseHardwarePixels(HotPixelFilterState state);
+static void setHardwarePixel(HotPixelFilterState state, size_t slot, int16_t row, int16_t column);
+static bool isHardwarePixel(HotPixelFilterState state, int32_t index);
+static inline bool isHotPixel(HotPixelFilterState state, size_t index);
+static inline size_t getHotPixelsCapacity(int16_t maxHotPixels);
+
+static struct caer_module_functions caerHotPixelFilterFunctions = { .moduleInit = &caerHotPixelFilterInit,
+	.moduleRun = &caerHotPixelFilterRun, .moduleConfig = &caerHotPixelFilterConfig, .moduleExit =
+		&caerHotPixelFilterExit };
+
+void caerHotPixelFilter(uint16_t moduleID, caerPolarityEventPacket polarity) {
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "HotPixelFilter");
+	if (moduleData == NULL) {
+		return;
+	}
+
+	caerModuleSM(&caerHotPixelFilterFunctions, moduleData, sizeof(struct HotPixelFilter_state), 1, polarity);
+}
+
+static bool caerHotPixelFilterInit(caerModuleData moduleData) {
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "windowTime", 1000000); // in µs, rates are measured over this
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "minHotRate", 100); // in Hz, never hot below this rate
+	sshsNodePutFloatIfAbsent(moduleData->moduleNode, "hotRatio", 20.0f); // times the average pixel rate
+	sshsNodePutShortIfAbsent(moduleData->moduleNode, "maxHotPixels", 256);
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "learn", true); // false freezes the current mask
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "hardwareFilter", true); // use device pixel filter if available
+	sshsNodePutStringIfAbsent(moduleData->moduleNode, "hotPixels", ""); // learned mask, as 'x:y,x:y,...'
+	sshsNodePutBool(moduleData->moduleNode, "resetMask", false); // set to true to forget all hot pixels
+
+	HotPixelFilterState state = moduleData->moduleState;
+
+	state->windowTime = sshsNodeGetInt(moduleData->moduleNode, "windowTime");
+	state->minHotRate = sshsNodeGetInt(moduleData->moduleNode, "minHotRate");
+	state->hotRatio = sshsNodeGetFloat(moduleData->moduleNode, "hotRatio");
+	state->maxHotPixels = sshsNodeGetShort(moduleData->moduleNode, "maxHotPixels");
+	state->learn = sshsNodeGetBool(moduleData->moduleNode, "learn");
+	state->hardwareFilter = sshsNodeGetBool(moduleData->moduleNode, "hardwareFilter");
+
+	state->halfWindowTime = (state->windowTime > 1) ? (state->windowTime / 2) : (1);
+	state->windowEnd = -1;
+
+	// Add config listeners last, to avoid having them dangling if Init doesn't succeed.
+	sshsNodeAddAttributeListener(moduleData->moduleNode, moduleData, &caerHotPixelFilterConfigListener);
+
+	// Nothing that can fail here.
+	return (true);
+}
+
+static void caerHotPixelFilterRun(caerModuleData moduleData, size_t argsNumber, va_list args) {
+	UNUSED_ARGUMENT(argsNumber);
+
+	// Interpret variable arguments (same as above in main function).
+	caerPolarityEventPacket polarity = va_arg(args, caerPolarityEventPacket);
+
+	// Only process packets with content.
+	if (polarity == NULL) {
+		return;
+	}
+
+	HotPixelFilterState state = moduleData->moduleState;
+
+	// If the maps are not allocated yet, do it.
+	if (state->hotPixelMap == NULL) {
+		if (!allocateMaps(moduleData, state, caerEventPacketHeaderGetEventSource(&polarity->packetHeader))) {
+			// Failed to allocate memory, nothing to do.
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate memory for hot pixel maps.");
+			return;
+		}
+	}
+
+	int32_t invalidNumber = 0;
+
+	CAER_POLARITY_ITERATOR_VALID_START(polarity)
+		int64_t ts = caerPolarityEventGetTimestamp64(caerPolarityIteratorElement, polarity);
+
+		// Half-window passed, or time went backwards (timestamp reset).
+		if (ts >= state->windowEnd || ts < (state->windowEnd - state->halfWindowTime)) {
+			updateWindow(moduleData, state, ts);
+		}
+
+		size_t index = (size_t) caerPolarityEventGetY(caerPolarityIteratorElement) * state->mapSizeX
+			+ (size_t) caerPolarityEventGetX(caerPolarityIteratorElement);
+
+		// Count all events, so hot pixels can also stop being hot.
+		uint16_t *count = &state->windowCounts[0][index];
+		*count = U16T(*count + (*count != UINT16_MAX));
+
+		// Filter out hot pixels, without branching: clear the valid mark (bit 0) directly.
+		uint32_t hot = isHotPixel(state, index);
+
+		caerPolarityIteratorElement->data &= htole32(~hot);
+		invalidNumber += I32T(hot);
+	CAER_POLARITY_ITERATOR_VALID_END
+
+	caerEventPacketHeaderSetEventValid(&polarity->packetHeader,
+		caerEventPacketHeaderGetEventValid(&polarity->packetHeader) - invalidNumber);
+}
+
+static void caerHotPixelFilterConfig(caerModuleData moduleData) {
+	caerModuleConfigUpdateReset(moduleData);
+
+	HotPixelFilterState state = moduleData->moduleState;
+
+	int32_t oldWindowTime = state->windowTime;
+
+	state->windowTime = sshsNodeGetInt(moduleData->moduleNode, "windowTime");
+	state->minHotRate = sshsNodeGetInt(moduleData->moduleNode, "minHotRate");
+	state->hotRatio = sshsNodeGetFloat(moduleData->moduleNode, "hotRatio");
+	state->maxHotPixels = sshsNodeGetShort(moduleData->moduleNode, "maxHotPixels");
+	state->learn = sshsNodeGetBool(moduleData->moduleNode, "learn");
+	state->hardwareFilter = sshsNodeGetBool(moduleData->moduleNode, "hardwareFilter");
+
+	if (sshsNodeGetBool(moduleData->moduleNode, "resetMask")) {
+		if (state->hotPixelMap != NULL) {
+			resetHotPixels(moduleData, state);
+		}
+		else {
+			sshsNodePutString(moduleData->moduleNode, "hotPixels", "");
+		}
+
+		// Reset the configuration key, so it can be triggered again.
+		sshsNodePutBool(moduleData->moduleNode, "resetMask", false);
+	}
+
+	if (state->hotPixelMap == NULL) {
+		return;
+	}
+
+	if (getHotPixelsCapacity(state->maxHotPixels) != state->hotPixelsCapacity) {
+		// Lists have to be resized, re-allocate on next run. The mask is
+		// loaded back from the configuration then.
+		freeMaps(state);
+		return;
+	}
+
+	if (state->windowTime != oldWindowTime) {
+		// Start measuring over again.
+		state->halfWindowTime = (state->windowTime > 1) ? (state->windowTime / 2) : (1);
+		state->windowEnd = -1;
+	}
+
+	if (state->hardwareFilter) {
+		fillHardwarePixels(state);
+	}
+	else {
+		releaseHardwarePixels(state);
+	}
+}
+
+static void caerHotPixelFilterExit(caerModuleData moduleData) {
+	// Remove listener, which can reference invalid memory in userData.
+	sshsNodeRemoveAttributeListener(moduleData->moduleNode, moduleData, &caerHotPixelFilterConfigListener);
+
+	HotPixelFilterState state = moduleData->moduleState;
+
+	// Ensure maps are freed, and the hardware filter is released.
+	freeMaps(state);
+}
+
+static void caerHotPixelFilterConfigListener(sshsNode node, void *userData, enum sshs_node_attribute_events event,
+	const char *changeKey, enum sshs_node_attr_value_type changeType, union sshs_node_attr_value changeValue) {
+	// The mask is published by the filter itself, no need to reconfigure on that.
+	if (changeType == STRING && caerStrEquals(changeKey, "hotPixels")) {
+		return;
+	}
+
+	caerModuleConfigDefaultListener(node, userData, event, changeKey, changeType, changeValue);
+}
+
+static bool allocateMaps(caerModuleData moduleData, HotPixelFilterState state, int16_t sourceID) {
+	// Get size information from source.
+	sshsNode sourceInfoNode = caerMainloopGetSourceInfo(U16T(sourceID));
+	if (sourceInfoNode == NULL) {
+		// This should never happen, but we handle it gracefully.
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to get source info to allocate maps.");
+		return (false);
+	}
+
+	int16_t sizeX = sshsNodeGetShort(sourceInfoNode, "dvsSizeX");
+	int16_t sizeY = sshsNodeGetShort(sourceInfoNode, "dvsSizeY");
+
+	state->mapSizeX = (size_t) sizeX;
+	state->mapSizeY = (size_t) sizeY;
+
+	size_t mapSize = state->mapSizeX * state->mapSizeY;
+
+	state->hotPixelsCapacity = getHotPixelsCapacity(state->maxHotPixels);
+
+	state->windowCounts[0] = calloc(mapSize, sizeof(uint16_t));
+	state->windowCounts[1] = calloc(mapSize, sizeof(uint16_t));
+	state->hotPixelMap = calloc((mapSize + 63) / 64, sizeof(uint64_t));
+	state->hotPixels = calloc(state->hotPixelsCapacity, sizeof(int32_t));
+	state->candidatePixels = calloc(state->hotPixelsCapacity, sizeof(int32_t));
+	state->candidateCounts = calloc(state->hotPixelsCapacity, sizeof(uint32_t));
+
+	if (state->windowCounts[0] == NULL || state->windowCounts[1] == NULL || state->hotPixelMap == NULL
+		|| state->hotPixels == NULL || state->candidatePixels == NULL
+		|| state->candidateCounts == NULL) {
+		freeMaps(state);
+		return (false);
+	}
+
+	state->hotPixelsNumber = 0;
+	state->windowEnd = -1;
+	state->windowFull = false;
+
+	// Only DAVIS devices have a pixel filter, other sources don't even have the key.
+	if (sshsNodeAttributeExists(sourceInfoNode, "dvsHasPixelFilter", BOOL)
+		&& sshsNodeGetBool(sourceInfoNode, "dvsHasPixelFilter")) {
+		state->hardwareNode = findHardwareNode(sourceInfoNode);
+		state->hardwareSizeX = sizeX;
+		state->hardwareSizeY = sizeY;
+	}
+
+	// Start from the last learned mask.
+	loadHotPixels(moduleData, state);
+
+	return (true);
+}
+
+static void freeMaps(HotPixelFilterState state) {
+	releaseHardwarePixels(state);
+	state->hardwareNode = NULL;
+
+	free(state->windowCounts[0]);
+	free(state->windowCounts[1]);
+	free(state->hotPixelMap);
+	free(state->hotPixels);
+	free(state->candidatePixels);
+	free(state->candidateCounts);
+
+	state->windowCounts[0] = NULL;
+	state->windowCounts[1] = NULL;
+	state->hotPixelMap = NULL;
+	state->hotPixels = NULL;
+	state->candidatePixels = NULL;
+	state->candidateCounts = NULL;
+	state->hotPixelsNumber = 0;
+	state->hotPixelsCapacity = 0;
+}
+
+/**
+ * The device keeps its DVS settings in '<chip>/dvs/' under its module node,
+ * which is also the parent of 'sourceInfo/'. The chip name isn't known here,
+ * so look for the node that has the pixel filter settings.
+ */
+static sshsNode findHardwareNode(sshsNode sourceInfoNode) {
+	sshsNode hardwareNode = NULL;
+
+	size_t chipNodesLength = 0;
+	sshsNode *chipNodes = sshsNodeGetChildren(sshsNodeGetParent(sourceInfoNode), &chipNodesLength);
+
+	for (size_t i = 0; i < chipNodesLength && hardwareNode == NULL; i++) {
+		size_t subNodesLength = 0;
+		sshsNode *subNodes = sshsNodeGetChildren(chipNodes[i], &subNodesLength);
+
+		for (size_t j = 0; j < subNodesLength; j++) {
+			if (caerStrEquals(sshsNodeGetName(subNodes[j]), "dvs")
+				&& sshsNodeAttributeExists(subNodes[j], "FilterPixel0Row", SHORT)) {
+				hardwareNode = subNodes[j];
+				break;
+			}
+		}
+
+		free(subNodes);
+	}
+
+	free(chipNodes);
+
+	return (hardwareNode);
+}
+
+static void updateWindow(caerModuleData moduleData, HotPixelFilterState state, int64_t timestamp) {
+	size_t mapSize = state->mapSizeX * state->mapSizeY;
+
+	if (state->windowEnd >= 0 && timestamp >= state->windowEnd) {
+		// Evaluate the full window, then slide it by half.
+		if (state->windowFull && state->learn) {
+			evaluateHotPixels(moduleData, state);
+		}
+
+		uint16_t *oldCounts = state->windowCounts[1];
+		state->windowCounts[1] = state->windowCounts[0];
+		state->windowCounts[0] = oldCounts;
+
+		memset(state->windowCounts[0], 0, mapSize * sizeof(uint16_t));
+
+		state->windowEnd += state->halfWindowTime;
+		state->windowFull = true;
+
+		// Still in the current half-window: a normal step, else a gap in the data.
+		if (timestamp < state->windowEnd) {
+			return;
+		}
+	}
+
+	// First event, time going backwards or gap: start over.
+	memset(state->windowCounts[0], 0, mapSize * sizeof(uint16_t));
+	memset(state->windowCounts[1], 0, mapSize * sizeof(uint16_t));
+
+	state->windowEnd = timestamp + state->halfWindowTime;
+	state->windowFull = false;
+}
+
+static void evaluateHotPixels(caerModuleData moduleData, HotPixelFilterState state) {
+	size_t mapSize = state->mapSizeX * state->mapSizeY;
+	const uint16_t *currCounts = state->windowCounts[0];
+	const uint16_t *prevCounts = state->windowCounts[1];
+
+	// Average rate of pixels that fired at all during the window.
+	uint64_t totalEvents = 0;
+	size_t activePixels = 0;
+
+	for (size_t i = 0; i < mapSize; i++) {
+		uint32_t count = (uint32_t) currCounts[i] + (uint32_t) prevCounts[i];
+
+		totalEvents += count;
+		activePixels += (count != 0);
+	}
+
+	double threshold = (double) state->minHotRate * (double) state->windowTime / 1000000.0;
+
+	if (activePixels != 0) {
+		double relativeThreshold = (double) state->hotRatio * (double) totalEvents / (double) activePixels;
+
+		if (relativeThreshold > threshold) {
+			threshold = relativeThreshold;
+		}
+	}
+
+	if (threshold < 1) {
+		threshold = 1;
+	}
+
+	size_t candidatesNumber = 0;
+
+	// Pixels in the hardware filter don't send events anymore, keep them first.
+	for (size_t i = 0; i < state->hardwarePixelsNumber; i++) {
+		insertCandidate(state, &candidatesNumber, state->hardwarePixels[i], UINT32_MAX);
+	}
+
+	for (size_t i = 0; i < mapSize; i++) {
+		uint32_t count = (uint32_t) currCounts[i] + (uint32_t) prevCounts[i];
+		bool wasHot = isHotPixel(state, i);
+
+		if (wasHot && isHardwarePixel(state, I32T(i))) {
+			continue;
+		}
+
+		// Hot pixels stay hot down to half the threshold, so they don't flicker in and out.
+		if ((double) count >= threshold || (wasHot && (2.0 * (double) count) >= threshold)) {
+			insertCandidate(state, &candidatesNumber, I32T(i), count);
+		}
+	}
+
+	setHotPixels(moduleData, state, candidatesNumber);
+}
+
+/**
+ * Insert into the candidate list, keeping it sorted by count, hottest first.
+ * If the list is full, the coolest pixel is dropped.
+ */
+static void insertCandidate(HotPixelFilterState state, size_t *candidatesNumber, int32_t index, uint32_t count) {
+	size_t pos;
+
+	if (*candidatesNumber == state->hotPixelsCapacity) {
+		if (count <= state->candidateCounts[*candidatesNumber - 1]) {
+			return;
+		}
+
+		pos = *candidatesNumber - 1;
+	}
+	else {
+		pos = (*candidatesNumber)++;
+	}
+
+	while (pos > 0 && state->candidateCounts[pos - 1] < count) {
+		state->candidatePixels[pos] = state->candidatePixels[pos - 1];
+		state->candidateCounts[pos] = state->candidateCounts[pos - 1];
+		pos--;
+	}
+
+	state->candidatePixels[pos] = index;
+	state->candidateCounts[pos] = count;
+}
+
+/**
+ * Make the candidate list the current hot pixel list. If the set of hot pixels
+ * changed, update the map, the hardware filter and the configuration.
+ */
+static void setHotPixels(caerModuleData moduleData, HotPixelFilterState state, size_t candidatesNumber) {
+	bool changed = (candidatesNumber != state->hotPixelsNumber);
+
+	for (size_t i = 0; i < candidatesNumber && !changed; i++) {
+		changed = !isHotPixel(state, (size_t) state->candidatePixels[i]);
+	}
+
+	if (changed) {
+		for (size_t i = 0; i < state->hotPixelsNumber; i++) {
+			size_t index = (size_t) state->hotPixels[i];
+			state->hotPixelMap[index / 64] &= ~(UINT64_C(1) << (index % 64));
+		}
+
+		for (size_t i = 0; i < candidatesNumber; i++) {
+			size_t index = (size_t) state->candidatePixels[i];
+			state->hotPixelMap[index / 64] |= (UINT64_C(1) << (index % 64));
+		}
+	}
+
+	// Always swap, to keep the order up-to-date.
+	int32_t *oldPixels = state->hotPixels;
+	state->hotPixels = state->candidatePixels;
+	state->candidatePixels = oldPixels;
+
+	state->hotPixelsNumber = candidatesNumber;
+
+	if (changed) {
+		caerLog(CAER_LOG_DEBUG, moduleData->moduleSubSystemString, "Hot pixels changed, now %zu.",
+			state->hotPixelsNumber);
+
+		if (state->hardwareFilter) {
+			fillHardwarePixels(state);
+		}
+
+		publishHotPixels(moduleData, state);
+	}
+}
+
+static void loadHotPixels(caerModuleData moduleData, HotPixelFilterState state) {
+	char *hotPixelsStr = sshsNodeGetString(moduleData->moduleNode, "hotPixels");
+	const char *str = hotPixelsStr;
+
+	size_t candidatesNumber = 0;
+
+	while (*str != '\0' && candidatesNumber < state->hotPixelsCapacity) {
+		char *end;
+
+		long x = strtol(str, &end, 10);
+		if (end == str || *end != ':') {
+			break;
+		}
+		str = end + 1;
+
+		long y = strtol(str, &end, 10);
+		if (end == str) {
+			break;
+		}
+		str = end;
+
+		if (x >= 0 && (size_t) x < state->mapSizeX && y >= 0 && (size_t) y < state->mapSizeY) {
+			// Counts are unknown, keep the saved order (hottest first).
+			insertCandidate(state, &candidatesNumber, I32T((size_t) y * state->mapSizeX + (size_t) x), 0);
+		}
+
+		if (*str == ',') {
+			str++;
+		}
+	}
+
+	free(hotPixelsStr);
+
+	for (size_t i = 0; i < candidatesNumber; i++) {
+		size_t index = (size_t) state->candidatePixels[i];
+		state->hotPixelMap[index / 64] |= (UINT64_C(1) << (index % 64));
+	}
+
+	int32_t *oldPixels = state->hotPixels;
+	state->hotPixels = state->candidatePixels;
+	state->candidatePixels = oldPixels;
+
+	state->hotPixelsNumber = candidatesNumber;
+
+	if (state->hardwareFilter) {
+		fillHardwarePixels(state);
+	}
+
+	if (state->hotPixelsNumber > 0) {
+		caerLog(CAER_LOG_INFO, moduleData->moduleSubSystemString, "Loaded %zu hot pixels from configuration.",
+			state->hotPixelsNumber);
+	}
+}
+
+static void publishHotPixels(caerModuleData moduleData, HotPixelFilterState state) {
+	// Each entry is at most 'xxxxx:yyyyy,'.
+	size_t hotPixelsStrLength = (state->hotPixelsNumber * 12) + 1;
+
+	char *hotPixelsStr = malloc(hotPixelsStrLength);
+	if (hotPixelsStr == NULL) {
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to update hotPixels information.");
+		return;
+	}
+
+	size_t offset = 0;
+	hotPixelsStr[0] = '\0';
+
+	for (size_t i = 0; i < state->hotPixelsNumber; i++) {
+		size_t index = (size_t) state->hotPixels[i];
+
+		offset += (size_t) snprintf(hotPixelsStr + offset, hotPixelsStrLength - offset,
+			(i == 0) ? ("%zu:%zu") : (",%zu:%zu"), index % state->mapSizeX, index / state->mapSizeX);
+	}
+
+	sshsNodePutString(moduleData->moduleNode, "hotPixels", hotPixelsStr);
+
+	free(hotPixelsStr);
+}
+
+static void resetHotPixels(caerModuleData moduleData, HotPixelFilterState state) {
+	releaseHardwarePixels(state);
+
+	for (size_t i = 0; i < state->hotPixelsNumber; i++) {
+		size_t index = (size_t) state->hotPixels[i];
+		state->hotPixelMap[index / 64] &= ~(UINT64_C(1) << (index % 64));
+	}
+
+	state->hotPixelsNumber = 0;
+	state->windowEnd = -1;
+
+	publishHotPixels(moduleData, state);
+
+	caerLog(CAER_LOG_INFO, moduleData->moduleSubSystemString, "Hot pixel mask cleared.");
+}
+
+/**
+ * Give the hottest pixels not yet in the hardware filter to it, as long as
+ * it has free slots. Pixels stay there until released.
+ */
+static void fillHardwarePixels(HotPixelFilterState state) {
+	if (state->hardwareNode == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < state->hotPixelsNumber && state->hardwarePixelsNumber < HOTPIXEL_HARDWARE_PIXELS; i++) {
+		int32_t index = state->hotPixels[i];
+
+		if (isHardwarePixel(state, index)) {
+			continue;
+		}
+
+		setHardwarePixel(state, state->hardwarePixelsNumber, I16T((size_t) index / state->mapSizeX),
+			I16T((size_t) index % state->mapSizeX));
+
+		state->hardwarePixels[state->hardwarePixelsNumber++] = index;
+	}
+}
+
+static void releaseHardwarePixels(HotPixelFilterState state) {
+	if (state->hardwareNode == NULL) {
+		return;
+	}
+
+	// Out of range coordinates disable a filter slot.
+	for (size_t i = 0; i < state->hardwarePixelsNumber; i++) {
+		setHardwarePixel(state, i, state->hardwareSizeY, state->hardwareSizeX);
+	}
+
+	state->hardwarePixelsNumber = 0;
+}
+
+/**
+ * Write into the device configuration, its listener sends it to the device.
+ * Rows and columns are the same as event Y and X addresses.
+ */
+static void setHardwarePixel(HotPixelFilterState state, size_t slot, int16_t row, int16_t column) {
+	char key[32];
+
+	snprintf(key, 32, "FilterPixel%zuRow", slot);
+	sshsNodePutShort(state->hardwareNode, key, row);
+
+	snprintf(key, 32, "FilterPixel%zuColumn", slot);
+	sshsNodePutShort(state->hardwareNode, key, column);
+}
+
+static bool isHardwarePixel(HotPixelFilterState state, int32_t index) {
+	for (size_t i = 0; i < state->hardwarePixelsNumber; i++) {
+		if (state->hardwarePixels[i] == index) {
+			return (true);
+		}
+	}
+
+	return (false);
+}
+
+static inline bool isHotPixel(HotPixelFilterState state, size_t index) {
+	return ((state->hotPixelMap[index / 64] >> (index % 64)) & 0x01);
+}
+
+/// The hardware pixels always have to fit in the list.
+static inline size_t getHotPixelsCapacity(int16_t maxHotPixels) {
+	return ((maxHotPixels > HOTPIXEL_HARDWARE_PIXELS) ? ((size_t) maxHotPixels) : (HOTPIXEL_HARDWARE_PIXELS));
+}
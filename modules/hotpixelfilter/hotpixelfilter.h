@@ -0,0 +1,18 @@
+/*
+ * hotpixelfilter.h
+ *
+ * Learns which pixels fire far more than the rest of the sensor (hot or
+ * stuck pixels), and suppresses their events. Should run before any other
+ * filter, so they don't waste time on those events.
+ */
+
+#ifndef HOTPIXELFILTER_H_
+#define HOTPIXELFILTER_H_
+
+#include "main.h"
+
+#include <libcaer/events/polarity.h>
+
+void caerHotPixelFilter(uint16_t moduleID, caerPolarityEventPacket polarity);
+
+#endif /* HOTPIXELFILTER_H_ */
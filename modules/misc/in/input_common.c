@@ -4,6 +4,7 @@
 #include "ext/ringbuffer/ringbuffer.h"
 #include "ext/uthash/utarray.h"
 #include "ext/buffers.h"
+#include "modules/misc/inout_compact.h"
 #ifdef HAVE_PTHREADS
 	#include "ext/c11threads_posix.h"
 #endif
@@ -42,6 +43,8 @@ struct input_common_packet_data {
 	size_t currPacketDataSize;
 	/// Current packet offset, index into data.
 	size_t currPacketDataOffset;
+	/// Current packet has invalid events that must be removed once it is complete.
+	bool currPacketCompact;
 	/// Skip over packets coming from other sources. We only support one!
 	size_t skipSize;
 };
@@ -912,12 +915,13 @@ static bool parsePackets(inputCommonState state) {
 				continue;
 			}
 
-			// Now let's get the right number of events, depending on user settings.
+			// In validOnly mode, packets with invalid events are read in full and then
+			// compacted in-place once complete, as events can be split across buffers.
 			bool validOnly = atomic_load_explicit(&state->validOnly, memory_order_relaxed);
-			int32_t eventCapacity = (validOnly) ? (eventValid) : (eventNumber);
+			state->packets.currPacketCompact = (validOnly && (eventValid != eventNumber));
 
 			// Allocate space for the full packet, so we can reassemble it.
-			state->packets.currPacketDataSize = (size_t) (eventCapacity * eventSize);
+			state->packets.currPacketDataSize = (size_t) (eventNumber * eventSize);
 
 			//caerLog(CAER_LOG_DEBUG, state->parentModule->moduleSubSystemString,
 			//	"Allocating %zu bytes for newly read event packet.",
@@ -937,54 +941,46 @@ static bool parsePackets(inputCommonState state) {
 
 			// Rewrite event source to reflect this module, not the original one.
 			caerEventPacketHeaderSetEventSource(state->packets.currPacket, I16T(state->parentModule->moduleID));
-
-			// And set the event numbers to the correct value for the valid-only mode.
-			if (validOnly) {
-				caerEventPacketHeaderSetEventNumber(state->packets.currPacket, eventCapacity);
-				caerEventPacketHeaderSetEventCapacity(state->packets.currPacket, eventCapacity);
-			}
 		}
 
 		// And then the data, from the buffer to the new event packet. We have to take care of
-		// date being split across multiple buffers, as well as what data we want to copy. In
-		// validOnly mode, we only want to copy valid events, which means either checking and
-		// copying, or in the case of already receiving a packet where eventValid == eventNumber
-		// just copying. For the non-validOnly case, we always just copy.
-		int32_t eventNumberOriginal = caerEventPacketHeaderGetEventNumber(
-			(caerEventPacketHeader) state->packets.currPacketHeader);
-		int32_t eventNumber = caerEventPacketHeaderGetEventNumber(state->packets.currPacket);
-
-		if (eventNumberOriginal == eventNumber) {
-			// Original packet header and new packet header have the same event number, this
-			// means that either there was no change due to validOnly (eventValid == eventNumber),
-			// or that validOnly mode is disabled. Just copy data!
-			if (state->packets.currPacketDataSize >= remainingData) {
-				// We need to copy more data than in this buffer.
-				memcpy(((uint8_t *) state->packets.currPacket) + state->packets.currPacketDataOffset,
-					buf->buffer + buf->bufferPosition, remainingData);
-
-				state->packets.currPacketDataOffset += remainingData;
-				state->packets.currPacketDataSize -= remainingData;
+		// data being split across multiple buffers.
+		if (state->packets.currPacketDataSize >= remainingData) {
+			// We need to copy more data than in this buffer.
+			memcpy(((uint8_t *) state->packets.currPacket) + state->packets.currPacketDataOffset,
+				buf->buffer + buf->bufferPosition, remainingData);
 
-				// Go and get next buffer. bufferPosition is reset.
-				return (true);
-			}
-			else {
-				// We copy the last bytes of data and we're done.
-				memcpy(((uint8_t *) state->packets.currPacket) + state->packets.currPacketDataOffset,
-					buf->buffer + buf->bufferPosition, state->packets.currPacketDataSize);
+			state->packets.currPacketDataOffset += remainingData;
+			state->packets.currPacketDataSize -= remainingData;
 
-				// This packet is fully copied and done, so reset variables for next iteration.
-				state->packets.currPacketHeaderSize = 0; // Get new header next iteration.
-				buf->bufferPosition += state->packets.currPacketDataSize;
-			}
+			// Go and get next buffer. bufferPosition is reset.
+			return (true);
 		}
 		else {
-			// Valid-only mode, iterate over events and copy only the valid ones.
-			int32_t eventSize = caerEventPacketHeaderGetEventSize(state->packets.currPacket);
+			// We copy the last bytes of data and we're done.
+			memcpy(((uint8_t *) state->packets.currPacket) + state->packets.currPacketDataOffset,
+				buf->buffer + buf->bufferPosition, state->packets.currPacketDataSize);
 
-			// TODO: implement this.
-			return (false);
+			// This packet is fully copied and done, so reset variables for next iteration.
+			state->packets.currPacketHeaderSize = 0; // Get new header next iteration.
+			buf->bufferPosition += state->packets.currPacketDataSize;
+		}
+
+		// Valid-only mode, remove invalid events from the complete packet.
+		if (state->packets.currPacketCompact) {
+			caerEventPacketHeader packet = state->packets.currPacket;
+
+			int32_t eventValid = caerInOutCompactEventPacket(packet);
+
+			if (eventValid == 0) {
+				// Nothing left, drop the packet.
+				free(packet);
+				state->packets.currPacket = NULL;
+
+				continue;
+			}
+
+			caerEventPacketHeaderSetEventCapacity(packet, eventValid);
 		}
 
 		// We've got a full event packet, store it. It will later appear in the packet
@@ -0,0 +1,476 @@
+/*
+ * Shared-memory input: maps the segment of a SharedMemoryOutput module running
+ * in another process, and returns the packets of each slot as a packet container
+ * pointing directly into shared memory, without copying. The slot is given back
+ * to the producer once the mainloop run that used it is over.
+ * The packets have their capacity equal to their size, so modules must never
+ * try to grow or free them (same as for any other input module's packets).
+ */
+
+#include "shm.h"
+#include "base/mainloop.h"
+#include "base/module.h"
+#include "modules/misc/inout_shm.h"
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#ifdef HAVE_PTHREADS
+#include "ext/c11threads_posix.h"
+#endif
+
+/**
+ * The mapping is reference counted: the module holds one reference, and each
+ * container still in use by the mainloop holds another, as those are only
+ * released after the mainloop run is over, which may be after module exit.
+ */
+struct shm_mapping {
+	struct shm_segment_header *segment;
+	size_t segmentSize;
+	atomic_uint_fast32_t references;
+};
+
+typedef struct shm_mapping *shmMapping;
+
+struct shm_slot_handle {
+	shmMapping mapping;
+	caerEventPacketContainer container;
+};
+
+typedef struct shm_slot_handle *shmSlotHandle;
+
+struct shm_input_state {
+	/// Control flag for doorbell thread.
+	atomic_bool running;
+	/// The doorbell thread, waits on the eventfd and notifies the mainloop.
+	thrd_t doorbellThread;
+	shmMapping mapping;
+	int doorbellFd;
+	int sockFd;
+	/// Slots signaled to the mainloop, but not yet consumed.
+	atomic_uint_fast32_t slotsPending;
+	/// Next slot to consume, slots before it might still be in use.
+	uint64_t consumeIndex;
+	/// Reference to parent module's original data.
+	caerModuleData parentModule;
+	/// Reference to mainloop, for data availability.
+	caerMainloopData mainloopReference;
+};
+
+typedef struct shm_input_state *shmInputState;
+
+static bool caerInputSharedMemoryInit(caerModuleData moduleData);
+static void caerInputSharedMemoryRun(caerModuleData moduleData, size_t argsNumber, va_list args);
+static void caerInputSharedMemoryExit(caerModuleData moduleData);
+static bool receiveDescriptors(caerModuleData moduleData, int sockFd, int *segmentFd, int *doorbellFd);
+static void updateSourceInfo(caerModuleData moduleData, struct shm_segment_header *segment);
+static void releaseMapping(shmMapping mapping);
+static void releaseSlot(void *slotHandlePtr);
+static int doorbellThread(void *stateArg);
+
+static struct caer_module_functions caerInputSharedMemoryFunctions = { .moduleInit = &caerInputSharedMemoryInit,
+	.moduleRun = &caerInputSharedMemoryRun, .moduleConfig = NULL, .moduleExit = &caerInputSharedMemoryExit };
+
+caerEventPacketContainer caerInputSharedMemory(uint16_t moduleID) {
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "SharedMemoryInput");
+	if (moduleData == NULL) {
+		return (NULL);
+	}
+
+	caerEventPacketContainer result = NULL;
+
+	caerModuleSM(&caerInputSharedMemoryFunctions, moduleData, sizeof(struct shm_input_state), 1, &result);
+
+	return (result);
+}
+
+static bool caerInputSharedMemoryInit(caerModuleData moduleData) {
+	// First, always create all needed setting nodes, set their default values
+	// and add their listeners.
+	sshsNodePutStringIfAbsent(moduleData->moduleNode, "socketPath", "/tmp/caer-shm.sock");
+
+	// Add auto-restart setting.
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "autoRestart", true);
+
+	shmInputState state = moduleData->moduleState;
+
+	state->parentModule = moduleData;
+	state->mainloopReference = caerMainloopGetReference();
+
+	// Connect to the producer's Unix local socket at a known path.
+	state->sockFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (state->sockFd < 0) {
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString, "Could not create local Unix socket. Error: %d.",
+		errno);
+		return (false);
+	}
+
+	struct sockaddr_un unixSocketAddr;
+	memset(&unixSocketAddr, 0, sizeof(struct sockaddr_un));
+
+	unixSocketAddr.sun_family = AF_UNIX;
+
+	char *socketPath = sshsNodeGetString(moduleData->moduleNode, "socketPath");
+	strncpy(unixSocketAddr.sun_path, socketPath, sizeof(unixSocketAddr.sun_path) - 1);
+	unixSocketAddr.sun_path[sizeof(unixSocketAddr.sun_path) - 1] = '\0'; // Ensure NUL terminated string.
+	free(socketPath);
+
+	if (connect(state->sockFd, (struct sockaddr *) &unixSocketAddr, sizeof(struct sockaddr_un)) < 0) {
+		close(state->sockFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Could not connect to local Unix socket. Error: %d.", errno);
+		return (false);
+	}
+
+	int segmentFd = -1;
+	if (!receiveDescriptors(moduleData, state->sockFd, &segmentFd, &state->doorbellFd)) {
+		close(state->sockFd);
+		return (false);
+	}
+
+	struct stat segmentStat;
+	if (fstat(segmentFd, &segmentStat) < 0) {
+		close(segmentFd);
+		close(state->doorbellFd);
+		close(state->sockFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Could not get shared memory segment size. Error: %d.", errno);
+		return (false);
+	}
+
+	// Read-write, since filters invalidate events in place.
+	void *segment = mmap(NULL, (size_t) segmentStat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, segmentFd, 0);
+
+	// The mapping keeps the segment alive, the descriptor isn't needed anymore.
+	close(segmentFd);
+
+	if (segment == MAP_FAILED) {
+		close(state->doorbellFd);
+		close(state->sockFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Could not map shared memory segment. Error: %d.", errno);
+		return (false);
+	}
+
+	state->mapping = malloc(sizeof(struct shm_mapping));
+	if (state->mapping == NULL) {
+		munmap(segment, (size_t) segmentStat.st_size);
+		close(state->doorbellFd);
+		close(state->sockFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString, "Failed to allocate shared memory mapping.");
+		return (false);
+	}
+
+	state->mapping->segment = segment;
+	state->mapping->segmentSize = (size_t) segmentStat.st_size;
+	atomic_store(&state->mapping->references, 1);
+
+	if (state->mapping->segment->magicNumber != SHM_MAGIC_NUMBER
+		|| state->mapping->segment->versionNumber != SHM_VERSION) {
+		releaseMapping(state->mapping);
+		close(state->doorbellFd);
+		close(state->sockFd);
+
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Invalid shared memory segment.");
+		return (false);
+	}
+
+	if (atomic_load_explicit(&state->mapping->segment->sourceInfoValid, memory_order_acquire)) {
+		updateSourceInfo(moduleData, state->mapping->segment);
+	}
+
+	// The producer reset the read index for us before handing over the segment.
+	state->consumeIndex = atomic_load_explicit(&state->mapping->segment->readIndex, memory_order_acquire);
+	atomic_store(&state->slotsPending, 0);
+
+	// Start doorbell thread.
+	atomic_store(&state->running, true);
+
+	if (thrd_create(&state->doorbellThread, &doorbellThread, state) != thrd_success) {
+		releaseMapping(state->mapping);
+		close(state->doorbellFd);
+		close(state->sockFd);
+
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to start doorbell thread.");
+		return (false);
+	}
+
+	caerLog(CAER_LOG_INFO, moduleData->moduleSubSystemString,
+		"Connected to shared memory at '%s' (%" PRIu32 " slots of %" PRIu64 " bytes).", unixSocketAddr.sun_path,
+		state->mapping->segment->slotNumber, state->mapping->segment->slotSize);
+
+	return (true);
+}
+
+static bool receiveDescriptors(caerModuleData moduleData, int sockFd, int *segmentFd, int *doorbellFd) {
+	int fds[2] = { -1, -1 };
+	char controlBuffer[CMSG_SPACE(sizeof(fds))];
+	memset(controlBuffer, 0, sizeof(controlBuffer));
+
+	uint8_t version = 0;
+	struct iovec iov = { .iov_base = &version, .iov_len = 1 };
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = controlBuffer;
+	msg.msg_controllen = sizeof(controlBuffer);
+
+	if (recvmsg(sockFd, &msg, 0) != 1) {
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Failed to receive shared memory descriptors. Error: %d.", errno);
+		return (false);
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+		|| cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Producer didn't send shared memory descriptors (busy with another consumer?).");
+		return (false);
+	}
+
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	if (version != SHM_VERSION) {
+		close(fds[0]);
+		close(fds[1]);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Unsupported shared memory version %" PRIu8 ".", version);
+		return (false);
+	}
+
+	*segmentFd = fds[0];
+	*doorbellFd = fds[1];
+
+	return (true);
+}
+
+static void updateSourceInfo(caerModuleData moduleData, struct shm_segment_header *segment) {
+	// Create SourceInfo node.
+	sshsNode sourceInfoNode = sshsGetRelativeNode(moduleData->moduleNode, "sourceInfo/");
+
+	if (segment->dvsSizeX != 0 && segment->dvsSizeY != 0) {
+		sshsNodePutShort(sourceInfoNode, "dvsSizeX", segment->dvsSizeX);
+		sshsNodePutShort(sourceInfoNode, "dvsSizeY", segment->dvsSizeY);
+	}
+
+	if (segment->apsSizeX != 0 && segment->apsSizeY != 0) {
+		sshsNodePutShort(sourceInfoNode, "apsSizeX", segment->apsSizeX);
+		sshsNodePutShort(sourceInfoNode, "apsSizeY", segment->apsSizeY);
+	}
+
+	if (segment->dataSizeX != 0 && segment->dataSizeY != 0) {
+		sshsNodePutShort(sourceInfoNode, "dataSizeX", segment->dataSizeX);
+		sshsNodePutShort(sourceInfoNode, "dataSizeY", segment->dataSizeY);
+	}
+
+	// Generate source string for output modules, same format as the network input modules,
+	// keeping the producer's source string around as a comment line.
+	const char *originalSourceString = segment->sourceString;
+	if (originalSourceString[0] == '#') {
+		originalSourceString++;
+	}
+
+	size_t sourceStringLength = (size_t) snprintf(NULL, 0, "#Source %" PRIu16 ": Network,"
+	"dvsSizeX=%" PRIi16 ",dvsSizeY=%" PRIi16 ",apsSizeX=%" PRIi16 ",apsSizeY=%" PRIi16 ","
+	"dataSizeX=%" PRIi16 ",dataSizeY=%" PRIi16 ",visualizerSizeX=0,visualizerSizeY=0\r\n"
+	"#-%s", moduleData->moduleID, segment->dvsSizeX, segment->dvsSizeY, segment->apsSizeX, segment->apsSizeY,
+		segment->dataSizeX, segment->dataSizeY, originalSourceString);
+
+	char sourceString[sourceStringLength + 1];
+	snprintf(sourceString, sourceStringLength + 1, "#Source %" PRIu16 ": Network,"
+	"dvsSizeX=%" PRIi16 ",dvsSizeY=%" PRIi16 ",apsSizeX=%" PRIi16 ",apsSizeY=%" PRIi16 ","
+	"dataSizeX=%" PRIi16 ",dataSizeY=%" PRIi16 ",visualizerSizeX=0,visualizerSizeY=0\r\n"
+	"#-%s", moduleData->moduleID, segment->dvsSizeX, segment->dvsSizeY, segment->apsSizeX, segment->apsSizeY,
+		segment->dataSizeX, segment->dataSizeY, originalSourceString);
+	sourceString[sourceStringLength] = '\0';
+
+	sshsNodePutString(sourceInfoNode, "sourceString", sourceString);
+}
+
+static void releaseMapping(shmMapping mapping) {
+	if (atomic_fetch_sub_explicit(&mapping->references, 1, memory_order_acq_rel) == 1) {
+		munmap(mapping->segment, mapping->segmentSize);
+		free(mapping);
+	}
+}
+
+static void releaseSlot(void *slotHandlePtr) {
+	shmSlotHandle slotHandle = slotHandlePtr;
+
+	// The packets live in shared memory, only free the container itself.
+	int32_t packetsNumber = caerEventPacketContainerGetEventPacketsNumber(slotHandle->container);
+
+	for (int32_t i = 0; i < packetsNumber; i++) {
+		caerEventPacketContainerSetEventPacket(slotHandle->container, i, NULL);
+	}
+
+	caerEventPacketContainerFree(slotHandle->container);
+
+	// Slots are consumed and released strictly in order, one per mainloop run,
+	// so giving this one back just means advancing the read index by one.
+	atomic_fetch_add_explicit(&slotHandle->mapping->segment->readIndex, 1, memory_order_release);
+
+	releaseMapping(slotHandle->mapping);
+
+	free(slotHandle);
+}
+
+static int doorbellThread(void *stateArg) {
+	shmInputState state = stateArg;
+
+	// Set thread name.
+	size_t threadNameLength = strlen(state->parentModule->moduleSubSystemString);
+	char threadName[threadNameLength + 1 + 8]; // +1 for NUL character.
+	strcpy(threadName, state->parentModule->moduleSubSystemString);
+	strcat(threadName, "[Input]");
+	thrd_set_name(threadName);
+
+	struct pollfd pollFds[2] = { { .fd = state->doorbellFd, .events = POLLIN, .revents = 0 }, { .fd = state->sockFd,
+		.events = POLLIN, .revents = 0 } };
+
+	// Everything up to here was already signaled to the mainloop. Only this thread
+	// touches this, so no synchronization with the consumer side is needed.
+	uint64_t signaledIndex = state->consumeIndex;
+
+	while (atomic_load_explicit(&state->running, memory_order_relaxed)) {
+		// Wake up regularly to check for termination.
+		if (poll(pollFds, 2, 100) <= 0) {
+			continue;
+		}
+
+		if (pollFds[0].revents & POLLIN) {
+			uint64_t doorbellCount;
+			if (read(state->doorbellFd, &doorbellCount, sizeof(uint64_t)) == sizeof(uint64_t)) {
+				// The doorbell count can lag or lead, the write index is authoritative.
+				uint64_t writeIndex = atomic_load_explicit(&state->mapping->segment->writeIndex,
+					memory_order_acquire);
+				if (writeIndex > signaledIndex) {
+					uint32_t newSlots = (uint32_t) (writeIndex - signaledIndex);
+					signaledIndex = writeIndex;
+
+					atomic_fetch_add_explicit(&state->slotsPending, newSlots, memory_order_release);
+					atomic_fetch_add_explicit(&state->mainloopReference->dataAvailable, newSlots,
+						memory_order_release);
+				}
+			}
+		}
+
+		if ((pollFds[1].revents & (POLLIN | POLLHUP | POLLERR))
+			|| !atomic_load_explicit(&state->mapping->segment->producerRunning, memory_order_relaxed)) {
+			caerLog(CAER_LOG_INFO, state->parentModule->moduleSubSystemString, "Producer went away.");
+			break;
+		}
+	}
+
+	// If the producer went away (not terminated by us), let the already signaled
+	// data be consumed and then ensure parent also shuts down.
+	if (atomic_load(&state->running)) {
+		while (atomic_load(&state->slotsPending) != 0) {
+			thrd_sleep(&(struct timespec ) { .tv_nsec = 500000 }, NULL);
+		}
+
+		sshsNodePutBool(state->parentModule->moduleNode, "running", false);
+	}
+
+	return (thrd_success);
+}
+
+static void caerInputSharedMemoryRun(caerModuleData moduleData, size_t argsNumber, va_list args) {
+	UNUSED_ARGUMENT(argsNumber);
+
+	shmInputState state = moduleData->moduleState;
+
+	// Interpret variable arguments (same as above in main function).
+	caerEventPacketContainer *container = va_arg(args, caerEventPacketContainer *);
+
+	if (atomic_load_explicit(&state->slotsPending, memory_order_acquire) == 0) {
+		return;
+	}
+
+	struct shm_segment_header *segment = state->mapping->segment;
+
+	// Source info is always published before the first slot.
+	if (!sshsNodeAttributeExists(sshsGetRelativeNode(moduleData->moduleNode, "sourceInfo/"), "sourceString", STRING)) {
+		updateSourceInfo(moduleData, segment);
+	}
+
+	uint8_t *slot = shmSlotGet(segment, state->consumeIndex);
+	struct shm_slot_header *slotHeader = (struct shm_slot_header *) slot;
+
+	shmSlotHandle slotHandle = malloc(sizeof(struct shm_slot_handle));
+	if (slotHandle == NULL) {
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate slot handle.");
+		return;
+	}
+
+	slotHandle->container = caerEventPacketContainerAllocate(slotHeader->packetsNumber);
+	if (slotHandle->container == NULL) {
+		free(slotHandle);
+
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate packet container.");
+		return;
+	}
+
+	// Point directly into shared memory, no copy. The slot is ours until it is
+	// released, so the headers can be changed in place.
+	for (int32_t i = 0; i < slotHeader->packetsNumber; i++) {
+		caerEventPacketHeader packet = (caerEventPacketHeader) (slot + slotHeader->packetOffsets[i]);
+
+		// Rewrite event source to reflect this module, not the original one.
+		caerEventPacketHeaderSetEventSource(packet, I16T(moduleData->moduleID));
+
+		caerEventPacketContainerSetEventPacket(slotHandle->container, i, packet);
+	}
+
+	atomic_fetch_add_explicit(&state->mapping->references, 1, memory_order_relaxed);
+	slotHandle->mapping = state->mapping;
+
+	state->consumeIndex++;
+	atomic_fetch_sub_explicit(&state->slotsPending, 1, memory_order_relaxed);
+
+	// Give the slot back at the end of this mainloop run.
+	caerMainloopFreeAfterLoop(&releaseSlot, slotHandle);
+
+	*container = slotHandle->container;
+
+	// No special memory order for decrease, because the acquire load to even start running
+	// through a mainloop already synchronizes with the release store above.
+	atomic_fetch_sub_explicit(&state->mainloopReference->dataAvailable, 1, memory_order_relaxed);
+}
+
+static void caerInputSharedMemoryExit(caerModuleData moduleData) {
+	shmInputState state = moduleData->moduleState;
+
+	// Stop doorbell thread and wait on it.
+	atomic_store(&state->running, false);
+
+	if ((errno = thrd_join(state->doorbellThread, NULL)) != thrd_success) {
+		// This should never happen!
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString, "Failed to join doorbell thread. Error: %d.",
+		errno);
+	}
+
+	// If we're here, then nobody will consume this data afterwards.
+	atomic_fetch_sub_explicit(&state->mainloopReference->dataAvailable, atomic_load(&state->slotsPending),
+		memory_order_relaxed);
+
+	close(state->doorbellFd);
+	close(state->sockFd);
+
+	// Slots still in use by this mainloop run keep the mapping alive.
+	releaseMapping(state->mapping);
+
+	if (sshsNodeGetBool(moduleData->moduleNode, "autoRestart")) {
+		// Prime input module again so that it will try to restart if new producers show up.
+		sshsNodePutBool(moduleData->moduleNode, "running", true);
+	}
+}
@@ -0,0 +1,14 @@
+#ifndef INPUT_SHM_H_
+#define INPUT_SHM_H_
+
+#include "main.h"
+
+#include <libcaer/events/packetContainer.h>
+#include <libcaer/events/special.h>
+#include <libcaer/events/polarity.h>
+#include <libcaer/events/frame.h>
+#include <libcaer/events/imu6.h>
+
+caerEventPacketContainer caerInputSharedMemory(uint16_t moduleID);
+
+#endif /* INPUT_SHM_H_ */
@@ -17,4 +17,28 @@ struct aedat3_network_header {
 	int16_t sourceNumber;
 }__attribute__((__packed__));
 
+/**
+ * Multiplexed network streams (NetTCPMuxOutput): an AEDAT 3 network header
+ * with the MUX magic number, followed by fragments of event packets from
+ * several channels, each fragment prefixed by this header.
+ */
+#define AEDAT3_MUX_MAGIC_NUMBER 0x1D378BC90B9A665A
+#define AEDAT3_MUX_VERSION 0x01
+#define AEDAT3_MUX_FRAGMENT_HEADER_LENGTH 16
+
+enum aedat3_mux_fragment_types {
+	AEDAT3_MUX_FRAGMENT_PACKET = 0, AEDAT3_MUX_FRAGMENT_CHANNEL_INFO = 1,
+};
+
+struct aedat3_mux_fragment_header {
+	int16_t channelID;
+	int8_t fragmentType;
+	int8_t priority;
+	/// Total size of the payload (event packet or source string) this fragment is part of.
+	int32_t payloadSize;
+	/// Offset of this fragment inside the payload, 0 for the first one.
+	int32_t fragmentOffset;
+	int32_t fragmentSize;
+}__attribute__((__packed__));
+
 #endif /* INPUT_OUTPUT_COMMON_H_ */
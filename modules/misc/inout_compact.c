@@ -0,0 +1,264 @@
+#include "inout_compact.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+	#define INOUT_COMPACT_X86_SIMD 1
+	#include <immintrin.h>
+#endif
+
+static inline bool compactEventIsValid(const uint8_t *event);
+static void compactEvents8Scalar(uint8_t *dst, const uint8_t *src, int32_t eventNumber, int32_t dstCapacity,
+	int32_t *srcIndex, int32_t *dstIndex);
+static int32_t compactValidEvents8(uint8_t *dst, const uint8_t *src, int32_t eventNumber, int32_t dstCapacity);
+static int32_t compactValidEventsRuns(uint8_t *dst, const uint8_t *src, int32_t eventNumber, int32_t eventSize,
+	int32_t dstCapacity);
+
+/**
+ * Same as caerGenericEventIsValid(), but only looks at the first byte:
+ * data is stored little-endian, so bit 0 of the first 32-bit word is
+ * always bit 0 of the first byte, and no alignment is needed.
+ */
+static inline bool compactEventIsValid(const uint8_t *event) {
+	return (event[0] & 0x01);
+}
+
+/**
+ * Branchless compaction for 8 byte events: always store, only advance the
+ * output position if the event was valid. Never writes past an event that
+ * was not yet read, so it also works in-place.
+ */
+static void compactEvents8Scalar(uint8_t *dst, const uint8_t *src, int32_t eventNumber, int32_t dstCapacity,
+	int32_t *srcIndex, int32_t *dstIndex) {
+	int32_t i = *srcIndex;
+	int32_t out = *dstIndex;
+
+	for (; i < eventNumber && out < dstCapacity; i++) {
+		uint64_t event;
+		memcpy(&event, src + ((size_t) i * 8), 8);
+
+		memcpy(dst + ((size_t) out * 8), &event, 8);
+		out += compactEventIsValid(src + ((size_t) i * 8));
+	}
+
+	*srcIndex = i;
+	*dstIndex = out;
+}
+
+#if defined(INOUT_COMPACT_X86_SIMD)
+
+/**
+ * AVX2 has no compress instruction, so we emulate it with a cross-lane permute:
+ * for each 4-bit validity mask, this table moves the selected 64-bit events
+ * (as pairs of 32-bit indexes) to the front of the vector.
+ */
+static const int32_t compactAVX2PermuteTable[16][8] = {
+	{ 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 0, 0, 0, 0, 0, 0 },
+	{ 2, 3, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 2, 3, 0, 0, 0, 0 },
+	{ 4, 5, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 4, 5, 0, 0, 0, 0 },
+	{ 2, 3, 4, 5, 0, 0, 0, 0 },
+	{ 0, 1, 2, 3, 4, 5, 0, 0 },
+	{ 6, 7, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 6, 7, 0, 0, 0, 0 },
+	{ 2, 3, 6, 7, 0, 0, 0, 0 },
+	{ 0, 1, 2, 3, 6, 7, 0, 0 },
+	{ 4, 5, 6, 7, 0, 0, 0, 0 },
+	{ 0, 1, 4, 5, 6, 7, 0, 0 },
+	{ 2, 3, 4, 5, 6, 7, 0, 0 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7 }
+};
+
+/**
+ * 4 events per iteration. The full vector is always stored, so we stop as soon
+ * as that could write past 'dstCapacity' and let the scalar code finish up.
+ * In-place is fine, as the store never goes past the events just loaded.
+ */
+__attribute__((target("avx2"))) static void compactEvents8AVX2(uint8_t *dst, const uint8_t *src, int32_t eventNumber,
+	int32_t dstCapacity, int32_t *srcIndex, int32_t *dstIndex) {
+	int32_t i = *srcIndex;
+	int32_t out = *dstIndex;
+
+	for (; (i + 4) <= eventNumber && (out + 4) <= dstCapacity; i += 4) {
+		__m256i events = _mm256_loadu_si256((const __m256i *) (const void *) (src + ((size_t) i * 8)));
+
+		// Move the valid mark (bit 0) to the sign bit of each 64-bit lane and extract it.
+		int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_slli_epi64(events, 63)));
+
+		__m256i permute = _mm256_loadu_si256((const __m256i *) (const void *) compactAVX2PermuteTable[mask]);
+
+		_mm256_storeu_si256((__m256i *) (void *) (dst + ((size_t) out * 8)),
+			_mm256_permutevar8x32_epi32(events, permute));
+
+		out += __builtin_popcount((unsigned int) mask);
+	}
+
+	*srcIndex = i;
+	*dstIndex = out;
+}
+
+/**
+ * 8 events per iteration, using the native AVX-512 compress. Same store
+ * considerations as for the AVX2 version apply.
+ */
+__attribute__((target("avx512f"))) static void compactEvents8AVX512(uint8_t *dst, const uint8_t *src,
+	int32_t eventNumber, int32_t dstCapacity, int32_t *srcIndex, int32_t *dstIndex) {
+	int32_t i = *srcIndex;
+	int32_t out = *dstIndex;
+
+	const __m512i validMark = _mm512_set1_epi64(0x01);
+
+	for (; (i + 8) <= eventNumber && (out + 8) <= dstCapacity; i += 8) {
+		__m512i events = _mm512_loadu_si512((const void *) (src + ((size_t) i * 8)));
+
+		__mmask8 mask = _mm512_test_epi64_mask(events, validMark);
+
+		_mm512_storeu_si512((void *) (dst + ((size_t) out * 8)), _mm512_maskz_compress_epi64(mask, events));
+
+		out += __builtin_popcount((unsigned int) mask);
+	}
+
+	*srcIndex = i;
+	*dstIndex = out;
+}
+
+#endif
+
+static int32_t compactValidEvents8(uint8_t *dst, const uint8_t *src, int32_t eventNumber, int32_t dstCapacity) {
+	int32_t srcIndex = 0;
+	int32_t dstIndex = 0;
+
+#if defined(INOUT_COMPACT_X86_SIMD)
+	if (__builtin_cpu_supports("avx512f")) {
+		compactEvents8AVX512(dst, src, eventNumber, dstCapacity, &srcIndex, &dstIndex);
+	}
+	else if (__builtin_cpu_supports("avx2")) {
+		compactEvents8AVX2(dst, src, eventNumber, dstCapacity, &srcIndex, &dstIndex);
+	}
+#endif
+
+	// Scalar code does the rest (or everything, if no SIMD support).
+	compactEvents8Scalar(dst, src, eventNumber, dstCapacity, &srcIndex, &dstIndex);
+
+	return (dstIndex);
+}
+
+/**
+ * Generic compaction for any event size: find runs of consecutive valid
+ * events and move each run with a single memmove(). Invalid events usually
+ * come in bursts (noise filters, ...), so runs are long and few.
+ */
+static int32_t compactValidEventsRuns(uint8_t *dst, const uint8_t *src, int32_t eventNumber, int32_t eventSize,
+	int32_t dstCapacity) {
+	size_t eventBytes = (size_t) eventSize;
+	int32_t i = 0;
+	int32_t out = 0;
+
+	while (i < eventNumber && out < dstCapacity) {
+		// Skip over invalid events.
+		while (i < eventNumber && !compactEventIsValid(src + ((size_t) i * eventBytes))) {
+			i++;
+		}
+
+		// Find the end of this run of valid events.
+		int32_t runStart = i;
+
+		while (i < eventNumber && (out + (i - runStart)) < dstCapacity
+			&& compactEventIsValid(src + ((size_t) i * eventBytes))) {
+			i++;
+		}
+
+		int32_t runLength = i - runStart;
+
+		// In-place, the first run is already where it should be.
+		if (runLength > 0 && (dst + ((size_t) out * eventBytes)) != (src + ((size_t) runStart * eventBytes))) {
+			memmove(dst + ((size_t) out * eventBytes), src + ((size_t) runStart * eventBytes),
+				(size_t) runLength * eventBytes);
+		}
+
+		out += runLength;
+	}
+
+	return (out);
+}
+
+int32_t caerInOutCompactValidEvents(uint8_t *dst, const uint8_t *src, int32_t eventNumber, int32_t eventSize,
+	int32_t dstCapacity) {
+	if (eventNumber <= 0 || eventSize <= 0 || dstCapacity <= 0) {
+		return (0);
+	}
+
+	// Polarity and special events, the bulk of all data.
+	if (eventSize == 8) {
+		return (compactValidEvents8(dst, src, eventNumber, dstCapacity));
+	}
+
+	return (compactValidEventsRuns(dst, src, eventNumber, eventSize, dstCapacity));
+}
+
+int32_t caerInOutCompactEventPacket(caerEventPacketHeader eventPacket) {
+	if (eventPacket == NULL) {
+		return (0);
+	}
+
+	int32_t eventNumber = caerEventPacketHeaderGetEventNumber(eventPacket);
+
+	// Nothing to remove.
+	if (caerEventPacketHeaderGetEventValid(eventPacket) == eventNumber) {
+		return (eventNumber);
+	}
+
+	uint8_t *events = ((uint8_t *) eventPacket) + CAER_EVENT_PACKET_HEADER_SIZE;
+
+	int32_t eventCompacted = caerInOutCompactValidEvents(events, events, eventNumber,
+		caerEventPacketHeaderGetEventSize(eventPacket), eventNumber);
+
+	caerEventPacketHeaderSetEventNumber(eventPacket, eventCompacted);
+	caerEventPacketHeaderSetEventValid(eventPacket, eventCompacted);
+
+	return (eventCompacted);
+}
+
+caerEventPacketHeader caerInOutCopyEventPacketOnlyValidEvents(caerEventPacketHeader eventPacket) {
+	if (eventPacket == NULL) {
+		return (NULL);
+	}
+
+	int32_t eventValid = caerEventPacketHeaderGetEventValid(eventPacket);
+	int32_t eventNumber = caerEventPacketHeaderGetEventNumber(eventPacket);
+	int32_t eventSize = caerEventPacketHeaderGetEventSize(eventPacket);
+
+	if (eventValid <= 0) {
+		return (NULL);
+	}
+
+	// Nothing to compact, a plain copy is fastest.
+	if (eventValid == eventNumber) {
+		return (caerCopyEventPacketOnlyEvents(eventPacket));
+	}
+
+	caerEventPacketHeader eventPacketCopy = malloc(
+		CAER_EVENT_PACKET_HEADER_SIZE + ((size_t) eventValid * (size_t) eventSize));
+	if (eventPacketCopy == NULL) {
+		return (NULL);
+	}
+
+	memcpy(eventPacketCopy, eventPacket, CAER_EVENT_PACKET_HEADER_SIZE);
+
+	int32_t eventCopied = caerInOutCompactValidEvents(((uint8_t *) eventPacketCopy) + CAER_EVENT_PACKET_HEADER_SIZE,
+		((uint8_t *) eventPacket) + CAER_EVENT_PACKET_HEADER_SIZE, eventNumber, eventSize, eventValid);
+	if (eventCopied == 0) {
+		free(eventPacketCopy);
+		return (NULL);
+	}
+
+	// Packet now holds exactly the valid events.
+	caerEventPacketHeaderSetEventNumber(eventPacketCopy, eventCopied);
+	caerEventPacketHeaderSetEventValid(eventPacketCopy, eventCopied);
+	caerEventPacketHeaderSetEventCapacity(eventPacketCopy, eventCopied);
+
+	return (eventPacketCopy);
+}
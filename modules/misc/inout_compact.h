@@ -0,0 +1,55 @@
+/*
+ * Valid-only event compaction, shared by the input and output modules.
+ *
+ * Event packets store fixed-size events contiguously, and every event type
+ * keeps its validity mark in bit 0 of its first (little-endian) 32-bit word.
+ * Compaction is thus the same for all types: keep the events with that bit set.
+ * 8 byte events (polarity, special) use a SIMD mask-and-compress kernel, where
+ * the CPU supports it (AVX2/AVX-512, runtime dispatch). Everything else copies
+ * whole runs of consecutive valid events at once.
+ */
+
+#ifndef INPUT_OUTPUT_COMPACT_H_
+#define INPUT_OUTPUT_COMPACT_H_
+
+#include <libcaer/events/common.h>
+
+/**
+ * Copy the valid events from 'src' to 'dst', preserving their order.
+ * 'dst' may be equal to 'src' for in-place compaction, but must not
+ * otherwise overlap it.
+ *
+ * @param dst destination memory, must have space for 'dstCapacity' events.
+ * @param src source events.
+ * @param eventNumber number of events in 'src'.
+ * @param eventSize size of one event in bytes.
+ * @param dstCapacity maximum number of events to write to 'dst'.
+ *
+ * @return number of events written to 'dst'.
+ */
+int32_t caerInOutCompactValidEvents(uint8_t *dst, const uint8_t *src, int32_t eventNumber, int32_t eventSize,
+	int32_t dstCapacity);
+
+/**
+ * Remove the invalid events from an event packet, in place. Its capacity
+ * (and memory) stays the same, only event number and valid count change.
+ *
+ * @param eventPacket the event packet to compact.
+ *
+ * @return number of events left in the packet.
+ */
+int32_t caerInOutCompactEventPacket(caerEventPacketHeader eventPacket);
+
+/**
+ * Make a copy of an event packet, containing only its valid events.
+ * Same semantics as libcaer's caerCopyEventPacketOnlyValidEvents(),
+ * but using the faster compaction kernel above.
+ *
+ * @param eventPacket the event packet to copy.
+ *
+ * @return a new event packet with only the valid events, or NULL
+ *         if there are none or on memory allocation failure.
+ */
+caerEventPacketHeader caerInOutCopyEventPacketOnlyValidEvents(caerEventPacketHeader eventPacket);
+
+#endif /* INPUT_OUTPUT_COMPACT_H_ */
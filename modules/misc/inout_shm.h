@@ -0,0 +1,73 @@
+/*
+ * Shared-memory transport between cAER processes on the same machine.
+ *
+ * The producer (SharedMemoryOutput) owns an anonymous shared memory segment,
+ * divided into a fixed number of fixed-size slots, that form a single-producer,
+ * single-consumer ring. Each slot holds one packet container (one mainloop run
+ * worth of packets), stored as complete libcaer event packets (header + events)
+ * at cacheline-aligned offsets from the start of the slot, so that the consumer
+ * can hand them out directly without any copy.
+ * The producer advances 'writeIndex' after filling a slot and rings an eventfd
+ * doorbell; the consumer (SharedMemoryInput) advances 'readIndex' only after the
+ * mainloop run using that slot is over, which returns it to the producer.
+ * The segment and eventfd file descriptors are handed over to the consumer via
+ * SCM_RIGHTS on a local Unix socket, which also serves to detect disconnects.
+ * Only one consumer at a time is supported.
+ */
+
+#ifndef INPUT_OUTPUT_SHM_H_
+#define INPUT_OUTPUT_SHM_H_
+
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <stdint.h>
+
+#define SHM_MAGIC_NUMBER 0x1D378BC90B9A6659
+#define SHM_VERSION 0x01
+#define SHM_SLOT_MAX_PACKETS 16
+#define SHM_PACKET_ALIGNMENT 64
+#define SHM_SOURCE_STRING_LENGTH 1024
+
+#define SHM_ALIGN_UP(X) (((X) + (SHM_PACKET_ALIGNMENT - 1)) & ~((size_t) (SHM_PACKET_ALIGNMENT - 1)))
+
+struct shm_segment_header {
+	uint64_t magicNumber;
+	uint32_t versionNumber;
+	/// Number of slots, always a power of two.
+	uint32_t slotNumber;
+	/// Size of each slot in bytes, including its shm_slot_header.
+	uint64_t slotSize;
+	/// Offset in bytes of the first slot from the start of the segment.
+	uint64_t slotsOffset;
+	/// Source information, filled in by the producer before the first slot is committed.
+	atomic_bool sourceInfoValid;
+	int16_t sourceID;
+	int16_t dvsSizeX;
+	int16_t dvsSizeY;
+	int16_t apsSizeX;
+	int16_t apsSizeY;
+	int16_t dataSizeX;
+	int16_t dataSizeY;
+	char sourceString[SHM_SOURCE_STRING_LENGTH];
+	/// Producer is still alive and writing.
+	atomic_bool producerRunning;
+	/// Producer-owned index, on its own cacheline to avoid false sharing.
+	alignas(SHM_PACKET_ALIGNMENT) atomic_uint_fast64_t writeIndex;
+	/// Consumer-owned index.
+	alignas(SHM_PACKET_ALIGNMENT) atomic_uint_fast64_t readIndex;
+};
+
+struct shm_slot_header {
+	int32_t packetsNumber;
+	/// Offset of each packet from the start of the slot, 0 means no packet.
+	uint64_t packetOffsets[SHM_SLOT_MAX_PACKETS];
+};
+
+#define SHM_SEGMENT_HEADER_SIZE SHM_ALIGN_UP(sizeof(struct shm_segment_header))
+#define SHM_SLOT_HEADER_SIZE SHM_ALIGN_UP(sizeof(struct shm_slot_header))
+
+static inline uint8_t *shmSlotGet(struct shm_segment_header *segment, uint64_t index) {
+	return ((uint8_t *) segment + segment->slotsOffset + ((index & (segment->slotNumber - 1)) * segment->slotSize));
+}
+
+#endif /* INPUT_OUTPUT_SHM_H_ */
@@ -8,10 +8,17 @@
 #include <time.h>
 
 static bool caerOutputFileInit(caerModuleData moduleData);
+static bool caerOutputFlightRecorderInit(caerModuleData moduleData);
+static bool caerOutputFileCommonInit(caerModuleData moduleData, bool flightRecorder);
+static int caerOutputFileOpenSegment(caerModuleData moduleData, uint32_t segmentNumber);
 
 static struct caer_module_functions caerOutputFileFunctions = { .moduleInit = &caerOutputFileInit, .moduleRun =
 	&caerOutputCommonRun, .moduleConfig = NULL, .moduleExit = &caerOutputCommonExit };
 
+static struct caer_module_functions caerOutputFlightRecorderFunctions = { .moduleInit =
+	&caerOutputFlightRecorderInit, .moduleRun = &caerOutputCommonRun, .moduleConfig = NULL, .moduleExit =
+	&caerOutputCommonExit };
+
 void caerOutputFile(uint16_t moduleID, size_t outputTypesNumber, ...) {
 	caerModuleData moduleData = caerMainloopFindModule(moduleID, "FileOutput");
 	if (moduleData == NULL) {
@@ -24,8 +31,22 @@ void caerOutputFile(uint16_t moduleID, size_t outputTypesNumber, ...) {
 	va_end(args);
 }
 
+void caerOutputFlightRecorder(uint16_t moduleID, size_t outputTypesNumber, ...) {
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "FlightRecorderOutput");
+	if (moduleData == NULL) {
+		return;
+	}
+
+	va_list args;
+	va_start(args, outputTypesNumber);
+	caerModuleSMv(&caerOutputFlightRecorderFunctions, moduleData, CAER_OUTPUT_COMMON_STATE_STRUCT_SIZE,
+		outputTypesNumber, args);
+	va_end(args);
+}
+
 static char *getUserHomeDirectory(const char *subSystemString);
-static char *getFullFilePath(const char *subSystemString, const char *directory, const char *prefix);
+static char *getFullFilePath(const char *subSystemString, const char *directory, const char *prefix,
+	uint32_t segmentNumber);
 
 // Remember to free strings returned by this.
 static char *getUserHomeDirectory(const char *subSystemString) {
@@ -73,7 +94,8 @@ static char *getUserHomeDirectory(const char *subSystemString) {
 	return (realHomeDir);
 }
 
-static char *getFullFilePath(const char *subSystemString, const char *directory, const char *prefix) {
+static char *getFullFilePath(const char *subSystemString, const char *directory, const char *prefix,
+	uint32_t segmentNumber) {
 	// First get time suffix string.
 	time_t currentTimeEpoch = time(NULL);
 
@@ -102,18 +124,38 @@ static char *getFullFilePath(const char *subSystemString, const char *directory,
 	// 1 for the directory/prefix separating slash, 1 for prefix-time separating
 	// dash, 6 for file extension, 1 for terminating NUL byte = +9.
 
+	// Further segments are named directory/prefix-time-segment.aedat, as several
+	// may be created within the same second.
+	if (segmentNumber != 0) {
+		filePathLength += (size_t) snprintf(NULL, 0, "-%" PRIu32, segmentNumber);
+	}
+
 	char *filePath = malloc(filePathLength);
 	if (filePath == NULL) {
 		caerLog(CAER_LOG_CRITICAL, subSystemString, "Unable to allocate memory for full file path.");
 		return (NULL);
 	}
 
-	snprintf(filePath, filePathLength, "%s/%s-%s.aedat", directory, prefix, currentTimeString);
+	if (segmentNumber != 0) {
+		snprintf(filePath, filePathLength, "%s/%s-%s-%" PRIu32 ".aedat", directory, prefix, currentTimeString,
+			segmentNumber);
+	}
+	else {
+		snprintf(filePath, filePathLength, "%s/%s-%s.aedat", directory, prefix, currentTimeString);
+	}
 
 	return (filePath);
 }
 
 static bool caerOutputFileInit(caerModuleData moduleData) {
+	return (caerOutputFileCommonInit(moduleData, false));
+}
+
+static bool caerOutputFlightRecorderInit(caerModuleData moduleData) {
+	return (caerOutputFileCommonInit(moduleData, true));
+}
+
+static bool caerOutputFileCommonInit(caerModuleData moduleData, bool flightRecorder) {
 	// First, always create all needed setting nodes, set their default values
 	// and add their listeners.
 	char *userHomeDir = getUserHomeDirectory(moduleData->moduleSubSystemString);
@@ -125,19 +167,66 @@ static bool caerOutputFileInit(caerModuleData moduleData) {
 	sshsNodePutStringIfAbsent(moduleData->moduleNode, "directory", userHomeDir);
 	free(userHomeDir);
 
-	sshsNodePutStringIfAbsent(moduleData->moduleNode, "prefix", DEFAULT_PREFIX);
+	sshsNodePutStringIfAbsent(moduleData->moduleNode, "prefix",
+		(flightRecorder) ? (DEFAULT_FLIGHT_RECORDER_PREFIX) : (DEFAULT_PREFIX));
+
+	// Generate current file name and open it. The flight recorder only
+	// opens files when triggered, from the output handling thread.
+	int fileFd = -1;
+
+	if (!flightRecorder) {
+		fileFd = caerOutputFileOpenSegment(moduleData, 0);
+		if (fileFd < 0) {
+			// caerLog() called inside caerOutputFileOpenSegment().
+			return (false);
+		}
+	}
+
+	outputCommonFDs fileDescriptors = caerOutputCommonAllocateFdArray(1);
+	if (fileDescriptors == NULL) {
+		if (fileFd >= 0) {
+			close(fileFd);
+		}
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Unable to allocate memory for file descriptors.");
+		return (false);
+	}
+
+	fileDescriptors->fds[0] = fileFd;
 
-	// Generate current file name and open it.
+	if (flightRecorder) {
+		// Each trigger writes its own file.
+		caerOutputCommonSetFlightRecorder(moduleData->moduleState, &caerOutputFileOpenSegment);
+	}
+	else {
+		// Files support splitting recordings into segments, by size or time.
+		caerOutputCommonSetSegmentRotation(moduleData->moduleState, &caerOutputFileOpenSegment);
+	}
+
+	if (!caerOutputCommonInit(moduleData, fileDescriptors, false, false)) {
+		if (fileFd >= 0) {
+			close(fileFd);
+		}
+		free(fileDescriptors);
+
+		return (false);
+	}
+
+	return (true);
+}
+
+static int caerOutputFileOpenSegment(caerModuleData moduleData, uint32_t segmentNumber) {
 	char *directory = sshsNodeGetString(moduleData->moduleNode, "directory");
 	char *prefix = sshsNodeGetString(moduleData->moduleNode, "prefix");
 
-	char *filePath = getFullFilePath(moduleData->moduleSubSystemString, directory, prefix);
+	char *filePath = getFullFilePath(moduleData->moduleSubSystemString, directory, prefix, segmentNumber);
 	free(directory);
 	free(prefix);
 
 	if (filePath == NULL) {
 		// caerLog() called inside getFullFilePath().
-		return (false);
+		return (-1);
 	}
 
 	int fileFd = open(filePath, O_WRONLY | O_CREAT, S_IWUSR | S_IRUSR | S_IRGRP);
@@ -146,30 +235,12 @@ static bool caerOutputFileInit(caerModuleData moduleData) {
 			"Could not create or open output file '%s' for writing. Error: %d.", filePath, errno);
 		free(filePath);
 
-		return (false);
+		return (-1);
 	}
 
 	caerLog(CAER_LOG_INFO, moduleData->moduleSubSystemString, "Opened output file '%s' successfully for writing.",
 		filePath);
 	free(filePath);
 
-	outputCommonFDs fileDescriptors = caerOutputCommonAllocateFdArray(1);
-	if (fileDescriptors == NULL) {
-		close(fileFd);
-
-		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
-			"Unable to allocate memory for file descriptors.");
-		return (false);
-	}
-
-	fileDescriptors->fds[0] = fileFd;
-
-	if (!caerOutputCommonInit(moduleData, fileDescriptors, false, false)) {
-		close(fileFd);
-		free(fileDescriptors);
-
-		return (false);
-	}
-
-	return (true);
+	return (fileFd);
 }
@@ -4,7 +4,9 @@
 #include "main.h"
 
 #define DEFAULT_PREFIX "caerOut"
+#define DEFAULT_FLIGHT_RECORDER_PREFIX "caerTrigger"
 
 void caerOutputFile(uint16_t moduleID, size_t outputTypesNumber, ...);
+void caerOutputFlightRecorder(uint16_t moduleID, size_t outputTypesNumber, ...);
 
 #endif /* OUTPUT_FILE_H_ */
@@ -0,0 +1,865 @@
+/*
+ * Multiplexed TCP server output: all NetTCPMuxOutput modules configured with
+ * the same port number are channels of one shared TCP server, with one set of
+ * client connections and one output thread, instead of one each.
+ * Every channel has an ID, which identifies its data on the wire, and a
+ * priority (lower value = higher priority). Event packets are split into
+ * fragments of at most 'maxFragmentSize' bytes, each one prefixed by a
+ * struct aedat3_mux_fragment_header (see modules/misc/inout_common.h).
+ * After each fragment, the output thread picks the next one from the highest
+ * priority channel that has data waiting, going round-robin among channels of
+ * equal priority. Low-latency data, like optic flow, thus never waits behind
+ * more than one fragment of bulk data, like frames.
+ * Clients first get an AEDAT 3 network header with AEDAT3_MUX_MAGIC_NUMBER,
+ * then, for each channel and before its first event packet, a CHANNEL_INFO
+ * fragment holding its source string (this may be repeated). Clients that
+ * connect while a packet is being sent get its remaining fragments, and
+ * should discard them until a fragment with offset 0 starts a new packet.
+ * Data is always in RAW format, no compression is applied.
+ */
+
+#include "net_tcp_mux.h"
+#include "base/mainloop.h"
+#include "base/module.h"
+#include "modules/misc/inout_common.h"
+#include "modules/misc/inout_compact.h"
+#include "ext/ringbuffer/ringbuffer.h"
+#include "ext/uthash/utlist.h"
+#include "ext/nets.h"
+#ifdef HAVE_PTHREADS
+	#include "ext/c11threads_posix.h"
+#endif
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MUX_MAX_FRAGMENT_SIZE (1024 * 1024)
+#define MUX_MIN_FRAGMENT_SIZE 1024
+
+struct net_tcp_mux_server;
+
+struct net_tcp_mux_channel {
+	/// Channel ID, identifies this channel's fragments on the wire.
+	int16_t channelID;
+	/// Priority, lower value means higher priority.
+	atomic_int_fast8_t priority;
+	/// Maximum size of each fragment of an event packet, in bytes.
+	atomic_int_fast32_t maxFragmentSize;
+	/// Filter out invalidated events or not.
+	atomic_bool validOnly;
+	/// Event packet copies from the mainloop, waiting to be sent.
+	RingBuffer queue;
+	/// Track source ID (cannot change!). One source per channel!
+	int16_t sourceID;
+	/// Source string for this channel, set before the first packet is queued.
+	char *sourceString;
+	atomic_bool sourceInfoReady;
+	/// Owned by the output thread (under the server lock): source info sent
+	/// to all clients, and the event packet currently being sent.
+	bool sourceInfoSent;
+	caerEventPacketHeader currPacket;
+	size_t currPacketSize;
+	size_t currPacketOffset;
+	/// Statistics.
+	uint64_t packetsDropped;
+	/// Shared server this channel belongs to.
+	struct net_tcp_mux_server *server;
+	/// Reference to parent module's original data.
+	caerModuleData parentModule;
+	/// Next channel of the same server.
+	struct net_tcp_mux_channel *next;
+};
+
+typedef struct net_tcp_mux_channel *netTCPMuxChannel;
+
+struct net_tcp_mux_server {
+	/// Port number identifies the server among all channels.
+	uint16_t portNumber;
+	/// Number of channels using this server.
+	size_t refCount;
+	/// Listening socket and connected clients (-1 if unused).
+	int serverFd;
+	size_t clientsSize;
+	int *clients;
+	/// Channels list, protected by 'channelsLock'. The output thread holds
+	/// the lock only to copy each fragment out, sending happens outside it.
+	mtx_t channelsLock;
+	netTCPMuxChannel channels;
+	/// Last channel a fragment was sent from, for round-robin.
+	netTCPMuxChannel lastChannel;
+	/// Fragment buffer: header + data, sent with one call. Only used by the
+	/// output thread.
+	uint8_t *fragmentBuffer;
+	/// Control flag for output thread.
+	atomic_bool running;
+	thrd_t outputThread;
+	/// Log subsystem string.
+	char logString[32];
+	/// Next server in the global list.
+	struct net_tcp_mux_server *next;
+};
+
+typedef struct net_tcp_mux_server *netTCPMuxServer;
+
+// All currently active servers, one per port number.
+static netTCPMuxServer muxServers = NULL;
+static mtx_t muxServersLock;
+static once_flag muxServersLockIsInitialized = ONCE_FLAG_INIT;
+
+static void muxServersLockInitialize(void);
+static bool caerOutputNetTCPMuxInit(caerModuleData moduleData);
+static void caerOutputNetTCPMuxRun(caerModuleData moduleData, size_t argsNumber, va_list args);
+static void caerOutputNetTCPMuxExit(caerModuleData moduleData);
+static void caerOutputNetTCPMuxConfigListener(sshsNode node, void *userData, enum sshs_node_attribute_events event,
+	const char *changeKey, enum sshs_node_attr_value_type changeType, union sshs_node_attr_value changeValue);
+static int packetsFirstTimestampThenTypeCmp(const void *a, const void *b);
+static bool updateSourceInfo(netTCPMuxChannel channel, int16_t eventSource);
+static netTCPMuxServer serverAcquire(caerModuleData moduleData);
+static void serverRelease(netTCPMuxServer server);
+static int serverCreateSocket(caerModuleData moduleData);
+static void serverSendToClient(netTCPMuxServer server, size_t clientIndex, const uint8_t *buffer, size_t bufferSize);
+static void serverSendToAll(netTCPMuxServer server, const uint8_t *buffer, size_t bufferSize);
+static bool serverHasClients(netTCPMuxServer server);
+static size_t serverPrepareFragment(netTCPMuxChannel channel, uint8_t *buffer, int8_t fragmentType,
+	const uint8_t *payload, size_t payloadSize, size_t fragmentOffset, size_t fragmentSize);
+static void serverHandleNewConnections(netTCPMuxServer server);
+static netTCPMuxChannel serverPickChannel(netTCPMuxServer server);
+static bool serverPrepareNextFragment(netTCPMuxServer server, size_t *fragmentSize);
+static int serverOutputThread(void *serverArg);
+
+static struct caer_module_functions caerOutputNetTCPMuxFunctions = { .moduleInit = &caerOutputNetTCPMuxInit,
+	.moduleRun = &caerOutputNetTCPMuxRun, .moduleConfig = NULL, .moduleExit = &caerOutputNetTCPMuxExit };
+
+void caerOutputNetTCPMux(uint16_t moduleID, int8_t defaultPriority, size_t outputTypesNumber, ...) {
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "NetTCPMuxOutput");
+	if (moduleData == NULL) {
+		return;
+	}
+
+	// Init has no access to the arguments, so set the default it will use here.
+	if (moduleData->moduleStatus == STOPPED) {
+		sshsNodePutByteIfAbsent(moduleData->moduleNode, "priority", defaultPriority); // 0 is highest
+	}
+
+	va_list args;
+	va_start(args, outputTypesNumber);
+	caerModuleSMv(&caerOutputNetTCPMuxFunctions, moduleData, sizeof(struct net_tcp_mux_channel), outputTypesNumber,
+		args);
+	va_end(args);
+}
+
+static void muxServersLockInitialize(void) {
+	mtx_init(&muxServersLock, mtx_plain);
+}
+
+static bool caerOutputNetTCPMuxInit(caerModuleData moduleData) {
+	// First, always create all needed setting nodes, set their default values
+	// and add their listeners.
+	// Server settings are taken from the first channel using a port number.
+	sshsNodePutStringIfAbsent(moduleData->moduleNode, "ipAddress", "127.0.0.1");
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "portNumber", 7778);
+	sshsNodePutShortIfAbsent(moduleData->moduleNode, "backlogSize", 5);
+	sshsNodePutShortIfAbsent(moduleData->moduleNode, "concurrentConnections", 10);
+
+	// Channel settings.
+	sshsNodePutShortIfAbsent(moduleData->moduleNode, "channelID", I16T(moduleData->moduleID));
+	// 'priority' default is set by caerOutputNetTCPMux().
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "maxFragmentSize", 16384); // in bytes
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "queueSize", 128); // in packets, power of two
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "validOnly", false); // only send valid events
+
+	netTCPMuxChannel channel = moduleData->moduleState;
+
+	channel->channelID = sshsNodeGetShort(moduleData->moduleNode, "channelID");
+	atomic_store(&channel->priority, sshsNodeGetByte(moduleData->moduleNode, "priority"));
+	atomic_store(&channel->maxFragmentSize, sshsNodeGetInt(moduleData->moduleNode, "maxFragmentSize"));
+	atomic_store(&channel->validOnly, sshsNodeGetBool(moduleData->moduleNode, "validOnly"));
+	channel->sourceID = -1;
+	channel->parentModule = moduleData;
+
+	channel->queue = ringBufferInit((size_t) sshsNodeGetInt(moduleData->moduleNode, "queueSize"));
+	if (channel->queue == NULL) {
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate channel queue.");
+		return (false);
+	}
+
+	channel->server = serverAcquire(moduleData);
+	if (channel->server == NULL) {
+		ringBufferFree(channel->queue);
+		return (false);
+	}
+
+	// Register channel with the server, IDs must be unique.
+	netTCPMuxServer server = channel->server;
+
+	mtx_lock(&server->channelsLock);
+
+	netTCPMuxChannel otherChannel;
+	LL_FOREACH(server->channels, otherChannel)
+	{
+		if (otherChannel->channelID == channel->channelID) {
+			break;
+		}
+	}
+
+	if (otherChannel == NULL) {
+		LL_APPEND(server->channels, channel);
+	}
+
+	mtx_unlock(&server->channelsLock);
+
+	if (otherChannel != NULL) {
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString,
+			"Channel ID %" PRIi16 " is already in use on port %" PRIu16 ".", channel->channelID, server->portNumber);
+
+		serverRelease(server);
+		ringBufferFree(channel->queue);
+		return (false);
+	}
+
+	// Add config listeners last, to avoid having them dangling if Init doesn't succeed.
+	sshsNodeAddAttributeListener(moduleData->moduleNode, moduleData, &caerOutputNetTCPMuxConfigListener);
+
+	caerLog(CAER_LOG_INFO, moduleData->moduleSubSystemString,
+		"Channel %" PRIi16 " (priority %" PRIi8 ") added to multiplexed TCP server on port %" PRIu16 ".",
+		channel->channelID, I8T(atomic_load(&channel->priority)), server->portNumber);
+
+	return (true);
+}
+
+static void caerOutputNetTCPMuxRun(caerModuleData moduleData, size_t argsNumber, va_list args) {
+	netTCPMuxChannel channel = moduleData->moduleState;
+
+	caerEventPacketHeader packets[argsNumber];
+	size_t packetsSize = 0;
+
+	// Collect non-empty packets, checking they're from the same source.
+	for (size_t i = 0; i < argsNumber; i++) {
+		caerEventPacketHeader packetHeader = va_arg(args, caerEventPacketHeader);
+
+		if (packetHeader == NULL || caerEventPacketHeaderGetEventNumber(packetHeader) == 0) {
+			continue;
+		}
+
+		int16_t eventSource = caerEventPacketHeaderGetEventSource(packetHeader);
+
+		if (channel->sourceID == -1) {
+			if (!updateSourceInfo(channel, eventSource)) {
+				return;
+			}
+		}
+		else if (channel->sourceID != eventSource) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString,
+				"An output module can only handle packets from the same source! "
+					"A packet with source %" PRIi16 " was sent, but this output module expects only packets from source %" PRIi16 ".",
+				eventSource, channel->sourceID);
+			continue;
+		}
+
+		packets[packetsSize++] = packetHeader;
+	}
+
+	// Respect time order as specified in AEDAT 3.X format, inside each channel.
+	qsort(packets, packetsSize, sizeof(caerEventPacketHeader), &packetsFirstTimestampThenTypeCmp);
+
+	bool validOnly = atomic_load_explicit(&channel->validOnly, memory_order_relaxed);
+
+	for (size_t i = 0; i < packetsSize; i++) {
+		caerEventPacketHeader packetCopy =
+			(validOnly) ?
+				(caerInOutCopyEventPacketOnlyValidEvents(packets[i])) : (caerCopyEventPacketOnlyEvents(packets[i]));
+		if (packetCopy == NULL) {
+			// Empty after valid-only filtering, or out of memory.
+			continue;
+		}
+
+		if (!ringBufferPut(channel->queue, packetCopy)) {
+			// Never block the mainloop, drop if the network can't keep up.
+			free(packetCopy);
+			channel->packetsDropped++;
+
+			caerLog(CAER_LOG_DEBUG, moduleData->moduleSubSystemString,
+				"Failed to put packet copy on channel queue: full.");
+		}
+	}
+}
+
+static void caerOutputNetTCPMuxExit(caerModuleData moduleData) {
+	// Remove listener, which can reference invalid memory in userData.
+	sshsNodeRemoveAttributeListener(moduleData->moduleNode, moduleData, &caerOutputNetTCPMuxConfigListener);
+
+	netTCPMuxChannel channel = moduleData->moduleState;
+	netTCPMuxServer server = channel->server;
+
+	// Unregister from server. Once done, the output thread doesn't touch this channel anymore.
+	mtx_lock(&server->channelsLock);
+
+	LL_DELETE(server->channels, channel);
+
+	if (server->lastChannel == channel) {
+		server->lastChannel = NULL;
+	}
+
+	mtx_unlock(&server->channelsLock);
+
+	serverRelease(server);
+
+	// Free all remaining packets.
+	free(channel->currPacket);
+
+	caerEventPacketHeader packet;
+	while ((packet = ringBufferGet(channel->queue)) != NULL) {
+		free(packet);
+	}
+
+	ringBufferFree(channel->queue);
+
+	free(channel->sourceString);
+
+	caerLog(CAER_LOG_INFO, moduleData->moduleSubSystemString,
+		"Channel %" PRIi16 " removed, %" PRIu64 " packets dropped in total.", channel->channelID,
+		channel->packetsDropped);
+}
+
+static void caerOutputNetTCPMuxConfigListener(sshsNode node, void *userData, enum sshs_node_attribute_events event,
+	const char *changeKey, enum sshs_node_attr_value_type changeType, union sshs_node_attr_value changeValue) {
+	UNUSED_ARGUMENT(node);
+
+	caerModuleData moduleData = userData;
+	netTCPMuxChannel channel = moduleData->moduleState;
+
+	if (event == ATTRIBUTE_MODIFIED) {
+		if (changeType == BYTE && caerStrEquals(changeKey, "priority")) {
+			atomic_store(&channel->priority, changeValue.ibyte);
+		}
+		else if (changeType == INT && caerStrEquals(changeKey, "maxFragmentSize")) {
+			atomic_store(&channel->maxFragmentSize, changeValue.iint);
+		}
+		else if (changeType == BOOL && caerStrEquals(changeKey, "validOnly")) {
+			atomic_store(&channel->validOnly, changeValue.boolean);
+		}
+	}
+}
+
+static int packetsFirstTimestampThenTypeCmp(const void *a, const void *b) {
+	const caerEventPacketHeader *aa = a;
+	const caerEventPacketHeader *bb = b;
+
+	// Sort first by timestamp of the first event.
+	int32_t eventTimestampA = caerGenericEventGetTimestamp(caerGenericEventGetEvent(*aa, 0), *aa);
+	int32_t eventTimestampB = caerGenericEventGetTimestamp(caerGenericEventGetEvent(*bb, 0), *bb);
+
+	if (eventTimestampA < eventTimestampB) {
+		return (-1);
+	}
+	else if (eventTimestampA > eventTimestampB) {
+		return (1);
+	}
+	else {
+		// If equal, further sort by type ID.
+		int16_t eventTypeA = caerEventPacketHeaderGetEventType(*aa);
+		int16_t eventTypeB = caerEventPacketHeaderGetEventType(*bb);
+
+		if (eventTypeA < eventTypeB) {
+			return (-1);
+		}
+		else if (eventTypeA > eventTypeB) {
+			return (1);
+		}
+		else {
+			return (0);
+		}
+	}
+}
+
+static bool updateSourceInfo(netTCPMuxChannel channel, int16_t eventSource) {
+	sshsNode sourceInfoNode = caerMainloopGetSourceInfo(U16T(eventSource));
+	if (sourceInfoNode == NULL) {
+		// This should never happen, but we handle it gracefully.
+		caerLog(CAER_LOG_ERROR, channel->parentModule->moduleSubSystemString,
+			"Failed to get source info to setup output module.");
+		return (false);
+	}
+
+	channel->sourceString = sshsNodeGetString(sourceInfoNode, "sourceString");
+	channel->sourceID = eventSource; // Remember this!
+
+	// Publish to output thread.
+	atomic_store_explicit(&channel->sourceInfoReady, true, memory_order_release);
+
+	return (true);
+}
+
+static netTCPMuxServer serverAcquire(caerModuleData moduleData) {
+	uint16_t portNumber = U16T(sshsNodeGetInt(moduleData->moduleNode, "portNumber"));
+
+	call_once(&muxServersLockIsInitialized, &muxServersLockInitialize);
+
+	mtx_lock(&muxServersLock);
+
+	// Join an existing server, if there is one for this port.
+	netTCPMuxServer server;
+	LL_FOREACH(muxServers, server)
+	{
+		if (server->portNumber == portNumber) {
+			server->refCount++;
+
+			mtx_unlock(&muxServersLock);
+			return (server);
+		}
+	}
+
+	// Else create a new one.
+	server = calloc(1, sizeof(struct net_tcp_mux_server));
+	if (server == NULL) {
+		mtx_unlock(&muxServersLock);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString, "Failed to allocate memory for server.");
+		return (NULL);
+	}
+
+	server->portNumber = portNumber;
+	server->refCount = 1;
+	snprintf(server->logString, 32, "NetTCPMux-%" PRIu16, portNumber);
+
+	server->clientsSize = (size_t) sshsNodeGetShort(moduleData->moduleNode, "concurrentConnections");
+	server->clients = malloc(server->clientsSize * sizeof(int));
+	server->fragmentBuffer = malloc(AEDAT3_MUX_FRAGMENT_HEADER_LENGTH + MUX_MAX_FRAGMENT_SIZE);
+
+	if (server->clients == NULL || server->fragmentBuffer == NULL) {
+		free(server->clients);
+		free(server->fragmentBuffer);
+		free(server);
+		mtx_unlock(&muxServersLock);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString, "Failed to allocate memory for server.");
+		return (NULL);
+	}
+
+	for (size_t i = 0; i < server->clientsSize; i++) {
+		server->clients[i] = -1;
+	}
+
+	server->serverFd = serverCreateSocket(moduleData);
+	if (server->serverFd < 0) {
+		free(server->clients);
+		free(server->fragmentBuffer);
+		free(server);
+		mtx_unlock(&muxServersLock);
+
+		return (NULL);
+	}
+
+	mtx_init(&server->channelsLock, mtx_plain);
+
+	atomic_store(&server->running, true);
+
+	if (thrd_create(&server->outputThread, &serverOutputThread, server) != thrd_success) {
+		mtx_destroy(&server->channelsLock);
+		close(server->serverFd);
+		free(server->clients);
+		free(server->fragmentBuffer);
+		free(server);
+		mtx_unlock(&muxServersLock);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString, "Failed to start output handling thread.");
+		return (NULL);
+	}
+
+	LL_APPEND(muxServers, server);
+
+	mtx_unlock(&muxServersLock);
+
+	return (server);
+}
+
+static void serverRelease(netTCPMuxServer server) {
+	mtx_lock(&muxServersLock);
+
+	server->refCount--;
+
+	if (server->refCount > 0) {
+		mtx_unlock(&muxServersLock);
+		return;
+	}
+
+	LL_DELETE(muxServers, server);
+
+	mtx_unlock(&muxServersLock);
+
+	// Last channel gone, stop output thread and close all connections.
+	atomic_store(&server->running, false);
+
+	if ((errno = thrd_join(server->outputThread, NULL)) != thrd_success) {
+		// This should never happen!
+		caerLog(CAER_LOG_CRITICAL, server->logString, "Failed to join output handling thread. Error: %d.", errno);
+	}
+
+	for (size_t i = 0; i < server->clientsSize; i++) {
+		if (server->clients[i] >= 0) {
+			close(server->clients[i]);
+		}
+	}
+
+	close(server->serverFd);
+
+	mtx_destroy(&server->channelsLock);
+
+	free(server->clients);
+	free(server->fragmentBuffer);
+	free(server);
+}
+
+static int serverCreateSocket(caerModuleData moduleData) {
+	// Open a TCP server socket for others to connect to.
+	int serverSockFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (serverSockFd < 0) {
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString, "Could not create TCP server socket. Error: %d.",
+		errno);
+		return (-1);
+	}
+
+	// Make socket address reusable right away.
+	socketReuseAddr(serverSockFd, true);
+
+	// Set server socket, on which accept() is called, to non-blocking mode.
+	if (!socketBlockingMode(serverSockFd, false)) {
+		close(serverSockFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Could not set TCP server socket to non-blocking mode.");
+		return (-1);
+	}
+
+	struct sockaddr_in tcpServer;
+	memset(&tcpServer, 0, sizeof(struct sockaddr_in));
+
+	tcpServer.sin_family = AF_INET;
+	tcpServer.sin_port = htons(U16T(sshsNodeGetInt(moduleData->moduleNode, "portNumber")));
+
+	char *ipAddress = sshsNodeGetString(moduleData->moduleNode, "ipAddress");
+	if (inet_pton(AF_INET, ipAddress, &tcpServer.sin_addr) == 0) {
+		close(serverSockFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"No valid server IP address found. '%s' is invalid!", ipAddress);
+
+		free(ipAddress);
+		return (-1);
+	}
+	free(ipAddress);
+
+	// Bind socket to above address.
+	if (bind(serverSockFd, (struct sockaddr *) &tcpServer, sizeof(struct sockaddr_in)) < 0) {
+		close(serverSockFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString, "Could not bind TCP server socket. Error: %d.",
+		errno);
+		return (-1);
+	}
+
+	// Listen to new connections on the socket.
+	if (listen(serverSockFd, sshsNodeGetShort(moduleData->moduleNode, "backlogSize")) < 0) {
+		close(serverSockFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Could not listen on TCP server socket. Error: %d.", errno);
+		return (-1);
+	}
+
+	caerLog(CAER_LOG_INFO, moduleData->moduleSubSystemString,
+		"Multiplexed TCP server socket connected to %s:%" PRIu16 ".",
+		inet_ntop(AF_INET, &tcpServer.sin_addr, (char[INET_ADDRSTRLEN] ) { 0x00 }, INET_ADDRSTRLEN),
+		ntohs(tcpServer.sin_port));
+
+	return (serverSockFd);
+}
+
+static void serverSendToClient(netTCPMuxServer server, size_t clientIndex, const uint8_t *buffer, size_t bufferSize) {
+	int fd = server->clients[clientIndex];
+
+	if (fd >= 0 && !sendUntilDone(fd, buffer, bufferSize)) {
+		// Write failed, most of the reasons for that to happen are
+		// not recoverable from, so we just disable this client.
+		caerLog(CAER_LOG_INFO, server->logString, "Disconnect or error on fd %d, closing and removing. Error: %d.",
+			fd, errno);
+
+		close(fd);
+		server->clients[clientIndex] = -1;
+	}
+}
+
+static void serverSendToAll(netTCPMuxServer server, const uint8_t *buffer, size_t bufferSize) {
+	for (size_t i = 0; i < server->clientsSize; i++) {
+		serverSendToClient(server, i, buffer, bufferSize);
+	}
+}
+
+static bool serverHasClients(netTCPMuxServer server) {
+	for (size_t i = 0; i < server->clientsSize; i++) {
+		if (server->clients[i] >= 0) {
+			return (true);
+		}
+	}
+
+	return (false);
+}
+
+/**
+ * Put header and data of one fragment into a buffer. Returns the total size to send.
+ */
+static size_t serverPrepareFragment(netTCPMuxChannel channel, uint8_t *buffer, int8_t fragmentType,
+	const uint8_t *payload, size_t payloadSize, size_t fragmentOffset, size_t fragmentSize) {
+	struct aedat3_mux_fragment_header fragmentHeader;
+
+	fragmentHeader.channelID = htole16(channel->channelID);
+	fragmentHeader.fragmentType = fragmentType;
+	fragmentHeader.priority = I8T(atomic_load_explicit(&channel->priority, memory_order_relaxed));
+	fragmentHeader.payloadSize = htole32(I32T(payloadSize));
+	fragmentHeader.fragmentOffset = htole32(I32T(fragmentOffset));
+	fragmentHeader.fragmentSize = htole32(I32T(fragmentSize));
+
+	memcpy(buffer, &fragmentHeader, AEDAT3_MUX_FRAGMENT_HEADER_LENGTH);
+	memcpy(buffer + AEDAT3_MUX_FRAGMENT_HEADER_LENGTH, payload + fragmentOffset, fragmentSize);
+
+	return (AEDAT3_MUX_FRAGMENT_HEADER_LENGTH + fragmentSize);
+}
+
+static void serverHandleNewConnections(netTCPMuxServer server) {
+	// First let's see if any new connections are waiting on the listening
+	// socket to be accepted. This returns right away (non-blocking).
+	int acceptResult = accept(server->serverFd, NULL, NULL);
+	if (acceptResult < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			// Only log real failure. EAGAIN/EWOULDBLOCK just means no
+			// connections are present for non-blocking accept() right now.
+			caerLog(CAER_LOG_ERROR, server->logString, "TCP server accept() failed. Error: %d.", errno);
+		}
+
+		return;
+	}
+
+	size_t clientIndex = server->clientsSize;
+
+	for (size_t i = 0; i < server->clientsSize; i++) {
+		if (server->clients[i] == -1) {
+			clientIndex = i;
+			break;
+		}
+	}
+
+	if (clientIndex == server->clientsSize) {
+		// No space for new connection, just close it (client will exit).
+		close(acceptResult);
+
+		caerLog(CAER_LOG_DEBUG, server->logString, "Rejected TCP client (fd %d), max connections reached.",
+			acceptResult);
+		return;
+	}
+
+	// Small fragments must go out right away, they're the low-latency data.
+	int noDelay = 1;
+	setsockopt(acceptResult, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+
+	server->clients[clientIndex] = acceptResult;
+
+	caerLog(CAER_LOG_DEBUG, server->logString, "Accepted new TCP connection from client (fd %d).", acceptResult);
+
+	// Send stream header and the source info of all known channels. They are
+	// put together under the lock, but sent outside of it.
+	struct aedat3_network_header networkHeader;
+
+	networkHeader.magicNumber = htole64(AEDAT3_MUX_MAGIC_NUMBER);
+	networkHeader.sequenceNumber = htole64(0);
+	networkHeader.versionNumber = AEDAT3_MUX_VERSION;
+	networkHeader.formatNumber = 0x00; // RAW format.
+
+	mtx_lock(&server->channelsLock);
+
+	int16_t channelsNumber = 0;
+	size_t streamStartSize = AEDAT3_NETWORK_HEADER_LENGTH;
+	netTCPMuxChannel channel;
+
+	LL_FOREACH(server->channels, channel)
+	{
+		channelsNumber++;
+
+		if (atomic_load_explicit(&channel->sourceInfoReady, memory_order_acquire)) {
+			streamStartSize += AEDAT3_MUX_FRAGMENT_HEADER_LENGTH + strlen(channel->sourceString);
+		}
+	}
+
+	uint8_t *streamStart = malloc(streamStartSize);
+	if (streamStart == NULL) {
+		mtx_unlock(&server->channelsLock);
+
+		close(acceptResult);
+		server->clients[clientIndex] = -1;
+
+		caerLog(CAER_LOG_ERROR, server->logString, "Failed to allocate stream header for new TCP client.");
+		return;
+	}
+
+	networkHeader.sourceNumber = htole16(channelsNumber); // Informative only, channels can change.
+
+	memcpy(streamStart, &networkHeader, AEDAT3_NETWORK_HEADER_LENGTH);
+	size_t streamStartPos = AEDAT3_NETWORK_HEADER_LENGTH;
+
+	LL_FOREACH(server->channels, channel)
+	{
+		if (atomic_load_explicit(&channel->sourceInfoReady, memory_order_acquire)) {
+			size_t sourceStringLength = strlen(channel->sourceString);
+
+			streamStartPos += serverPrepareFragment(channel, streamStart + streamStartPos,
+				AEDAT3_MUX_FRAGMENT_CHANNEL_INFO, (const uint8_t *) channel->sourceString, sourceStringLength, 0,
+				sourceStringLength);
+		}
+	}
+
+	mtx_unlock(&server->channelsLock);
+
+	serverSendToClient(server, clientIndex, streamStart, streamStartPos);
+
+	free(streamStart);
+}
+
+/**
+ * Find the highest priority channel with data to send. Search starts after
+ * the last channel served, so that equal priorities get served round-robin.
+ */
+static netTCPMuxChannel serverPickChannel(netTCPMuxServer server) {
+	if (server->channels == NULL) {
+		return (NULL);
+	}
+
+	netTCPMuxChannel start = (server->lastChannel != NULL && server->lastChannel->next != NULL) ?
+		(server->lastChannel->next) : (server->channels);
+	netTCPMuxChannel channel = start;
+
+	netTCPMuxChannel bestChannel = NULL;
+	int_fast8_t bestPriority = INT8_MAX;
+
+	do {
+		if (channel->currPacket != NULL || ringBufferLook(channel->queue) != NULL) {
+			int_fast8_t priority = atomic_load_explicit(&channel->priority, memory_order_relaxed);
+
+			if (bestChannel == NULL || priority < bestPriority) {
+				bestChannel = channel;
+				bestPriority = priority;
+			}
+		}
+
+		channel = (channel->next != NULL) ? (channel->next) : (server->channels);
+	}
+	while (channel != start);
+
+	return (bestChannel);
+}
+
+/**
+ * Copy the next fragment, from the channel chosen by priority, into the
+ * fragment buffer, and set its size (0 if there is nothing to send, like when
+ * data was dropped). Must hold the server lock. Returns false if no channel
+ * had anything to do.
+ */
+static bool serverPrepareNextFragment(netTCPMuxServer server, size_t *fragmentSize) {
+	*fragmentSize = 0;
+
+	netTCPMuxChannel channel = serverPickChannel(server);
+	if (channel == NULL) {
+		return (false);
+	}
+
+	server->lastChannel = channel;
+
+	// Start on a new packet, if needed.
+	if (channel->currPacket == NULL) {
+		channel->currPacket = ringBufferGet(channel->queue);
+
+		channel->currPacketSize = CAER_EVENT_PACKET_HEADER_SIZE
+			+ ((size_t) caerEventPacketHeaderGetEventNumber(channel->currPacket)
+				* (size_t) caerEventPacketHeaderGetEventSize(channel->currPacket));
+		channel->currPacketOffset = 0;
+
+		// Nobody is listening, just drop the data.
+		if (!serverHasClients(server)) {
+			free(channel->currPacket);
+			channel->currPacket = NULL;
+
+			return (true);
+		}
+
+		// Announce this channel to everyone before its first packet. That is
+		// a fragment of its own, the packet follows next time.
+		if (!channel->sourceInfoSent && atomic_load_explicit(&channel->sourceInfoReady, memory_order_acquire)) {
+			size_t sourceStringLength = strlen(channel->sourceString);
+
+			*fragmentSize = serverPrepareFragment(channel, server->fragmentBuffer, AEDAT3_MUX_FRAGMENT_CHANNEL_INFO,
+				(const uint8_t *) channel->sourceString, sourceStringLength, 0, sourceStringLength);
+
+			channel->sourceInfoSent = true;
+
+			return (true);
+		}
+	}
+
+	size_t maxFragmentSize = (size_t) atomic_load_explicit(&channel->maxFragmentSize, memory_order_relaxed);
+	if (maxFragmentSize < MUX_MIN_FRAGMENT_SIZE) {
+		maxFragmentSize = MUX_MIN_FRAGMENT_SIZE;
+	}
+	if (maxFragmentSize > MUX_MAX_FRAGMENT_SIZE) {
+		maxFragmentSize = MUX_MAX_FRAGMENT_SIZE;
+	}
+
+	size_t fragmentDataSize = channel->currPacketSize - channel->currPacketOffset;
+	if (fragmentDataSize > maxFragmentSize) {
+		fragmentDataSize = maxFragmentSize;
+	}
+
+	*fragmentSize = serverPrepareFragment(channel, server->fragmentBuffer, AEDAT3_MUX_FRAGMENT_PACKET,
+		(const uint8_t *) channel->currPacket, channel->currPacketSize, channel->currPacketOffset, fragmentDataSize);
+
+	channel->currPacketOffset += fragmentDataSize;
+
+	// Packet fully copied out, free it.
+	if (channel->currPacketOffset == channel->currPacketSize) {
+		free(channel->currPacket);
+		channel->currPacket = NULL;
+	}
+
+	return (true);
+}
+
+static int serverOutputThread(void *serverArg) {
+	netTCPMuxServer server = serverArg;
+
+	// Set thread name.
+	thrd_set_name(server->logString);
+
+	// If no data is available on any channel, sleep for 500µs (0.5 ms)
+	// to avoid wasting resources in a busy loop.
+	struct timespec noDataSleep = { .tv_sec = 0, .tv_nsec = 500000 };
+
+	while (atomic_load_explicit(&server->running, memory_order_relaxed)) {
+		serverHandleNewConnections(server);
+
+		// Only copy the fragment out under the lock, so that a slow client
+		// doesn't keep channels from being added or removed.
+		size_t fragmentSize;
+
+		mtx_lock(&server->channelsLock);
+		bool fragmentReady = serverPrepareNextFragment(server, &fragmentSize);
+		mtx_unlock(&server->channelsLock);
+
+		if (fragmentSize > 0) {
+			serverSendToAll(server, server->fragmentBuffer, fragmentSize);
+		}
+
+		if (!fragmentReady) {
+			thrd_sleep(&noDataSleep, NULL);
+		}
+	}
+
+	return (thrd_success);
+}
@@ -0,0 +1,12 @@
+#ifndef OUTPUT_NET_TCP_MUX_H_
+#define OUTPUT_NET_TCP_MUX_H_
+
+#include "main.h"
+
+/**
+ * Channel of the multiplexed TCP server on its configured port. The default
+ * priority applies until changed in the configuration, 0 is highest.
+ */
+void caerOutputNetTCPMux(uint16_t moduleID, int8_t defaultPriority, size_t outputTypesNumber, ...);
+
+#endif /* OUTPUT_NET_TCP_MUX_H_ */
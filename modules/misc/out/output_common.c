@@ -71,8 +71,14 @@
 #include "ext/portable_time.h"
 #include "ext/ringbuffer/ringbuffer.h"
 #include "ext/buffers.h"
+#include "ext/uthash/utlist.h"
+#include "modules/misc/inout_compact.h"
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#if defined(OS_LINUX)
+#include <linux/falloc.h>
+#include <sys/syscall.h>
+#endif
 #ifdef HAVE_PTHREADS
 #include "ext/c11threads_posix.h"
 #endif
@@ -83,6 +89,7 @@
 #include <libcaer/events/common.h>
 #include <libcaer/events/packetContainer.h>
 #include <libcaer/events/frame.h>
+#include <libcaer/events/special.h>
 
 // TODO: check handling of TS reset events from camera!
 
@@ -94,6 +101,41 @@ struct output_common_statistics {
 	uint64_t dataWritten;
 };
 
+/**
+ * Flight recorder history entry: a packet container waiting for a trigger,
+ * together with its time range and memory footprint.
+ */
+struct output_common_recorder_entry {
+	caerEventPacketContainer container;
+	int64_t lowestTimestamp;
+	int64_t highestTimestamp;
+	size_t memorySize;
+	struct output_common_recorder_entry *prev;
+	struct output_common_recorder_entry *next;
+};
+
+typedef struct output_common_recorder_entry *outputCommonRecorderEntry;
+
+struct output_common_recorder {
+	/// Enable flight recorder mode: only write data around triggers.
+	bool enabled;
+	/// Time kept before a trigger, in µs.
+	atomic_int_fast32_t preTriggerTime;
+	/// Time written after a trigger, in µs.
+	atomic_int_fast32_t postTriggerTime;
+	/// Maximum memory used by the history, in bytes.
+	atomic_int_fast64_t maxMemory;
+	/// Special event type that triggers a recording, -1 to disable.
+	atomic_int_fast16_t triggerEventType;
+	/// Manual trigger requested via configuration.
+	atomic_bool triggerManual;
+	/// Packet containers waiting for a trigger, oldest first.
+	outputCommonRecorderEntry history;
+	size_t historyMemory;
+	/// Timestamp up to which we keep writing after a trigger, -1 if not recording.
+	int64_t recordUntil;
+};
+
 struct output_common_state {
 	/// Control flag for output handling thread.
 	atomic_bool running;
@@ -138,10 +180,26 @@ struct output_common_state {
 	int8_t format;
 	/// Output module statistics collection.
 	struct output_common_statistics statistics;
+	/// File segment rotation support, only for file-like outputs that set it.
+	/// NULL if rotation is not supported.
+	outputCommonOpenSegment openSegment;
+	/// Rotate to a new segment after this many bytes, 0 to disable.
+	atomic_int_fast64_t segmentMaxSize;
+	/// Rotate to a new segment after this many seconds, 0 to disable.
+	atomic_int_fast32_t segmentMaxInterval;
+	/// Current segment number, starts at 0.
+	uint32_t segmentNumber;
+	/// Bytes written to the current segment.
+	uint64_t segmentBytesWritten;
+	/// Creation time of the current segment.
+	struct timespec segmentStartTime;
+	/// Flight recorder support, uses the segment support to open new files.
+	struct output_common_recorder recorder;
 	/// Reference to parent module's original data.
 	caerModuleData parentModule;
 };
 
+
 typedef struct output_common_state *outputCommonState;
 
 size_t CAER_OUTPUT_COMMON_STATE_STRUCT_SIZE = sizeof(struct output_common_state);
@@ -156,6 +214,14 @@ static void orderAndSendEventPackets(outputCommonState state, caerEventPacketCon
 static void handleNewServerConnections(outputCommonState state);
 static void sendFileHeader(outputCommonState state);
 static void sendNetworkHeader(outputCommonState state, int *onlyOneClientFD);
+static void preallocateSegment(outputCommonState state, int fd);
+static void closeSegment(outputCommonState state, int fd);
+static void rotateSegment(outputCommonState state);
+static int64_t recorderFindTrigger(outputCommonState state, caerEventPacketContainer packetContainer,
+	int64_t highestTimestamp);
+static void recorderHandlePacketContainer(outputCommonState state, caerEventPacketContainer packetContainer);
+static void recorderStopRecording(outputCommonState state);
+static void recorderFreeHistory(outputCommonState state);
 static int outputHandlerThread(void *stateArg);
 static void caerOutputCommonConfigListener(sshsNode node, void *userData, enum sshs_node_attribute_events event,
 	const char *changeKey, enum sshs_node_attr_value_type changeType, union sshs_node_attr_value changeValue);
@@ -166,6 +232,22 @@ int caerOutputCommonGetServerFd(void *statePtr) {
 	return (state->fileDescriptors->serverFd);
 }
 
+void caerOutputCommonSetSegmentRotation(void *statePtr, outputCommonOpenSegment openSegment) {
+	outputCommonState state = statePtr;
+
+	// Must be called before caerOutputCommonInit(), so the output thread sees it.
+	state->openSegment = openSegment;
+}
+
+void caerOutputCommonSetFlightRecorder(void *statePtr, outputCommonOpenSegment openSegment) {
+	outputCommonState state = statePtr;
+
+	// Must be called before caerOutputCommonInit(), so the output thread sees it.
+	// Each trigger opens a new segment, no size/time rotation happens.
+	state->openSegment = openSegment;
+	state->recorder.enabled = true;
+}
+
 outputCommonFDs caerOutputCommonAllocateFdArray(size_t size) {
 	// Allocate memory for file descriptor array structure.
 	outputCommonFDs fileDescriptors = malloc(sizeof(*fileDescriptors) + (size * sizeof(int)));
@@ -254,7 +336,7 @@ static void copyPacketsToTransferRing(outputCommonState state, size_t packetsLis
 	for (size_t i = 0; i < packetsSize; i++) {
 		if (validOnly) {
 			caerEventPacketContainerSetEventPacket(eventPackets, (int32_t) idx,
-				caerCopyEventPacketOnlyValidEvents(packets[i]));
+				caerInOutCopyEventPacketOnlyValidEvents(packets[i]));
 		}
 		else {
 			caerEventPacketContainerSetEventPacket(eventPackets, (int32_t) idx,
@@ -363,6 +445,8 @@ static bool newOutputBuffer(outputCommonState state) {
 }
 
 static inline void writeBufferToAll(outputCommonState state, const uint8_t *buffer, size_t bufferSize) {
+	state->segmentBytesWritten += bufferSize;
+
 	for (size_t i = 0; i < state->fileDescriptors->fdsSize; i++) {
 		int fd = state->fileDescriptors->fds[i];
 
@@ -917,6 +1001,274 @@ static void sendNetworkHeader(outputCommonState state, int *onlyOneClientFD) {
 	}
 }
 
+/**
+ * Reserve space for a whole segment up-front, so that the file doesn't fragment
+ * and no block allocation happens while writing. The file size is kept as is,
+ * so a crash never leaves garbage at the end of a segment.
+ */
+static void preallocateSegment(outputCommonState state, int fd) {
+#if defined(OS_LINUX)
+	int64_t segmentMaxSize = atomic_load_explicit(&state->segmentMaxSize, memory_order_relaxed);
+
+	if (segmentMaxSize > 0) {
+		if (syscall(SYS_fallocate, fd, FALLOC_FL_KEEP_SIZE, (off_t) 0, (off_t) segmentMaxSize) != 0) {
+			// Not all file-systems support this, it's only an optimization.
+			caerLog(CAER_LOG_DEBUG, state->parentModule->moduleSubSystemString,
+				"Failed to pre-allocate segment space. Error: %d.", errno);
+		}
+	}
+#else
+	UNUSED_ARGUMENT(state);
+	UNUSED_ARGUMENT(fd);
+#endif
+}
+
+static void closeSegment(outputCommonState state, int fd) {
+	// Give back pre-allocated space that wasn't used.
+	off_t segmentSize = lseek(fd, 0, SEEK_CUR);
+
+	if (segmentSize >= 0 && ftruncate(fd, segmentSize) != 0) {
+		caerLog(CAER_LOG_DEBUG, state->parentModule->moduleSubSystemString,
+			"Failed to release unused segment space. Error: %d.", errno);
+	}
+
+	close(fd);
+}
+
+static void rotateSegment(outputCommonState state) {
+	int64_t segmentMaxSize = atomic_load_explicit(&state->segmentMaxSize, memory_order_relaxed);
+	int32_t segmentMaxInterval = I32T(atomic_load_explicit(&state->segmentMaxInterval, memory_order_relaxed));
+
+	bool sizeExceeded = (segmentMaxSize > 0 && state->segmentBytesWritten >= (uint64_t) segmentMaxSize);
+	bool intervalExceeded = false;
+
+	if (segmentMaxInterval > 0) {
+		struct timespec currentTime;
+		portable_clock_gettime_monotonic(&currentTime);
+
+		intervalExceeded = ((currentTime.tv_sec - state->segmentStartTime.tv_sec) >= segmentMaxInterval);
+	}
+
+	if (!sizeExceeded && !intervalExceeded) {
+		return;
+	}
+
+	// Only happens between packet containers, so each segment has complete packets
+	// with monotonic timestamps. Packets keep queuing up in the transfer ring-buffer
+	// while we're switching, so nothing is lost.
+	int newFd = (*state->openSegment)(state->parentModule, state->segmentNumber + 1);
+	if (newFd < 0) {
+		// Keep writing to the current segment, we'll retry on the next packet container.
+		// Restart the interval, so that we don't retry on every single container.
+		portable_clock_gettime_monotonic(&state->segmentStartTime);
+
+		caerLog(CAER_LOG_ERROR, state->parentModule->moduleSubSystemString,
+			"Failed to open new segment, continuing with current one.");
+		return;
+	}
+
+	preallocateSegment(state, newFd);
+
+	// Flush everything to the old segment, then swap.
+	commitOutputBuffer(state);
+
+	if (state->fileDescriptors->fds[0] >= 0) {
+		closeSegment(state, state->fileDescriptors->fds[0]);
+	}
+
+	state->fileDescriptors->fds[0] = newFd;
+
+	state->segmentNumber++;
+	state->segmentBytesWritten = 0;
+	portable_clock_gettime_monotonic(&state->segmentStartTime);
+
+	// Each segment is a complete, valid AEDAT file on its own.
+	sendFileHeader(state);
+}
+
+static int64_t recorderFindTrigger(outputCommonState state, caerEventPacketContainer packetContainer,
+	int64_t highestTimestamp) {
+	// Manual trigger, happens "now", so at the latest time we know about.
+	if (atomic_load_explicit(&state->recorder.triggerManual, memory_order_relaxed)) {
+		atomic_store(&state->recorder.triggerManual, false);
+
+		// Reset the configuration key, so it can be triggered again.
+		sshsNodePutBool(state->parentModule->moduleNode, "trigger", false);
+
+		return (highestTimestamp);
+	}
+
+	int16_t triggerEventType = I16T(atomic_load_explicit(&state->recorder.triggerEventType, memory_order_relaxed));
+	if (triggerEventType < 0) {
+		return (-1);
+	}
+
+	caerSpecialEventPacket special = (caerSpecialEventPacket) caerEventPacketContainerGetEventPacketForType(
+		packetContainer, SPECIAL_EVENT);
+	if (special == NULL) {
+		return (-1);
+	}
+
+	CAER_SPECIAL_ITERATOR_VALID_START(special)
+		if (caerSpecialEventGetType(caerSpecialIteratorElement) == triggerEventType) {
+			return (caerSpecialEventGetTimestamp64(caerSpecialIteratorElement, special));
+		}
+	CAER_SPECIAL_ITERATOR_VALID_END
+
+	return (-1);
+}
+
+static void recorderStopRecording(outputCommonState state) {
+	commitOutputBuffer(state);
+
+	if (state->fileDescriptors->fds[0] >= 0) {
+		closeSegment(state, state->fileDescriptors->fds[0]);
+		state->fileDescriptors->fds[0] = -1;
+	}
+
+	state->recorder.recordUntil = -1;
+
+	caerLog(CAER_LOG_INFO, state->parentModule->moduleSubSystemString, "Flight recorder: recording %" PRIu32 " done.",
+		state->segmentNumber);
+}
+
+static void recorderFreeHistory(outputCommonState state) {
+	outputCommonRecorderEntry entry, entryTmp;
+	DL_FOREACH_SAFE(state->recorder.history, entry, entryTmp)
+	{
+		DL_DELETE(state->recorder.history, entry);
+
+		caerEventPacketContainerFree(entry->container);
+		free(entry);
+	}
+
+	state->recorder.historyMemory = 0;
+}
+
+/**
+ * Flight recorder mode: keep the last preTriggerTime µs of data in memory, and only
+ * write out to a new file the data from preTriggerTime before to postTriggerTime
+ * after a trigger. Triggers during a recording extend it.
+ * Takes ownership of the packet container.
+ */
+static void recorderHandlePacketContainer(outputCommonState state, caerEventPacketContainer packetContainer) {
+	// Get time range and memory size of this packet container.
+	int64_t lowestTimestamp = INT64_MAX;
+	int64_t highestTimestamp = INT64_MIN;
+	size_t memorySize = 0;
+
+	for (int32_t i = 0; i < caerEventPacketContainerGetEventPacketsNumber(packetContainer); i++) {
+		caerEventPacketHeader packet = caerEventPacketContainerGetEventPacket(packetContainer, i);
+
+		int64_t firstTimestamp = caerGenericEventGetTimestamp64(caerGenericEventGetEvent(packet, 0), packet);
+		int64_t lastTimestamp = caerGenericEventGetTimestamp64(
+			caerGenericEventGetEvent(packet, caerEventPacketHeaderGetEventNumber(packet) - 1), packet);
+
+		if (firstTimestamp < lowestTimestamp) {
+			lowestTimestamp = firstTimestamp;
+		}
+		if (lastTimestamp > highestTimestamp) {
+			highestTimestamp = lastTimestamp;
+		}
+
+		memorySize += CAER_EVENT_PACKET_HEADER_SIZE
+			+ (size_t) (caerEventPacketHeaderGetEventCapacity(packet) * caerEventPacketHeaderGetEventSize(packet));
+	}
+
+	int64_t preTriggerTime = atomic_load_explicit(&state->recorder.preTriggerTime, memory_order_relaxed);
+	int64_t postTriggerTime = atomic_load_explicit(&state->recorder.postTriggerTime, memory_order_relaxed);
+
+	int64_t triggerTimestamp = recorderFindTrigger(state, packetContainer, highestTimestamp);
+
+	if (triggerTimestamp >= 0) {
+		if (state->recorder.recordUntil < 0) {
+			// New recording, open a new file for it.
+			int newFd = (*state->openSegment)(state->parentModule, state->segmentNumber + 1);
+			if (newFd < 0) {
+				caerLog(CAER_LOG_ERROR, state->parentModule->moduleSubSystemString,
+					"Flight recorder: failed to open file for trigger at %" PRIi64 ", ignoring it.", triggerTimestamp);
+			}
+			else {
+				state->fileDescriptors->fds[0] = newFd;
+				state->segmentNumber++;
+				state->lastTimestamp = 0;
+
+				sendFileHeader(state);
+
+				caerLog(CAER_LOG_INFO, state->parentModule->moduleSubSystemString,
+					"Flight recorder: trigger at %" PRIi64 ", starting recording %" PRIu32 ".", triggerTimestamp,
+					state->segmentNumber);
+
+				// Write out pre-trigger history, dropping what's too old.
+				outputCommonRecorderEntry entry, entryTmp;
+				DL_FOREACH_SAFE(state->recorder.history, entry, entryTmp)
+				{
+					DL_DELETE(state->recorder.history, entry);
+
+					if (entry->highestTimestamp >= (triggerTimestamp - preTriggerTime)) {
+						orderAndSendEventPackets(state, entry->container);
+					}
+
+					caerEventPacketContainerFree(entry->container);
+					free(entry);
+				}
+
+				state->recorder.historyMemory = 0;
+				state->recorder.recordUntil = triggerTimestamp + postTriggerTime;
+			}
+		}
+		else if ((triggerTimestamp + postTriggerTime) > state->recorder.recordUntil) {
+			// Already recording, just extend it.
+			state->recorder.recordUntil = triggerTimestamp + postTriggerTime;
+		}
+	}
+
+	if (state->recorder.recordUntil >= 0) {
+		// Recording: write out directly, no history needed.
+		orderAndSendEventPackets(state, packetContainer);
+		caerEventPacketContainerFree(packetContainer);
+
+		if (highestTimestamp >= state->recorder.recordUntil) {
+			recorderStopRecording(state);
+		}
+
+		return;
+	}
+
+	// Not recording: remember this packet container.
+	outputCommonRecorderEntry newEntry = malloc(sizeof(*newEntry));
+	if (newEntry == NULL) {
+		caerEventPacketContainerFree(packetContainer);
+
+		caerLog(CAER_LOG_ERROR, state->parentModule->moduleSubSystemString,
+			"Flight recorder: failed to allocate memory for history entry.");
+		return;
+	}
+
+	newEntry->container = packetContainer;
+	newEntry->lowestTimestamp = lowestTimestamp;
+	newEntry->highestTimestamp = highestTimestamp;
+	newEntry->memorySize = memorySize;
+
+	DL_APPEND(state->recorder.history, newEntry);
+	state->recorder.historyMemory += memorySize;
+
+	// Drop oldest entries that are out of the pre-trigger window, or over the memory limit.
+	size_t maxMemory = (size_t) atomic_load_explicit(&state->recorder.maxMemory, memory_order_relaxed);
+
+	while (state->recorder.history != newEntry
+		&& ((state->recorder.history->highestTimestamp < (highestTimestamp - preTriggerTime))
+			|| (state->recorder.historyMemory > maxMemory))) {
+		outputCommonRecorderEntry oldestEntry = state->recorder.history;
+
+		DL_DELETE(state->recorder.history, oldestEntry);
+		state->recorder.historyMemory -= oldestEntry->memorySize;
+
+		caerEventPacketContainerFree(oldestEntry->container);
+		free(oldestEntry);
+	}
+}
+
 static int outputHandlerThread(void *stateArg) {
 	outputCommonState state = stateArg;
 
@@ -996,22 +1348,43 @@ static int outputHandlerThread(void *stateArg) {
 			continue;
 		}
 
+		// Flight recorder takes care of writing out and freeing the packet container itself.
+		if (state->recorder.enabled) {
+			recorderHandlePacketContainer(state, currPacketContainer);
+			continue;
+		}
+
 		orderAndSendEventPackets(state, currPacketContainer);
 
 		// Free all remaining packet container memory.
 		caerEventPacketContainerFree(currPacketContainer);
+
+		// Switch file segments if needed.
+		if (state->openSegment != NULL) {
+			rotateSegment(state);
+		}
 	}
 
 	// Handle shutdown, write out all content remaining in the transfer ring-buffer
 	// and write the packets out to the file descriptor.
 	caerEventPacketContainer packetContainer;
 	while ((packetContainer = ringBufferGet(state->transferRing)) != NULL) {
+		if (state->recorder.enabled) {
+			recorderHandlePacketContainer(state, packetContainer);
+			continue;
+		}
+
 		orderAndSendEventPackets(state, packetContainer);
 
 		// Free all remaining packet container memory.
 		caerEventPacketContainerFree(packetContainer);
 	}
 
+	// Untriggered history is never written out.
+	if (state->recorder.enabled) {
+		recorderFreeHistory(state);
+	}
+
 	// Make sure last (incomplete) buffer is sent out.
 	commitOutputBuffer(state);
 
@@ -1071,6 +1444,41 @@ bool isNetworkMessageBased) {
 
 	atomic_store(&state->validOnly, sshsNodeGetBool(moduleData->moduleNode, "validOnly"));
 	atomic_store(&state->keepPackets, sshsNodeGetBool(moduleData->moduleNode, "keepPackets"));
+
+	// Flight recorder mode, only for outputs that support it.
+	if (state->recorder.enabled) {
+		sshsNodePutIntIfAbsent(moduleData->moduleNode, "preTriggerTime", 5000000); // in µs, data kept before trigger
+		sshsNodePutIntIfAbsent(moduleData->moduleNode, "postTriggerTime", 5000000); // in µs, data written after trigger
+		sshsNodePutLongIfAbsent(moduleData->moduleNode, "maxMemory", 512 * 1024 * 1024); // in bytes, history limit
+		sshsNodePutShortIfAbsent(moduleData->moduleNode, "triggerEventType", EXTERNAL_INPUT_PULSE); // -1 to disable
+		sshsNodePutBool(moduleData->moduleNode, "trigger", false); // set to true to trigger manually
+
+		atomic_store(&state->recorder.preTriggerTime, sshsNodeGetInt(moduleData->moduleNode, "preTriggerTime"));
+		atomic_store(&state->recorder.postTriggerTime, sshsNodeGetInt(moduleData->moduleNode, "postTriggerTime"));
+		atomic_store(&state->recorder.maxMemory, sshsNodeGetLong(moduleData->moduleNode, "maxMemory"));
+		atomic_store(&state->recorder.triggerEventType, sshsNodeGetShort(moduleData->moduleNode, "triggerEventType"));
+		atomic_store(&state->recorder.triggerManual, false);
+
+		state->recorder.history = NULL;
+		state->recorder.historyMemory = 0;
+		state->recorder.recordUntil = -1;
+	}
+
+	// Segment rotation, only for outputs that support it.
+	if (state->openSegment != NULL && !state->recorder.enabled) {
+		sshsNodePutLongIfAbsent(moduleData->moduleNode, "segmentMaxSize", 0); // in bytes, 0 to disable
+		sshsNodePutIntIfAbsent(moduleData->moduleNode, "segmentMaxInterval", 0); // in seconds, 0 to disable
+
+		atomic_store(&state->segmentMaxSize, sshsNodeGetLong(moduleData->moduleNode, "segmentMaxSize"));
+		atomic_store(&state->segmentMaxInterval, sshsNodeGetInt(moduleData->moduleNode, "segmentMaxInterval"));
+
+		state->segmentNumber = 0;
+		state->segmentBytesWritten = 0;
+		portable_clock_gettime_monotonic(&state->segmentStartTime);
+
+		preallocateSegment(state, fds->fds[0]);
+	}
+
 	state->bufferMaxInterval = U64T(sshsNodeGetInt(moduleData->moduleNode, "bufferMaxInterval"));
 	state->bufferMaxInterval *= 1000LLU; // Convert from microseconds to nanoseconds.
 
@@ -1140,7 +1548,12 @@ void caerOutputCommonExit(caerModuleData moduleData) {
 		int fd = state->fileDescriptors->fds[i];
 
 		if (fd >= 0) {
-			close(fd);
+			if (state->openSegment != NULL) {
+				closeSegment(state, fd);
+			}
+			else {
+				close(fd);
+			}
 		}
 	}
 
@@ -1195,5 +1608,27 @@ static void caerOutputCommonConfigListener(sshsNode node, void *userData, enum s
 			// Set buffer update flag.
 			atomic_store(&state->bufferUpdate, true);
 		}
+		else if (changeType == LONG && caerStrEquals(changeKey, "segmentMaxSize")) {
+			atomic_store(&state->segmentMaxSize, changeValue.ilong);
+		}
+		else if (changeType == INT && caerStrEquals(changeKey, "segmentMaxInterval")) {
+			atomic_store(&state->segmentMaxInterval, changeValue.iint);
+		}
+		else if (changeType == INT && caerStrEquals(changeKey, "preTriggerTime")) {
+			atomic_store(&state->recorder.preTriggerTime, changeValue.iint);
+		}
+		else if (changeType == INT && caerStrEquals(changeKey, "postTriggerTime")) {
+			atomic_store(&state->recorder.postTriggerTime, changeValue.iint);
+		}
+		else if (changeType == LONG && caerStrEquals(changeKey, "maxMemory")) {
+			atomic_store(&state->recorder.maxMemory, changeValue.ilong);
+		}
+		else if (changeType == SHORT && caerStrEquals(changeKey, "triggerEventType")) {
+			atomic_store(&state->recorder.triggerEventType, changeValue.ishort);
+		}
+		else if (changeType == BOOL && caerStrEquals(changeKey, "trigger") && changeValue.boolean) {
+			// Picked up by the output handling thread with the next packet container.
+			atomic_store(&state->recorder.triggerManual, true);
+		}
 	}
 }
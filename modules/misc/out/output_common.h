@@ -15,8 +15,17 @@ struct output_common_fds {
 
 typedef struct output_common_fds *outputCommonFDs;
 
+/**
+ * Open the next file segment for writing, used by file-like outputs that
+ * support rotation. Called from the output handling thread.
+ * Must return a valid file descriptor, or -1 on failure.
+ */
+typedef int (*outputCommonOpenSegment)(caerModuleData moduleData, uint32_t segmentNumber);
+
 outputCommonFDs caerOutputCommonAllocateFdArray(size_t size);
 int caerOutputCommonGetServerFd(void *statePtr);
+void caerOutputCommonSetSegmentRotation(void *statePtr, outputCommonOpenSegment openSegment);
+void caerOutputCommonSetFlightRecorder(void *statePtr, outputCommonOpenSegment openSegment);
 bool caerOutputCommonInit(caerModuleData moduleData, outputCommonFDs fds, bool isNetworkStream, bool isNetworkMessageBased);
 void caerOutputCommonExit(caerModuleData moduleData);
 void caerOutputCommonRun(caerModuleData moduleData, size_t argsNumber, va_list args);
@@ -0,0 +1,457 @@
+/*
+ * Shared-memory output: packets from each mainloop run are copied exactly once,
+ * into a slot of a shared memory ring, and a co-located consumer process using
+ * the SharedMemoryInput module gets them as regular packet containers without
+ * any further copies or kernel round-trips. See modules/misc/inout_shm.h for
+ * the segment layout and the hand-over protocol.
+ */
+
+#include "shm.h"
+#include "base/mainloop.h"
+#include "base/module.h"
+#include "modules/misc/inout_shm.h"
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+struct shm_output_state {
+	/// Shared memory segment, mapped read-write.
+	struct shm_segment_header *segment;
+	size_t segmentSize;
+	int segmentFd;
+	/// Doorbell, incremented by one for each committed slot.
+	int doorbellFd;
+	/// Local Unix socket for the file descriptor hand-over.
+	int serverFd;
+	/// Connected consumer, -1 if none.
+	int clientFd;
+	/// Track source ID (cannot change!). One source per I/O module!
+	int16_t sourceID;
+	/// Statistics.
+	uint64_t slotsCommitted;
+	uint64_t slotsDropped;
+};
+
+typedef struct shm_output_state *shmOutputState;
+
+static bool caerOutputSharedMemoryInit(caerModuleData moduleData);
+static void caerOutputSharedMemoryRun(caerModuleData moduleData, size_t argsNumber, va_list args);
+static void caerOutputSharedMemoryExit(caerModuleData moduleData);
+static bool createSegment(caerModuleData moduleData, shmOutputState state);
+static void handleNewConsumer(caerModuleData moduleData, shmOutputState state);
+static bool checkConsumerAlive(caerModuleData moduleData, shmOutputState state);
+static bool updateSourceInfo(caerModuleData moduleData, shmOutputState state, int16_t eventSource);
+
+static struct caer_module_functions caerOutputSharedMemoryFunctions = { .moduleInit = &caerOutputSharedMemoryInit,
+	.moduleRun = &caerOutputSharedMemoryRun, .moduleConfig = NULL, .moduleExit = &caerOutputSharedMemoryExit };
+
+void caerOutputSharedMemory(uint16_t moduleID, size_t outputTypesNumber, ...) {
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "SharedMemoryOutput");
+	if (moduleData == NULL) {
+		return;
+	}
+
+	va_list args;
+	va_start(args, outputTypesNumber);
+	caerModuleSMv(&caerOutputSharedMemoryFunctions, moduleData, sizeof(struct shm_output_state), outputTypesNumber,
+		args);
+	va_end(args);
+}
+
+static bool caerOutputSharedMemoryInit(caerModuleData moduleData) {
+	// First, always create all needed setting nodes, set their default values
+	// and add their listeners.
+	sshsNodePutStringIfAbsent(moduleData->moduleNode, "socketPath", "/tmp/caer-shm.sock");
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "slotNumber", 16); // power of two, in packet containers
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "slotSize", 2 * 1024 * 1024); // in bytes
+
+	shmOutputState state = moduleData->moduleState;
+
+	state->segmentFd = -1;
+	state->doorbellFd = -1;
+	state->serverFd = -1;
+	state->clientFd = -1;
+	state->sourceID = -1;
+
+	if (!createSegment(moduleData, state)) {
+		return (false);
+	}
+
+	state->doorbellFd = eventfd(0, EFD_NONBLOCK);
+	if (state->doorbellFd < 0) {
+		munmap(state->segment, state->segmentSize);
+		close(state->segmentFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString, "Could not create eventfd doorbell. Error: %d.",
+		errno);
+		return (false);
+	}
+
+	// Open a non-blocking Unix local socket on a known path, consumers connect to it
+	// to get the segment and doorbell file descriptors.
+	state->serverFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (state->serverFd < 0) {
+		close(state->doorbellFd);
+		munmap(state->segment, state->segmentSize);
+		close(state->segmentFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString, "Could not create local Unix socket. Error: %d.",
+		errno);
+		return (false);
+	}
+
+	struct sockaddr_un unixSocketAddr;
+	memset(&unixSocketAddr, 0, sizeof(struct sockaddr_un));
+
+	unixSocketAddr.sun_family = AF_UNIX;
+
+	char *socketPath = sshsNodeGetString(moduleData->moduleNode, "socketPath");
+	strncpy(unixSocketAddr.sun_path, socketPath, sizeof(unixSocketAddr.sun_path) - 1);
+	unixSocketAddr.sun_path[sizeof(unixSocketAddr.sun_path) - 1] = '\0'; // Ensure NUL terminated string.
+	free(socketPath);
+
+	if (bind(state->serverFd, (struct sockaddr *) &unixSocketAddr, sizeof(struct sockaddr_un)) < 0
+		|| listen(state->serverFd, 1) < 0) {
+		close(state->serverFd);
+		close(state->doorbellFd);
+		munmap(state->segment, state->segmentSize);
+		close(state->segmentFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Could not bind/listen on local Unix socket. Error: %d.", errno);
+		return (false);
+	}
+
+	caerLog(CAER_LOG_INFO, moduleData->moduleSubSystemString,
+		"Shared memory ready (%" PRIu32 " slots of %" PRIu64 " bytes), consumers connect at '%s'.",
+		state->segment->slotNumber, state->segment->slotSize, unixSocketAddr.sun_path);
+
+	return (true);
+}
+
+static bool createSegment(caerModuleData moduleData, shmOutputState state) {
+	uint32_t slotNumber = U32T(sshsNodeGetInt(moduleData->moduleNode, "slotNumber"));
+	size_t slotSize = SHM_ALIGN_UP((size_t ) sshsNodeGetInt(moduleData->moduleNode, "slotSize"));
+
+	// Slot number must be a power of two, so that indexes can simply be masked.
+	if (slotNumber == 0 || (slotNumber & (slotNumber - 1)) != 0) {
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Slot number must be a power of two.");
+		return (false);
+	}
+
+	if (slotSize <= SHM_SLOT_HEADER_SIZE) {
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Slot size too small.");
+		return (false);
+	}
+
+	state->segmentSize = SHM_SEGMENT_HEADER_SIZE + (slotNumber * slotSize);
+
+	// Create an anonymous segment: we unlink the name right away, only the file
+	// descriptor we pass on to consumers keeps it reachable.
+	char segmentName[64];
+	snprintf(segmentName, 64, "/caer-shm-%ld-%" PRIu16, (long) getpid(), moduleData->moduleID);
+
+	state->segmentFd = shm_open(segmentName, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (state->segmentFd < 0) {
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Could not create shared memory segment. Error: %d.", errno);
+		return (false);
+	}
+
+	shm_unlink(segmentName);
+
+	if (ftruncate(state->segmentFd, (off_t) state->segmentSize) < 0) {
+		close(state->segmentFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Could not resize shared memory segment. Error: %d.", errno);
+		return (false);
+	}
+
+	state->segment = mmap(NULL, state->segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, state->segmentFd, 0);
+	if (state->segment == MAP_FAILED) {
+		close(state->segmentFd);
+
+		caerLog(CAER_LOG_CRITICAL, moduleData->moduleSubSystemString,
+			"Could not map shared memory segment. Error: %d.", errno);
+		return (false);
+	}
+
+	// Segment is zero-filled by ftruncate(), only set what's needed.
+	state->segment->magicNumber = SHM_MAGIC_NUMBER;
+	state->segment->versionNumber = SHM_VERSION;
+	state->segment->slotNumber = slotNumber;
+	state->segment->slotSize = slotSize;
+	state->segment->slotsOffset = SHM_SEGMENT_HEADER_SIZE;
+
+	atomic_store(&state->segment->sourceInfoValid, false);
+	atomic_store(&state->segment->writeIndex, 0);
+	atomic_store(&state->segment->readIndex, 0);
+	atomic_store(&state->segment->producerRunning, true);
+
+	return (true);
+}
+
+static void handleNewConsumer(caerModuleData moduleData, shmOutputState state) {
+	int clientFd = accept(state->serverFd, NULL, NULL);
+	if (clientFd < 0) {
+		// EAGAIN/EWOULDBLOCK: nobody is waiting, the common case.
+		return;
+	}
+
+	if (state->clientFd >= 0) {
+		// Only one consumer at a time.
+		close(clientFd);
+
+		caerLog(CAER_LOG_WARNING, moduleData->moduleSubSystemString,
+			"Rejected new consumer, only one consumer at a time is supported.");
+		return;
+	}
+
+	// No consumer is active, so we can safely take over its index: start the new
+	// consumer on the next slot we write, any older data is gone.
+	atomic_store_explicit(&state->segment->readIndex,
+		atomic_load_explicit(&state->segment->writeIndex, memory_order_relaxed), memory_order_release);
+
+	// Hand over segment and doorbell via SCM_RIGHTS.
+	int fds[2] = { state->segmentFd, state->doorbellFd };
+	char controlBuffer[CMSG_SPACE(sizeof(fds))];
+	memset(controlBuffer, 0, sizeof(controlBuffer));
+
+	uint8_t dummy = SHM_VERSION;
+	struct iovec iov = { .iov_base = &dummy, .iov_len = 1 };
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = controlBuffer;
+	msg.msg_controllen = sizeof(controlBuffer);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(clientFd, &msg, MSG_NOSIGNAL) != 1) {
+		close(clientFd);
+
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString,
+			"Failed to send shared memory descriptors to consumer. Error: %d.", errno);
+		return;
+	}
+
+	state->clientFd = clientFd;
+
+	caerLog(CAER_LOG_INFO, moduleData->moduleSubSystemString, "New consumer connected.");
+}
+
+static bool checkConsumerAlive(caerModuleData moduleData, shmOutputState state) {
+	if (state->clientFd < 0) {
+		return (false);
+	}
+
+	// The consumer never sends anything, so a readable socket means it went away.
+	uint8_t dummy;
+	ssize_t result = recv(state->clientFd, &dummy, 1, MSG_DONTWAIT | MSG_PEEK);
+
+	if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return (true);
+	}
+
+	close(state->clientFd);
+	state->clientFd = -1;
+
+	caerLog(CAER_LOG_INFO, moduleData->moduleSubSystemString, "Consumer disconnected.");
+
+	return (false);
+}
+
+static bool updateSourceInfo(caerModuleData moduleData, shmOutputState state, int16_t eventSource) {
+	sshsNode sourceInfoNode = caerMainloopGetSourceInfo(U16T(eventSource));
+	if (sourceInfoNode == NULL) {
+		// This should never happen, but we handle it gracefully.
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to get source info to setup output module.");
+		return (false);
+	}
+
+	struct shm_segment_header *segment = state->segment;
+
+	segment->sourceID = eventSource;
+
+	if (sshsNodeAttributeExists(sourceInfoNode, "dvsSizeX", SHORT)) {
+		segment->dvsSizeX = sshsNodeGetShort(sourceInfoNode, "dvsSizeX");
+		segment->dvsSizeY = sshsNodeGetShort(sourceInfoNode, "dvsSizeY");
+	}
+
+	if (sshsNodeAttributeExists(sourceInfoNode, "apsSizeX", SHORT)) {
+		segment->apsSizeX = sshsNodeGetShort(sourceInfoNode, "apsSizeX");
+		segment->apsSizeY = sshsNodeGetShort(sourceInfoNode, "apsSizeY");
+	}
+
+	segment->dataSizeX = sshsNodeGetShort(sourceInfoNode, "dataSizeX");
+	segment->dataSizeY = sshsNodeGetShort(sourceInfoNode, "dataSizeY");
+
+	char *sourceString = sshsNodeGetString(sourceInfoNode, "sourceString");
+	strncpy(segment->sourceString, sourceString, SHM_SOURCE_STRING_LENGTH - 1);
+	segment->sourceString[SHM_SOURCE_STRING_LENGTH - 1] = '\0'; // Ensure NUL terminated string.
+	free(sourceString);
+
+	atomic_store_explicit(&segment->sourceInfoValid, true, memory_order_release);
+
+	state->sourceID = eventSource; // Remember this!
+
+	return (true);
+}
+
+static void caerOutputSharedMemoryRun(caerModuleData moduleData, size_t argsNumber, va_list args) {
+	shmOutputState state = moduleData->moduleState;
+
+	caerEventPacketHeader packets[SHM_SLOT_MAX_PACKETS];
+	int32_t packetsNumber = 0;
+	size_t packetsSize = SHM_SLOT_HEADER_SIZE;
+
+	// Collect non-empty packets and the space they need, checking they're from the same source.
+	for (size_t i = 0; i < argsNumber; i++) {
+		caerEventPacketHeader packetHeader = va_arg(args, caerEventPacketHeader);
+
+		if (packetHeader == NULL || caerEventPacketHeaderGetEventNumber(packetHeader) == 0) {
+			continue;
+		}
+
+		int16_t eventSource = caerEventPacketHeaderGetEventSource(packetHeader);
+
+		if (state->sourceID == -1) {
+			if (!updateSourceInfo(moduleData, state, eventSource)) {
+				return;
+			}
+		}
+		else if (state->sourceID != eventSource) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString,
+				"An output module can only handle packets from the same source! "
+					"A packet with source %" PRIi16 " was sent, but this output module expects only packets from source %" PRIi16 ".",
+				eventSource, state->sourceID);
+			continue;
+		}
+
+		if (packetsNumber == SHM_SLOT_MAX_PACKETS) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString,
+				"Too many packets in one run, at most %d are supported.", SHM_SLOT_MAX_PACKETS);
+			break;
+		}
+
+		packets[packetsNumber++] = packetHeader;
+
+		packetsSize += SHM_ALIGN_UP(
+			CAER_EVENT_PACKET_HEADER_SIZE
+				+ ((size_t) caerEventPacketHeaderGetEventNumber(packetHeader)
+					* (size_t) caerEventPacketHeaderGetEventSize(packetHeader)));
+	}
+
+	// Check for consumers only after source info is known, so they can immediately use it.
+	if (state->sourceID != -1) {
+		handleNewConsumer(moduleData, state);
+	}
+
+	// Nothing to do if there's nobody listening or no data.
+	if (!checkConsumerAlive(moduleData, state) || packetsNumber == 0) {
+		return;
+	}
+
+	struct shm_segment_header *segment = state->segment;
+
+	if (packetsSize > segment->slotSize) {
+		state->slotsDropped++;
+
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString,
+			"Packet container of %zu bytes doesn't fit into a slot of %" PRIu64 " bytes, dropping it.", packetsSize,
+			segment->slotSize);
+		return;
+	}
+
+	uint64_t writeIndex = atomic_load_explicit(&segment->writeIndex, memory_order_relaxed);
+	uint64_t readIndex = atomic_load_explicit(&segment->readIndex, memory_order_acquire);
+
+	if ((writeIndex - readIndex) >= segment->slotNumber) {
+		// Consumer too slow, all slots busy. Never block the mainloop for it.
+		state->slotsDropped++;
+
+		caerLog(CAER_LOG_DEBUG, moduleData->moduleSubSystemString, "All slots busy, dropping packet container.");
+		return;
+	}
+
+	// Copy each packet to its place in the slot. This is the only copy.
+	uint8_t *slot = shmSlotGet(segment, writeIndex);
+	struct shm_slot_header *slotHeader = (struct shm_slot_header *) slot;
+	size_t offset = SHM_SLOT_HEADER_SIZE;
+
+	for (int32_t i = 0; i < packetsNumber; i++) {
+		size_t packetSize = CAER_EVENT_PACKET_HEADER_SIZE
+			+ ((size_t) caerEventPacketHeaderGetEventNumber(packets[i])
+				* (size_t) caerEventPacketHeaderGetEventSize(packets[i]));
+
+		memcpy(slot + offset, packets[i], packetSize);
+
+		// The copy only has room for the events actually present.
+		caerEventPacketHeaderSetEventCapacity((caerEventPacketHeader) (slot + offset),
+			caerEventPacketHeaderGetEventNumber(packets[i]));
+
+		slotHeader->packetOffsets[i] = offset;
+
+		offset += SHM_ALIGN_UP(packetSize);
+	}
+
+	slotHeader->packetsNumber = packetsNumber;
+
+	// Publish slot, then ring the doorbell.
+	atomic_store_explicit(&segment->writeIndex, writeIndex + 1, memory_order_release);
+
+	uint64_t one = 1;
+	if (write(state->doorbellFd, &one, sizeof(uint64_t)) < 0) {
+		// Counter saturated (EAGAIN), the consumer will still see the slot on its next wake-up.
+		caerLog(CAER_LOG_DEBUG, moduleData->moduleSubSystemString, "Failed to ring doorbell. Error: %d.", errno);
+	}
+
+	state->slotsCommitted++;
+}
+
+static void caerOutputSharedMemoryExit(caerModuleData moduleData) {
+	shmOutputState state = moduleData->moduleState;
+
+	// Tell the consumer no more data is coming.
+	atomic_store(&state->segment->producerRunning, false);
+
+	uint64_t one = 1;
+	if (write(state->doorbellFd, &one, sizeof(uint64_t)) < 0) {
+		// Nothing to do, consumer will notice the closed socket.
+	}
+
+	// Get socket path before it's closed.
+	socklen_t unixSocketAddrLength = sizeof(struct sockaddr_un);
+	struct sockaddr_un unixSocketAddr;
+	memset(&unixSocketAddr, 0, unixSocketAddrLength);
+
+	getsockname(state->serverFd, (struct sockaddr *) &unixSocketAddr, &unixSocketAddrLength);
+
+	if (state->clientFd >= 0) {
+		close(state->clientFd);
+	}
+
+	close(state->serverFd);
+	close(state->doorbellFd);
+
+	// The consumer keeps its own mapping, this only drops ours.
+	munmap(state->segment, state->segmentSize);
+	close(state->segmentFd);
+
+	// Remove socket file after use.
+	unlink(unixSocketAddr.sun_path);
+
+	caerLog(CAER_LOG_INFO, moduleData->moduleSubSystemString,
+		"Statistics: committed %" PRIu64 " packet containers, dropped %" PRIu64 ".", state->slotsCommitted,
+		state->slotsDropped);
+}
@@ -0,0 +1,8 @@
+#ifndef OUTPUT_SHM_H_
+#define OUTPUT_SHM_H_
+
+#include "main.h"
+
+void caerOutputSharedMemory(uint16_t moduleID, size_t outputTypesNumber, ...);
+
+#endif /* OUTPUT_SHM_H_ */
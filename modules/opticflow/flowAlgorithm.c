@@ -0,0 +1,121 @@
+/*
+ * flowAlgorithm.c
+ *
+ * Runtime selection of the optic flow algorithm.
+ */
+
+#include "flowAlgorithm.h"
+
+static void computeBenosman2014(FlowEvent e, int64_t t, FlowEventBuffer buffer, const FlowAlgorithmParams *params);
+static void computeTimeSurface(FlowEvent e, int64_t t, FlowEventBuffer buffer, const FlowAlgorithmParams *params);
+static void computeBlockMatching(FlowEvent e, int64_t t, FlowEventBuffer buffer, const FlowAlgorithmParams *params);
+static uint16_t radiusBenosman2014(const FlowAlgorithmParams *params);
+static uint16_t radiusTimeSurface(const FlowAlgorithmParams *params);
+static uint16_t radiusBlockMatching(const FlowAlgorithmParams *params);
+
+struct flow_algorithm_functions {
+	const char *name;
+	void (*compute)(FlowEvent e, int64_t t, FlowEventBuffer buffer, const FlowAlgorithmParams *params);
+	uint16_t (*radius)(const FlowAlgorithmParams *params);
+};
+
+static const struct flow_algorithm_functions flowAlgorithms[FLOW_ALGORITHM_NUMBER] = {
+	[FLOW_ALGORITHM_BENOSMAN2014] = { "benosman2014", &computeBenosman2014, &radiusBenosman2014 },
+	[FLOW_ALGORITHM_TIME_SURFACE] = { "timesurface", &computeTimeSurface, &radiusTimeSurface },
+	[FLOW_ALGORITHM_BLOCK_MATCHING] = { "blockmatching", &computeBlockMatching, &radiusBlockMatching },
+};
+
+bool flowAlgorithmFromName(const char *name, FlowAlgorithm *algorithm) {
+	for (size_t i = 0; i < FLOW_ALGORITHM_NUMBER; i++) {
+		if (strcmp(name, flowAlgorithms[i].name) == 0) {
+			*algorithm = (FlowAlgorithm) i;
+			return (true);
+		}
+	}
+
+	return (false);
+}
+
+const char *flowAlgorithmName(FlowAlgorithm algorithm) {
+	return (flowAlgorithms[algorithm].name);
+}
+
+void flowAlgorithmCompute(FlowAlgorithm algorithm, FlowEvent e, int64_t t, FlowEventBuffer buffer,
+	const FlowAlgorithmParams *params) {
+	flowAlgorithms[algorithm].compute(e, t, buffer, params);
+}
+
+uint16_t flowAlgorithmRadius(FlowAlgorithm algorithm, const FlowAlgorithmParams *params) {
+	return (flowAlgorithms[algorithm].radius(params));
+}
+
+void flowBenchmarkAdd(struct flow_benchmark *benchmark, const struct flow_event *reference,
+	const struct flow_event *e, int64_t referenceTime, int64_t algorithmTime) {
+	benchmark->events++;
+	benchmark->referenceTime += referenceTime;
+	benchmark->algorithmTime += algorithmTime;
+
+	if (reference->hasFlow) {
+		benchmark->referenceFlows++;
+	}
+	if (e->hasFlow) {
+		benchmark->algorithmFlows++;
+	}
+	if (!reference->hasFlow || !e->hasFlow) {
+		return;
+	}
+
+	benchmark->bothFlows++;
+
+	double uRef = (double) reference->u;
+	double vRef = (double) reference->v;
+	double u = (double) e->u;
+	double v = (double) e->v;
+	double magnitudeRef = sqrt(uRef*uRef + vRef*vRef);
+	double magnitude = sqrt(u*u + v*v);
+
+	if (magnitudeRef > 0) {
+		benchmark->relativeError += sqrt((u-uRef)*(u-uRef) + (v-vRef)*(v-vRef)) / magnitudeRef;
+	}
+	if (magnitudeRef > 0 && magnitude > 0) {
+		double cosAngle = (u*uRef + v*vRef) / (magnitude * magnitudeRef);
+		cosAngle = (cosAngle > 1) ? (1) : ((cosAngle < -1) ? (-1) : (cosAngle));
+		benchmark->angularError += acos(cosAngle) * 180.0 / M_PI;
+	}
+}
+
+void flowBenchmarkMerge(struct flow_benchmark *total, const struct flow_benchmark *part) {
+	total->events += part->events;
+	total->referenceFlows += part->referenceFlows;
+	total->algorithmFlows += part->algorithmFlows;
+	total->bothFlows += part->bothFlows;
+	total->relativeError += part->relativeError;
+	total->angularError += part->angularError;
+	total->algorithmTime += part->algorithmTime;
+	total->referenceTime += part->referenceTime;
+}
+
+static void computeBenosman2014(FlowEvent e, int64_t t, FlowEventBuffer buffer, const FlowAlgorithmParams *params) {
+	flowBenosman2014(e, t, buffer, params->benosman2014);
+}
+
+static void computeTimeSurface(FlowEvent e, int64_t t, FlowEventBuffer buffer, const FlowAlgorithmParams *params) {
+	flowTimeSurface(e, t, buffer, params->timeSurface);
+}
+
+static void computeBlockMatching(FlowEvent e, int64_t t, FlowEventBuffer buffer, const FlowAlgorithmParams *params) {
+	flowBlockMatching(e, t, buffer, params->blockMatching);
+}
+
+static uint16_t radiusBenosman2014(const FlowAlgorithmParams *params) {
+	return (params->benosman2014.dx / 2);
+}
+
+static uint16_t radiusTimeSurface(const FlowAlgorithmParams *params) {
+	UNUSED_ARGUMENT(params);
+	return (1);
+}
+
+static uint16_t radiusBlockMatching(const FlowAlgorithmParams *params) {
+	return ((uint16_t) (params->blockMatching.blockRadius + params->blockMatching.searchRadius));
+}
@@ -0,0 +1,85 @@
+/*
+ * flowAlgorithm.h
+ *
+ * Runtime selection of the optic flow algorithm. All algorithms work on the
+ * same flow event buffer, and assign flow to the new event, or leave it
+ * without. To add one, give it its own parameters here, and an entry in the
+ * table in flowAlgorithm.c.
+ */
+
+#ifndef FLOWALGORITHM_H_
+#define FLOWALGORITHM_H_
+
+#include "flowEvent.h"
+#include "flowBenosman2014.h"
+#include "flowTimeSurface.h"
+#include "flowBlockMatching.h"
+
+typedef enum {
+	FLOW_ALGORITHM_BENOSMAN2014,
+	FLOW_ALGORITHM_TIME_SURFACE,
+	FLOW_ALGORITHM_BLOCK_MATCHING,
+	FLOW_ALGORITHM_NUMBER
+} FlowAlgorithm;
+
+/**
+ * Parameters of all algorithms, so switching keeps them.
+ */
+typedef struct {
+	FlowBenosman2014Params benosman2014;
+	FlowTimeSurfaceParams timeSurface;
+	FlowBlockMatchingParams blockMatching;
+} FlowAlgorithmParams;
+
+/**
+ * Accuracy and cost of an algorithm against the reference, flowBenosman2014(),
+ * over the events both were run on.
+ */
+struct flow_benchmark {
+	int64_t events;
+	/// Events with flow from the reference, the algorithm, and both.
+	int64_t referenceFlows;
+	int64_t algorithmFlows;
+	int64_t bothFlows;
+	/// Sums over the events with flow from both: endpoint error relative
+	/// to the reference's magnitude, and angle between them (degrees).
+	double relativeError;
+	double angularError;
+	/// Time spent in the algorithm and the reference (ns).
+	int64_t algorithmTime;
+	int64_t referenceTime;
+};
+
+/**
+ * Algorithm from its configuration name ("benosman2014", "timesurface" or
+ * "blockmatching"). Returns false if there is no such algorithm.
+ */
+bool flowAlgorithmFromName(const char *name, FlowAlgorithm *algorithm);
+
+const char *flowAlgorithmName(FlowAlgorithm algorithm);
+
+/**
+ * Compute the flow of the new event e, with full timestamp t, from the
+ * events in the buffer (not including e yet).
+ */
+void flowAlgorithmCompute(FlowAlgorithm algorithm, FlowEvent e, int64_t t, FlowEventBuffer buffer,
+	const FlowAlgorithmParams *params);
+
+/**
+ * How many pixels away from the new event the algorithm looks, at most.
+ */
+uint16_t flowAlgorithmRadius(FlowAlgorithm algorithm, const FlowAlgorithmParams *params);
+
+/**
+ * Add one event to a benchmark: the flow the algorithm assigned to e, and
+ * the reference to it, with the time each took (ns).
+ */
+void flowBenchmarkAdd(struct flow_benchmark *benchmark, const struct flow_event *reference,
+	const struct flow_event *e, int64_t referenceTime, int64_t algorithmTime);
+
+/**
+ * Add up benchmark results, e.g. of the tiles.
+ */
+void flowBenchmarkMerge(struct flow_benchmark *total, const struct flow_benchmark *part);
+
+#endif /* FLOWALGORITHM_H_ */
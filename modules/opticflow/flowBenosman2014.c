@@ -14,30 +14,290 @@
 #include <math.h>
 #include "flowEvent.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+	#define FLOW_X86_SIMD 1
+#endif
+
 #define MAX_NUMBER_OF_EVENTS 100
 #define DBL_ZERO_EPSILON 1.0E-10
 #define FLOW_PIX_PER_SECOND 1e6
 
-void flowBenosman2014(FlowEvent e, FlowEventBuffer buffer,
+// The plane fit works on blocks of 8 floats: one AVX register, or two SSE/NEON ones.
+#define FLOW_FIT_LANES 8
+#define FLOW_FIT_CAPACITY (((MAX_NUMBER_OF_EVENTS + FLOW_FIT_LANES - 1) / FLOW_FIT_LANES) * FLOW_FIT_LANES)
+
+typedef float flowFitVector __attribute__((vector_size(FLOW_FIT_LANES * sizeof(float))));
+typedef int32_t flowFitMask __attribute__((vector_size(FLOW_FIT_LANES * sizeof(int32_t))));
+typedef float flowFitHalfVector __attribute__((vector_size(FLOW_FIT_LANES / 2 * sizeof(float))));
+
+/**
+ * Neighborhood events used for the plane fit, relative to the new event
+ * (which is the first point), so they fit in a float without precision
+ * loss. 'w' is 1 for points in the fit, 0 for rejected and padding ones.
+ */
+struct flow_fit_points {
+	float x[FLOW_FIT_CAPACITY] __attribute__((aligned(32)));
+	float y[FLOW_FIT_CAPACITY] __attribute__((aligned(32)));
+	float t[FLOW_FIT_CAPACITY] __attribute__((aligned(32)));
+	float w[FLOW_FIT_CAPACITY] __attribute__((aligned(32)));
+	size_t blocks;
+	double x0, y0;
+};
+
+static bool flowPlaneFit(struct flow_fit_points *points, FlowBenosman2014Params params, double *a, double *b);
+static bool flowPlaneFitGeneric(struct flow_fit_points *points, FlowBenosman2014Params params, double *a,
+	double *b);
+#if defined(FLOW_X86_SIMD)
+static bool flowPlaneFitAVX2(struct flow_fit_points *points, FlowBenosman2014Params params, double *a, double *b);
+#endif
+
+void flowBenosman2014(FlowEvent e, int64_t t, FlowEventBuffer buffer,
+		FlowBenosman2014Params params) {
+	uint16_t x = caerPolarityEventGetX((caerPolarityEvent) e);
+	uint16_t y = caerPolarityEventGetY((caerPolarityEvent) e);
+	uint8_t  p = caerPolarityEventGetPolarity((caerPolarityEvent) e);
+	uint16_t xMin, xMax;
+	flowEventBufferClampX(buffer, x, params.dx/2, &xMin, &xMax);
+	uint16_t yMin = (uint16_t) (y - params.dx/2);
+	uint16_t yMax = (uint16_t) (y + params.dx/2);
+
+	// Bounds checking
+	if (yMin > buffer->sizeY-1) {
+		yMin = 0; // In case of uint, cannot be zero.
+	}
+	if (yMax > buffer->sizeY-1) {
+		yMax = (uint16_t) (buffer->sizeY-1);
+	}
+
+	struct flow_fit_points points;
+	points.x0 = x;
+	points.y0 = y;
+	points.x[0] = 0;
+	points.y[0] = 0;
+	points.t[0] = 0;
+
+	// Gather the events of the same polarity within [dtMin, dtMax]. They are
+	// always written, but only kept (n advanced) if they qualify. Older slots
+	// of a pixel can only be older still, so there is no need to stop early.
+	size_t n = 1;
+	for (uint16_t xx = xMin; xx < xMax+1; xx++) {
+		for (uint16_t yy = yMin; yy < yMax+1; yy++) {
+			size_t pixel = flowEventBufferPixel(buffer,xx,yy);
+			for (size_t i = 0; i < buffer->size; i++) {
+				size_t slot = flowEventBufferSlot(buffer,pixel,i);
+				int64_t dt = t - buffer->timestamp[slot];
+
+				points.x[n] = (float) (xx - x);
+				points.y[n] = (float) (yy - y);
+				points.t[n] = (float) -dt;
+				n += (buffer->polarity[slot] == p) & (dt <= params.dtMax) & (dt >= params.dtMin)
+					& (n < MAX_NUMBER_OF_EVENTS);
+			}
+		}
+	}
+	// Conditioning
+	if (n < 3) { // insufficient events
+		return;
+	}
+
+	// Pad to full blocks with points that have no weight.
+	points.blocks = (n + FLOW_FIT_LANES - 1) / FLOW_FIT_LANES;
+	for (size_t i = 0; i < points.blocks * FLOW_FIT_LANES; i++) {
+		points.w[i] = (i < n) ? (1.0f) : (0.0f);
+	}
+	for (size_t i = n; i < points.blocks * FLOW_FIT_LANES; i++) {
+		points.x[i] = 0;
+		points.y[i] = 0;
+		points.t[i] = 0;
+	}
+
+	double a, b;
+	if (!flowPlaneFit(&points, params, &a, &b)) {
+		return;
+	}
+
+	// Compute velocity
+	double scaleFactor = -1.0/(a*a+b*b);
+	double u = scaleFactor*a;
+	double v = scaleFactor*b;
+	// Check for NaN value
+	if (isnan(u) || isnan(v)) {
+		return;
+	}
+
+	// Reject if magnitude is too large
+	if (1.0/sqrt(u*u+v*v) < (double) params.dtMin) {
+		return;
+	}
+
+	// Assign flow to event in pixels per second (instead of pix/us)
+	e->u = (float) (u * FLOW_PIX_PER_SECOND);
+	e->v = (float) (v * FLOW_PIX_PER_SECOND);
+	e->hasFlow = true;
+}
+
+static bool flowPlaneFit(struct flow_fit_points *points, FlowBenosman2014Params params, double *a, double *b) {
+#if defined(FLOW_X86_SIMD)
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		return (flowPlaneFitAVX2(points, params, a, b));
+	}
+#endif
+
+	return (flowPlaneFitGeneric(points, params, a, b));
+}
+
+/**
+ * Solve the least squares plane from the sums, see flowBenosman2014.h.
+ * Returns false if the system is singular or there are too few points.
+ */
+static inline bool flowPlaneSolve(const double s[9], double *a, double *b, double *d) {
+	double n = s[0], sx = s[1], sy = s[2], st = s[3], sxy = s[4], sxt = s[5], syt = s[6], sx2 = s[7], sy2 = s[8];
+
+	// Conditioning
+	if (n < 3) { // insufficient events
+		return (false);
+	}
+
+	// Compute determinant and check invertibility
+	double D = n*sx2*sy2 - sy2*sx*sx + 2*sx*sxy*sy - n*sxy*sxy - sx2*sy*sy;
+	if (fabs(D) < DBL_ZERO_EPSILON) { // determinant too small: singular system
+		return (false);
+	}
+
+	double invD = 1/D;
+	*a = invD*(syt*(n*sxy - sx*sy) - sxt*(- sy*sy + n*sy2) + st*(sx*sy2 - sxy*sy));
+	*b = invD*(sxt*(n*sxy - sx*sy) - syt*(- sx*sx + n*sx2) - st*(sx*sxy - sx2*sy));
+	*d = invD*(sxt*(sx*sy2 - sxy*sy) - st*(- sxy*sxy + sx2*sy2) - syt*(sx*sxy - sx2*sy));
+
+	return (true);
+}
+
+/**
+ * Least squares sums over all weighted points, accumulated per lane
+ * in float, then added up in double.
+ */
+static inline __attribute__((always_inline)) void flowPlaneSums(const struct flow_fit_points *points, double s[9]) {
+	flowFitVector acc[9] = { { 0 } };
+
+	for (size_t i = 0; i < points->blocks * FLOW_FIT_LANES; i += FLOW_FIT_LANES) {
+		flowFitVector x, y, t, w;
+		memcpy(&x, &points->x[i], sizeof(x));
+		memcpy(&y, &points->y[i], sizeof(y));
+		memcpy(&t, &points->t[i], sizeof(t));
+		memcpy(&w, &points->w[i], sizeof(w));
+
+		flowFitVector wx = w * x;
+		flowFitVector wy = w * y;
+
+		acc[0] += w;
+		acc[1] += wx;
+		acc[2] += wy;
+		acc[3] += w * t;
+		acc[4] += wx * y;
+		acc[5] += wx * t;
+		acc[6] += wy * t;
+		acc[7] += wx * x;
+		acc[8] += wy * y;
+	}
+
+	// Add up the lanes pairwise, as a tree: short dependency chains.
+	for (size_t k = 0; k < 9; k++) {
+		flowFitHalfVector low, high;
+		memcpy(&low, &acc[k], sizeof(low));
+		memcpy(&high, ((const float *) &acc[k]) + (FLOW_FIT_LANES / 2), sizeof(high));
+
+		flowFitHalfVector half = low + high;
+		s[k] = (double) ((half[0] + half[2]) + (half[1] + half[3]));
+	}
+}
+
+/**
+ * Plane fit with iterative outlier rejection, as in flowBenosman2014Scalar(),
+ * but on whole blocks of points at once: a rejected point gets weight 0,
+ * and the sums are recomputed. The new event itself is never rejected.
+ */
+static inline __attribute__((always_inline)) bool flowPlaneFitBody(struct flow_fit_points *points,
+	FlowBenosman2014Params params, double *aOut, double *bOut) {
+	double s[9];
+	double a, b, d;
+
+	flowPlaneSums(points, s);
+	if (!flowPlaneSolve(s, &a, &b, &d)) {
+		return (false);
+	}
+
+	// Iterative outlier rejection
+	double eps = 1.0E6;
+	while (eps > params.thr1) {
+		flowFitVector va = (flowFitVector) { 0 } + (float) a;
+		flowFitVector vb = (flowFitVector) { 0 } + (float) b;
+		flowFitVector vd = (flowFitVector) { 0 } + (float) d;
+		flowFitVector thr2 = (flowFitVector) { 0 } + (float) params.thr2;
+
+		for (size_t i = 0; i < points->blocks * FLOW_FIT_LANES; i += FLOW_FIT_LANES) {
+			flowFitVector x, y, t, w;
+			memcpy(&x, &points->x[i], sizeof(x));
+			memcpy(&y, &points->y[i], sizeof(y));
+			memcpy(&t, &points->t[i], sizeof(t));
+			memcpy(&w, &points->w[i], sizeof(w));
+
+			// |residual| by clearing the sign bit.
+			flowFitVector r = (va * x) + (vb * y) + t + vd;
+			r = (flowFitVector) ((flowFitMask) r & 0x7FFFFFFF);
+
+			w = (flowFitVector) ((flowFitMask) w & ~(r > thr2));
+			memcpy(&points->w[i], &w, sizeof(w));
+		}
+		points->w[0] = 1.0f;
+
+		double aNew, bNew, dNew;
+		flowPlaneSums(points, s);
+		if (!flowPlaneSolve(s, &aNew, &bNew, &dNew)) {
+			return (false);
+		}
+
+		// Update improvement. The offset d is measured at the sensor origin, as
+		// in the reference, which makes the criterion depend on the position.
+		double dDiff = (dNew - d) - ((aNew - a) * points->x0) - ((bNew - b) * points->y0);
+		eps = sqrt((aNew-a)*(aNew-a) + (bNew-b)*(bNew-b) + dDiff*dDiff);
+		a = aNew;
+		b = bNew;
+		d = dNew;
+	}
+
+	*aOut = a;
+	*bOut = b;
+
+	return (true);
+}
+
+static bool flowPlaneFitGeneric(struct flow_fit_points *points, FlowBenosman2014Params params, double *a,
+	double *b) {
+	return (flowPlaneFitBody(points, params, a, b));
+}
+
+#if defined(FLOW_X86_SIMD)
+
+__attribute__((target("avx2,fma"))) static bool flowPlaneFitAVX2(struct flow_fit_points *points,
+	FlowBenosman2014Params params, double *a, double *b) {
+	return (flowPlaneFitBody(points, params, a, b));
+}
+
+#endif
+
+void flowBenosman2014Scalar(FlowEvent e, int64_t t, FlowEventBuffer buffer,
 		FlowBenosman2014Params params) {
-	int64_t  t = e->timestamp;
 	uint16_t x = caerPolarityEventGetX((caerPolarityEvent) e);
 	uint16_t y = caerPolarityEventGetY((caerPolarityEvent) e);;
 	bool 	 p = (bool) caerPolarityEventGetPolarity((caerPolarityEvent) e);
-	uint16_t xMin = (uint16_t) (x - params.dx/2);
-	uint16_t xMax = (uint16_t) (x + params.dx/2);
+	uint16_t xMin, xMax;
+	flowEventBufferClampX(buffer, x, params.dx/2, &xMin, &xMax);
 	uint16_t yMin = (uint16_t) (y - params.dx/2);
 	uint16_t yMax = (uint16_t) (y + params.dx/2);
 
 	// Bounds checking
-	if (xMin > buffer->sizeX-1) {
-		xMin = 0; // In case of uint, cannot be zero.
-	}
 	if (yMin > buffer->sizeY-1) {
-		yMin = 0;
-	}
-	if (xMax > buffer->sizeX-1) {
-		xMax = (uint16_t) (buffer->sizeX-1);
+		yMin = 0; // In case of uint, cannot be zero.
 	}
 	if (yMax > buffer->sizeY-1) {
 		yMax = (uint16_t) (buffer->sizeY-1);
@@ -65,16 +325,17 @@ void flowBenosman2014(FlowEvent e, FlowEventBuffer buffer,
 	uint16_t xx,yy,i;
 	for (xx = xMin; xx < xMax+1; xx++) {
 		for (yy = yMin; yy < yMax+1; yy++) {
+			size_t pixel = flowEventBufferPixel(buffer,xx,yy);
 			for (i = 0; i < (uint16_t) buffer->size; i++) {
 				if (n >= MAX_NUMBER_OF_EVENTS) {
 					break;
 				}
-				FlowEvent eB = flowEventBufferRead(buffer,xx,yy,i);
-				bool pB = (bool) caerPolarityEventGetPolarity((caerPolarityEvent) eB);
+				size_t slot = flowEventBufferSlot(buffer,pixel,i);
+				bool pB = buffer->polarity[slot];
 				if (pB != p) {
 					continue;
 				}
-				int64_t tt = eB->timestamp;
+				int64_t tt = buffer->timestamp[slot];
 				int64_t dt = t - tt;
 				if (dt > params.dtMax) {
 					break;
@@ -172,7 +433,7 @@ void flowBenosman2014(FlowEvent e, FlowEventBuffer buffer,
 	}
 
 	// Assign flow to event in pixels per second (instead of pix/us)
-	e->u = u * FLOW_PIX_PER_SECOND;
-	e->v = v * FLOW_PIX_PER_SECOND;
+	e->u = (float) (u * FLOW_PIX_PER_SECOND);
+	e->v = (float) (v * FLOW_PIX_PER_SECOND);
 	e->hasFlow = true;
 }
@@ -36,8 +36,19 @@ typedef struct {
  * and
  *  	A'*t = [sxt; syt; st]
  * are precomputed. Thus, when an outlier is to be rejected, we only decrement the sum values.
+ *
+ * The event's full timestamp is passed as 't', see flowEventGetTimestamp64().
+ */
+void flowBenosman2014(FlowEvent e, int64_t t, FlowEventBuffer buffer,
+		FlowBenosman2014Params params);
+
+/**
+ * Same as flowBenosman2014(), computed one event at a time in double precision.
+ * The fast version fits the plane on blocks of events, in float, so its results
+ * can differ slightly (and flip the decision on points right at the thresholds).
+ * This one is kept as the reference to validate it against.
  */
-void flowBenosman2014(FlowEvent e, FlowEventBuffer buffer,
+void flowBenosman2014Scalar(FlowEvent e, int64_t t, FlowEventBuffer buffer,
 		FlowBenosman2014Params params);
 
 #endif /* FLOWBENOSMAN2014_H_ */
@@ -0,0 +1,193 @@
+/*
+ * flowBlockMatching.c
+ *
+ * Optic flow by matching blocks between time slices.
+ */
+
+#include "flowBlockMatching.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+	#define FLOW_X86_POPCNT 1
+#endif
+
+#define FLOW_PIX_PER_SECOND 1e6f
+#define FLOW_BLOCK_MATCHING_WINDOW (2 * FLOW_BLOCK_MATCHING_MAX_RADIUS + 1)
+
+static inline uint32_t sliceRowBits(const uint64_t *row, size_t words, int32_t first, int32_t width);
+static bool blockSearch(const uint32_t *recent, const uint32_t *older, FlowBlockMatchingParams params,
+	int32_t *dx, int32_t *dy);
+static bool blockSearchGeneric(const uint32_t *recent, const uint32_t *older, FlowBlockMatchingParams params,
+	int32_t *dx, int32_t *dy);
+#if defined(FLOW_X86_POPCNT)
+static bool blockSearchPopcnt(const uint32_t *recent, const uint32_t *older, FlowBlockMatchingParams params,
+	int32_t *dx, int32_t *dy);
+#endif
+static inline int32_t blockDistance(const uint32_t *recent, const uint32_t *older, uint32_t blockMask,
+	int32_t firstRow, int32_t lastRow, int32_t dx, int32_t dy, int32_t bound);
+
+void flowBlockMatching(FlowEvent e, int64_t t, FlowEventBuffer buffer,
+		FlowBlockMatchingParams params) {
+	int32_t x = caerPolarityEventGetX((caerPolarityEvent) e);
+	int32_t y = caerPolarityEventGetY((caerPolarityEvent) e);
+
+	int32_t blockRadius = params.blockRadius;
+	int32_t searchRadius = params.searchRadius;
+	int32_t radius = blockRadius + searchRadius;
+	if (radius > FLOW_BLOCK_MATCHING_MAX_RADIUS) {
+		return;
+	}
+
+	if (buffer->slices == NULL || buffer->sliceTime != params.sliceTime) {
+		if (!flowEventBufferInitSlices(buffer, params.sliceTime)) {
+			return;
+		}
+	}
+	flowEventBufferRotateSlices(buffer, t);
+
+	// Window around the event, in the last two full slices: row r is
+	// y - radius + r, bit c is x - radius + c.
+	uint32_t recent[FLOW_BLOCK_MATCHING_WINDOW] = { 0 };
+	uint32_t older[FLOW_BLOCK_MATCHING_WINDOW] = { 0 };
+	int32_t firstColumn = x - (int32_t) buffer->firstX - radius;
+
+	for (int32_t r = 0; r <= 2 * radius; r++) {
+		int32_t yy = y - radius + r;
+		if (yy < 0 || yy >= (int32_t) buffer->sizeY) {
+			continue;
+		}
+
+		recent[r] = sliceRowBits(flowEventBufferSliceRow(buffer, 1, (uint16_t) yy), buffer->sliceWords,
+			firstColumn, 2 * radius + 1);
+		older[r] = sliceRowBits(flowEventBufferSliceRow(buffer, 2, (uint16_t) yy), buffer->sliceWords,
+			firstColumn, 2 * radius + 1);
+	}
+
+	int32_t dx, dy;
+	if (!blockSearch(recent, older, params, &dx, &dy)) {
+		return;
+	}
+
+	// Assign flow to event in pixels per second (instead of pix/us)
+	float scale = FLOW_PIX_PER_SECOND / (float) params.sliceTime;
+	e->u = (float) dx * scale;
+	e->v = (float) dy * scale;
+	e->hasFlow = true;
+}
+
+static bool blockSearch(const uint32_t *recent, const uint32_t *older, FlowBlockMatchingParams params,
+	int32_t *dx, int32_t *dy) {
+#if defined(FLOW_X86_POPCNT)
+	if (__builtin_cpu_supports("popcnt")) {
+		return (blockSearchPopcnt(recent, older, params, dx, dy));
+	}
+#endif
+
+	return (blockSearchGeneric(recent, older, params, dx, dy));
+}
+
+/**
+ * Find the displacement d with recent(p) = older(p - d) best, in the
+ * windows around the event. Returns false if there are too few events, or
+ * the best displacement is zero. Ties go to the shortest displacement,
+ * e.g. along an edge.
+ */
+static inline __attribute__((always_inline)) bool blockSearchBody(const uint32_t *recent, const uint32_t *older,
+	FlowBlockMatchingParams params, int32_t *dxOut, int32_t *dyOut) {
+	int32_t blockRadius = params.blockRadius;
+	int32_t searchRadius = params.searchRadius;
+	int32_t radius = blockRadius + searchRadius;
+
+	// Block columns, at the center of the window. The block may have come
+	// from anywhere in the window.
+	uint32_t blockMask = ((1U << (2 * blockRadius + 1)) - 1) << searchRadius;
+
+	int32_t recentEvents = 0;
+	int32_t olderEvents = 0;
+	for (int32_t r = 0; r <= 2 * radius; r++) {
+		if (r >= searchRadius && r <= radius + blockRadius) {
+			recentEvents += __builtin_popcount(recent[r] & blockMask);
+		}
+		olderEvents += __builtin_popcount(older[r]);
+	}
+	if (recentEvents < params.minEvents || olderEvents < params.minEvents) {
+		return (false);
+	}
+
+	int32_t bestDistance = blockDistance(recent, older, blockMask, searchRadius, radius + blockRadius, 0, 0,
+		INT32_MAX);
+	int32_t bestDx = 0;
+	int32_t bestDy = 0;
+	for (int32_t dy = -searchRadius; dy <= searchRadius; dy++) {
+		for (int32_t dx = -searchRadius; dx <= searchRadius; dx++) {
+			if (dx == 0 && dy == 0) {
+				continue;
+			}
+
+			int32_t distance = blockDistance(recent, older, blockMask, searchRadius, radius + blockRadius, dx,
+				dy, bestDistance + 1);
+			if (distance < bestDistance
+				|| (distance == bestDistance && abs(dx) + abs(dy) < abs(bestDx) + abs(bestDy))) {
+				bestDistance = distance;
+				bestDx = dx;
+				bestDy = dy;
+			}
+		}
+	}
+
+	*dxOut = bestDx;
+	*dyOut = bestDy;
+
+	return (bestDx != 0 || bestDy != 0);
+}
+
+static bool blockSearchGeneric(const uint32_t *recent, const uint32_t *older, FlowBlockMatchingParams params,
+	int32_t *dx, int32_t *dy) {
+	return (blockSearchBody(recent, older, params, dx, dy));
+}
+
+#if defined(FLOW_X86_POPCNT)
+
+__attribute__((target("popcnt"))) static bool blockSearchPopcnt(const uint32_t *recent, const uint32_t *older,
+	FlowBlockMatchingParams params, int32_t *dx, int32_t *dy) {
+	return (blockSearchBody(recent, older, params, dx, dy));
+}
+
+#endif
+
+/**
+ * Bits first to first + width - 1 (width < 32) of a slice row, as the low
+ * bits of the result. Columns outside the row are empty.
+ */
+static inline uint32_t sliceRowBits(const uint64_t *row, size_t words, int32_t first, int32_t width) {
+	if (first < 0) {
+		return ((width + first > 0) ? (sliceRowBits(row, words, 0, width + first) << -first) : (0));
+	}
+
+	size_t word = (size_t) first / 64;
+	uint32_t shift = (uint32_t) first % 64;
+
+	uint64_t bits = (word < words) ? (row[word] >> shift) : (0);
+	if (shift > 0 && word + 1 < words) {
+		bits |= row[word + 1] << (64 - shift);
+	}
+
+	return ((uint32_t) (bits & ((UINT64_C(1) << width) - 1)));
+}
+
+/**
+ * Number of differing pixels between the block in the recent slice and the
+ * block displaced by (dx,dy) in the older one. Stops once it reaches
+ * bound, as the result can then no longer be the best.
+ */
+static inline __attribute__((always_inline)) int32_t blockDistance(const uint32_t *recent, const uint32_t *older,
+	uint32_t blockMask, int32_t firstRow, int32_t lastRow, int32_t dx, int32_t dy, int32_t bound) {
+	int32_t distance = 0;
+
+	for (int32_t r = firstRow; r <= lastRow && distance < bound; r++) {
+		// Bit c of the older row goes to c + dx.
+		uint32_t shifted = (dx >= 0) ? (older[r - dy] << dx) : (older[r - dy] >> -dx);
+		distance += __builtin_popcount((recent[r] ^ shifted) & blockMask);
+	}
+
+	return (distance);
+}
@@ -0,0 +1,48 @@
+/*
+ * flowBlockMatching.h
+ *
+ * Optic flow by matching blocks between time slices, in the style of the
+ * adaptive block-matching optical flow (ABMOF) of Liu and Delbruck (2018).
+ */
+
+#ifndef FLOWBLOCKMATCHING_H_
+#define FLOWBLOCKMATCHING_H_
+
+#include "flowEvent.h"
+
+/// Block radius plus search radius, so the window fits 32-bit rows.
+#define FLOW_BLOCK_MATCHING_MAX_RADIUS 15
+
+/**
+ * Parameters of the block matching algorithm.
+ */
+typedef struct {
+	/// Duration of a time slice (µs).
+	int64_t sliceTime;
+	/// Block of (2*blockRadius+1)^2 pixels around the event.
+	uint16_t blockRadius;
+	/// Displacements of up to searchRadius pixels are tried.
+	uint16_t searchRadius;
+	/// Events needed in both slices to match.
+	uint16_t minEvents;
+} FlowBlockMatchingParams;
+
+/**
+ * The buffer bins all events, of both polarities, into binary images of
+ * consecutive time slices (see flowEventBufferInitSlices(), this sets them
+ * up on first use). While the current slice fills, the event's block in the
+ * previous slice is compared to the displaced blocks in the one before, by
+ * the number of differing pixels (sum of absolute differences of binary
+ * images). The best displacement, over sliceTime, is the flow. Rows of the
+ * images are bit masks, so a comparison is a few XORs and population counts,
+ * and no events need to be looked up per pixel.
+ *
+ * Flow is quantized to 1 px per sliceTime, and is up to one slice late;
+ * none is assigned if the best displacement is zero, or there are fewer
+ * than minEvents events in the block (in the older slice, in the whole
+ * search window). Ties go to the shortest displacement.
+ */
+void flowBlockMatching(FlowEvent e, int64_t t, FlowEventBuffer buffer,
+		FlowBlockMatchingParams params);
+
+#endif /* FLOWBLOCKMATCHING_H_ */
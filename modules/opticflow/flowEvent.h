@@ -3,28 +3,31 @@
 
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 #include "main.h"
 #include <libcaer/events/polarity.h>
 
 #define FLOW_EVENT_TYPE 101
+#define FLOW_EVENT_BUFFER_SLICES 3
 
 /**
  * The flow event is a custom event type that 'extends' the polarity
- * event type defined in libcaer, having address/timestamp data.
- * Hence, all basic get/set functions for the polarity event work equally
- * for this new event type.
- *
- * Note that the timestamp in this variable is 64 bits.
+ * event type defined in libcaer: its first 8 bytes, address and 32-bit
+ * timestamp, are laid out exactly like a polarity event. Hence, all basic
+ * get/set functions for the polarity event work equally for this new
+ * event type, and the 64-bit timestamp comes from the packet header's
+ * timestamp overflow, like for any libcaer event.
  *
  * It is augmented with three variables:
- * - u,v, which indicate horizontal/vertical optical flow speed
+ * - u,v, which indicate horizontal/vertical optical flow speed (px/s)
  * - hasFlow, a flag indicating that flow has been assigned to this event.
  */
 struct flow_event {
 	uint32_t data;
-	int64_t timestamp;
-	double u,v;
-	bool hasFlow;
+	int32_t timestamp;
+	float u,v;
+	uint8_t hasFlow;
 }__attribute__((__packed__));
 
 /**
@@ -33,16 +36,16 @@ struct flow_event {
 typedef struct flow_event *FlowEvent;
 
 /**
- * Similar to a polarity event packet, a flow event packet contains a
- * packet header, and a container of the events.
- * The flow event packet is hence compatible with existing functions
- * in the visualizer and in libcaer
+ * Like a polarity event packet, a flow event packet is a packet header
+ * directly followed by its events, in one block of memory. It can thus
+ * be copied, freed, and sent through the output and input modules like
+ * any libcaer event packet.
  */
 struct flow_event_packet {
 	/// The common event packet header.
 	struct caer_event_packet_header packetHeader;
 	/// The events array.
-	struct flow_event* events;
+	struct flow_event events[];
 }__attribute__((__packed__));
 
 /**
@@ -54,13 +57,44 @@ typedef struct flow_event_packet *FlowEventPacket;
  * The flow event buffer stores full event data for use with optic
  * flow computation algorithms. It stores data not only in x/y, but
  * also allows storing multiple sequential events at a position.
+ *
+ * Each field is kept in its own contiguous array (structure of arrays),
+ * with the 'size' history slots of a pixel next to each other, and pixels
+ * ordered by x, then y. Every pixel has a ring head pointing to its most
+ * recent event, so adding an event only moves the head back by one slot.
+ * Scanning a neighborhood thus reads memory linearly.
+ *
+ * Flow is stored as magnitude and unit direction, computed once when the
+ * event is added, so that comparing neighboring flow vectors needs only
+ * products, no square roots or trigonometry. Slots without flow hold zeros.
+ *
+ * Optionally, the buffer also bins events into binary images of fixed
+ * time slices (see flowEventBufferInitSlices()), for block matching.
+ *
+ * A buffer can also cover only a band of columns of the sensor, starting
+ * at 'firstX'. It is always accessed with sensor coordinates.
  */
 struct flow_event_buffer {
-	struct flow_event*** buffer;
+	int64_t *timestamp;
+	uint8_t *polarity;
+	uint8_t *hasFlow;
+	float *magnitude;
+	float *uHat;
+	float *vHat;
+	uint8_t *head;
+	size_t firstX;
 	size_t sizeX;
 	size_t sizeY;
 	size_t size;
-}__attribute__((__packed__));
+	/// Time slices: FLOW_EVENT_BUFFER_SLICES images of sizeY rows of
+	/// 'sliceWords' words, bit c of a row is column firstX + c. NULL if unused.
+	uint64_t *slices;
+	size_t sliceWords;
+	int64_t sliceTime;
+	/// Slice of the current time, t / sliceTime, and where it is kept.
+	int64_t sliceIndex;
+	size_t sliceCurrent;
+};
 
 /**
  * Pointer to flow event buffer.
@@ -72,10 +106,10 @@ typedef struct flow_event_buffer *FlowEventBuffer;
  *  Flow event initialization. By default, a flow event is not assigned
  *  any optic flow value.
 */
-static inline struct flow_event flowEventInit(uint32_t data, int64_t timestamp) {
+static inline struct flow_event flowEventInit(uint32_t data, int32_t timestamp) {
 	struct flow_event e;
 	e.data = data;
-	e.timestamp = timestamp;
+	caerPolarityEventSetTimestamp((caerPolarityEvent) &e, timestamp);
 	e.u = 0;
 	e.v = 0;
 	e.hasFlow = false;
@@ -85,57 +119,81 @@ static inline struct flow_event flowEventInit(uint32_t data, int64_t timestamp)
 /**
  *  Flow event initialization from an existing polarity event.
 */
-static inline struct flow_event flowEventInitFromPolarity(caerPolarityEvent polarity, caerPolarityEventPacket packet) {
-	uint32_t data = polarity->data;
-	int64_t  timestamp = caerPolarityEventGetTimestamp64(polarity,packet);
-	return (flowEventInit(data,timestamp));
+static inline struct flow_event flowEventInitFromPolarity(caerPolarityEvent polarity) {
+	return (flowEventInit(polarity->data, caerPolarityEventGetTimestamp(polarity)));
 }
 
 /**
  *  Flow event initialization from x,y coordinates, timestamp, and polarity.
 */
 static inline struct flow_event flowEventInitXYTP(uint16_t x, uint16_t y, int32_t t, bool p) {
-	struct flow_event e;
+	struct flow_event e = flowEventInit(0, t);
 	caerPolarityEventSetX((caerPolarityEvent) &e, x);
 	caerPolarityEventSetY((caerPolarityEvent) &e, y);
 	caerPolarityEventSetPolarity((caerPolarityEvent) &e, (_Bool) p);
 	SET_NUMBITS32(e.data, VALID_MARK_SHIFT, VALID_MARK_MASK, 1); // validate event
-	e.timestamp = t;
-	e.u = 0;
-	e.v = 0;
-	e.hasFlow = false;
 	return (e);
 }
 
 /**
- * A flow event packet is for now initialized by copying the content of an
- * existing polarity event packet. This prevents having to adapt the original
- * libcaer definitions, while enabling packet management using existing methods.
+ * Full 64-bit timestamp of a flow event, using the packet's timestamp overflow.
+ */
+static inline int64_t flowEventGetTimestamp64(FlowEvent e, FlowEventPacket packet) {
+	return (caerPolarityEventGetTimestamp64((caerPolarityEvent) e, (caerPolarityEventPacket) packet));
+}
+
+/**
+ * Fill a flow event packet, whose header is already set, with the events of a
+ * polarity event packet. Address and timestamp are copied as they are, flow is
+ * cleared.
+ */
+static inline void flowEventPacketFillFromPolarity(FlowEventPacket flow, const struct caer_polarity_event *events,
+	int32_t eventNumber) {
+	for (int32_t i = 0; i < eventNumber; i++) {
+		FlowEvent e = &flow->events[i];
+		memcpy(e, &events[i], sizeof(struct caer_polarity_event));
+		e->u = 0;
+		e->v = 0;
+		e->hasFlow = false;
+	}
+}
+
+/**
+ * Turn the copied header of a polarity event packet into the header of a flow
+ * event packet holding just its events.
+ */
+static inline void flowEventPacketSetHeaderFromPolarity(FlowEventPacket flow, int32_t eventNumber) {
+	caerEventPacketHeader header = &flow->packetHeader;
+	caerEventPacketHeaderSetEventType(header, FLOW_EVENT_TYPE);
+	caerEventPacketHeaderSetEventSize(header, sizeof(struct flow_event));
+	caerEventPacketHeaderSetEventTSOffset(header, offsetof(struct flow_event, timestamp));
+	caerEventPacketHeaderSetEventCapacity(header, eventNumber);
+}
+
+/**
+ * Allocate a new flow event packet, with the same events as an existing
+ * polarity event packet, which stays untouched. No flow is assigned yet.
+ * Timestamps need no conversion, the timestamp overflow comes along with
+ * the packet header.
  */
 static inline FlowEventPacket flowEventPacketInitFromPolarity(caerPolarityEventPacket polarity) {
 	if (polarity == NULL) {
-		return NULL;
+		return (NULL);
 	}
-	if (polarity->packetHeader.eventNumber == 0) {
-		return NULL;
+
+	int32_t eventNumber = caerEventPacketHeaderGetEventNumber(&polarity->packetHeader);
+	if (eventNumber == 0) {
+		return (NULL);
 	}
 
-	uint64_t eventNumber = (uint64_t) polarity->packetHeader.eventNumber;
-	size_t eventCapacity = (size_t) polarity->packetHeader.eventCapacity;
-	size_t eventSize = sizeof(struct flow_event);
-	FlowEventPacket flow = malloc(sizeof(struct flow_event_packet) + eventCapacity*eventSize);
-
-	flow->packetHeader = polarity->packetHeader; //take same specs of packets
-	flow->events = calloc(eventNumber,sizeof(struct flow_event));
-	uint64_t i;
-	for (i=0; i < eventNumber; i++) {
-		caerPolarityEvent p = caerPolarityEventPacketGetEvent(polarity,(int)i);
-		flow->events[i] = flowEventInitFromPolarity(p, polarity);
+	FlowEventPacket flow = malloc(CAER_EVENT_PACKET_HEADER_SIZE + ((size_t) eventNumber * sizeof(struct flow_event)));
+	if (flow == NULL) {
+		return (NULL);
 	}
 
-	// Adapt packetHeader to make the flow event packet compatible with any modifications
-	caerEventPacketHeaderSetEventType(&(flow->packetHeader),FLOW_EVENT_TYPE);
-	caerEventPacketHeaderSetEventSize(&(flow->packetHeader),sizeof(struct flow_event));
+	memcpy(&flow->packetHeader, &polarity->packetHeader, CAER_EVENT_PACKET_HEADER_SIZE);
+	flowEventPacketSetHeaderFromPolarity(flow, eventNumber);
+	flowEventPacketFillFromPolarity(flow, polarity->events, eventNumber);
 
 	return (flow);
 }
@@ -158,7 +216,7 @@ static inline FlowEvent flowEventPacketGetEvent(FlowEventPacket packet, int32_t
 }
 
 /**
- * Make a copy of a flow event packet.
+ * Make a copy of a flow event packet, with only its valid events.
 */
 static inline FlowEventPacket flowEventPacketCopy(FlowEventPacket flow) {
 	// Handle empty event packets.
@@ -192,10 +250,11 @@ static inline FlowEventPacket flowEventPacketCopy(FlowEventPacket flow) {
 	// Copy the data over. Must check every event for validity!
 	size_t offset = CAER_EVENT_PACKET_HEADER_SIZE;
 
-	int i;
-	for (i = 0; i < eventNumber; i++) {
+	for (int32_t i = 0; i < eventNumber; i++) {
 		FlowEvent e = flowEventPacketGetEvent(flow, i);
-		if (caerPolarityEventIsValid((caerPolarityEvent) e)) continue;
+		if (!caerPolarityEventIsValid((caerPolarityEvent) e)) {
+			continue;
+		}
 		memcpy(((uint8_t *) eventPacketCopy) + offset, e, (size_t) eventSize);
 		offset += (size_t) eventSize;
 	}
@@ -209,104 +268,222 @@ static inline FlowEventPacket flowEventPacketCopy(FlowEventPacket flow) {
 }
 
 /**
- * Free flow event packet memory.
-*/
+ * Free a flow event packet. Being contiguous, it is freed like any event packet.
+ */
 static inline void flowEventPacketFree(FlowEventPacket flow) {
-	if (flow != NULL) {
-		free(flow->events);
-		free(flow);
+	free(flow);
+}
+
+/**
+ * Free the memory of a flow event buffer.
+ */
+static inline void flowEventBufferFree(FlowEventBuffer buffer) {
+	if (buffer != NULL) {
+		free(buffer->timestamp);
+		free(buffer->polarity);
+		free(buffer->hasFlow);
+		free(buffer->magnitude);
+		free(buffer->uHat);
+		free(buffer->vHat);
+		free(buffer->head);
+		free(buffer->slices);
+		free(buffer);
 	}
-	flow = NULL; // make sure that free is not called twice on the same packet
 }
 
 /**
  * Memory allocation and initialization of a flow event buffer.
  * The events in the buffer are initialized with zero timestamp and negative polarity.
+ * At most 255 events can be stored per pixel. The buffer covers the columns
+ * from 'firstX' to 'firstX + width - 1'.
 */
-static inline FlowEventBuffer flowEventBufferInit(size_t width, size_t height, size_t size) {
-	FlowEventBuffer buffer = malloc(sizeof(*buffer) + (width * sizeof(struct flow_event *)));
+static inline FlowEventBuffer flowEventBufferInit(size_t firstX, size_t width, size_t height, size_t size) {
+	if (size == 0 || size > UINT8_MAX) {
+		return (NULL);
+	}
+
+	FlowEventBuffer buffer = calloc(1, sizeof(*buffer));
+	if (buffer == NULL) {
+		return (NULL);
+	}
+
+	buffer->firstX = firstX;
 	buffer->sizeX = width;
 	buffer->sizeY = height;
 	buffer->size = size;
 
-	buffer->buffer = malloc(width * sizeof(double*));
-	uint16_t i,j,k;
-	for (i = 0; i < width; i++) {
-		buffer->buffer [i] = malloc(height * sizeof(double*));
-		for (j = 0; j < height; j++) {
-			buffer->buffer [i][j] = malloc(size * sizeof(struct flow_event));
-			for (k = 0; k < size; k++) {
-				buffer->buffer [i][j][k] = flowEventInitXYTP(i,j,0,false);
-			}
-		}
+	size_t slots = width * height * size;
+	buffer->timestamp = calloc(slots, sizeof(int64_t));
+	buffer->polarity = calloc(slots, sizeof(uint8_t));
+	buffer->hasFlow = calloc(slots, sizeof(uint8_t));
+	buffer->magnitude = calloc(slots, sizeof(float));
+	buffer->uHat = calloc(slots, sizeof(float));
+	buffer->vHat = calloc(slots, sizeof(float));
+	buffer->head = calloc(width * height, sizeof(uint8_t));
+
+	if (buffer->timestamp == NULL || buffer->polarity == NULL || buffer->hasFlow == NULL
+		|| buffer->magnitude == NULL || buffer->uHat == NULL || buffer->vHat == NULL || buffer->head == NULL) {
+		flowEventBufferFree(buffer);
+		return (NULL);
 	}
+
 	return (buffer);
 }
 
+/**
+ * Limit a neighborhood from x - radius to x + radius to the columns covered
+ * by the buffer. Also handles x - radius wrapping around below zero.
+ */
+static inline void flowEventBufferClampX(FlowEventBuffer buffer, uint16_t x, uint16_t radius,
+	uint16_t *xMin, uint16_t *xMax) {
+	*xMin = (uint16_t) (x - radius);
+	*xMax = (uint16_t) (x + radius);
+
+	if (*xMin > x || *xMin < buffer->firstX) {
+		*xMin = (uint16_t) buffer->firstX;
+	}
+	if (*xMax > buffer->firstX + buffer->sizeX - 1) {
+		*xMax = (uint16_t) (buffer->firstX + buffer->sizeX - 1);
+	}
+}
+
+/**
+ * Index of a pixel in the flow event buffer. Does not check bounds.
+ */
+static inline size_t flowEventBufferPixel(FlowEventBuffer buffer, uint16_t x, uint16_t y) {
+	return ((((size_t) x - buffer->firstX) * buffer->sizeY) + y);
+}
+
+/**
+ * Index into the buffer arrays of the i-th most recent event (0 = newest)
+ * at a pixel, as returned by flowEventBufferPixel(). Does not check bounds.
+ */
+static inline size_t flowEventBufferSlot(FlowEventBuffer buffer, size_t pixel, size_t i) {
+	size_t slot = buffer->head[pixel] + i;
+	if (slot >= buffer->size) {
+		slot -= buffer->size;
+	}
+	return ((pixel * buffer->size) + slot);
+}
+
+/**
+ * Start binning events into time slices of 'sliceTime' µs, from now on.
+ * Replaces any slices there were. Returns false if out of memory.
+ */
+static inline bool flowEventBufferInitSlices(FlowEventBuffer buffer, int64_t sliceTime) {
+	size_t words = (buffer->sizeX + 63) / 64;
+
+	uint64_t *slices = calloc(FLOW_EVENT_BUFFER_SLICES * buffer->sizeY * words, sizeof(uint64_t));
+	if (slices == NULL || sliceTime <= 0) {
+		free(slices);
+		return (false);
+	}
+
+	free(buffer->slices);
+	buffer->slices = slices;
+	buffer->sliceWords = words;
+	buffer->sliceTime = sliceTime;
+	buffer->sliceIndex = -1;
+	buffer->sliceCurrent = 0;
+
+	return (true);
+}
+
+/**
+ * Move the slices on to the one holding time t, clearing the ones that
+ * start. Slices follow a fixed grid in time, so they only depend on the
+ * events, not on when this is called. If time went back (timestamp reset),
+ * all slices are cleared.
+ */
+static inline void flowEventBufferRotateSlices(FlowEventBuffer buffer, int64_t t) {
+	int64_t index = t / buffer->sliceTime;
+	if (index == buffer->sliceIndex) {
+		return;
+	}
+
+	size_t sliceSize = buffer->sizeY * buffer->sliceWords;
+	int64_t steps = index - buffer->sliceIndex;
+	if (buffer->sliceIndex < 0 || steps < 0 || steps > FLOW_EVENT_BUFFER_SLICES) {
+		steps = FLOW_EVENT_BUFFER_SLICES;
+	}
+
+	for (int64_t i = 0; i < steps; i++) {
+		buffer->sliceCurrent = (buffer->sliceCurrent + 1) % FLOW_EVENT_BUFFER_SLICES;
+		memset(&buffer->slices[buffer->sliceCurrent * sliceSize], 0, sliceSize * sizeof(uint64_t));
+	}
+
+	buffer->sliceIndex = index;
+}
+
+/**
+ * Row y of a slice, 'age' slices before the current one (0 = current).
+ * Call flowEventBufferRotateSlices() first.
+ */
+static inline uint64_t *flowEventBufferSliceRow(FlowEventBuffer buffer, size_t age, uint16_t y) {
+	size_t slice = (buffer->sliceCurrent + FLOW_EVENT_BUFFER_SLICES - age) % FLOW_EVENT_BUFFER_SLICES;
+	return (&buffer->slices[((slice * buffer->sizeY) + y) * buffer->sliceWords]);
+}
+
 /**
  * Add a flow event event to a buffer, checking the buffer bounds.
- * With each new event, the previously added events on a pixel location
- * are shifted forward in time.
+ * The new event replaces the oldest one at its pixel location.
+ * The buffer keeps full 64-bit timestamps, so 't' is the event's
+ * timestamp as given by flowEventGetTimestamp64().
  *
  * Returns true if successful, false if the event cannot be added to the buffer.
 */
-static inline bool flowEventBufferAdd(FlowEvent e, FlowEventBuffer buffer) {
-	// TODO make buffer update more efficient for larger buffer size,
-	// 		e.g. by using a ring buffer structure
-	size_t i;
+static inline bool flowEventBufferAdd(FlowEvent e, int64_t t, FlowEventBuffer buffer) {
 	uint16_t x = caerPolarityEventGetX((caerPolarityEvent) e);
 	uint16_t y = caerPolarityEventGetY((caerPolarityEvent) e);
 
-	if (x > buffer->sizeX) {
+	if (x < buffer->firstX || x >= buffer->firstX + buffer->sizeX) {
 		caerLog(CAER_LOG_ALERT,"FLOW: ", "Event buffer write access out of bounds: x=%i\n", x);
 		return (false);
 	}
-	if (y > buffer->sizeY) {
+	if (y >= buffer->sizeY) {
 		caerLog(CAER_LOG_ALERT,"FLOW: ", "Event buffer write access out of bounds: y=%i\n", y);
 		return (false);
 	}
 
-	for (i = buffer->size-1; i > 0 ; i--) {
-		buffer->buffer[x][y][i] = buffer->buffer[x][y][i-1];
+	// Move the head back onto the oldest slot, which then holds the newest event.
+	size_t pixel = flowEventBufferPixel(buffer, x, y);
+	buffer->head[pixel] = (uint8_t) ((buffer->head[pixel] == 0) ? (buffer->size - 1) : (buffer->head[pixel] - 1U));
+
+	size_t slot = (pixel * buffer->size) + buffer->head[pixel];
+	buffer->timestamp[slot] = t;
+	buffer->polarity[slot] = caerPolarityEventGetPolarity((caerPolarityEvent) e);
+	buffer->hasFlow[slot] = e->hasFlow;
+
+	float magnitude = (e->hasFlow) ? (sqrtf(e->u * e->u + e->v * e->v)) : (0);
+	buffer->magnitude[slot] = magnitude;
+	buffer->uHat[slot] = (magnitude > 0) ? (e->u / magnitude) : (0);
+	buffer->vHat[slot] = (magnitude > 0) ? (e->v / magnitude) : (0);
+
+	if (buffer->slices != NULL) {
+		flowEventBufferRotateSlices(buffer, t);
+
+		size_t column = x - buffer->firstX;
+		uint64_t *row = flowEventBufferSliceRow(buffer, 0, y);
+		row[column / 64] |= UINT64_C(1) << (column % 64);
 	}
-	buffer->buffer[x][y][0] = *e; // copy the event
+
 	return (true);
 }
 
 /**
- * Finds the content of a flow event buffer at a specified location, and returns a pointer to the event.
+ * Finds the timestamp of the most recent event at a location, checking
+ * the buffer bounds. Returns -1 if the location is outside the buffer.
  */
-static inline FlowEvent flowEventBufferRead(FlowEventBuffer buffer, uint16_t x, uint16_t y, uint16_t i) {
-	if (x > buffer->sizeX) {
+static inline int64_t flowEventBufferReadTimestamp(FlowEventBuffer buffer, uint16_t x, uint16_t y) {
+	if (x < buffer->firstX || x >= buffer->firstX + buffer->sizeX) {
 		caerLog(CAER_LOG_ALERT,"FLOW: ", "Event buffer read access out of bounds: x=%i\n", x);
-		return (NULL);
+		return (-1);
 	}
-	if (y > buffer->sizeY) {
+	if (y >= buffer->sizeY) {
 		caerLog(CAER_LOG_ALERT,"FLOW: ", "Event buffer read access out of bounds: y=%i\n", y);
-		return (NULL);
-	}
-	if (i > buffer->size) {
-		caerLog(CAER_LOG_ALERT,"FLOW: ", "Event buffer read access out of bounds: i=%i\n", i);
-		return (NULL);
-	}
-	return (&(buffer->buffer[x][y][i]));
-}
-
-/**
- * Free the memory of a flow event buffer.
- */
-static inline void flowEventBufferFree(FlowEventBuffer buffer) {
-	if (buffer != NULL) {
-		uint16_t i,j;
-		for (i = 0; i < buffer->sizeX; i++) {
-			for (j = 0; j < buffer->sizeY; j++) {
-				free(buffer->buffer[i][j]);
-			}
-			free(buffer->buffer[i]);
-		}
-		free(buffer->buffer);
-		free(buffer);
+		return (-1);
 	}
+	return (buffer->timestamp[flowEventBufferSlot(buffer, flowEventBufferPixel(buffer, x, y), 0)]);
 }
 
 #endif
@@ -6,120 +6,181 @@
  */
 
 #include "flowOutput.h"
+#include "ext/portable_time.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#include <termios.h>
+
 #define SUBSYSTEM_UART "UART"
 #define SUBSYSTEM_FILE "Event logger"
-#define FILE_MAX_NUMBER_OF_LINES 5000000
-
-static inline FlowEventPacket getPacketFromTransferBuffer(RingBuffer buffer);
-static inline bool sendFlowEventPacketUart(FlowEventPacket header);
+#define FILE_BUFFER_SIZE (256 * 1024)
+#define UART_LINK_RATE_SMOOTHING 0.1
+
+static inline FlowEventPacket getPacketFromPool(flowOutputState state, int32_t capacity);
+static inline void returnPacketToPool(flowOutputState state, FlowEventPacket packet);
+static inline bool uartBaudToSpeed(int32_t baud, speed_t *speed);
+static inline double secondsBetween(struct timespec *from, struct timespec *to);
+static inline void updateUartLink(flowOutputState state, struct timespec *now);
+static inline void sendUartFrame(flowOutputState state);
+static inline bool writeFlowEventPacketFile(flowOutputState state, FlowEventPacket flow);
+static inline bool flushFileBuffer(flowOutputState state);
+static inline void outputFlowEventPacket(flowOutputState state, FlowEventPacket packet);
 static int outputHandlerThread(void *stateArg);
-static inline bool writeFlowEventPacketFile(flowOutputState state,
-		FlowEventPacket packet);
 
-bool initUartOutput(flowOutputState state, char* port, unsigned int baud, size_t bufferSize) {
+bool initUartOutput(flowOutputState state, FlowUartParams params) {
+	speed_t speed;
+	if (!uartBaudToSpeed(params.baud, &speed)) {
+		caerLog(CAER_LOG_ALERT, SUBSYSTEM_UART, "Unsupported baud rate %d.", params.baud);
+		return (false);
+	}
+
 	// Initialize UART communication
-	int uartErrno = uart_open(port, baud);
+	int uartErrno = uart_open(params.port, (unsigned int) speed);
 	if (uartErrno) {
 		caerLog(CAER_LOG_ALERT, SUBSYSTEM_UART,
 				"Failed to identify serial communication, errno=%i.",uartErrno);
 		return (false);
 	}
-	// Test message
-	char* testMessage = "DVS128UART";
-	if (uart_tx((int) strlen(testMessage), (unsigned char*) testMessage)) {
+	// Test message: a frame delimiter, which also lets the receiver synchronize
+	unsigned char delimiter = 0;
+	if (uart_tx(1, &delimiter)) {
 		caerLog(CAER_LOG_ALERT, SUBSYSTEM_UART,
 				"Test transmission unsuccessful - connection closed.");
 		uart_close();
 		return(false);
 	}
 
-	// Start output handler thread
-	state->thread = 0;
-	if (thrd_create(&state->thread, &outputHandlerThread, state) != thrd_success) {
-		caerLog(CAER_LOG_ALERT, SUBSYSTEM_UART,"Failed to start output handler thread");
+	state->telemetry = flowTelemetryInit(params.sizeX, params.sizeY, params.regions);
+	if (state->telemetry == NULL) {
+		caerLog(CAER_LOG_ALERT, SUBSYSTEM_UART, "Failed to allocate flow telemetry.");
+		uart_close();
 		return (false);
 	}
-	state->buffer = ringBufferInit(bufferSize);
-	if (state->buffer == NULL) {
-		caerLog(CAER_LOG_ERROR, SUBSYSTEM_UART, "Failed to allocate transfer ring-buffer.");
-		return (false);
+
+	if (params.frameRate < 1) {
+		params.frameRate = 1;
 	}
-	atomic_store(&state->running, true);
-	caerLog(CAER_LOG_NOTICE, SUBSYSTEM_UART, "Streaming flow events to port %s.",port);
+	if (params.budget <= 0 || params.budget > 1) {
+		params.budget = 1;
+	}
+
+	// 8N1: ten bits on the line per byte.
+	state->uartParams = params;
+	state->uartParams.port = NULL; // only valid during init
+	state->uartLinkRate = params.baud / 10.0;
+	state->uartQueued = 0;
+	state->uartLastFrameSize = 0;
+	portable_clock_gettime_monotonic(&state->uartLastPoll);
+	state->uartLastFrame = state->uartLastPoll;
+
+	caerLog(CAER_LOG_NOTICE, SUBSYSTEM_UART, "Streaming flow telemetry to port %s at %d baud.",
+		params.port, params.baud);
 	return (true);
 }
 
-bool initFileOutput(flowOutputState state, char* fileName, size_t bufferSize) {
+bool initFileOutput(flowOutputState state, char* fileName) {
 	// Initialize file communication
-	state->file = fopen(fileName,"w+");
-	if (state->file == NULL) {
-		caerLog(CAER_LOG_ALERT, SUBSYSTEM_FILE,"Failed to open file");
+	state->fileDescriptor = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (state->fileDescriptor < 0) {
+		caerLog(CAER_LOG_ALERT, SUBSYSTEM_FILE, "Failed to open file %s. Error: %d.", fileName, errno);
 		return (false);
 	}
-	// Write header as check for file output
-	if (fprintf(state->file,"#cAER event data with optic flow values\n") < 0) {
-		caerLog(CAER_LOG_ALERT, SUBSYSTEM_FILE,"Failed to write header");
-		fclose(state->file);
+
+	state->fileBuffer = simpleBufferInit(FILE_BUFFER_SIZE);
+	if (state->fileBuffer == NULL) {
+		caerLog(CAER_LOG_ALERT, SUBSYSTEM_FILE, "Failed to allocate file buffer.");
+		close(state->fileDescriptor);
 		return (false);
 	}
-	// Write creation date
+
+	// Write header: format, creation date, end of header.
 	time_t rawTime;
-	struct tm * timeInfo;
-	time (&rawTime);
-	timeInfo = localtime(&rawTime);
-	fprintf(state->file,"#Date created: %s\n",asctime(timeInfo));
-	// Write column legend
-	fprintf(state->file,"#x,y,t,p,u,v\n");
-
-	state->fileLineNumber = 4;
-
-	// Start output handler thread (ONLY IF NOT YET CALLED BY UART)
-	if (state->mode != OF_OUT_BOTH ||
-			!atomic_load_explicit(&state->running, memory_order_relaxed)) {
-		state->mode = OF_OUT_FILE; // to ensure that only file output is performed in this case
-		state->thread = 0;
-		if (thrd_create(&state->thread, &outputHandlerThread, state) != thrd_success) {
-			caerLog(CAER_LOG_ALERT, SUBSYSTEM_FILE,
-					"Failed to start output handler thread");
-			return (false);
-		}
-		state->buffer = ringBufferInit(bufferSize);
-		if (state->buffer == NULL) {
-			caerLog(CAER_LOG_ERROR, SUBSYSTEM_FILE,
-					"Failed to allocate transfer ring-buffer.");
-			return (false);
-		}
-		atomic_store(&state->running, true);
+	struct tm timeInfo;
+	time(&rawTime);
+	localtime_r(&rawTime, &timeInfo);
+
+	char dateString[64];
+	strftime(dateString, sizeof(dateString), "%Y-%m-%d %H:%M:%S (TZ%z)", &timeInfo);
+
+	char header[256];
+	int headerLength = snprintf(header, sizeof(header),
+		FLOW_RECORD_FORMAT_LINE "#Date created: %s\r\n" FLOW_RECORD_END_LINE, dateString);
+
+	if (headerLength < 0 || !writeUntilDone(state->fileDescriptor, (uint8_t *) header, (size_t) headerLength)) {
+		caerLog(CAER_LOG_ALERT, SUBSYSTEM_FILE,"Failed to write header");
+		free(state->fileBuffer);
+		state->fileBuffer = NULL;
+		close(state->fileDescriptor);
+		return (false);
 	}
-	caerLog(CAER_LOG_NOTICE, SUBSYSTEM_FILE, "Logging events to fileName %s",fileName);
 
+	caerLog(CAER_LOG_NOTICE, SUBSYSTEM_FILE, "Logging events to file %s.",fileName);
 	return (true);
 }
 
-void closeUartOutput(flowOutputState state) {
-	state->running = false;
-	uart_close();
+bool startFlowOutput(flowOutputState state, size_t bufferSize) {
+	state->buffer = ringBufferInit(bufferSize);
+	state->pool = ringBufferInit(bufferSize);
+	if (state->buffer == NULL || state->pool == NULL) {
+		caerLog(CAER_LOG_ERROR, SUBSYSTEM_FILE, "Failed to allocate transfer ring-buffers.");
+		goto error;
+	}
+
+	// Start output handler thread, which only reads the state set up above.
+	atomic_store(&state->running, true);
+	if (thrd_create(&state->thread, &outputHandlerThread, state) != thrd_success) {
+		caerLog(CAER_LOG_ALERT, SUBSYSTEM_FILE, "Failed to start output handler thread.");
+		atomic_store(&state->running, false);
+		goto error;
+	}
+
+	return (true);
+
+	error:
+	if (state->buffer != NULL) {
+		ringBufferFree(state->buffer);
+	}
+	if (state->pool != NULL) {
+		ringBufferFree(state->pool);
+	}
+	if (state->mode == OF_OUT_UART || state->mode == OF_OUT_BOTH) {
+		uart_close();
+		flowTelemetryFree(state->telemetry);
+	}
+	if (state->mode == OF_OUT_FILE || state->mode == OF_OUT_BOTH) {
+		free(state->fileBuffer);
+		close(state->fileDescriptor);
+	}
+	return (false);
+}
+
+void closeFlowOutput(flowOutputState state) {
+	// The thread writes out what is left in the transfer buffer before exiting.
+	atomic_store(&state->running, false);
 
 	if ((errno = thrd_join(state->thread, NULL)) != thrd_success) {
 		// This should never happen!
-		caerLog(CAER_LOG_CRITICAL, SUBSYSTEM_UART,
+		caerLog(CAER_LOG_CRITICAL, SUBSYSTEM_FILE,
 				"Failed to join output handling thread. Error: %d.", errno);
 	}
-	ringBufferFree(state->buffer);
-}
 
+	if (state->mode == OF_OUT_UART || state->mode == OF_OUT_BOTH) {
+		uart_close();
+		flowTelemetryFree(state->telemetry);
+	}
+	if (state->mode == OF_OUT_FILE || state->mode == OF_OUT_BOTH) {
+		free(state->fileBuffer);
+		close(state->fileDescriptor);
+	}
 
-void closeFileOutput(flowOutputState state) {
-	if (state->mode != OF_OUT_BOTH) {
-		state->running = false;
-		if ((errno = thrd_join(state->thread, NULL)) != thrd_success) {
-			// This should never happen!
-			caerLog(CAER_LOG_CRITICAL, SUBSYSTEM_UART,
-					"Failed to join output handling thread. Error: %d.", errno);
-		}
-		ringBufferFree(state->buffer);
+	FlowEventPacket packet;
+	while ((packet = ringBufferGet(state->pool)) != NULL) {
+		flowEventPacketFree(packet);
 	}
-	fclose(state->file);
+	ringBufferFree(state->pool);
+	ringBufferFree(state->buffer);
 }
 
 void addPacketToTransferBuffer(flowOutputState state, FlowEventPacket packet,
@@ -139,24 +200,24 @@ void addPacketToTransferBuffer(flowOutputState state, FlowEventPacket packet,
 		return;
 	}
 
-	// Allocate memory for new flow event packet
-	FlowEventPacket copy = malloc(sizeof(struct flow_event_packet));
+	// Take a packet returned by the output thread, holding only the flow events
+	FlowEventPacket copy = getPacketFromPool(state, flowNumber);
 	if (copy == NULL) {
-			caerLog(CAER_LOG_ERROR, SUBSYSTEM_UART,"Failed to copy event packet.");
+		caerLog(CAER_LOG_ERROR, SUBSYSTEM_FILE,"Failed to copy event packet.");
 		return;
 	}
 
 	// Copy header information
 	copy->packetHeader = packet->packetHeader;
-	copy->packetHeader.eventNumber = flowNumber;
-	copy->packetHeader.eventValid = flowNumber;
-	copy->events = malloc(sizeof(struct flow_event) * (size_t) flowNumber);
+	caerEventPacketHeaderSetEventCapacity(&copy->packetHeader, flowNumber);
+	caerEventPacketHeaderSetEventNumber(&copy->packetHeader, flowNumber);
+	caerEventPacketHeaderSetEventValid(&copy->packetHeader, flowNumber);
 
 	// Copy events
-	int j = 0;
-	for (int i = 0; i < header->eventNumber; i++) {
+	int32_t j = 0;
+	for (int32_t i = 0; i < caerEventPacketHeaderGetEventNumber(header); i++) {
 		FlowEvent e = &packet->events[i];
-		if (e->hasFlow) {
+		if (e->hasFlow && j < flowNumber) {
 			copy->events[j] = *e;
 			j++;
 		}
@@ -173,108 +234,227 @@ void addPacketToTransferBuffer(flowOutputState state, FlowEventPacket packet,
 
 	if (!ringBufferPut(state->buffer, copy)) {
 		flowEventPacketFree(copy);
-		caerLog(CAER_LOG_ALERT, SUBSYSTEM_UART,"Failed to add event packet to ring buffer.");
+		caerLog(CAER_LOG_ALERT, SUBSYSTEM_FILE,"Failed to add event packet to ring buffer.");
 		return;
 	}
 }
 
-static inline FlowEventPacket getPacketFromTransferBuffer(RingBuffer buffer) {
-	FlowEventPacket packet = ringBufferGet(buffer);
-	repeat: if (packet != NULL) {
-		// Are there others? Only render last one, to avoid getting backed up!
-		FlowEventPacket packet2 = ringBufferGet(buffer);
+/**
+ * Get a packet with room for at least capacity events, reusing the ones the
+ * output thread is done with, so that the mainloop doesn't malloc per packet.
+ * Packets in the pool keep their old header, whose capacity never exceeds
+ * what was allocated.
+ */
+static inline FlowEventPacket getPacketFromPool(flowOutputState state, int32_t capacity) {
+	FlowEventPacket packet = ringBufferGet(state->pool);
 
-		if (packet2 != NULL) {
-			flowEventPacketFree(packet);
-			packet = packet2;
-			goto repeat;
-		}
+	if (packet != NULL && caerEventPacketHeaderGetEventCapacity(&packet->packetHeader) >= capacity) {
+		return (packet);
 	}
 
-	return (packet);
+	FlowEventPacket grown = realloc(packet,
+		sizeof(struct flow_event_packet) + ((size_t) capacity * sizeof(struct flow_event)));
+	if (grown == NULL) {
+		free(packet);
+		return (NULL);
+	}
+
+	return (grown);
 }
 
-static inline bool sendFlowEventPacketUart(FlowEventPacket flow) {
-	caerEventPacketHeader header = (caerEventPacketHeader) flow;
-	uint32_t packetSize = (uint32_t) caerEventPacketHeaderGetEventNumber(header);
-	if (packetSize == 0) {
-		// No events to send - return
-		return (false);
+static inline void returnPacketToPool(flowOutputState state, FlowEventPacket packet) {
+	if (!ringBufferPut(state->pool, packet)) {
+		flowEventPacketFree(packet);
 	}
-	// Events are separated by unsigned ints of value 255. This value should
-	// never occur as pixel location
-	unsigned char eventSeparator = 255;
+}
 
-	// Iterate through packet and send events
-	for (uint32_t i = 0; i < packetSize; i++) {
-		FlowEvent e = &(flow->events[i]);
-		if (e == NULL) {
-			caerLog(CAER_LOG_ERROR,SUBSYSTEM_UART,"Event null pointer found.");
-			return (false);
-		}
-		if (!e->hasFlow) {continue;}
-		uint8_t x = (uint8_t) caerPolarityEventGetX((caerPolarityEvent) e);
-		uint8_t y = (uint8_t) caerPolarityEventGetY((caerPolarityEvent) e);
-		int32_t t = caerPolarityEventGetTimestamp((caerPolarityEvent) e);
-		int16_t u = (int16_t) (e->u*100);
-		int16_t v = (int16_t) (e->v*100);
-
-		// Send data over UART
-		if (uart_tx(sizeof(x),(unsigned char*) &x)
-				|| uart_tx(sizeof(y),(unsigned char*) &y)
-				|| uart_tx(sizeof(t),(unsigned char*) &t)
-				|| uart_tx(sizeof(u),(unsigned char*) &u)
-				|| uart_tx(sizeof(v),(unsigned char*) &v)
-				|| uart_tx(sizeof(eventSeparator), &eventSeparator))  {
-			caerLog(CAER_LOG_ERROR,SUBSYSTEM_UART,"Event info not fully sent.");
+static inline bool uartBaudToSpeed(int32_t baud, speed_t *speed) {
+	switch (baud) {
+		case 9600:
+			*speed = B9600;
+			break;
+		case 19200:
+			*speed = B19200;
+			break;
+		case 38400:
+			*speed = B38400;
+			break;
+		case 57600:
+			*speed = B57600;
+			break;
+		case 115200:
+			*speed = B115200;
+			break;
+		case 230400:
+			*speed = B230400;
+			break;
+#ifdef B460800
+		case 460800:
+			*speed = B460800;
+			break;
+#endif
+#ifdef B921600
+		case 921600:
+			*speed = B921600;
+			break;
+#endif
+		default:
 			return (false);
-		}
 	}
 	return (true);
 }
 
+static inline double secondsBetween(struct timespec *from, struct timespec *to) {
+	return ((double) (to->tv_sec - from->tv_sec) + (double) (to->tv_nsec - from->tv_nsec) / 1.0e9);
+}
+
+/**
+ * Measure the UART throughput from how fast the transmit queue drains.
+ * Only intervals with data left over at the end count: otherwise the link
+ * was idle for part of it.
+ */
+static inline void updateUartLink(flowOutputState state, struct timespec *now) {
+	int queued = uart_tx_queued();
+	if (queued < 0) {
+		// Queue not observable: keep the nominal rate.
+		queued = 0;
+	}
+
+	double elapsed = secondsBetween(&state->uartLastPoll, now);
+	if (state->uartQueued > queued && queued > 0 && elapsed > 0) {
+		double measured = (double) (state->uartQueued - queued) / elapsed;
+		state->uartLinkRate += UART_LINK_RATE_SMOOTHING * (measured - state->uartLinkRate);
+	}
+
+	state->uartQueued = queued;
+	state->uartLastPoll = *now;
+}
+
+/**
+ * Send a telemetry frame if one is due and the link has drained. A frame
+ * waiting in the queue would only delay a fresher one, so nothing is queued
+ * behind it; its size follows from the budgeted share of the link rate.
+ */
+static inline void sendUartFrame(flowOutputState state) {
+	struct timespec now;
+	portable_clock_gettime_monotonic(&now);
+
+	updateUartLink(state, &now);
+	if (state->uartQueued > 0) {
+		return;
+	}
+
+	// A slow link can't fit even the summary in a frame period: then the
+	// frames themselves are spaced out to stay within budget.
+	double budgetRate = (double) state->uartParams.budget * state->uartLinkRate;
+	double framePeriod = 1.0 / state->uartParams.frameRate;
+	double lastFrameTime = (double) state->uartLastFrameSize / budgetRate;
+	if (secondsBetween(&state->uartLastFrame, &now) < ((lastFrameTime > framePeriod) ? (lastFrameTime) : (framePeriod))) {
+		return;
+	}
+
+	double budget = budgetRate * framePeriod;
+	size_t frameBudget = (budget < FLOW_TELEMETRY_MAX_FRAME) ? ((size_t) budget) : (FLOW_TELEMETRY_MAX_FRAME);
+
+	size_t frameSize = flowTelemetryEncodeFrame(state->telemetry, state->uartFrame, frameBudget);
+	if (frameSize == 0) {
+		return;
+	}
+
+	if (uart_tx((int) frameSize, state->uartFrame)) {
+		caerLog(CAER_LOG_ERROR, SUBSYSTEM_UART, "Flow telemetry frame not fully sent.");
+	}
+
+	state->uartLastFrame = now;
+	state->uartLastFrameSize = frameSize;
+	state->uartQueued = (int) frameSize;
+}
+
+/**
+ * Append the packet to the file buffer as binary flow records, flushing the
+ * buffer to the file whenever it fills up. A packet larger than the buffer
+ * is split over several record blocks.
+ */
 static inline bool writeFlowEventPacketFile(flowOutputState state,
 		FlowEventPacket flow) {
 	caerEventPacketHeader header = (caerEventPacketHeader) flow;
+	simpleBuffer buffer = state->fileBuffer;
 
+	int32_t eventNumber = caerEventPacketHeaderGetEventNumber(header);
 	if (caerEventPacketHeaderGetEventValid(header) == 0) {
 		return (false);
 	}
 
-	for (int32_t i = 0; i < caerEventPacketHeaderGetEventNumber(header); i++) {
-		FlowEvent e = &(flow->events[i]);
-		if (e == NULL) {
-			caerLog(CAER_LOG_ERROR,SUBSYSTEM_FILE,"Event null pointer found.");
-			return (false);
-		}
-		if (!e->hasFlow) {continue;}
-
-		// Get event data
-		uint8_t x = (uint8_t) caerPolarityEventGetX((caerPolarityEvent) e);
-		uint8_t y = (uint8_t) caerPolarityEventGetY((caerPolarityEvent) e);
-		int32_t t = caerPolarityEventGetTimestamp((caerPolarityEvent) e);
-		bool p = caerPolarityEventGetPolarity((caerPolarityEvent) e);
-		double u = e->u;
-		double v = e->v;
-
-		// Write to file
-		if (state->fileLineNumber < FILE_MAX_NUMBER_OF_LINES)  {
-			fprintf(state->file,"%3i,%3i,%10i,%d,%4.3f,%4.3f\n",x,y,t,p,u,v);
-			state->fileLineNumber++;
+	int32_t i = 0;
+	while (i < eventNumber) {
+		if (buffer->bufferSize - buffer->bufferUsedSize
+			< sizeof(struct flow_record_block) + sizeof(struct flow_record)) {
+			if (!flushFileBuffer(state)) {
+				return (false);
+			}
 		}
-		else {
-			// If too many lines, stop logging to prevent overrun
-			if (state->fileLineNumber == FILE_MAX_NUMBER_OF_LINES) {
-				caerLog(CAER_LOG_NOTICE, SUBSYSTEM_FILE,
-						"File log reached limit of %d lines - "
-						"no more lines will be added.", FILE_MAX_NUMBER_OF_LINES);
-				state->fileLineNumber++;
+
+		// Reserve the block header, fill in its record number once known.
+		struct flow_record_block *block = (struct flow_record_block *) (buffer->buffer + buffer->bufferUsedSize);
+		buffer->bufferUsedSize += sizeof(struct flow_record_block);
+
+		int32_t recordNumber = 0;
+		for (; i < eventNumber; i++) {
+			if (buffer->bufferSize - buffer->bufferUsedSize < sizeof(struct flow_record)) {
+				break;
 			}
+
+			FlowEvent e = &(flow->events[i]);
+			if (!e->hasFlow) {continue;}
+
+			caerPolarityEvent p = (caerPolarityEvent) e;
+			struct flow_record record = flowRecordInit(caerPolarityEventGetX(p), caerPolarityEventGetY(p),
+				caerPolarityEventGetPolarity(p), caerPolarityEventGetTimestamp(p), e->u, e->v);
+
+			memcpy(buffer->buffer + buffer->bufferUsedSize, &record, sizeof(struct flow_record));
+			buffer->bufferUsedSize += sizeof(struct flow_record);
+			recordNumber++;
 		}
+
+		block->tsOverflow = (int32_t) htole32((uint32_t) caerEventPacketHeaderGetEventTSOverflow(header));
+		block->recordNumber = (int32_t) htole32((uint32_t) recordNumber);
 	}
+
 	return (true);
 }
 
+static inline bool flushFileBuffer(flowOutputState state) {
+	simpleBuffer buffer = state->fileBuffer;
+	if (buffer->bufferUsedSize == 0) {
+		return (true);
+	}
+
+	buffer->bufferPosition = 0;
+	bool written = simpleBufferWrite(state->fileDescriptor, buffer);
+	buffer->bufferUsedSize = 0;
+
+	if (!written) {
+		caerLog(CAER_LOG_ALERT, SUBSYSTEM_FILE, "Failed to write flow records to file. Error: %d.", errno);
+	}
+	return (written);
+}
+
+/**
+ * The file gets every packet. The UART link is slower than the flow rate can
+ * be, so it gets a summary of the packets, sent at its own pace.
+ */
+static inline void outputFlowEventPacket(flowOutputState state, FlowEventPacket packet) {
+	if (state->mode == OF_OUT_UART || state->mode == OF_OUT_BOTH) {
+		flowTelemetryAddPacket(state->telemetry, packet);
+	}
+	if (state->mode == OF_OUT_FILE || state->mode == OF_OUT_BOTH) {
+		if (!writeFlowEventPacketFile(state,packet)) {
+			caerLog(CAER_LOG_ALERT, SUBSYSTEM_FILE, "A flow packet was not written.");
+		}
+	}
+	returnPacketToPool(state, packet);
+}
+
 static int outputHandlerThread(void *stateArg) {
 	if (stateArg == NULL) {
 		return (thrd_error);
@@ -296,46 +476,34 @@ static int outputHandlerThread(void *stateArg) {
 
 	struct timespec sleepTime = { .tv_sec = 0, .tv_nsec = 500000 };
 
-	// Wait until the buffer is initialized
-	while (!atomic_load_explicit(&state->running, memory_order_relaxed)) {
-		thrd_sleep(&sleepTime, NULL);
-	}
+	bool uart = (state->mode == OF_OUT_UART || state->mode == OF_OUT_BOTH);
 
 	// Main thread loop
 	while (atomic_load_explicit(&state->running, memory_order_relaxed)) {
-		FlowEventPacket packet = getPacketFromTransferBuffer(state->buffer);
-		if (packet == NULL) { // no data: sleep for a while
-			thrd_sleep(&sleepTime, NULL);
+		if (uart) {
+			sendUartFrame(state);
 		}
-		else {
-			if (state->mode == OF_OUT_UART || state->mode == OF_OUT_BOTH) {
-				if (!sendFlowEventPacketUart(packet)) {
-					caerLog(CAER_LOG_ALERT, SUBSYSTEM_UART, "A flow packet was not sent.");
-				}
-			}
+
+		FlowEventPacket packet = ringBufferGet(state->buffer);
+		if (packet == NULL) {
+			// No data: write out what was buffered, then sleep for a while
 			if (state->mode == OF_OUT_FILE || state->mode == OF_OUT_BOTH) {
-				if (!writeFlowEventPacketFile(state,packet)) {
-					caerLog(CAER_LOG_ALERT, SUBSYSTEM_FILE, "A flow packet was not written.");
-				}
+				flushFileBuffer(state);
 			}
-			flowEventPacketFree(packet);
+			thrd_sleep(&sleepTime, NULL);
+		}
+		else {
+			outputFlowEventPacket(state, packet);
 		}
 	}
 
 	// If shutdown: empty buffer before closing thread
 	FlowEventPacket packet;
-	while ((packet = getPacketFromTransferBuffer(state->buffer)) != NULL) {
-		if (state->mode == OF_OUT_UART || state->mode == OF_OUT_BOTH) {
-			if (!sendFlowEventPacketUart(packet)) {
-				caerLog(CAER_LOG_ALERT, SUBSYSTEM_UART, "A flow packet was not sent.");
-			}
-		}
-		if (state->mode == OF_OUT_FILE || state->mode == OF_OUT_BOTH) {
-			if (!writeFlowEventPacketFile(state,packet)) {
-				caerLog(CAER_LOG_ALERT, SUBSYSTEM_FILE, "A flow packet was not written.");
-			}
-		}
-		flowEventPacketFree(packet);
+	while ((packet = ringBufferGet(state->buffer)) != NULL) {
+		outputFlowEventPacket(state, packet);
+	}
+	if (state->mode == OF_OUT_FILE || state->mode == OF_OUT_BOTH) {
+		flushFileBuffer(state);
 	}
 
 	return (thrd_success);
@@ -10,6 +10,9 @@
 
 #include "uart.h"
 #include "flowEvent.h"
+#include "flowRecord.h"
+#include "flowTelemetry.h"
+#include "ext/buffers.h"
 #include "ext/c11threads_posix.h"
 #include "ext/ringbuffer/ringbuffer.h"
 #include <stdatomic.h>
@@ -21,22 +24,53 @@ typedef enum {
 	OF_OUT_BOTH
 } outputMode;
 
+/**
+ * UART telemetry settings. The budget is the fraction of the measured link
+ * rate the frames may use, the rest is left as margin.
+ */
+typedef struct {
+	char *port;
+	int32_t baud;
+	float budget;
+	int32_t frameRate;
+	uint8_t regions;
+	uint16_t sizeX;
+	uint16_t sizeY;
+} FlowUartParams;
+
 struct flow_output_state {
 	atomic_bool running;
 	outputMode mode;
 	RingBuffer buffer;
+	/// Flow packets handed back by the output thread, for reuse.
+	RingBuffer pool;
 	thrd_t thread;
-	FILE* file;
-	int32_t fileLineNumber;
+	int fileDescriptor;
+	/// Binary flow records waiting to be written to the file.
+	simpleBuffer fileBuffer;
+	/// Flow summary for the next UART frame.
+	FlowTelemetry telemetry;
+	FlowUartParams uartParams;
+	/// Measured UART throughput (bytes/s), nominal until measured.
+	double uartLinkRate;
+	int uartQueued;
+	struct timespec uartLastPoll;
+	struct timespec uartLastFrame;
+	size_t uartLastFrameSize;
+	uint8_t uartFrame[FLOW_TELEMETRY_MAX_FRAME];
 };
 
 typedef struct flow_output_state *flowOutputState;
 
-bool initUartOutput(flowOutputState state, char* port, unsigned int baud, size_t bufferSize);
-void closeUartOutput(flowOutputState state);
+bool initUartOutput(flowOutputState state, FlowUartParams params);
+bool initFileOutput(flowOutputState state, char* file);
 
-bool initFileOutput(flowOutputState state, char* file, size_t bufferSize);
-void closeFileOutput(flowOutputState state);
+/**
+ * Start the output thread for the outputs in state->mode, which must have
+ * been initialized above. On failure, those outputs are closed again.
+ */
+bool startFlowOutput(flowOutputState state, size_t bufferSize);
+void closeFlowOutput(flowOutputState state);
 
 void addPacketToTransferBuffer(flowOutputState state, FlowEventPacket packet, int32_t flowNumber);
 
@@ -0,0 +1,93 @@
+/*
+ * flowRecord.h
+ *
+ * Binary format of the flow event log, written by the flow file output
+ * and converted back to CSV offline by utils/flowcsv.
+ *
+ * The file starts with text header lines, the first one being
+ * FLOW_RECORD_FORMAT_LINE, the last one FLOW_RECORD_END_LINE. Then follow
+ * blocks, each a flow_record_block header and its records. All values are
+ * little-endian. A record is 16 bytes, against ~35 for a line of text.
+ */
+
+#ifndef MODULES_OPTICFLOW_FLOWRECORD_H_
+#define MODULES_OPTICFLOW_FLOWRECORD_H_
+
+#include <libcaer/events/common.h>
+#include <string.h>
+
+#define FLOW_RECORD_FORMAT_LINE "#!FLOW-DAT1.0\r\n"
+#define FLOW_RECORD_END_LINE "#!END-HEADER\r\n"
+
+/// Polarity is stored in the top bit of the y address.
+#define FLOW_RECORD_POLARITY_MASK 0x8000
+
+/**
+ * Header of a block of records. Timestamps in the records are relative to
+ * the timestamp overflow, like in a libcaer event packet.
+ */
+struct flow_record_block {
+	int32_t tsOverflow;
+	int32_t recordNumber;
+}__attribute__((__packed__));
+
+/**
+ * One flow event: address, polarity, timestamp and flow (px/s).
+ */
+struct flow_record {
+	uint16_t x;
+	uint16_t yPolarity;
+	int32_t timestamp;
+	uint32_t u;
+	uint32_t v;
+}__attribute__((__packed__));
+
+static inline uint32_t flowRecordFloatToLE(float f) {
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	return (htole32(bits));
+}
+
+static inline float flowRecordFloatFromLE(uint32_t le) {
+	uint32_t bits = le32toh(le);
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return (f);
+}
+
+static inline struct flow_record flowRecordInit(uint16_t x, uint16_t y, bool polarity, int32_t timestamp, float u,
+	float v) {
+	struct flow_record record;
+	record.x = htole16(x);
+	record.yPolarity = htole16((uint16_t) (y | ((polarity) ? (FLOW_RECORD_POLARITY_MASK) : (0))));
+	record.timestamp = (int32_t) htole32((uint32_t) timestamp);
+	record.u = flowRecordFloatToLE(u);
+	record.v = flowRecordFloatToLE(v);
+	return (record);
+}
+
+static inline uint16_t flowRecordGetX(const struct flow_record *record) {
+	return (le16toh(record->x));
+}
+
+static inline uint16_t flowRecordGetY(const struct flow_record *record) {
+	return ((uint16_t) (le16toh(record->yPolarity) & ~FLOW_RECORD_POLARITY_MASK));
+}
+
+static inline bool flowRecordGetPolarity(const struct flow_record *record) {
+	return ((le16toh(record->yPolarity) & FLOW_RECORD_POLARITY_MASK) != 0);
+}
+
+static inline int64_t flowRecordGetTimestamp64(const struct flow_record *record, int32_t tsOverflow) {
+	return ((int64_t) (((uint64_t) tsOverflow << TS_OVERFLOW_SHIFT) | (uint32_t) le32toh((uint32_t) record->timestamp)));
+}
+
+static inline float flowRecordGetU(const struct flow_record *record) {
+	return (flowRecordFloatFromLE(record->u));
+}
+
+static inline float flowRecordGetV(const struct flow_record *record) {
+	return (flowRecordFloatFromLE(record->v));
+}
+
+#endif /* MODULES_OPTICFLOW_FLOWRECORD_H_ */
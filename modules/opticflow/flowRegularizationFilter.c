@@ -7,95 +7,93 @@
 
 #include "flowRegularizationFilter.h"
 
-#define DEG2RAD M_PI/180
-
-void flowRegularizationFilter(FlowEvent e, FlowEventBuffer buffer,
+void flowRegularizationFilter(FlowEvent e, int64_t t, FlowEventBuffer buffer,
 		FlowRegularizationFilterParams params) {
 	if (!e->hasFlow) {	// Only apply filter if the event has flow at all
 		return;
 	}
 
 	// Extract event properties
-	int64_t  t = e->timestamp;
 	uint16_t x = caerPolarityEventGetX((caerPolarityEvent) e);
 	uint16_t y = caerPolarityEventGetY((caerPolarityEvent) e);
-	uint16_t xMin = (uint16_t) (x - params.dx/2);
-	uint16_t xMax = (uint16_t) (x + params.dx/2);
+	uint16_t xMin, xMax;
+	flowEventBufferClampX(buffer, x, params.dx/2, &xMin, &xMax);
 	uint16_t yMin = (uint16_t) (y - params.dx/2);
 	uint16_t yMax = (uint16_t) (y + params.dx/2);
 
-	double magnitude = sqrt(e->u*e->u + e->v*e->v);
-	double angle = atan2(e->v,e->u);
-	double rejectMagnitudeDifference = magnitude * params.maxSpeedFactor;
-	double rejectAngleDifference = DEG2RAD * params.maxSpeedFactor; // we work with radians
-	double magnitudeMean = magnitude;
-	double angleMean = angle;
-
-	double uHat = cos(angle);
-	double vHat = sin(angle);
+	// Neighbors are compared by magnitude and unit direction, as stored in
+	// the buffer, so the angle criterion becomes a dot product against
+	// the cosine of the maximum angle.
+	float magnitude = sqrtf(e->u*e->u + e->v*e->v);
+	float uHat = (magnitude > 0) ? (e->u / magnitude) : (0);
+	float vHat = (magnitude > 0) ? (e->v / magnitude) : (0);
+	float rejectMagnitudeDifference = magnitude * (float) params.maxSpeedFactor;
+	float minCosAngle = (float) params.minCosAngle;
 
 	// Bounds checking
-	if (xMin > buffer->sizeX-1) {
-		xMin = 0; // In case of uint, cannot be zero.
-	}
 	if (yMin > buffer->sizeY-1) {
-		yMin = 0;
-	}
-	if (xMax > buffer->sizeX-1) {
-		xMax = (uint16_t) (buffer->sizeX-1);
+		yMin = 0; // In case of uint, cannot be zero.
 	}
 	if (yMax > buffer->sizeY-1) {
 		yMax = (uint16_t) (buffer->sizeY-1);
 	}
 
-	// Scan in neighborhood for flow vectors
+	// Scan in neighborhood for flow vectors. Pixels are contiguous in y.
 	uint16_t xx,yy,i;
 	uint16_t n = 0;
+	float magnitudeSum = magnitude;
+	float uHatSum = uHat;
+	float vHatSum = vHat;
 	for (xx = xMin; xx < xMax+1; xx++) {
-		for (yy = yMin; yy < yMax+1; yy++) {
+		size_t pixel = flowEventBufferPixel(buffer,xx,yMin);
+		for (yy = yMin; yy < yMax+1; yy++, pixel++) {
+			if (xx == x && yy == y) {
+				continue;
+			}
+			// Flow direction criterion: only neighbors the flow came from
+			float dx = (float) (xx - x);
+			float dy = (float) (yy - y);
+			if (uHat*dx + vHat*dy > 0) {
+				continue;
+			}
 			for (i = 0; i < (uint16_t) buffer->size; i++) {
-				if (xx == x && yy == y) {
-					break;
-				}
-				FlowEvent eB = flowEventBufferRead(buffer,xx,yy,i);
-				if (!eB->hasFlow) {
+				size_t slot = flowEventBufferSlot(buffer,pixel,i);
+				if (!buffer->hasFlow[slot]) {
 					continue;
 				}
-				if (t-eB->timestamp > params.dtMax) {
-					break;
-				}
-				// Flow direction criterion
-				int dx = xx - x;
-				int dy = yy - y;
-				if (uHat*dx + vHat*dy > 0) {
+				if (t-buffer->timestamp[slot] > params.dtMax) {
 					break;
 				}
-
 				// Magnitude criterion
-				double magnitudeB = sqrt(eB->u*eB->u + eB->v*eB->v);
-				double magnitudeDifference = fabs(magnitude - magnitudeB);
-				if (magnitudeDifference > rejectMagnitudeDifference) {
+				float magnitudeB = buffer->magnitude[slot];
+				if (fabsf(magnitude - magnitudeB) > rejectMagnitudeDifference) {
 					break;
 				}
 				// Orientation criterion
-				double angleB = atan2(eB->v, eB->u);
-				double num = angle-angleB+M_PI;
-				int sig = (num > 0) - (num < 0);
-				double angleDifference = fabs(fmod(num*sig,2*M_PI)-M_PI);
-				if (angleDifference > rejectAngleDifference) {
+				float uHatB = buffer->uHat[slot];
+				float vHatB = buffer->vHat[slot];
+				if (uHat*uHatB + vHat*vHatB < minCosAngle) {
 					break;
 				}
 				n++;
-				// Recursive averaging of magnitude and angle
-				magnitudeMean += magnitudeDifference/n;
-				angleMean += angleDifference/n;
+				magnitudeSum += magnitudeB;
+				uHatSum += uHatB;
+				vHatSum += vHatB;
 				break; // only consider last found flow vector
 			}
 		}
 	}
 	if (n == 0) { // no neighbor support
 		e->hasFlow = false;
+		return;
+	}
+
+	// Mean magnitude, along the mean direction. The unit vectors passed the
+	// angle criterion, so their sum is not (close to) zero.
+	float magnitudeMean = magnitudeSum / (float) (n + 1);
+	float norm = sqrtf(uHatSum*uHatSum + vHatSum*vHatSum);
+	if (norm > 0) {
+		e->u = magnitudeMean * uHatSum / norm;
+		e->v = magnitudeMean * vHatSum / norm;
 	}
-	e->u = cos(angleMean)*magnitudeMean;
-	e->v = sin(angleMean)*magnitudeMean;
 }
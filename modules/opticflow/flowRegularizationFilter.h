@@ -15,15 +15,19 @@ typedef struct {
 	int64_t dtMax;
 	uint16_t dx;
 	double maxAngle;
+	/// Cosine of maxAngle (degrees), set along with it.
+	double minCosAngle;
 	double maxSpeedFactor;
 } FlowRegularizationFilterParams;
 
 /**
  * This filter rejects flow vectors that are not supported by
  * neighboring events with flow in a similar direction and
- * magnitude.
+ * magnitude. Supported flow is replaced by the mean magnitude and
+ * mean direction of the event and its supporting neighbors.
+ * The event must already have been added to the buffer.
  */
-void flowRegularizationFilter(FlowEvent e, FlowEventBuffer buffer,
+void flowRegularizationFilter(FlowEvent e, int64_t t, FlowEventBuffer buffer,
 		FlowRegularizationFilterParams params);
 
 
@@ -0,0 +1,251 @@
+/*
+ * flowTelemetry.c
+ *
+ * Flow summary frames, see flowTelemetry.h for the frame layout.
+ */
+
+#include "flowTelemetry.h"
+
+static inline size_t putU8(uint8_t *payload, size_t pos, uint8_t value);
+static inline size_t putU16(uint8_t *payload, size_t pos, uint16_t value);
+static inline size_t putI64(uint8_t *payload, size_t pos, int64_t value);
+static inline int16_t flowToTelemetry(float flow);
+static uint16_t crc16(const uint8_t *data, size_t length);
+static size_t cobsEncode(const uint8_t *data, size_t length, uint8_t *encoded);
+static void resetSummary(FlowTelemetry telemetry);
+
+FlowTelemetry flowTelemetryInit(uint16_t sizeX, uint16_t sizeY, uint8_t regions) {
+	FlowTelemetry telemetry = calloc(1, sizeof(struct flow_telemetry));
+	if (telemetry == NULL) {
+		return (NULL);
+	}
+
+	if (regions < 1) {
+		regions = 1;
+	}
+	if (regions > FLOW_TELEMETRY_MAX_REGIONS) {
+		regions = FLOW_TELEMETRY_MAX_REGIONS;
+	}
+
+	telemetry->sizeX = sizeX;
+	telemetry->sizeY = sizeY;
+	telemetry->regions = regions;
+
+	return (telemetry);
+}
+
+void flowTelemetryFree(FlowTelemetry telemetry) {
+	free(telemetry);
+}
+
+void flowTelemetryAddPacket(FlowTelemetry telemetry, FlowEventPacket packet) {
+	caerEventPacketHeader header = &packet->packetHeader;
+	int32_t eventNumber = caerEventPacketHeaderGetEventNumber(header);
+	if (eventNumber == 0) {
+		return;
+	}
+
+	uint32_t regions = telemetry->regions;
+	int32_t flowNumber = 0;
+
+	for (int32_t i = 0; i < eventNumber; i++) {
+		FlowEvent e = &packet->events[i];
+		if (!e->hasFlow) {
+			continue;
+		}
+
+		uint32_t x = caerPolarityEventGetX((caerPolarityEvent) e);
+		uint32_t y = caerPolarityEventGetY((caerPolarityEvent) e);
+		uint32_t rx = (x * regions) / telemetry->sizeX;
+		uint32_t ry = (y * regions) / telemetry->sizeY;
+		if (rx >= regions || ry >= regions) {
+			continue;
+		}
+
+		size_t region = ry * regions + rx;
+		telemetry->regionSumU[region] += e->u;
+		telemetry->regionSumV[region] += e->v;
+		telemetry->regionCount[region]++;
+		flowNumber++;
+	}
+
+	if (flowNumber == 0) {
+		return;
+	}
+
+	// Only the newest events are worth sending: replace the subsample.
+	int32_t stride = (flowNumber + FLOW_TELEMETRY_MAX_EVENTS - 1) / FLOW_TELEMETRY_MAX_EVENTS;
+	int32_t flowIndex = 0;
+	telemetry->eventsNumber = 0;
+
+	for (int32_t i = 0; i < eventNumber; i++) {
+		FlowEvent e = &packet->events[i];
+		if (!e->hasFlow) {
+			continue;
+		}
+
+		int64_t t = flowEventGetTimestamp64(e, packet);
+		telemetry->timestamp = t;
+
+		if ((flowIndex++ % stride) != 0 || telemetry->eventsNumber >= FLOW_TELEMETRY_MAX_EVENTS) {
+			continue;
+		}
+
+		struct flow_telemetry_event *te = &telemetry->events[telemetry->eventsNumber++];
+		te->x = caerPolarityEventGetX((caerPolarityEvent) e);
+		te->y = caerPolarityEventGetY((caerPolarityEvent) e);
+		te->timestamp = t;
+		te->u = e->u;
+		te->v = e->v;
+	}
+
+	telemetry->hasData = true;
+}
+
+size_t flowTelemetryFrameSize(uint8_t regions, int32_t eventsNumber) {
+	size_t payload = FLOW_TELEMETRY_HEADER_SIZE + (size_t) (regions * regions) * FLOW_TELEMETRY_REGION_SIZE
+		+ (size_t) eventsNumber * FLOW_TELEMETRY_EVENT_SIZE + FLOW_TELEMETRY_CRC_SIZE;
+
+	// COBS adds one byte per started 254 byte block, plus the delimiter.
+	return (payload + (payload / 254) + 1 + 1);
+}
+
+size_t flowTelemetryEncodeFrame(FlowTelemetry telemetry, uint8_t *frame, size_t budget) {
+	if (!telemetry->hasData) {
+		return (0);
+	}
+
+	// Fit as many events as the budget allows, spread over the subsample.
+	int32_t eventsNumber = telemetry->eventsNumber;
+	while (eventsNumber > 0 && flowTelemetryFrameSize(telemetry->regions, eventsNumber) > budget) {
+		eventsNumber--;
+	}
+
+	uint8_t payload[FLOW_TELEMETRY_MAX_FRAME];
+	size_t pos = 0;
+
+	pos = putU8(payload, pos, FLOW_TELEMETRY_FRAME_SUMMARY);
+	pos = putU8(payload, pos, telemetry->sequence++);
+	pos = putI64(payload, pos, telemetry->timestamp);
+	pos = putU8(payload, pos, telemetry->regions);
+	pos = putU8(payload, pos, (uint8_t) eventsNumber);
+
+	size_t regionsNumber = (size_t) (telemetry->regions * telemetry->regions);
+	for (size_t r = 0; r < regionsNumber; r++) {
+		uint32_t count = telemetry->regionCount[r];
+		float meanU = (count > 0) ? (telemetry->regionSumU[r] / (float) count) : (0);
+		float meanV = (count > 0) ? (telemetry->regionSumV[r] / (float) count) : (0);
+
+		pos = putU16(payload, pos, (uint16_t) flowToTelemetry(meanU));
+		pos = putU16(payload, pos, (uint16_t) flowToTelemetry(meanV));
+		pos = putU16(payload, pos, (count > UINT16_MAX) ? (UINT16_MAX) : ((uint16_t) count));
+	}
+
+	for (int32_t i = 0; i < eventsNumber; i++) {
+		// Evenly spaced over the subsample, ending with the newest event.
+		int32_t n = telemetry->eventsNumber - 1
+			- (int32_t) (((int64_t) (eventsNumber - 1 - i) * telemetry->eventsNumber) / eventsNumber);
+		struct flow_telemetry_event *te = &telemetry->events[n];
+
+		int64_t age = telemetry->timestamp - te->timestamp;
+
+		pos = putU16(payload, pos, te->x);
+		pos = putU16(payload, pos, te->y);
+		pos = putU16(payload, pos, (age > UINT16_MAX) ? (UINT16_MAX) : ((uint16_t) age));
+		pos = putU16(payload, pos, (uint16_t) flowToTelemetry(te->u));
+		pos = putU16(payload, pos, (uint16_t) flowToTelemetry(te->v));
+	}
+
+	pos = putU16(payload, pos, crc16(payload, pos));
+
+	size_t frameSize = cobsEncode(payload, pos, frame);
+	frame[frameSize++] = 0;
+
+	resetSummary(telemetry);
+
+	return (frameSize);
+}
+
+static void resetSummary(FlowTelemetry telemetry) {
+	memset(telemetry->regionSumU, 0, sizeof(telemetry->regionSumU));
+	memset(telemetry->regionSumV, 0, sizeof(telemetry->regionSumV));
+	memset(telemetry->regionCount, 0, sizeof(telemetry->regionCount));
+	telemetry->eventsNumber = 0;
+	telemetry->hasData = false;
+}
+
+static inline size_t putU8(uint8_t *payload, size_t pos, uint8_t value) {
+	payload[pos] = value;
+	return (pos + 1);
+}
+
+static inline size_t putU16(uint8_t *payload, size_t pos, uint16_t value) {
+	payload[pos] = (uint8_t) value;
+	payload[pos + 1] = (uint8_t) (value >> 8);
+	return (pos + 2);
+}
+
+static inline size_t putI64(uint8_t *payload, size_t pos, int64_t value) {
+	for (size_t i = 0; i < 8; i++) {
+		payload[pos + i] = (uint8_t) ((uint64_t) value >> (8 * i));
+	}
+	return (pos + 8);
+}
+
+static inline int16_t flowToTelemetry(float flow) {
+	float scaled = flow * FLOW_TELEMETRY_FLOW_SCALE;
+
+	if (scaled >= (float) INT16_MAX) {
+		return (INT16_MAX);
+	}
+	if (scaled <= (float) INT16_MIN) {
+		return (INT16_MIN);
+	}
+
+	return ((int16_t) lrintf(scaled));
+}
+
+/**
+ * CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF), bitwise:
+ * frames are small and sent at most a few hundred times per second.
+ */
+static uint16_t crc16(const uint8_t *data, size_t length) {
+	uint16_t crc = 0xFFFF;
+
+	for (size_t i = 0; i < length; i++) {
+		crc = (uint16_t) (crc ^ (data[i] << 8));
+
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (uint16_t) ((crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1));
+		}
+	}
+
+	return (crc);
+}
+
+/**
+ * Consistent Overhead Byte Stuffing: removes all zero bytes from data, so
+ * that zero can delimit frames. Returns the encoded length.
+ */
+static size_t cobsEncode(const uint8_t *data, size_t length, uint8_t *encoded) {
+	size_t codePos = 0;
+	size_t pos = 1;
+	uint8_t code = 1;
+
+	for (size_t i = 0; i < length; i++) {
+		if (data[i] != 0) {
+			encoded[pos++] = data[i];
+			code++;
+		}
+
+		if (data[i] == 0 || code == 0xFF) {
+			encoded[codePos] = code;
+			codePos = pos++;
+			code = 1;
+		}
+	}
+
+	encoded[codePos] = code;
+
+	return (pos);
+}
@@ -0,0 +1,86 @@
+/*
+ * flowTelemetry.h
+ *
+ * Compact flow summaries for a bandwidth-limited link (UART to the flight
+ * controller): per-region mean flow over the sensor, plus a subsample of the
+ * newest flow events, sized to fit a byte budget per frame.
+ *
+ * Frame payload, all little-endian:
+ *	uint8_t  type (FLOW_TELEMETRY_FRAME_SUMMARY)
+ *	uint8_t  sequence number
+ *	int64_t  timestamp of the newest flow event (us)
+ *	uint8_t  regions N (grid of N x N regions, row-major)
+ *	uint8_t  number of events E
+ *	N*N x    { int16_t u, int16_t v, uint16_t flow events }
+ *	E x      { uint16_t x, uint16_t y, uint16_t age (us before timestamp), int16_t u, int16_t v }
+ *	uint16_t CRC-16/CCITT-FALSE over all of the above
+ * Flow is in units of 1/FLOW_TELEMETRY_FLOW_SCALE px/s, saturated to int16.
+ * The payload is COBS-encoded and terminated by a zero byte, so a receiver
+ * resynchronizes on the next zero after a corrupted or dropped byte.
+ */
+
+#ifndef MODULES_OPTICFLOW_FLOWTELEMETRY_H_
+#define MODULES_OPTICFLOW_FLOWTELEMETRY_H_
+
+#include "flowEvent.h"
+
+#define FLOW_TELEMETRY_FRAME_SUMMARY 1
+#define FLOW_TELEMETRY_FLOW_SCALE 10.0f
+#define FLOW_TELEMETRY_MAX_REGIONS 8
+#define FLOW_TELEMETRY_MAX_EVENTS 64
+#define FLOW_TELEMETRY_HEADER_SIZE 12
+#define FLOW_TELEMETRY_REGION_SIZE 6
+#define FLOW_TELEMETRY_EVENT_SIZE 10
+#define FLOW_TELEMETRY_CRC_SIZE 2
+/// Largest encoded frame: full payload, COBS overhead and delimiter.
+#define FLOW_TELEMETRY_MAX_FRAME 1152
+
+struct flow_telemetry_event {
+	uint16_t x;
+	uint16_t y;
+	int64_t timestamp;
+	float u;
+	float v;
+};
+
+struct flow_telemetry {
+	uint16_t sizeX;
+	uint16_t sizeY;
+	uint8_t regions;
+	uint8_t sequence;
+	/// Flow summed per region since the last frame.
+	float regionSumU[FLOW_TELEMETRY_MAX_REGIONS * FLOW_TELEMETRY_MAX_REGIONS];
+	float regionSumV[FLOW_TELEMETRY_MAX_REGIONS * FLOW_TELEMETRY_MAX_REGIONS];
+	uint32_t regionCount[FLOW_TELEMETRY_MAX_REGIONS * FLOW_TELEMETRY_MAX_REGIONS];
+	/// Evenly spaced subsample of the newest packet, oldest first.
+	struct flow_telemetry_event events[FLOW_TELEMETRY_MAX_EVENTS];
+	int32_t eventsNumber;
+	int64_t timestamp;
+	bool hasData;
+};
+
+typedef struct flow_telemetry *FlowTelemetry;
+
+FlowTelemetry flowTelemetryInit(uint16_t sizeX, uint16_t sizeY, uint8_t regions);
+void flowTelemetryFree(FlowTelemetry telemetry);
+
+/**
+ * Add the flow events of a packet to the summary. Cheap enough to be called
+ * for every packet, also those that will never be sent themselves.
+ */
+void flowTelemetryAddPacket(FlowTelemetry telemetry, FlowEventPacket packet);
+
+/**
+ * Encode the summary of everything added since the last frame into frame,
+ * with as many events as fit in budget bytes (the summary itself is always
+ * sent whole), and start a new summary.
+ * Returns the encoded frame size, or 0 if nothing was added since the last frame.
+ */
+size_t flowTelemetryEncodeFrame(FlowTelemetry telemetry, uint8_t *frame, size_t budget);
+
+/**
+ * Encoded size of a frame with the given number of events.
+ */
+size_t flowTelemetryFrameSize(uint8_t regions, int32_t eventsNumber);
+
+#endif /* MODULES_OPTICFLOW_FLOWTELEMETRY_H_ */
@@ -0,0 +1,88 @@
+/*
+ * flowTimeSurface.c
+ *
+ * Optic flow from the local gradient of the time surface.
+ */
+
+#include "flowTimeSurface.h"
+
+#define FLOW_PIX_PER_SECOND 1e6f
+
+static inline bool timeSurfaceRead(FlowEventBuffer buffer, int32_t x, int32_t y, uint8_t p, int64_t t,
+	int64_t dtMax, float *dt);
+
+void flowTimeSurface(FlowEvent e, int64_t t, FlowEventBuffer buffer,
+		FlowTimeSurfaceParams params) {
+	int32_t x = caerPolarityEventGetX((caerPolarityEvent) e);
+	int32_t y = caerPolarityEventGetY((caerPolarityEvent) e);
+	uint8_t p = caerPolarityEventGetPolarity((caerPolarityEvent) e);
+
+	// Time since the most recent events at the neighbors, the new event is at 0.
+	float dtLeft, dtRight, dtDown, dtUp;
+	bool left = timeSurfaceRead(buffer, x - 1, y, p, t, params.dtMax, &dtLeft);
+	bool right = timeSurfaceRead(buffer, x + 1, y, p, t, params.dtMax, &dtRight);
+	bool down = timeSurfaceRead(buffer, x, y - 1, p, t, params.dtMax, &dtDown);
+	bool up = timeSurfaceRead(buffer, x, y + 1, p, t, params.dtMax, &dtUp);
+
+	// Time surface gradient in µs/px: T(neighbor) - T(event) = -dt, to the
+	// neighbor with the most recent event. On the other side, the edge has
+	// not passed yet, so older events are left there.
+	float gx, gy;
+	if (left && (!right || dtLeft <= dtRight)) {
+		gx = dtLeft;
+	}
+	else if (right) {
+		gx = -dtRight;
+	}
+	else {
+		return;
+	}
+
+	if (down && (!up || dtDown <= dtUp)) {
+		gy = dtDown;
+	}
+	else if (up) {
+		gy = -dtUp;
+	}
+	else {
+		return;
+	}
+
+	// Reject if magnitude is too large: flat time surface.
+	float gradient2 = gx*gx + gy*gy;
+	if (gradient2 < (float) (params.dtMin * params.dtMin) || gradient2 <= 0) {
+		return;
+	}
+
+	// Assign flow to event in pixels per second (instead of pix/us)
+	e->u = gx / gradient2 * FLOW_PIX_PER_SECOND;
+	e->v = gy / gradient2 * FLOW_PIX_PER_SECOND;
+	e->hasFlow = true;
+}
+
+/**
+ * Time since the most recent event of polarity p at (x,y), if there is one
+ * within dtMax, and (x,y) is inside the buffer.
+ */
+static inline bool timeSurfaceRead(FlowEventBuffer buffer, int32_t x, int32_t y, uint8_t p, int64_t t,
+	int64_t dtMax, float *dt) {
+	if (x < (int32_t) buffer->firstX || x >= (int32_t) (buffer->firstX + buffer->sizeX) || y < 0
+		|| y >= (int32_t) buffer->sizeY) {
+		return (false);
+	}
+
+	size_t pixel = flowEventBufferPixel(buffer, (uint16_t) x, (uint16_t) y);
+	for (size_t i = 0; i < buffer->size; i++) {
+		size_t slot = flowEventBufferSlot(buffer, pixel, i);
+		int64_t dtSlot = t - buffer->timestamp[slot];
+		if (dtSlot > dtMax) {
+			break;
+		}
+		if (buffer->polarity[slot] == p) {
+			*dt = (float) dtSlot;
+			return (true);
+		}
+	}
+
+	return (false);
+}
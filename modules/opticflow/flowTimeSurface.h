@@ -0,0 +1,38 @@
+/*
+ * flowTimeSurface.h
+ *
+ * Optic flow from the local gradient of the time surface.
+ */
+
+#ifndef FLOWTIMESURFACE_H_
+#define FLOWTIMESURFACE_H_
+
+#include "flowEvent.h"
+
+/**
+ * Parameters of the time surface algorithm.
+ */
+typedef struct {
+	int64_t dtMin;
+	int64_t dtMax;
+} FlowTimeSurfaceParams;
+
+/**
+ * The time surface holds, per pixel, the time of the most recent event of
+ * a polarity. Along a moving edge, it is a plane as fitted by
+ * flowBenosman2014(), whose gradient (in µs/px) gives the flow:
+ *	v = grad(T) / |grad(T)|^2
+ * Here the gradient is taken by finite differences to the direct neighbors
+ * of the new event, with the most recent event of the same polarity within
+ * dtMax: per axis, to the neighbor the edge came from, the one with the more
+ * recent event. On the other side, the edge has not passed yet.
+ * Flow faster than 1 px per dtMin is rejected: a time surface that flat is
+ * mostly timestamp jitter, so dtMin is best set well above it.
+ *
+ * No fit and no outlier rejection: four buffer reads per event, several
+ * times cheaper than flowBenosman2014(), but noisier.
+ */
+void flowTimeSurface(FlowEvent e, int64_t t, FlowEventBuffer buffer,
+		FlowTimeSurfaceParams params);
+
+#endif /* FLOWTIMESURFACE_H_ */
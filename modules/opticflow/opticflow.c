@@ -10,35 +10,121 @@
 #include "base/module.h"
 #include "ext/portable_time.h"
 #include "flowEvent.h"
-#include "flowBenosman2014.h"
+#include "flowAlgorithm.h"
 #include "flowRegularizationFilter.h"
 #include "flowOutput.h"
-#include "termios.h"
+#ifdef HAVE_PTHREADS
+	#include "ext/c11threads_posix.h"
+#endif
 
 #define FLOW_BUFFER_SIZE 3
 #define RING_BUFFER_SIZE 1024
-#define DVS128_LOCAL_FLOW_TO_VENTRAL_FLOW 1/115.0
+#define FLOW_BENCHMARK_INTERVAL 1000000 // in µs of event time
+#define FLOW_BUDGET_INTERVAL 100000 // in µs of event time
+#define FLOW_BUDGET_TARGET 0.8 // share of the budget aimed for, the rest is headroom
+#define FLOW_BUDGET_CHECK_EVENTS 64 // events between deadline checks
+#define FLOW_BUDGET_REFRACTORY_STEP 100 // in µs, smallest raise of the refractory period
 
 outputMode outMode = OF_OUT_FILE;
 
-char* UART_PORT = (char*) "/dev/ttySAC2"; // based on Odroid XU4 ports
-unsigned int BAUD = B921600;
+char* OUTPUT_FILE_NAME = "caerFlowEvents.bin"; // convert to CSV with flowcsv
 
-char* OUTPUT_FILE_NAME = "caerEventLog.csv";
+struct OpticFlowFilter_state;
 
-struct OpticFlowFilter_state {
+/**
+ * A vertical band of the sensor, owned by one thread. In serial mode, there is
+ * just one tile, covering all columns.
+ */
+struct OpticFlowFilter_tile {
+	/// Flow event buffer for the tile's columns, plus the halo columns on both
+	/// sides (clipped at the sensor borders).
 	FlowEventBuffer buffer;
-	FlowBenosman2014Params flowParams;
+	/// Columns owned by this tile.
+	size_t firstColumn;
+	size_t columns;
+	/// Validation results for the events owned by this tile.
+	int32_t validateCount;
+	int32_t validateMismatches;
+	/// Benchmark results for the events owned by this tile.
+	struct flow_benchmark benchmark;
+	/// Events owned by this tile that had no flow computed to stay within
+	/// the time budget.
+	int32_t budgetShed;
+	/// Worker thread (not used by tile 0, which runs on the mainloop thread).
+	thrd_t workerThread;
+	struct OpticFlowFilter_state *state;
+};
+
+typedef struct OpticFlowFilter_tile *OpticFlowFilterTile;
+
+struct OpticFlowFilter_state {
+	/// Flow event buffer tiles.
+	OpticFlowFilterTile tiles;
+	size_t tilesNumber;
+	/// Threads and halo width the tiles were set up for.
+	int8_t tilesThreads;
+	size_t tilesHalo;
+	int8_t threads;
+	int16_t sizeX;
+	int16_t sizeY;
+	FlowAlgorithm flowAlgorithm;
+	FlowAlgorithmParams flowParams;
 	FlowRegularizationFilterParams filterParams;
 	bool enableFlowRegularization;
+	bool validateFlow;
+	/// Benchmark mode: also run the reference algorithm on every event, and
+	/// publish the comparison to the 'benchmark/' node every interval.
+	bool benchmarkFlow;
+	struct flow_benchmark benchmark;
+	int64_t benchmarkStart;
+	sshsNode benchmarkNode;
 	int64_t refractoryPeriod;
+	/// Time budget: flow computation per packet is kept within budgetTime, by
+	/// raising the refractory period above the configured one as load grows,
+	/// by computing flow for an even subsample of at most budgetEvents events
+	/// per packet, and, as a last resort, by shedding the rest of a packet
+	/// once budgetDeadline has passed. Shed events are added to the buffer,
+	/// but invalidated, like those within the refractory period.
+	bool budgetEnable;
+	int64_t budgetTime; // in ns, like budgetCost and budgetDeadline
+	int64_t budgetMaxRefractoryPeriod;
+	int64_t budgetRefractoryPeriod;
+	double budgetCost;
+	int32_t budgetEvents;
+	int64_t budgetDeadline;
+	/// Time budget statistics since budgetStart, published to the 'budget/' node.
+	int64_t budgetStart;
+	int64_t budgetValid;
+	int64_t budgetShed;
+	int64_t budgetMisses;
+	double budgetLoad;
+	sshsNode budgetNode;
 	int8_t subSampleBy;
-	double wx, wy;
 	double flowRate;
+	int64_t timeDelay;
 	struct timespec timeInit;
 	int64_t timeInitEvent;
 	bool timeSet;
 	flowOutputState outputState;
+	/// Parallel mode: the events being worked on (only the valid ones), copied
+	/// out of the packet, with their full timestamp and index into it, plus the
+	/// result per event, written only by the tile owning it.
+	size_t batchSize;
+	size_t batchCapacity;
+	struct flow_event *batchEvents;
+	int64_t *batchTimestamps;
+	int32_t *batchIndexes;
+	struct flow_event *batchResults;
+	uint8_t *batchInvalid;
+	/// Parallel mode: worker synchronization.
+	mtx_t workLock;
+	cnd_t workStart;
+	cnd_t workDone;
+	uint64_t workGeneration;
+	size_t workPending;
+	bool workRunning;
+	/// Worker threads actually started, for tiles 1 to workersNumber.
+	size_t workersNumber;
 };
 
 typedef struct OpticFlowFilter_state *OpticFlowFilterState;
@@ -47,8 +133,29 @@ static bool caerOpticFlowFilterInit(caerModuleData moduleData);
 static void caerOpticFlowFilterRun(caerModuleData moduleData, size_t argsNumber, va_list args);
 static void caerOpticFlowFilterConfig(caerModuleData moduleData);
 static void caerOpticFlowFilterExit(caerModuleData moduleData);
-static bool allocateBuffer(OpticFlowFilterState state, int16_t sourceID);
+static int32_t flowPacketSerial(OpticFlowFilterState state, FlowEventPacket flow);
+static int32_t flowPacketParallel(OpticFlowFilterState state, FlowEventPacket flow);
+static void flowTileBatch(OpticFlowFilterState state, OpticFlowFilterTile tile);
+static int flowTileWorker(void *tileArg);
+static bool computeEventFlow(OpticFlowFilterState state, FlowEventBuffer buffer, FlowEvent e, int64_t t,
+	bool *differs, struct flow_benchmark *benchmark);
+static void benchmarkEventFlow(OpticFlowFilterState state, FlowEventBuffer buffer, FlowEvent e, int64_t t,
+	struct flow_benchmark *benchmark);
+static void publishBenchmark(caerModuleData moduleData, OpticFlowFilterState state, FlowEventPacket flow);
+static bool budgetShedEvent(OpticFlowFilterState state, size_t index, size_t number, size_t *checked,
+	bool *expired);
+static void updateBudget(OpticFlowFilterState state, FlowEventPacket flow, int64_t elapsed, int32_t eventsValid);
+static inline int64_t monotonicTimeNs(void);
+static void updateFlowStatistics(OpticFlowFilterState state, FlowEventPacket flow, int32_t index, FlowEvent e,
+	int64_t t, int32_t *flowCount);
+static void updateConfig(caerModuleData moduleData);
+static size_t tileHaloColumns(OpticFlowFilterState state);
+static bool startOutput(caerModuleData moduleData, OpticFlowFilterState state);
+static bool allocateBuffer(caerModuleData moduleData, OpticFlowFilterState state, int16_t sourceID);
+static void freeBuffer(OpticFlowFilterState state);
+static bool growBatch(OpticFlowFilterState state, size_t size);
 static int64_t computeTimeDelay(OpticFlowFilterState state, int64_t timeEvent);
+static bool flowDiffersFromScalar(struct flow_event *reference, FlowEvent e);
 
 static struct caer_module_functions caerOpticFlowFilterFunctions = { .moduleInit =
 	&caerOpticFlowFilterInit, .moduleRun = &caerOpticFlowFilterRun, .moduleConfig =
@@ -66,11 +173,23 @@ void caerOpticFlowFilter(uint16_t moduleID, FlowEventPacket flow) {
 static bool caerOpticFlowFilterInit(caerModuleData moduleData) {
 	sshsNodePutLongIfAbsent(moduleData->moduleNode, "refractoryPeriod", 10000);
 
+	sshsNodePutStringIfAbsent(moduleData->moduleNode, "flow_algorithm", "benosman2014"); // or timesurface, blockmatching
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "flow_benchmark", false); // compare to benosman2014
+
 	sshsNodePutLongIfAbsent(moduleData->moduleNode, "flow_dtMin", 3);
 	sshsNodePutLongIfAbsent(moduleData->moduleNode, "flow_dtMax", 300000);
 	sshsNodePutIntIfAbsent(moduleData->moduleNode,  "flow_dx", 3);
 	sshsNodePutDoubleIfAbsent(moduleData->moduleNode, "flow_thr1", 1E5);
 	sshsNodePutDoubleIfAbsent(moduleData->moduleNode, "flow_thr2", 5E3);
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "flow_validate", false);
+
+	sshsNodePutLongIfAbsent(moduleData->moduleNode, "ts_dtMin", 50); // in µs/px, i.e. at most 20000 px/s
+	sshsNodePutLongIfAbsent(moduleData->moduleNode, "ts_dtMax", 300000);
+
+	sshsNodePutLongIfAbsent(moduleData->moduleNode, "bm_sliceTime", 10000); // in µs
+	sshsNodePutByteIfAbsent(moduleData->moduleNode, "bm_blockRadius", 1);
+	sshsNodePutByteIfAbsent(moduleData->moduleNode, "bm_searchRadius", 2);
+	sshsNodePutByteIfAbsent(moduleData->moduleNode, "bm_minEvents", 3);
 
 	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "filter_enable",true);
 	sshsNodePutLongIfAbsent(moduleData->moduleNode, "filter_dtMax", 300000);
@@ -78,50 +197,45 @@ static bool caerOpticFlowFilterInit(caerModuleData moduleData) {
 	sshsNodePutDoubleIfAbsent(moduleData->moduleNode, "filter_dMag", 1.0);
 	sshsNodePutDoubleIfAbsent(moduleData->moduleNode, "filter_dAngle", 20);
 
-	sshsNodePutByteIfAbsent(moduleData->moduleNode, "subSampleBy", 0);
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "budget_enable", false);
+	sshsNodePutLongIfAbsent(moduleData->moduleNode, "budget_time", 5000); // in µs of processing time per packet
+	sshsNodePutLongIfAbsent(moduleData->moduleNode, "budget_maxRefractoryPeriod", 100000);
 
-	OpticFlowFilterState state = moduleData->moduleState;
+	sshsNodePutByteIfAbsent(moduleData->moduleNode, "subSampleBy", 0);
+	sshsNodePutByteIfAbsent(moduleData->moduleNode, "threads", 1); // >1 splits the sensor into tiles
 
-	state->refractoryPeriod = sshsNodeGetLong(moduleData->moduleNode, "refractoryPeriod");
+	sshsNodePutStringIfAbsent(moduleData->moduleNode, "uart_port", "/dev/ttySAC2"); // Odroid XU4
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "uart_baud", 921600);
+	sshsNodePutFloatIfAbsent(moduleData->moduleNode, "uart_budget", 0.8f); // share of the measured link rate
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "uart_frameRate", 100);
+	sshsNodePutByteIfAbsent(moduleData->moduleNode, "uart_regions", 4); // N x N regions
 
-	state->flowParams.dtMin = sshsNodeGetLong(moduleData->moduleNode, "flow_dtMin");
-	state->flowParams.dtMax = sshsNodeGetLong(moduleData->moduleNode, "flow_dtMax");
-	state->flowParams.dx 	= (uint16_t) sshsNodeGetInt(moduleData->moduleNode, "flow_dx");
-	state->flowParams.thr1  = sshsNodeGetDouble(moduleData->moduleNode, "flow_thr1");
-	state->flowParams.thr2  = sshsNodeGetDouble(moduleData->moduleNode, "flow_thr2");
+	OpticFlowFilterState state = moduleData->moduleState;
 
-	state->enableFlowRegularization = sshsNodeGetBool(moduleData->moduleNode, "filter_enable");
-	state->filterParams.dtMax = sshsNodeGetLong(moduleData->moduleNode, "filter_dtMax");
-	state->filterParams.dx = (uint16_t) sshsNodeGetInt(moduleData->moduleNode, "filter_dx");
-	state->filterParams.maxSpeedFactor = sshsNodeGetDouble(moduleData->moduleNode, "filter_dMag");
-	state->filterParams.maxAngle = sshsNodeGetDouble(moduleData->moduleNode, "filter_dAngle");
+	state->benchmarkNode = sshsGetRelativeNode(moduleData->moduleNode, "benchmark/");
+	sshsNodePutStringIfAbsent(state->benchmarkNode, "algorithm", "");
+	sshsNodePutLongIfAbsent(state->benchmarkNode, "events", 0);
+	sshsNodePutFloatIfAbsent(state->benchmarkNode, "coverage", 0.0f);
+	sshsNodePutFloatIfAbsent(state->benchmarkNode, "extraFlow", 0.0f);
+	sshsNodePutFloatIfAbsent(state->benchmarkNode, "relativeError", 0.0f);
+	sshsNodePutFloatIfAbsent(state->benchmarkNode, "angularError", 0.0f);
+	sshsNodePutFloatIfAbsent(state->benchmarkNode, "nsPerEvent", 0.0f);
+	sshsNodePutFloatIfAbsent(state->benchmarkNode, "referenceNsPerEvent", 0.0f);
 
-	state->subSampleBy = sshsNodeGetByte(moduleData->moduleNode, "subSampleBy");
+	state->budgetNode = sshsGetRelativeNode(moduleData->moduleNode, "budget/");
+	sshsNodePutLongIfAbsent(state->budgetNode, "refractoryPeriod", 0);
+	sshsNodePutIntIfAbsent(state->budgetNode, "eventBudget", 0);
+	sshsNodePutFloatIfAbsent(state->budgetNode, "load", 0.0f);
+	sshsNodePutFloatIfAbsent(state->budgetNode, "shedEvents", 0.0f);
+	sshsNodePutLongIfAbsent(state->budgetNode, "deadlineMisses", 0);
 
-	state->wx = 0;
-	state->wy = 0;
+	updateConfig(moduleData);
 
 	state->timeSet = false;
 
 	// Add config listeners last, to avoid having them dangling if Init doesn't succeed.
 	sshsNodeAddAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
 
-	state->outputState = malloc(sizeof(struct flow_output_state));
-	atomic_store(&state->outputState->running, false);
-	state->outputState->mode = outMode;
-	if (outMode == OF_OUT_UART || outMode == OF_OUT_BOTH) {
-		// Init UART communication
-		if (!initUartOutput(state->outputState, UART_PORT, BAUD, RING_BUFFER_SIZE)) {
-			caerLog(CAER_LOG_INFO,moduleData->moduleSubSystemString,
-					"UART communication not available.");
-		}
-	}
-	if (outMode == OF_OUT_FILE || outMode == OF_OUT_BOTH) {
-		if (!initFileOutput(state->outputState, OUTPUT_FILE_NAME, RING_BUFFER_SIZE)) {
-			caerLog(CAER_LOG_INFO,moduleData->moduleSubSystemString,
-					"UART communication not available.");
-		}
-	}
 	return (true);
 }
 
@@ -139,74 +253,539 @@ static void caerOpticFlowFilterRun(caerModuleData moduleData, size_t argsNumber,
 	OpticFlowFilterState state = moduleData->moduleState;
 
 	// If the map is not allocated yet, do it.
-	if (state->buffer == NULL) {
-		if (!allocateBuffer(state, caerEventPacketHeaderGetEventSource((caerEventPacketHeader) flow))) {
+	if (state->tiles == NULL) {
+		if (!allocateBuffer(moduleData, state, caerEventPacketHeaderGetEventSource((caerEventPacketHeader) flow))) {
 			// Failed to allocate memory, nothing to do.
 			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate memory for timestampMap.");
 			return;
 		}
 	}
 
-	int64_t delay = 0;
+	// Start output once the sensor size is known, the UART regions need it.
+	if (state->outputState == NULL) {
+		if (!startOutput(moduleData, state)) {
+			return;
+		}
+	}
+
+	for (size_t i = 0; i < state->tilesNumber; i++) {
+		state->tiles[i].validateCount = 0;
+		state->tiles[i].validateMismatches = 0;
+		state->tiles[i].budgetShed = 0;
+	}
+
+	// Time the flow computation for the budget, output is not part of it.
+	int64_t packetStart = monotonicTimeNs();
+	int32_t eventsValid = caerEventPacketHeaderGetEventValid((caerEventPacketHeader) flow);
+	state->budgetDeadline = packetStart + state->budgetTime;
+
+	int32_t flowCount;
+	if (state->tilesNumber > 1) {
+		flowCount = flowPacketParallel(state, flow);
+	}
+	else {
+		flowCount = flowPacketSerial(state, flow);
+	}
+
+	if (state->budgetEnable) {
+		updateBudget(state, flow, monotonicTimeNs() - packetStart, eventsValid);
+	}
+
+	int32_t validateCount = 0;
+	int32_t validateMismatches = 0;
+
+	for (size_t i = 0; i < state->tilesNumber; i++) {
+		validateCount += state->tiles[i].validateCount;
+		validateMismatches += state->tiles[i].validateMismatches;
+	}
+
+	if (validateMismatches > 0) {
+		caerLog(CAER_LOG_NOTICE, moduleData->moduleSubSystemString,
+			"Flow validation: %d of %d events differ from the scalar reference.",
+			validateMismatches, validateCount);
+	}
+
+	if (state->benchmarkFlow) {
+		publishBenchmark(moduleData, state, flow);
+	}
+
+	// Add event packet to ring buffer for transmission through UART/ to file
+	// Transmission is performed in a separate thread
+	if (atomic_load_explicit(&state->outputState->running, memory_order_relaxed)) {
+		addPacketToTransferBuffer(state->outputState, flow, flowCount);
+	}
+
+	// Print average optic flow, time delay, and flow rate
+//	fprintf(stdout, "%c[2K", 27);
+//	fprintf(stdout, "\rdelay: %ld ms. rate: %3.3fk",
+//			state->timeDelay/1000, state->flowRate*1e3);
+//	fflush(stdout);
+}
+
+static int32_t flowPacketSerial(OpticFlowFilterState state, FlowEventPacket flow) {
+	OpticFlowFilterTile tile = &state->tiles[0];
 	int32_t flowCount = 0;
 
+	size_t eventsValid = (size_t) caerEventPacketHeaderGetEventValid((caerEventPacketHeader) flow);
+	size_t validIndex = 0;
+	size_t checked = 0;
+	bool expired = false;
+
 	// Iterate over events and filter out ones that are not supported by other
 	// events within a certain region in the specified timeframe.
 	for (int32_t i = 0; i < caerEventPacketHeaderGetEventNumber((caerEventPacketHeader) flow); i++) {
 		FlowEvent e = flowEventPacketGetEvent(flow,i);
 		if (!caerPolarityEventIsValid((caerPolarityEvent) e)) { continue; } // Skip invalid events.
 
-		// Refractory period
-		uint16_t x = caerPolarityEventGetX((caerPolarityEvent) e);
-		uint16_t y = caerPolarityEventGetY((caerPolarityEvent) e);
-		FlowEvent eB = flowEventBufferRead(state->buffer,x,y,0);
-		if (e->timestamp - eB->timestamp < state->refractoryPeriod) {
-			flowEventBufferAdd(e, state->buffer); // preserve event but do not compute flow
+		int64_t t = flowEventGetTimestamp64(e, flow);
+
+		if (budgetShedEvent(state, validIndex++, eventsValid, &checked, &expired)) {
+			flowEventBufferAdd(e, t, tile->buffer);
+			caerPolarityEventInvalidate((caerPolarityEvent) e,
+					(caerPolarityEventPacket) flow);
+			tile->budgetShed++;
+			continue;
+		}
+
+		bool differs;
+		if (!computeEventFlow(state, tile->buffer, e, t, &differs, &tile->benchmark)) {
+			caerPolarityEventInvalidate((caerPolarityEvent) e,
+					(caerPolarityEventPacket) flow);
+			continue;
+		}
+
+		if (state->validateFlow) {
+			tile->validateCount++;
+			tile->validateMismatches += differs;
+		}
+
+		updateFlowStatistics(state, flow, i, e, t, &flowCount);
+	}
+
+	return (flowCount);
+}
+
+/**
+ * Parallel mode: copy the valid events into a batch, let all tiles work on it
+ * at the same time, then write the results back into the packet.
+ * Each tile goes through the events in packet (timestamp) order, and applies
+ * all those that fall into its buffer: events in its own columns, and in the
+ * halo columns around them whose flow the regularization filter looks at, get
+ * their flow computed, the ones further out are only added to the buffer, as
+ * the plane fit only needs their timestamp and polarity. So every tile sees
+ * exactly the same neighborhoods as the serial code, and gives the same results.
+ */
+static int32_t flowPacketParallel(OpticFlowFilterState state, FlowEventPacket flow) {
+	int32_t eventNumber = caerEventPacketHeaderGetEventNumber((caerEventPacketHeader) flow);
+
+	if (!growBatch(state, (size_t) eventNumber)) {
+		caerLog(CAER_LOG_ERROR, __func__, "Failed to allocate memory for event batch.");
+		return (0);
+	}
+
+	state->batchSize = 0;
+
+	for (int32_t i = 0; i < eventNumber; i++) {
+		FlowEvent e = flowEventPacketGetEvent(flow,i);
+		if (!caerPolarityEventIsValid((caerPolarityEvent) e)) { continue; } // Skip invalid events.
+
+		size_t j = state->batchSize++;
+
+		state->batchEvents[j] = *e;
+		state->batchTimestamps[j] = flowEventGetTimestamp64(e, flow);
+		state->batchIndexes[j] = i;
+		state->batchInvalid[j] = 0;
+	}
+
+	// Start workers, do tile 0 here, and wait for the others.
+	mtx_lock(&state->workLock);
+	state->workPending = state->tilesNumber - 1;
+	state->workGeneration++;
+	cnd_broadcast(&state->workStart);
+	mtx_unlock(&state->workLock);
+
+	flowTileBatch(state, &state->tiles[0]);
+
+	mtx_lock(&state->workLock);
+	while (state->workPending > 0) {
+		cnd_wait(&state->workDone, &state->workLock);
+	}
+	mtx_unlock(&state->workLock);
+
+	// Write results back in place, in packet order, same as in serial mode.
+	int32_t flowCount = 0;
+
+	for (size_t j = 0; j < state->batchSize; j++) {
+		FlowEvent e = flowEventPacketGetEvent(flow,state->batchIndexes[j]);
+
+		if (state->batchInvalid[j]) {
 			caerPolarityEventInvalidate((caerPolarityEvent) e,
 					(caerPolarityEventPacket) flow);
 			continue;
 		}
 
-		// Compute optic flow using events in buffer
-		flowBenosman2014(e,state->buffer,state->flowParams);
+		e->u = state->batchResults[j].u;
+		e->v = state->batchResults[j].v;
+		e->hasFlow = state->batchResults[j].hasFlow;
 
-		// Add event to buffer
-		flowEventBufferAdd(e,state->buffer);
+		updateFlowStatistics(state, flow, state->batchIndexes[j], e, state->batchTimestamps[j], &flowCount);
+	}
+
+	return (flowCount);
+}
 
-		// Apply flow regularization filter
-		if (state->enableFlowRegularization) {
-			flowRegularizationFilter(e,state->buffer,state->filterParams);
+static void flowTileBatch(OpticFlowFilterState state, OpticFlowFilterTile tile) {
+	// Events up to this many columns outside the tile need their flow computed.
+	size_t flowHalo = (state->enableFlowRegularization) ? (state->filterParams.dx / 2) : (0);
+
+	size_t bufferFirst = tile->buffer->firstX;
+	size_t bufferLast = bufferFirst + tile->buffer->sizeX;
+	size_t flowFirst = (tile->firstColumn > flowHalo) ? (tile->firstColumn - flowHalo) : (0);
+	size_t flowLast = tile->firstColumn + tile->columns + flowHalo;
+	size_t ownFirst = tile->firstColumn;
+	size_t ownLast = tile->firstColumn + tile->columns;
+
+	size_t checked = 0;
+	bool expired = false;
+
+	for (size_t j = 0; j < state->batchSize; j++) {
+		size_t x = caerPolarityEventGetX((caerPolarityEvent) &state->batchEvents[j]);
+
+		// Route: only events that fall into this tile's buffer touch it.
+		if (x < bufferFirst || x >= bufferLast) {
+			continue;
 		}
 
-		// For now, estimate average ventral flows for debugging purposes
-		if (e->hasFlow) {
-			double wxNew = e->u*DVS128_LOCAL_FLOW_TO_VENTRAL_FLOW;
-			double wyNew = e->v*DVS128_LOCAL_FLOW_TO_VENTRAL_FLOW;
-			state->wx += (wxNew-state->wx)/2;
-			state->wy += (wyNew-state->wy)/2;
-			flowCount++;
+		// Work on a copy, as other tiles may be reading the same event.
+		struct flow_event e = state->batchEvents[j];
+
+		if (x < flowFirst || x >= flowLast) {
+			flowEventBufferAdd(&e, state->batchTimestamps[j], tile->buffer);
+			continue;
 		}
 
-		// Estimate time delay and flow event rate using last event
-		if (caerEventPacketHeaderGetEventNumber((caerEventPacketHeader) flow) - i == 1) {
-			delay = computeTimeDelay(state, e->timestamp);
-			double packetTimeDiff = (double) (e->timestamp - flowEventPacketGetEvent(flow,0)->timestamp);
-			double flowRate = flowCount / (packetTimeDiff+0.00001);
-			state->flowRate += (flowRate-state->flowRate)/500;
+		// Only the owning tile writes results.
+		bool owned = (x >= ownFirst && x < ownLast);
+
+		// The subsample is the same for all tiles, the deadline is per tile.
+		if (budgetShedEvent(state, j, state->batchSize, &checked, &expired)) {
+			flowEventBufferAdd(&e, state->batchTimestamps[j], tile->buffer);
+			if (owned) {
+				state->batchInvalid[j] = 1;
+				tile->budgetShed++;
+			}
+			continue;
+		}
+
+		bool differs;
+		bool valid = computeEventFlow(state, tile->buffer, &e, state->batchTimestamps[j], &differs,
+			(owned) ? (&tile->benchmark) : (NULL));
+
+		if (owned) {
+			state->batchResults[j] = e;
+			state->batchInvalid[j] = !valid;
+
+			if (valid && state->validateFlow) {
+				tile->validateCount++;
+				tile->validateMismatches += differs;
+			}
 		}
 	}
+}
 
-	// Add event packet to ring buffer for transmission through UART/ to file
-	// Transmission is performed in a separate thread
-	if (atomic_load_explicit(&state->outputState->running, memory_order_relaxed)) {
-		addPacketToTransferBuffer(state->outputState, flow, flowCount);
+static int flowTileWorker(void *tileArg) {
+	OpticFlowFilterTile tile = tileArg;
+	OpticFlowFilterState state = tile->state;
+
+	uint64_t lastGeneration = 0;
+
+	mtx_lock(&state->workLock);
+
+	while (true) {
+		while (state->workRunning && state->workGeneration == lastGeneration) {
+			cnd_wait(&state->workStart, &state->workLock);
+		}
+
+		if (!state->workRunning) {
+			break;
+		}
+
+		lastGeneration = state->workGeneration;
+
+		mtx_unlock(&state->workLock);
+
+		flowTileBatch(state, tile);
+
+		mtx_lock(&state->workLock);
+
+		state->workPending--;
+		if (state->workPending == 0) {
+			cnd_signal(&state->workDone);
+		}
 	}
 
-	// Print average optic flow, time delay, and flow rate
-//	fprintf(stdout, "%c[2K", 27);
-//	fprintf(stdout, "\rwx: %1.3f. wy: %1.3f. delay: %ld ms. rate: %3.3fk",
-//			state->wx, state->wy, delay/1000, state->flowRate*1e3);
-//	fflush(stdout);
+	mtx_unlock(&state->workLock);
+
+	return (thrd_success);
+}
+
+/**
+ * Refractory check, flow computation and regularization for one event, using
+ * the given buffer. Returns false if the event falls within
+ * the refractory period and should be invalidated. When validating, 'differs'
+ * tells if the result differs from the scalar reference. When benchmarking,
+ * the event is added to 'benchmark', unless that is NULL (halo events).
+ */
+static bool computeEventFlow(OpticFlowFilterState state, FlowEventBuffer buffer, FlowEvent e, int64_t t,
+	bool *differs, struct flow_benchmark *benchmark) {
+	*differs = false;
+
+	// Refractory period
+	uint16_t x = caerPolarityEventGetX((caerPolarityEvent) e);
+	uint16_t y = caerPolarityEventGetY((caerPolarityEvent) e);
+	int64_t tB = flowEventBufferReadTimestamp(buffer,x,y);
+	if (t - tB < state->budgetRefractoryPeriod) {
+		flowEventBufferAdd(e, t, buffer); // preserve event but do not compute flow
+		return (false);
+	}
+
+	// When validating, run the scalar reference on a copy first, since
+	// both read the same buffer state.
+	struct flow_event reference;
+	if (state->validateFlow) {
+		reference = *e;
+		reference.u = 0;
+		reference.v = 0;
+		reference.hasFlow = false;
+		flowBenosman2014Scalar(&reference,t,buffer,state->flowParams.benosman2014);
+	}
+
+	// Compute optic flow using events in buffer
+	if (state->benchmarkFlow && benchmark != NULL) {
+		benchmarkEventFlow(state, buffer, e, t, benchmark);
+	}
+	else {
+		flowAlgorithmCompute(state->flowAlgorithm, e, t, buffer, &state->flowParams);
+	}
+
+	if (state->validateFlow) {
+		*differs = flowDiffersFromScalar(&reference, e);
+	}
+
+	// Add event to buffer
+	flowEventBufferAdd(e,t,buffer);
+
+	// Apply flow regularization filter
+	if (state->enableFlowRegularization) {
+		flowRegularizationFilter(e,t,buffer,state->filterParams);
+	}
+
+	return (true);
+}
+
+/**
+ * Benchmark mode: compute the flow with both the reference and the selected
+ * algorithm, on the same buffer state, timing each. The event gets the flow
+ * of the selected algorithm, as in normal operation.
+ */
+static void benchmarkEventFlow(OpticFlowFilterState state, FlowEventBuffer buffer, FlowEvent e, int64_t t,
+	struct flow_benchmark *benchmark) {
+	struct flow_event reference = *e;
+	struct timespec start, referenceDone, algorithmDone;
+
+	portable_clock_gettime_monotonic(&start);
+	flowAlgorithmCompute(FLOW_ALGORITHM_BENOSMAN2014, &reference, t, buffer, &state->flowParams);
+	portable_clock_gettime_monotonic(&referenceDone);
+	flowAlgorithmCompute(state->flowAlgorithm, e, t, buffer, &state->flowParams);
+	portable_clock_gettime_monotonic(&algorithmDone);
+
+	int64_t referenceTime = (referenceDone.tv_sec - start.tv_sec) * 1000000000LL
+		+ (referenceDone.tv_nsec - start.tv_nsec);
+	int64_t algorithmTime = (algorithmDone.tv_sec - referenceDone.tv_sec) * 1000000000LL
+		+ (algorithmDone.tv_nsec - referenceDone.tv_nsec);
+
+	flowBenchmarkAdd(benchmark, &reference, e, referenceTime, algorithmTime);
+}
+
+/**
+ * Collect the benchmark results of the tiles, and publish them every
+ * FLOW_BENCHMARK_INTERVAL of event time.
+ */
+static void publishBenchmark(caerModuleData moduleData, OpticFlowFilterState state, FlowEventPacket flow) {
+	for (size_t i = 0; i < state->tilesNumber; i++) {
+		flowBenchmarkMerge(&state->benchmark, &state->tiles[i].benchmark);
+		memset(&state->tiles[i].benchmark, 0, sizeof(struct flow_benchmark));
+	}
+
+	int32_t eventNumber = caerEventPacketHeaderGetEventNumber((caerEventPacketHeader) flow);
+	int64_t t = flowEventGetTimestamp64(flowEventPacketGetEvent(flow, eventNumber - 1), flow);
+
+	if (state->benchmarkStart < 0 || t < state->benchmarkStart) {
+		state->benchmarkStart = t;
+	}
+	if (t - state->benchmarkStart < FLOW_BENCHMARK_INTERVAL || state->benchmark.events == 0) {
+		return;
+	}
+
+	struct flow_benchmark *benchmark = &state->benchmark;
+	double events = (double) benchmark->events;
+	double referenceFlows = (benchmark->referenceFlows > 0) ? ((double) benchmark->referenceFlows) : (1);
+	double bothFlows = (benchmark->bothFlows > 0) ? ((double) benchmark->bothFlows) : (1);
+
+	float coverage = (float) ((double) benchmark->bothFlows / referenceFlows);
+	float extraFlow = (float) ((double) (benchmark->algorithmFlows - benchmark->bothFlows) / referenceFlows);
+	float relativeError = (float) (benchmark->relativeError / bothFlows);
+	float angularError = (float) (benchmark->angularError / bothFlows);
+	float nsPerEvent = (float) ((double) benchmark->algorithmTime / events);
+	float referenceNsPerEvent = (float) ((double) benchmark->referenceTime / events);
+
+	caerLog(CAER_LOG_NOTICE, moduleData->moduleSubSystemString,
+		"Benchmark %s: %.1f%% of reference flow, %.1f%% extra, error %.2f relative, %.1f deg; "
+		"%.0f ns/event, reference %.0f ns/event.", flowAlgorithmName(state->flowAlgorithm),
+		(double) coverage * 100, (double) extraFlow * 100, (double) relativeError, (double) angularError,
+		(double) nsPerEvent, (double) referenceNsPerEvent);
+
+	sshsNodePutString(state->benchmarkNode, "algorithm", flowAlgorithmName(state->flowAlgorithm));
+	sshsNodePutLong(state->benchmarkNode, "events", benchmark->events);
+	sshsNodePutFloat(state->benchmarkNode, "coverage", coverage);
+	sshsNodePutFloat(state->benchmarkNode, "extraFlow", extraFlow);
+	sshsNodePutFloat(state->benchmarkNode, "relativeError", relativeError);
+	sshsNodePutFloat(state->benchmarkNode, "angularError", angularError);
+	sshsNodePutFloat(state->benchmarkNode, "nsPerEvent", nsPerEvent);
+	sshsNodePutFloat(state->benchmarkNode, "referenceNsPerEvent", referenceNsPerEvent);
+
+	memset(benchmark, 0, sizeof(struct flow_benchmark));
+	state->benchmarkStart = t;
+}
+
+/**
+ * Time budget: tells if the index-th of number valid events in the packet is
+ * to be shed, either because it is not in the even subsample of budgetEvents
+ * events, or because the deadline has passed. The clock is only read every
+ * FLOW_BUDGET_CHECK_EVENTS events, counted in 'checked'; once the deadline
+ * has passed, 'expired' sheds all further events.
+ */
+static bool budgetShedEvent(OpticFlowFilterState state, size_t index, size_t number, size_t *checked,
+	bool *expired) {
+	if (!state->budgetEnable) {
+		return (false);
+	}
+
+	if (number > (size_t) state->budgetEvents) {
+		// Keep the events where the count of kept ones goes up.
+		size_t events = (size_t) state->budgetEvents;
+		if (((index + 1) * events) / number == (index * events) / number) {
+			return (true);
+		}
+	}
+
+	if (!*expired && ((*checked)++ % FLOW_BUDGET_CHECK_EVENTS) == 0) {
+		*expired = (monotonicTimeNs() >= state->budgetDeadline);
+	}
+
+	return (*expired);
+}
+
+/**
+ * Time budget: after each packet, update the moving average of the processing
+ * time per flow event, and from it the event budget for the next packet. The
+ * refractory period follows the demand, the share of the target the packet
+ * would have needed for all its events: above it, the refractory period is
+ * raised in proportion, so that fewer events need flow to begin with; below
+ * it, lowered back towards the configured one.
+ * Publishes the budget state to the 'budget/' node every FLOW_BUDGET_INTERVAL.
+ */
+static void updateBudget(OpticFlowFilterState state, FlowEventPacket flow, int64_t elapsed, int32_t eventsValid) {
+	int32_t shed = 0;
+	for (size_t i = 0; i < state->tilesNumber; i++) {
+		shed += state->tiles[i].budgetShed;
+	}
+
+	if (eventsValid > shed) {
+		double cost = (double) elapsed / (double) (eventsValid - shed);
+		state->budgetCost = (state->budgetCost > 0) ? (state->budgetCost + (cost - state->budgetCost) * 0.2) : (cost);
+	}
+
+	double target = (double) state->budgetTime * FLOW_BUDGET_TARGET;
+
+	if (state->budgetCost > 0) {
+		double events = target / state->budgetCost;
+		state->budgetEvents = (events > (double) INT32_MAX) ? (INT32_MAX) : ((events < 1) ? (1) : ((int32_t) events));
+
+		double demand = (double) eventsValid * state->budgetCost / target;
+		int64_t refractoryPeriod = state->budgetRefractoryPeriod;
+
+		if (demand > 1) {
+			if (refractoryPeriod < FLOW_BUDGET_REFRACTORY_STEP) {
+				refractoryPeriod = FLOW_BUDGET_REFRACTORY_STEP;
+			}
+			refractoryPeriod = (int64_t) ((double) refractoryPeriod * ((demand < 2) ? (demand) : (2)));
+		}
+		else if (demand < 0.9) {
+			refractoryPeriod = (int64_t) ((double) refractoryPeriod * ((demand > 0.8) ? (demand) : (0.8)));
+		}
+
+		if (refractoryPeriod > state->budgetMaxRefractoryPeriod) {
+			refractoryPeriod = state->budgetMaxRefractoryPeriod;
+		}
+		if (refractoryPeriod < state->refractoryPeriod) {
+			refractoryPeriod = state->refractoryPeriod;
+		}
+		state->budgetRefractoryPeriod = refractoryPeriod;
+	}
+
+	double load = (double) elapsed / (double) state->budgetTime;
+	if (load > state->budgetLoad) {
+		state->budgetLoad = load;
+	}
+	if (elapsed > state->budgetTime) {
+		state->budgetMisses++;
+	}
+	state->budgetValid += eventsValid;
+	state->budgetShed += shed;
+
+	int32_t eventNumber = caerEventPacketHeaderGetEventNumber((caerEventPacketHeader) flow);
+	if (eventNumber == 0) {
+		return;
+	}
+	int64_t t = flowEventGetTimestamp64(flowEventPacketGetEvent(flow, eventNumber - 1), flow);
+
+	if (state->budgetStart < 0 || t < state->budgetStart) {
+		state->budgetStart = t;
+	}
+	if (t - state->budgetStart < FLOW_BUDGET_INTERVAL) {
+		return;
+	}
+
+	double valid = (state->budgetValid > 0) ? ((double) state->budgetValid) : (1);
+
+	sshsNodePutLong(state->budgetNode, "refractoryPeriod", state->budgetRefractoryPeriod);
+	sshsNodePutInt(state->budgetNode, "eventBudget", state->budgetEvents);
+	sshsNodePutFloat(state->budgetNode, "load", (float) state->budgetLoad);
+	sshsNodePutFloat(state->budgetNode, "shedEvents", (float) ((double) state->budgetShed / valid));
+	sshsNodePutLong(state->budgetNode, "deadlineMisses", state->budgetMisses);
+
+	state->budgetValid = 0;
+	state->budgetShed = 0;
+	state->budgetMisses = 0;
+	state->budgetLoad = 0;
+	state->budgetStart = t;
+}
+
+static void updateFlowStatistics(OpticFlowFilterState state, FlowEventPacket flow, int32_t index, FlowEvent e,
+	int64_t t, int32_t *flowCount) {
+	// Ventral flow is estimated by the VentralFlow module, from the flow packet
+	if (e->hasFlow) {
+		(*flowCount)++;
+	}
+
+	// Estimate time delay and flow event rate using last event
+	if (caerEventPacketHeaderGetEventNumber((caerEventPacketHeader) flow) - index == 1) {
+		state->timeDelay = computeTimeDelay(state, t);
+		double packetTimeDiff = (double) (t - flowEventGetTimestamp64(flowEventPacketGetEvent(flow,0), flow));
+		double flowRate = *flowCount / (packetTimeDiff+0.00001);
+		state->flowRate += (flowRate-state->flowRate)/500;
+	}
 }
 
 static void caerOpticFlowFilterConfig(caerModuleData moduleData) {
@@ -214,47 +793,175 @@ static void caerOpticFlowFilterConfig(caerModuleData moduleData) {
 
 	OpticFlowFilterState state = moduleData->moduleState;
 
+	updateConfig(moduleData);
+
+	// Tiles depend on threads and on the neighborhood sizes, re-allocate them on next run.
+	if (state->tiles != NULL
+		&& (state->threads != state->tilesThreads
+			|| (state->tilesNumber > 1 && tileHaloColumns(state) != state->tilesHalo))) {
+		freeBuffer(state);
+	}
+}
+
+static void caerOpticFlowFilterExit(caerModuleData moduleData) {
+	// Remove listener, which can reference invalid memory in userData.
+	sshsNodeRemoveAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	OpticFlowFilterState state = moduleData->moduleState;
+
+	// Close UART connection/file if necessary
+	if (state->outputState != NULL) {
+		if (atomic_load_explicit(&state->outputState->running, memory_order_relaxed)) {
+			closeFlowOutput(state->outputState);
+		}
+		free(state->outputState);
+	}
+
+	// Ensure buffer is freed.
+	freeBuffer(state);
+}
+
+static void updateConfig(caerModuleData moduleData) {
+	OpticFlowFilterState state = moduleData->moduleState;
+
 	state->refractoryPeriod = sshsNodeGetLong(moduleData->moduleNode, "refractoryPeriod");
 
-	state->flowParams.dtMin = sshsNodeGetLong(moduleData->moduleNode, "flow_dtMin");
-	state->flowParams.dtMax = sshsNodeGetLong(moduleData->moduleNode, "flow_dtMax");
-	state->flowParams.dx 	= (uint16_t) sshsNodeGetInt(moduleData->moduleNode, "flow_dx");
-	state->flowParams.thr1  = sshsNodeGetDouble(moduleData->moduleNode, "flow_thr1");
-	state->flowParams.thr2  = sshsNodeGetDouble(moduleData->moduleNode, "flow_thr2");
+	char *algorithmName = sshsNodeGetString(moduleData->moduleNode, "flow_algorithm");
+	if (!flowAlgorithmFromName(algorithmName, &state->flowAlgorithm)) {
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString,
+			"Unknown flow algorithm '%s', using %s.", algorithmName, flowAlgorithmName(state->flowAlgorithm));
+	}
+	free(algorithmName);
+
+	// Any change can change the results, start a new benchmark.
+	state->benchmarkFlow = sshsNodeGetBool(moduleData->moduleNode, "flow_benchmark");
+	memset(&state->benchmark, 0, sizeof(state->benchmark));
+	state->benchmarkStart = -1;
+
+	state->flowParams.benosman2014.dtMin = sshsNodeGetLong(moduleData->moduleNode, "flow_dtMin");
+	state->flowParams.benosman2014.dtMax = sshsNodeGetLong(moduleData->moduleNode, "flow_dtMax");
+	state->flowParams.benosman2014.dx 	= (uint16_t) sshsNodeGetInt(moduleData->moduleNode, "flow_dx");
+	state->flowParams.benosman2014.thr1  = sshsNodeGetDouble(moduleData->moduleNode, "flow_thr1");
+	state->flowParams.benosman2014.thr2  = sshsNodeGetDouble(moduleData->moduleNode, "flow_thr2");
+	// Validation checks the fast plane fit against its scalar version.
+	state->validateFlow = sshsNodeGetBool(moduleData->moduleNode, "flow_validate")
+		&& state->flowAlgorithm == FLOW_ALGORITHM_BENOSMAN2014;
+
+	state->flowParams.timeSurface.dtMin = sshsNodeGetLong(moduleData->moduleNode, "ts_dtMin");
+	state->flowParams.timeSurface.dtMax = sshsNodeGetLong(moduleData->moduleNode, "ts_dtMax");
+
+	FlowBlockMatchingParams *blockMatching = &state->flowParams.blockMatching;
+	blockMatching->sliceTime = sshsNodeGetLong(moduleData->moduleNode, "bm_sliceTime");
+	blockMatching->blockRadius = U8T(sshsNodeGetByte(moduleData->moduleNode, "bm_blockRadius"));
+	blockMatching->searchRadius = U8T(sshsNodeGetByte(moduleData->moduleNode, "bm_searchRadius"));
+	blockMatching->minEvents = U8T(sshsNodeGetByte(moduleData->moduleNode, "bm_minEvents"));
+	if (blockMatching->blockRadius + blockMatching->searchRadius > FLOW_BLOCK_MATCHING_MAX_RADIUS) {
+		if (blockMatching->blockRadius > FLOW_BLOCK_MATCHING_MAX_RADIUS) {
+			blockMatching->blockRadius = FLOW_BLOCK_MATCHING_MAX_RADIUS;
+		}
+		blockMatching->searchRadius = (uint16_t) (FLOW_BLOCK_MATCHING_MAX_RADIUS - blockMatching->blockRadius);
+		caerLog(CAER_LOG_WARNING, moduleData->moduleSubSystemString,
+			"Block matching window too large, search radius limited to %d.", blockMatching->searchRadius);
+	}
 
 	state->enableFlowRegularization = sshsNodeGetBool(moduleData->moduleNode, "filter_enable");
 	state->filterParams.dtMax = sshsNodeGetLong(moduleData->moduleNode, "filter_dtMax");
 	state->filterParams.dx = (uint16_t) sshsNodeGetInt(moduleData->moduleNode, "filter_dx");
 	state->filterParams.maxSpeedFactor = sshsNodeGetDouble(moduleData->moduleNode, "filter_dMag");
 	state->filterParams.maxAngle = sshsNodeGetDouble(moduleData->moduleNode, "filter_dAngle");
+	state->filterParams.minCosAngle = cos(state->filterParams.maxAngle * M_PI / 180.0);
+
+	// Start the budget over from the configured refractory period.
+	state->budgetEnable = sshsNodeGetBool(moduleData->moduleNode, "budget_enable");
+	state->budgetTime = sshsNodeGetLong(moduleData->moduleNode, "budget_time") * 1000;
+	state->budgetMaxRefractoryPeriod = sshsNodeGetLong(moduleData->moduleNode, "budget_maxRefractoryPeriod");
+	if (state->budgetTime <= 0) {
+		caerLog(CAER_LOG_WARNING, moduleData->moduleSubSystemString,
+			"Flow time budget must be positive, budget disabled.");
+		state->budgetEnable = false;
+	}
+	state->budgetRefractoryPeriod = state->refractoryPeriod;
+	state->budgetCost = 0;
+	state->budgetEvents = INT32_MAX;
+	state->budgetStart = -1;
+	state->budgetValid = 0;
+	state->budgetShed = 0;
+	state->budgetMisses = 0;
+	state->budgetLoad = 0;
 
 	state->subSampleBy = sshsNodeGetByte(moduleData->moduleNode, "subSampleBy");
+	state->threads = sshsNodeGetByte(moduleData->moduleNode, "threads");
 }
 
-static void caerOpticFlowFilterExit(caerModuleData moduleData) {
-	// Remove listener, which can reference invalid memory in userData.
-	sshsNodeRemoveAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+/**
+ * Halo columns a tile needs on each side: the flow algorithm looks at events
+ * up to flowAlgorithmRadius() columns away, and the regularization filter looks
+ * at the flow of events up to filter_dx/2 columns away, which in turn needs theirs.
+ */
+static size_t tileHaloColumns(OpticFlowFilterState state) {
+	size_t halo = flowAlgorithmRadius(state->flowAlgorithm, &state->flowParams);
 
-	OpticFlowFilterState state = moduleData->moduleState;
+	if (state->enableFlowRegularization) {
+		halo += state->filterParams.dx / 2;
+	}
 
-	// Close UART connection/file if necessary
-	if (atomic_load_explicit(&state->outputState->running, memory_order_relaxed)) {
-		if (state->outputState->mode == OF_OUT_UART
-				|| state->outputState->mode == OF_OUT_BOTH) {
-			closeUartOutput(state->outputState);
+	return (halo);
+}
+
+/**
+ * Open the configured outputs and start the output thread. Outputs that fail
+ * to open are left out; the output state stays allocated either way, so this
+ * is only tried once.
+ */
+static bool startOutput(caerModuleData moduleData, OpticFlowFilterState state) {
+	state->outputState = calloc(1, sizeof(struct flow_output_state));
+	if (state->outputState == NULL) {
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate flow output state.");
+		return (false);
+	}
+	atomic_store(&state->outputState->running, false);
+
+	bool uartOpen = false;
+	bool fileOpen = false;
+	if (outMode == OF_OUT_UART || outMode == OF_OUT_BOTH) {
+		// Init UART communication
+		FlowUartParams uartParams;
+		uartParams.port = sshsNodeGetString(moduleData->moduleNode, "uart_port");
+		uartParams.baud = sshsNodeGetInt(moduleData->moduleNode, "uart_baud");
+		uartParams.budget = sshsNodeGetFloat(moduleData->moduleNode, "uart_budget");
+		uartParams.frameRate = sshsNodeGetInt(moduleData->moduleNode, "uart_frameRate");
+		uartParams.regions = U8T(sshsNodeGetByte(moduleData->moduleNode, "uart_regions"));
+		uartParams.sizeX = U16T(state->sizeX);
+		uartParams.sizeY = U16T(state->sizeY);
+
+		uartOpen = initUartOutput(state->outputState, uartParams);
+		free(uartParams.port);
+		if (!uartOpen) {
+			caerLog(CAER_LOG_INFO,moduleData->moduleSubSystemString,
+					"UART communication not available.");
 		}
-		if (state->outputState->mode == OF_OUT_FILE
-				|| state->outputState->mode == OF_OUT_BOTH) {
-			closeFileOutput(state->outputState);
+	}
+	if (outMode == OF_OUT_FILE || outMode == OF_OUT_BOTH) {
+		fileOpen = initFileOutput(state->outputState, OUTPUT_FILE_NAME);
+		if (!fileOpen) {
+			caerLog(CAER_LOG_INFO,moduleData->moduleSubSystemString,
+					"File output not available.");
+		}
+	}
+	// Only serve the outputs that could be opened
+	state->outputState->mode = (uartOpen && fileOpen) ? OF_OUT_BOTH :
+		(uartOpen) ? OF_OUT_UART : (fileOpen) ? OF_OUT_FILE : OF_OUT_NONE;
+	if (state->outputState->mode != OF_OUT_NONE) {
+		if (!startFlowOutput(state->outputState, RING_BUFFER_SIZE)) {
+			caerLog(CAER_LOG_INFO,moduleData->moduleSubSystemString,
+					"Flow output not available.");
 		}
 	}
-	free(state->outputState);
 
-	// Ensure buffer is freed.
-	flowEventBufferFree(state->buffer);
+	return (true);
 }
 
-static bool allocateBuffer(OpticFlowFilterState state, int16_t sourceID) {
+static bool allocateBuffer(caerModuleData moduleData, OpticFlowFilterState state, int16_t sourceID) {
 	// Get size information from source.
 	sshsNode sourceInfoNode = caerMainloopGetSourceInfo(U16T(sourceID));
 	if (sourceInfoNode == NULL) {
@@ -266,10 +973,164 @@ static bool allocateBuffer(OpticFlowFilterState state, int16_t sourceID) {
 	int16_t sizeX = sshsNodeGetShort(sourceInfoNode, "dvsSizeX");
 	int16_t sizeY = sshsNodeGetShort(sourceInfoNode, "dvsSizeY");
 
-	state->buffer = flowEventBufferInit((size_t) sizeX, (size_t) sizeY, FLOW_BUFFER_SIZE);
-	if (state->buffer == NULL) {
+	state->sizeX = sizeX;
+	state->sizeY = sizeY;
+
+	// Split columns evenly between tiles, one per thread. Columns, as the
+	// buffer is ordered by x, so a tile's part of it is contiguous.
+	size_t tilesNumber = (state->threads > 1) ? ((size_t) state->threads) : (1);
+	if (tilesNumber > (size_t) sizeX) {
+		tilesNumber = (size_t) sizeX;
+	}
+
+	size_t tileColumns = ((size_t) sizeX + tilesNumber - 1) / tilesNumber;
+	tilesNumber = ((size_t) sizeX + tileColumns - 1) / tileColumns;
+
+	// In serial mode the one buffer covers everything, no halo needed.
+	size_t halo = (tilesNumber > 1) ? (tileHaloColumns(state)) : (0);
+
+	state->tiles = calloc(tilesNumber, sizeof(struct OpticFlowFilter_tile));
+	if (state->tiles == NULL) {
+		return (false);
+	}
+
+	state->tilesNumber = tilesNumber;
+
+	for (size_t i = 0; i < tilesNumber; i++) {
+		OpticFlowFilterTile tile = &state->tiles[i];
+
+		tile->firstColumn = i * tileColumns;
+		tile->columns = (tile->firstColumn + tileColumns <= (size_t) sizeX) ?
+			(tileColumns) : ((size_t) sizeX - tile->firstColumn);
+		tile->state = state;
+
+		size_t bufferFirstColumn = (tile->firstColumn > halo) ? (tile->firstColumn - halo) : (0);
+		size_t bufferLastColumn = tile->firstColumn + tile->columns + halo;
+		if (bufferLastColumn > (size_t) sizeX) {
+			bufferLastColumn = (size_t) sizeX;
+		}
+
+		tile->buffer = flowEventBufferInit(bufferFirstColumn, bufferLastColumn - bufferFirstColumn, (size_t) sizeY,
+			FLOW_BUFFER_SIZE);
+		if (tile->buffer == NULL) {
+			// Tiles not reached yet have a NULL buffer, freeing them is fine.
+			freeBuffer(state);
+			return (false);
+		}
+	}
+
+	state->tilesThreads = state->threads;
+	state->tilesHalo = halo;
+
+	// Start worker threads for all tiles but the first.
+	if (tilesNumber > 1) {
+		mtx_init(&state->workLock, mtx_plain);
+		cnd_init(&state->workStart);
+		cnd_init(&state->workDone);
+
+		state->workGeneration = 0;
+		state->workPending = 0;
+		state->workRunning = true;
+		state->workersNumber = 0;
+
+		for (size_t i = 1; i < tilesNumber; i++) {
+			if (thrd_create(&state->tiles[i].workerThread, &flowTileWorker, &state->tiles[i]) != thrd_success) {
+				// Stops only the threads that were started, but frees all tiles.
+				freeBuffer(state);
+				return (false);
+			}
+
+			state->workersNumber = i;
+		}
+
+		caerLog(CAER_LOG_DEBUG, moduleData->moduleSubSystemString,
+			"Parallel mode with %zu tiles of %zu columns, %zu halo columns.", tilesNumber, tileColumns, halo);
+	}
+
+	return (true);
+}
+
+static void freeBuffer(OpticFlowFilterState state) {
+	if (state->tiles == NULL) {
+		return;
+	}
+
+	// Stop worker threads, if any.
+	if (state->workRunning) {
+		mtx_lock(&state->workLock);
+		state->workRunning = false;
+		cnd_broadcast(&state->workStart);
+		mtx_unlock(&state->workLock);
+
+		for (size_t i = 1; i <= state->workersNumber; i++) {
+			thrd_join(state->tiles[i].workerThread, NULL);
+		}
+
+		state->workersNumber = 0;
+
+		cnd_destroy(&state->workDone);
+		cnd_destroy(&state->workStart);
+		mtx_destroy(&state->workLock);
+	}
+
+	for (size_t i = 0; i < state->tilesNumber; i++) {
+		flowEventBufferFree(state->tiles[i].buffer);
+	}
+
+	free(state->tiles);
+	state->tiles = NULL;
+	state->tilesNumber = 0;
+
+	free(state->batchEvents);
+	free(state->batchTimestamps);
+	free(state->batchIndexes);
+	free(state->batchResults);
+	free(state->batchInvalid);
+
+	state->batchEvents = NULL;
+	state->batchTimestamps = NULL;
+	state->batchIndexes = NULL;
+	state->batchResults = NULL;
+	state->batchInvalid = NULL;
+	state->batchCapacity = 0;
+}
+
+static bool growBatch(OpticFlowFilterState state, size_t size) {
+	if (size <= state->batchCapacity) {
+		return (true);
+	}
+
+	struct flow_event *events = realloc(state->batchEvents, size * sizeof(struct flow_event));
+	if (events == NULL) {
 		return (false);
 	}
+	state->batchEvents = events;
+
+	int64_t *timestamps = realloc(state->batchTimestamps, size * sizeof(int64_t));
+	if (timestamps == NULL) {
+		return (false);
+	}
+	state->batchTimestamps = timestamps;
+
+	int32_t *indexes = realloc(state->batchIndexes, size * sizeof(int32_t));
+	if (indexes == NULL) {
+		return (false);
+	}
+	state->batchIndexes = indexes;
+
+	struct flow_event *results = realloc(state->batchResults, size * sizeof(struct flow_event));
+	if (results == NULL) {
+		return (false);
+	}
+	state->batchResults = results;
+
+	uint8_t *invalid = realloc(state->batchInvalid, size * sizeof(uint8_t));
+	if (invalid == NULL) {
+		return (false);
+	}
+	state->batchInvalid = invalid;
+
+	state->batchCapacity = size;
 
 	return (true);
 }
@@ -296,3 +1157,22 @@ static int64_t computeTimeDelay(OpticFlowFilterState state, int64_t timeEvent) {
 		return (delay);
 	}
 }
+
+static inline int64_t monotonicTimeNs(void) {
+	struct timespec currentTime;
+	portable_clock_gettime_monotonic(&currentTime);
+	return (I64T(currentTime.tv_sec) * 1000000000LL + currentTime.tv_nsec);
+}
+
+static bool flowDiffersFromScalar(struct flow_event *reference, FlowEvent e) {
+	if (reference->hasFlow != e->hasFlow) {
+		return (true);
+	}
+	if (!e->hasFlow) {
+		return (false);
+	}
+
+	// The fast fit runs in float, so allow a small relative error.
+	float tolerance = 1e-3f * (fabsf(reference->u) + fabsf(reference->v) + 1e-9f);
+	return (fabsf(reference->u - e->u) > tolerance || fabsf(reference->v - e->v) > tolerance);
+}
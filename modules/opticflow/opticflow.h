@@ -18,9 +18,9 @@
  * It can be used in conjunction with the background activity
  * filter and the visualizer.
  *
- * Currently, only local optic flow values are produced.
- * A future version of this module also computes
- * ego-motion estimates through ventral flow and divergence.
+ * Only local optic flow values are produced; ego-motion
+ * estimates through ventral flow and divergence are made
+ * from them by the VentralFlow module (ventralflow.h).
  */
 void caerOpticFlowFilter(uint16_t moduleID, FlowEventPacket polarity);
 
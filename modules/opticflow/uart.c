@@ -189,6 +189,16 @@ int uart_tx(int len, unsigned char *data)
   return 0;
 }
 
+int uart_tx_queued()
+{
+  COMSTAT status;
+  DWORD errors;
+  if (!ClearCommError(serial_handle, &errors, &status)) {
+    return -1;
+  }
+  return (int) status.cbOutQue;
+}
+
 int uart_rx(int len, unsigned char *data, int timeout_ms)
 {
   int l = len;
@@ -229,6 +239,7 @@ int uart_rx(int len, unsigned char *data, int timeout_ms)
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/ioctl.h>
 
 int serial_handle;
 
@@ -304,6 +315,17 @@ int uart_tx(int len, unsigned char *data)
 
   return 0;
 }
+
+int uart_tx_queued()
+{
+  int queued;
+
+  if (ioctl(serial_handle, TIOCOUTQ, &queued) < 0) {
+    return -1;
+  }
+
+  return queued;
+}
 int uart_rx(int len, unsigned char *data, int timeout_ms)
 {
   int l = len;
@@ -33,6 +33,7 @@ int uart_find_serialport(char *name);
 int uart_open(char *port, unsigned int speed);
 void uart_close();
 int uart_tx(int len, unsigned char *data);
+int uart_tx_queued();
 int uart_rx(int len, unsigned char *data, int timeout_ms);
 
 #endif // UART_H
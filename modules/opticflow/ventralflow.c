@@ -0,0 +1,320 @@
+/*
+ * ventralflow.c
+ *
+ * Recursive least squares, with the three parameters of u and the three of
+ * v sharing the regressor [1 x y], and so the covariance P: per flow event,
+ * first P grows by exp(dt/timeConstant), forgetting the old events, then
+ *	K = P*phi / (1 + phi'*P*phi)
+ *	a += K * (u - phi'*a), b += K * (v - phi'*b)
+ *	P -= K * phi'*P
+ * P grows at most until its trace is 3 * initialCovariance (its value for the
+ * starting P = initialCovariance * I), so that it doesn't wind up when the flow
+ * lacks excitation (e.g. all events on one line) or stops for a while (static
+ * scene, landed drone).
+ */
+
+#include "ventralflow.h"
+#include "base/mainloop.h"
+#include "base/module.h"
+#include <math.h>
+
+#define VF_PACKET_CAPACITY 16
+
+struct VentralFlow_state {
+	/// Node the estimates are published to.
+	sshsNode estimateNode;
+	float focalLength;
+	int32_t timeConstant;
+	int32_t publishInterval;
+	float initialCovariance;
+	/// Principal point, the sensor center.
+	float centerX;
+	float centerY;
+	bool sizeKnown;
+	/// Model parameters, see ventralflow.h, and their shared covariance.
+	double a[3];
+	double b[3];
+	double P[3][3];
+	bool started;
+	int64_t lastTimestamp;
+	int64_t nextPublish;
+	caerPoint4DEventPacket estimatePacket;
+};
+
+typedef struct VentralFlow_state *VentralFlowState;
+
+static bool caerVentralFlowEstimatorInit(caerModuleData moduleData);
+static void caerVentralFlowEstimatorRun(caerModuleData moduleData, size_t argsNumber, va_list args);
+static void caerVentralFlowEstimatorConfig(caerModuleData moduleData);
+static void caerVentralFlowEstimatorExit(caerModuleData moduleData);
+static void updateConfig(caerModuleData moduleData);
+static void resetModel(VentralFlowState state);
+static void updateModel(VentralFlowState state, FlowEvent e, int64_t t);
+static bool publishEstimate(VentralFlowState state, int64_t t);
+
+static struct caer_module_functions caerVentralFlowEstimatorFunctions = { .moduleInit =
+	&caerVentralFlowEstimatorInit, .moduleRun = &caerVentralFlowEstimatorRun, .moduleConfig =
+	&caerVentralFlowEstimatorConfig, .moduleExit = &caerVentralFlowEstimatorExit };
+
+void caerVentralFlowEstimator(uint16_t moduleID, FlowEventPacket flow, caerPoint4DEventPacket *estimates) {
+	// Nothing to put out by default.
+	*estimates = NULL;
+
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "VentralFlow");
+	if (moduleData == NULL) {
+		return;
+	}
+
+	caerModuleSM(&caerVentralFlowEstimatorFunctions, moduleData, sizeof(struct VentralFlow_state), 2, flow,
+		estimates);
+}
+
+static bool caerVentralFlowEstimatorInit(caerModuleData moduleData) {
+	sshsNodePutFloatIfAbsent(moduleData->moduleNode, "focalLength", 115.0f); // in pixels, DVS128 standard lens
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "timeConstant", 50000); // in µs, how fast old flow is forgotten
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "publishInterval", 10000); // in µs of event time
+	sshsNodePutFloatIfAbsent(moduleData->moduleNode, "initialCovariance", 100.0f);
+
+	VentralFlowState state = moduleData->moduleState;
+
+	state->estimateNode = sshsGetRelativeNode(moduleData->moduleNode, "estimate/");
+	sshsNodePutFloatIfAbsent(state->estimateNode, "ventralFlowX", 0.0f);
+	sshsNodePutFloatIfAbsent(state->estimateNode, "ventralFlowY", 0.0f);
+	sshsNodePutFloatIfAbsent(state->estimateNode, "divergence", 0.0f);
+	sshsNodePutFloatIfAbsent(state->estimateNode, "rotation", 0.0f);
+	sshsNodePutLongIfAbsent(state->estimateNode, "timestamp", 0);
+
+	updateConfig(moduleData);
+	resetModel(state);
+
+	// Add config listeners last, to avoid having them dangling if Init doesn't succeed.
+	sshsNodeAddAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	// Nothing that can fail here.
+	return (true);
+}
+
+static void caerVentralFlowEstimatorRun(caerModuleData moduleData, size_t argsNumber, va_list args) {
+	UNUSED_ARGUMENT(argsNumber);
+
+	// Interpret variable arguments (same as above in main function).
+	FlowEventPacket flow = va_arg(args, FlowEventPacket);
+	caerPoint4DEventPacket *estimates = va_arg(args, caerPoint4DEventPacket *);
+
+	// Only process packets with content.
+	if (flow == NULL || caerEventPacketHeaderGetEventValid(&flow->packetHeader) == 0) {
+		return;
+	}
+
+	VentralFlowState state = moduleData->moduleState;
+
+	int16_t sourceID = caerEventPacketHeaderGetEventSource(&flow->packetHeader);
+
+	// The principal point is taken to be the sensor center.
+	if (!state->sizeKnown) {
+		sshsNode sourceInfoNode = caerMainloopGetSourceInfo(U16T(sourceID));
+		if (sourceInfoNode == NULL) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to get source info.");
+			return;
+		}
+
+		state->centerX = (float) (sshsNodeGetShort(sourceInfoNode, "dvsSizeX") - 1) / 2.0f;
+		state->centerY = (float) (sshsNodeGetShort(sourceInfoNode, "dvsSizeY") - 1) / 2.0f;
+		state->sizeKnown = true;
+	}
+
+	if (state->estimatePacket == NULL) {
+		state->estimatePacket = caerPoint4DEventPacketAllocate(VF_PACKET_CAPACITY, sourceID, 0);
+		if (state->estimatePacket == NULL) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate estimates event packet.");
+			return;
+		}
+	}
+
+	caerEventPacketHeaderSetEventTSOverflow(&state->estimatePacket->packetHeader,
+		caerEventPacketHeaderGetEventTSOverflow(&flow->packetHeader));
+	caerEventPacketHeaderSetEventNumber(&state->estimatePacket->packetHeader, 0);
+	caerEventPacketHeaderSetEventValid(&state->estimatePacket->packetHeader, 0);
+
+	int32_t eventNumber = caerEventPacketHeaderGetEventNumber(&flow->packetHeader);
+	for (int32_t i = 0; i < eventNumber; i++) {
+		FlowEvent e = flowEventPacketGetEvent(flow, i);
+		if (!caerPolarityEventIsValid((caerPolarityEvent) e) || !e->hasFlow) {
+			continue;
+		}
+
+		int64_t t = flowEventGetTimestamp64(e, flow);
+
+		updateModel(state, e, t);
+
+		// Publish at a fixed rate, skipping intervals without flow.
+		if (t >= state->nextPublish) {
+			if (!publishEstimate(state, t)) {
+				caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to grow estimates event packet.");
+			}
+			state->nextPublish = t - ((t - state->nextPublish) % state->publishInterval) + state->publishInterval;
+		}
+	}
+
+	if (caerEventPacketHeaderGetEventNumber(&state->estimatePacket->packetHeader) > 0) {
+		*estimates = state->estimatePacket;
+	}
+}
+
+static void updateModel(VentralFlowState state, FlowEvent e, int64_t t) {
+	if (!state->started) {
+		state->lastTimestamp = t;
+		state->nextPublish = t + state->publishInterval;
+		state->started = true;
+	}
+
+	// Forget: grow the covariance with the time since the last update.
+	if (t > state->lastTimestamp) {
+		double trace = state->P[0][0] + state->P[1][1] + state->P[2][2];
+
+		double maxTrace = 3 * (double) state->initialCovariance;
+
+		if (trace < maxTrace) {
+			// Long gaps without flow would overflow P, stop at the maximum trace.
+			double growth = fmin(exp((double) (t - state->lastTimestamp) / state->timeConstant), maxTrace / trace);
+
+			for (size_t r = 0; r < 3; r++) {
+				for (size_t c = 0; c < 3; c++) {
+					state->P[r][c] *= growth;
+				}
+			}
+		}
+
+		state->lastTimestamp = t;
+	}
+
+	uint16_t x = caerPolarityEventGetX((caerPolarityEvent) e);
+	uint16_t y = caerPolarityEventGetY((caerPolarityEvent) e);
+
+	double f = (double) state->focalLength;
+	double phi[3] = { 1.0, ((double) x - (double) state->centerX) / f, ((double) y - (double) state->centerY) / f };
+
+	double Pphi[3];
+	for (size_t r = 0; r < 3; r++) {
+		Pphi[r] = state->P[r][0] * phi[0] + state->P[r][1] * phi[1] + state->P[r][2] * phi[2];
+	}
+
+	double gain = 1.0 / (1.0 + phi[0] * Pphi[0] + phi[1] * Pphi[1] + phi[2] * Pphi[2]);
+
+	double errorU = (double) e->u / f - (state->a[0] * phi[0] + state->a[1] * phi[1] + state->a[2] * phi[2]);
+	double errorV = (double) e->v / f - (state->b[0] * phi[0] + state->b[1] * phi[1] + state->b[2] * phi[2]);
+
+	for (size_t r = 0; r < 3; r++) {
+		double K = Pphi[r] * gain;
+
+		state->a[r] += K * errorU;
+		state->b[r] += K * errorV;
+	}
+
+	// P is symmetric, so phi'*P = Pphi'.
+	for (size_t r = 0; r < 3; r++) {
+		for (size_t c = 0; c < 3; c++) {
+			state->P[r][c] -= Pphi[r] * Pphi[c] * gain;
+		}
+	}
+}
+
+static bool publishEstimate(VentralFlowState state, int64_t t) {
+	caerPoint4DEventPacket packet = state->estimatePacket;
+	int32_t number = caerEventPacketHeaderGetEventNumber(&packet->packetHeader);
+
+	// At most one estimate per flow event, but there can be many.
+	if (number == caerEventPacketHeaderGetEventCapacity(&packet->packetHeader)) {
+		packet = (caerPoint4DEventPacket) caerGenericEventPacketGrow(&packet->packetHeader, number * 2);
+		if (packet == NULL) {
+			return (false);
+		}
+		state->estimatePacket = packet;
+	}
+
+	float ventralFlowX = (float) -state->a[0];
+	float ventralFlowY = (float) -state->b[0];
+	float divergence = (float) ((state->a[1] + state->b[2]) / 2);
+	float rotation = (float) ((state->b[1] - state->a[2]) / 2);
+
+	// Fresh events have 'info' cleared, so the validity can be OR'ed in.
+	caerPoint4DEvent estimate = caerPoint4DEventPacketGetEvent(packet, number);
+	estimate->info = 0;
+
+	caerPoint4DEventSetX(estimate, ventralFlowX);
+	caerPoint4DEventSetY(estimate, ventralFlowY);
+	caerPoint4DEventSetZ(estimate, divergence);
+	caerPoint4DEventSetW(estimate, rotation);
+	caerPoint4DEventSetTimestamp(estimate, I32T(t & INT32_MAX));
+	estimate->info |= htole32(1U); // Valid mark, counted below.
+
+	caerEventPacketHeaderSetEventNumber(&packet->packetHeader, number + 1);
+	caerEventPacketHeaderSetEventValid(&packet->packetHeader, number + 1);
+
+	sshsNodePutFloat(state->estimateNode, "ventralFlowX", ventralFlowX);
+	sshsNodePutFloat(state->estimateNode, "ventralFlowY", ventralFlowY);
+	sshsNodePutFloat(state->estimateNode, "divergence", divergence);
+	sshsNodePutFloat(state->estimateNode, "rotation", rotation);
+	sshsNodePutLong(state->estimateNode, "timestamp", t);
+
+	return (true);
+}
+
+static void caerVentralFlowEstimatorConfig(caerModuleData moduleData) {
+	caerModuleConfigUpdateReset(moduleData);
+
+	VentralFlowState state = moduleData->moduleState;
+
+	// The model is in normalized coordinates: start over with new settings.
+	updateConfig(moduleData);
+	resetModel(state);
+}
+
+static void caerVentralFlowEstimatorExit(caerModuleData moduleData) {
+	// Remove listener, which can reference invalid memory in userData.
+	sshsNodeRemoveAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	VentralFlowState state = moduleData->moduleState;
+
+	// Ensure output packet is freed.
+	free(state->estimatePacket);
+	state->estimatePacket = NULL;
+}
+
+static void updateConfig(caerModuleData moduleData) {
+	VentralFlowState state = moduleData->moduleState;
+
+	state->focalLength = sshsNodeGetFloat(moduleData->moduleNode, "focalLength");
+	state->timeConstant = sshsNodeGetInt(moduleData->moduleNode, "timeConstant");
+	state->publishInterval = sshsNodeGetInt(moduleData->moduleNode, "publishInterval");
+	state->initialCovariance = sshsNodeGetFloat(moduleData->moduleNode, "initialCovariance");
+
+	if (state->focalLength < 1.0f) {
+		state->focalLength = 1.0f;
+	}
+
+	if (state->timeConstant < 1) {
+		state->timeConstant = 1;
+	}
+
+	if (state->publishInterval < 1) {
+		state->publishInterval = 1;
+	}
+
+	if (state->initialCovariance <= 0.0f) {
+		state->initialCovariance = 1.0f;
+	}
+}
+
+static void resetModel(VentralFlowState state) {
+	for (size_t r = 0; r < 3; r++) {
+		state->a[r] = 0;
+		state->b[r] = 0;
+
+		for (size_t c = 0; c < 3; c++) {
+			state->P[r][c] = (r == c) ? ((double) state->initialCovariance) : (0);
+		}
+	}
+
+	state->started = false;
+}
@@ -0,0 +1,36 @@
+/*
+ * ventralflow.h
+ *
+ * Estimates ego-motion from optic flow, as ventral flow and divergence, for
+ * a camera looking at a (roughly) flat surface, e.g. down from a drone.
+ */
+
+#ifndef VENTRALFLOW_H_
+#define VENTRALFLOW_H_
+
+#include "main.h"
+
+#include <libcaer/events/point4d.h>
+#include "modules/opticflow/flowEvent.h"
+
+/**
+ * Fits the flow field model, in normalized image coordinates,
+ *	u/f = a0 + a1*x + a2*y
+ *	v/f = b0 + b1*x + b2*y
+ * by recursive least squares, one update per flow event, forgetting old
+ * events with 'timeConstant'. For a flat surface, this gives:
+ *	ventral flow	wx = Vx/Z = -a0, wy = Vy/Z = -b0 (1/s)
+ *	divergence	D = Vz/Z = (a1 + b2) / 2 (1/s)
+ *	rotation	about the optical axis, (b1 - a2) / 2 (rad/s)
+ *
+ * Every 'publishInterval' (event time), the estimate is put out as a Point4D
+ * event with x = wx, y = wy, z = D and w = rotation, and written to the
+ * 'estimate/' child node of the module's configuration.
+ *
+ * The returned packet is owned by the module, and stays valid until it runs
+ * again. It is set to NULL if the module is not running or there was no
+ * estimate in this run.
+ */
+void caerVentralFlowEstimator(uint16_t moduleID, FlowEventPacket flow, caerPoint4DEventPacket *estimates);
+
+#endif /* VENTRALFLOW_H_ */
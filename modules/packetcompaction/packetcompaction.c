@@ -0,0 +1,88 @@
+/*
+ * packetcompaction.c
+ *
+ * Compaction costs one pass over the packet, so it only pays off when
+ * enough events are skipped by all the modules that follow. That is what
+ * 'invalidThreshold' controls: the fraction of invalid events above which
+ * a packet is compacted. Works on any event type.
+ */
+
+#include "packetcompaction.h"
+#include "base/mainloop.h"
+#include "base/module.h"
+#include "modules/misc/inout_compact.h"
+
+struct PacketCompaction_state {
+	float invalidThreshold;
+};
+
+typedef struct PacketCompaction_state *PacketCompactionState;
+
+static bool caerPacketCompactionInit(caerModuleData moduleData);
+static void caerPacketCompactionRun(caerModuleData moduleData, size_t argsNumber, va_list args);
+static void caerPacketCompactionConfig(caerModuleData moduleData);
+static void caerPacketCompactionExit(caerModuleData moduleData);
+
+static struct caer_module_functions caerPacketCompactionFunctions = { .moduleInit = &caerPacketCompactionInit,
+	.moduleRun = &caerPacketCompactionRun, .moduleConfig = &caerPacketCompactionConfig, .moduleExit =
+		&caerPacketCompactionExit };
+
+void caerPacketCompaction(uint16_t moduleID, size_t packetsNumber, ...) {
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "PacketCompaction");
+	if (moduleData == NULL) {
+		return;
+	}
+
+	va_list args;
+	va_start(args, packetsNumber);
+	caerModuleSMv(&caerPacketCompactionFunctions, moduleData, sizeof(struct PacketCompaction_state), packetsNumber,
+		args);
+	va_end(args);
+}
+
+static bool caerPacketCompactionInit(caerModuleData moduleData) {
+	sshsNodePutFloatIfAbsent(moduleData->moduleNode, "invalidThreshold", 0.25f); // fraction of events, 0 to 1
+
+	PacketCompactionState state = moduleData->moduleState;
+
+	state->invalidThreshold = sshsNodeGetFloat(moduleData->moduleNode, "invalidThreshold");
+
+	// Add config listeners last, to avoid having them dangling if Init doesn't succeed.
+	sshsNodeAddAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	// Nothing that can fail here.
+	return (true);
+}
+
+static void caerPacketCompactionRun(caerModuleData moduleData, size_t argsNumber, va_list args) {
+	PacketCompactionState state = moduleData->moduleState;
+
+	for (size_t i = 0; i < argsNumber; i++) {
+		caerEventPacketHeader packet = va_arg(args, caerEventPacketHeader);
+
+		// Only process packets with content.
+		if (packet == NULL) {
+			continue;
+		}
+
+		int32_t eventNumber = caerEventPacketHeaderGetEventNumber(packet);
+		int32_t eventInvalid = eventNumber - caerEventPacketHeaderGetEventValid(packet);
+
+		if (eventInvalid > 0 && (float) eventInvalid >= (state->invalidThreshold * (float) eventNumber)) {
+			caerInOutCompactEventPacket(packet);
+		}
+	}
+}
+
+static void caerPacketCompactionConfig(caerModuleData moduleData) {
+	caerModuleConfigUpdateReset(moduleData);
+
+	PacketCompactionState state = moduleData->moduleState;
+
+	state->invalidThreshold = sshsNodeGetFloat(moduleData->moduleNode, "invalidThreshold");
+}
+
+static void caerPacketCompactionExit(caerModuleData moduleData) {
+	// Remove listener, which can reference invalid memory in userData.
+	sshsNodeRemoveAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+}
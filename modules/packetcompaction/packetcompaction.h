@@ -0,0 +1,17 @@
+/*
+ * packetcompaction.h
+ *
+ * Removes invalid events from event packets, in place, once enough of
+ * them were invalidated by earlier filters. Later modules then iterate
+ * over dense arrays instead of skipping over invalid events. Can be put
+ * anywhere in the pipeline, as often as needed, each with its own ID.
+ */
+
+#ifndef PACKETCOMPACTION_H_
+#define PACKETCOMPACTION_H_
+
+#include "main.h"
+
+void caerPacketCompaction(uint16_t moduleID, size_t packetsNumber, ...);
+
+#endif /* PACKETCOMPACTION_H_ */
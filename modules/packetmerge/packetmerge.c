@@ -0,0 +1,874 @@
+/*
+ * packetmerge.c
+ *
+ * Every input gets one queue per event type, holding copies of its packets
+ * (valid events only), since the originals are freed at the end of each
+ * mainloop run. Each event type is merged as its own stream, as types arrive
+ * with different delays (frames only after readout, with the timestamps of
+ * their start). Events are released once their timestamp is below the
+ * watermark of their type: the lowest of the latest timestamps of that type
+ * of all inputs that ever sent it, so nothing older can arrive anymore. An
+ * input that stops sending can hold the others back by at most 'maxSkew'
+ * microseconds, after that its late events are dropped. Released events are
+ * merged by a k-way heap merge, copying whole runs of events from one input
+ * at a time. Timestamps of the inputs are expected to be synchronized (one
+ * camera master, the others slaves).
+ *
+ * Only polarity and frame events are merged. Special and IMU6 events only
+ * make sense per camera (timestamp resets, one IMU per sensor), so their
+ * packets are passed on right away, one per input, keeping their source.
+ * If after 'maxSkew' µs still only one input sent data, for example because
+ * the second camera isn't connected, that input is passed through as it is.
+ */
+
+#include "packetmerge.h"
+#include "base/mainloop.h"
+#include "base/module.h"
+#include "modules/misc/inout_compact.h"
+
+#include <libcaer/events/special.h>
+#include <libcaer/events/polarity.h>
+#include <libcaer/events/frame.h>
+#include <libcaer/events/imu6.h>
+
+// Types handled, the output container has a block of this many packets per input.
+#define PACKETMERGE_TYPES (IMU6_EVENT + 1)
+// Maximum number of packets buffered per input and type.
+#define PACKETMERGE_QUEUE_SIZE 256
+
+struct packet_merge_queue {
+	caerEventPacketHeader packets[PACKETMERGE_QUEUE_SIZE];
+	size_t head;
+	size_t length;
+	int32_t eventIndex; // First not yet merged event in the head packet.
+	int64_t eventsNumber;
+	int64_t lastTimestamp; // Latest timestamp ever enqueued.
+};
+
+struct packet_merge_input {
+	int16_t sourceID;
+	uint16_t dvsOffsetX;
+	int32_t apsOffsetX;
+	int32_t mergeNumber; // Events to merge in the current run, per type.
+	struct packet_merge_queue queues[PACKETMERGE_TYPES];
+};
+
+typedef struct packet_merge_input *packetMergeInput;
+
+struct packet_merge_heap_entry {
+	int64_t timestamp;
+	size_t input;
+};
+
+struct PacketMerge_state {
+	int32_t maxSkew;
+	int32_t maxBufferedEvents;
+	bool stackAddresses;
+	size_t inputsNumber;
+	packetMergeInput inputs;
+	struct packet_merge_heap_entry *heap;
+	bool layoutDone;
+	/// Timestamp of the first data, to give up waiting for the other inputs.
+	int64_t layoutWaitStart;
+	/// Single input passed through unmerged, if the others never sent data.
+	bool passThrough;
+	size_t passThroughInput;
+	int64_t watermark[PACKETMERGE_TYPES];
+	caerEventPacketContainer merged;
+};
+
+typedef struct PacketMerge_state *PacketMergeState;
+
+static bool caerPacketMergeInit(caerModuleData moduleData);
+static void caerPacketMergeRun(caerModuleData moduleData, size_t argsNumber, va_list args);
+static void caerPacketMergeConfig(caerModuleData moduleData);
+static void caerPacketMergeExit(caerModuleData moduleData);
+static bool allocateInputs(PacketMergeState state, size_t inputsNumber);
+static void enqueuePacket(caerModuleData moduleData, packetMergeInput input, caerEventPacketHeader packet);
+static bool setOutputPacket(caerModuleData moduleData, size_t index, caerEventPacketHeader packet);
+static bool checkPassThrough(caerModuleData moduleData);
+static void updateWatermark(PacketMergeState state, int16_t type);
+static void dropHeadPacket(struct packet_merge_queue *queue);
+static bool updateLayout(caerModuleData moduleData);
+static int64_t queueHeadTimestamp(struct packet_merge_queue *queue);
+static int32_t queueCountUpTo(struct packet_merge_queue *queue, int64_t limit, int32_t *maxEventSize);
+static caerEventPacketHeader mergeType(caerModuleData moduleData, int16_t type);
+static void heapSiftDown(struct packet_merge_heap_entry *heap, size_t size, size_t pos);
+static void heapSiftUp(struct packet_merge_heap_entry *heap, size_t pos);
+
+static inline bool isMergedType(int16_t type) {
+	return (type == POLARITY_EVENT || type == FRAME_EVENT);
+}
+
+static struct caer_module_functions caerPacketMergeFunctions = { .moduleInit = &caerPacketMergeInit, .moduleRun =
+	&caerPacketMergeRun, .moduleConfig = &caerPacketMergeConfig, .moduleExit = &caerPacketMergeExit };
+
+caerEventPacketContainer caerPacketMerge(uint16_t moduleID, size_t inputsNumber, ...) {
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "PacketMerge");
+	if (moduleData == NULL) {
+		return (NULL);
+	}
+
+	va_list args;
+	va_start(args, inputsNumber);
+	caerModuleSMv(&caerPacketMergeFunctions, moduleData, sizeof(struct PacketMerge_state), inputsNumber, args);
+	va_end(args);
+
+	// Run can't return anything, so it leaves the merged container in the state.
+	PacketMergeState state = moduleData->moduleState;
+	if (state == NULL) {
+		return (NULL);
+	}
+
+	caerEventPacketContainer merged = state->merged;
+	state->merged = NULL;
+
+	return (merged);
+}
+
+static bool caerPacketMergeInit(caerModuleData moduleData) {
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "maxSkew", 20000); // in µs
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "maxBufferedEvents", 2000000); // per input and type
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "stackAddresses", true);
+
+	PacketMergeState state = moduleData->moduleState;
+
+	state->maxSkew = sshsNodeGetInt(moduleData->moduleNode, "maxSkew");
+	state->maxBufferedEvents = sshsNodeGetInt(moduleData->moduleNode, "maxBufferedEvents");
+	// Only applied when the layout is built, at the first run.
+	state->stackAddresses = sshsNodeGetBool(moduleData->moduleNode, "stackAddresses");
+
+	// Add config listeners last, to avoid having them dangling if Init doesn't succeed.
+	sshsNodeAddAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	// Nothing that can fail here.
+	return (true);
+}
+
+static void caerPacketMergeRun(caerModuleData moduleData, size_t argsNumber, va_list args) {
+	PacketMergeState state = moduleData->moduleState;
+
+	size_t inputsNumber = argsNumber;
+
+	if (state->inputs == NULL) {
+		if (!allocateInputs(state, inputsNumber)) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate input queues.");
+			return;
+		}
+	}
+
+	if (inputsNumber != state->inputsNumber) {
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Number of inputs changed from %zu to %zu.",
+			state->inputsNumber, inputsNumber);
+		return;
+	}
+
+	caerEventPacketContainer containers[inputsNumber];
+
+	for (size_t i = 0; i < inputsNumber; i++) {
+		containers[i] = va_arg(args, caerEventPacketContainer);
+	}
+
+	if (state->passThrough) {
+		state->merged = containers[state->passThroughInput];
+		return;
+	}
+
+	// Copy all new packets of merged types into the queues of their input.
+	for (size_t i = 0; i < inputsNumber; i++) {
+		if (containers[i] == NULL) {
+			continue;
+		}
+
+		packetMergeInput input = &state->inputs[i];
+
+		for (int16_t type = 0; type < PACKETMERGE_TYPES; type++) {
+			caerEventPacketHeader packet = caerEventPacketContainerGetEventPacketForType(containers[i], type);
+
+			if (packet == NULL || caerEventPacketHeaderGetEventValid(packet) == 0) {
+				continue;
+			}
+
+			if (input->sourceID < 0) {
+				input->sourceID = caerEventPacketHeaderGetEventSource(packet);
+
+				if (state->layoutWaitStart == INT64_MIN) {
+					state->layoutWaitStart = caerGenericEventGetTimestamp64(caerGenericEventGetEvent(packet, 0), packet);
+				}
+			}
+
+			if (isMergedType(type)) {
+				enqueuePacket(moduleData, input, packet);
+			}
+		}
+	}
+
+	if (!state->layoutDone && checkPassThrough(moduleData)) {
+		state->merged = containers[state->passThroughInput];
+		return;
+	}
+
+	// Special and IMU6 packets go on per input, in its block of the output.
+	for (size_t i = 0; i < inputsNumber; i++) {
+		if (containers[i] == NULL) {
+			continue;
+		}
+
+		for (int16_t type = 0; type < PACKETMERGE_TYPES; type++) {
+			caerEventPacketHeader packet = caerEventPacketContainerGetEventPacketForType(containers[i], type);
+
+			if (isMergedType(type) || packet == NULL || caerEventPacketHeaderGetEventValid(packet) == 0) {
+				continue;
+			}
+
+			caerEventPacketHeader copy = caerInOutCopyEventPacketOnlyValidEvents(packet);
+			if (copy == NULL) {
+				caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to copy event packet.");
+				continue;
+			}
+
+			if (!setOutputPacket(moduleData, (i * PACKETMERGE_TYPES) + (size_t) type, copy)) {
+				return;
+			}
+		}
+	}
+
+	// Sensor placement needs the sizes of all inputs, so nothing is merged until
+	// each of them sent data at least once. Meanwhile the queue bounds apply.
+	if (!state->layoutDone && !updateLayout(moduleData)) {
+		return;
+	}
+
+	for (int16_t type = 0; type < PACKETMERGE_TYPES; type++) {
+		if (!isMergedType(type)) {
+			continue;
+		}
+
+		updateWatermark(state, type);
+
+		caerEventPacketHeader packet = mergeType(moduleData, type);
+
+		if (packet == NULL) {
+			continue;
+		}
+
+		// Merged packets go in the block of the first input.
+		if (!setOutputPacket(moduleData, (size_t) type, packet)) {
+			return;
+		}
+	}
+}
+
+static void caerPacketMergeConfig(caerModuleData moduleData) {
+	caerModuleConfigUpdateReset(moduleData);
+
+	PacketMergeState state = moduleData->moduleState;
+
+	state->maxSkew = sshsNodeGetInt(moduleData->moduleNode, "maxSkew");
+	state->maxBufferedEvents = sshsNodeGetInt(moduleData->moduleNode, "maxBufferedEvents");
+}
+
+static void caerPacketMergeExit(caerModuleData moduleData) {
+	// Remove listener, which can reference invalid memory in userData.
+	sshsNodeRemoveAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	PacketMergeState state = moduleData->moduleState;
+
+	if (state->inputs != NULL) {
+		for (size_t i = 0; i < state->inputsNumber; i++) {
+			for (size_t type = 0; type < PACKETMERGE_TYPES; type++) {
+				while (state->inputs[i].queues[type].length > 0) {
+					dropHeadPacket(&state->inputs[i].queues[type]);
+				}
+			}
+		}
+
+		free(state->inputs);
+		state->inputs = NULL;
+	}
+
+	free(state->heap);
+	state->heap = NULL;
+}
+
+static bool allocateInputs(PacketMergeState state, size_t inputsNumber) {
+	state->inputs = calloc(inputsNumber, sizeof(struct packet_merge_input));
+	if (state->inputs == NULL) {
+		return (false);
+	}
+
+	state->heap = calloc(inputsNumber, sizeof(struct packet_merge_heap_entry));
+	if (state->heap == NULL) {
+		free(state->inputs);
+		state->inputs = NULL;
+
+		return (false);
+	}
+
+	for (size_t i = 0; i < inputsNumber; i++) {
+		state->inputs[i].sourceID = -1;
+
+		for (size_t type = 0; type < PACKETMERGE_TYPES; type++) {
+			state->inputs[i].queues[type].lastTimestamp = INT64_MIN;
+		}
+	}
+
+	state->inputsNumber = inputsNumber;
+	state->layoutDone = false;
+	state->layoutWaitStart = INT64_MIN;
+	state->passThrough = false;
+
+	for (size_t type = 0; type < PACKETMERGE_TYPES; type++) {
+		state->watermark[type] = INT64_MIN;
+	}
+
+	return (true);
+}
+
+static void enqueuePacket(caerModuleData moduleData, packetMergeInput input, caerEventPacketHeader packet) {
+	PacketMergeState state = moduleData->moduleState;
+	struct packet_merge_queue *queue = &input->queues[caerEventPacketHeaderGetEventType(packet)];
+
+	// The queues only hold valid events, so the merge doesn't have to check.
+	caerEventPacketHeader copy = caerInOutCopyEventPacketOnlyValidEvents(packet);
+	if (copy == NULL) {
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to copy event packet.");
+		return;
+	}
+
+	int32_t eventNumber = caerEventPacketHeaderGetEventNumber(copy);
+
+	int64_t lastTimestamp = caerGenericEventGetTimestamp64(caerGenericEventGetEvent(copy, eventNumber - 1), copy);
+	if (lastTimestamp > queue->lastTimestamp) {
+		queue->lastTimestamp = lastTimestamp;
+	}
+
+	// Events older than what was already merged of their type are too late to
+	// keep the output ordered. Timestamps only grow within a packet, so they
+	// are all at its start.
+	int64_t watermark = state->watermark[caerEventPacketHeaderGetEventType(copy)];
+
+	if (caerGenericEventGetTimestamp64(caerGenericEventGetEvent(copy, 0), copy) < watermark) {
+		int32_t low = 0, high = eventNumber;
+
+		while (low < high) {
+			int32_t mid = low + ((high - low) / 2);
+
+			if (caerGenericEventGetTimestamp64(caerGenericEventGetEvent(copy, mid), copy) < watermark) {
+				low = mid + 1;
+			}
+			else {
+				high = mid;
+			}
+		}
+
+		caerLog(CAER_LOG_DEBUG, moduleData->moduleSubSystemString,
+			"Dropped %" PRIi32 " late events of type %" PRIi16 " from source %" PRIi16 ".", low,
+			caerEventPacketHeaderGetEventType(copy), input->sourceID);
+
+		if (low == eventNumber) {
+			free(copy);
+			return;
+		}
+
+		eventNumber -= low;
+
+		memmove(caerGenericEventGetEvent(copy, 0), caerGenericEventGetEvent(copy, low),
+			(size_t) (eventNumber * caerEventPacketHeaderGetEventSize(copy)));
+
+		caerEventPacketHeaderSetEventNumber(copy, eventNumber);
+		caerEventPacketHeaderSetEventValid(copy, eventNumber);
+	}
+
+	// Bound the memory used: drop the oldest packets first.
+	while (queue->length == PACKETMERGE_QUEUE_SIZE
+		|| (queue->length > 0 && (queue->eventsNumber + eventNumber) > state->maxBufferedEvents)) {
+		caerLog(CAER_LOG_DEBUG, moduleData->moduleSubSystemString,
+			"Queue full, dropped a packet of type %" PRIi16 " from source %" PRIi16 ".",
+			caerEventPacketHeaderGetEventType(copy), input->sourceID);
+
+		dropHeadPacket(queue);
+	}
+
+	queue->packets[(queue->head + queue->length) % PACKETMERGE_QUEUE_SIZE] = copy;
+	queue->length++;
+	queue->eventsNumber += eventNumber;
+}
+
+/**
+ * Put a packet into the output container, allocating it if needed. Frees the
+ * packet and returns false if that fails.
+ */
+static bool setOutputPacket(caerModuleData moduleData, size_t index, caerEventPacketHeader packet) {
+	PacketMergeState state = moduleData->moduleState;
+
+	if (state->merged == NULL) {
+		state->merged = caerEventPacketContainerAllocate(I32T(state->inputsNumber * PACKETMERGE_TYPES));
+		if (state->merged == NULL) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate event packet container.");
+			free(packet);
+			return (false);
+		}
+
+		// Free the merged packets at the end of this mainloop run, like input modules do.
+		caerMainloopFreeAfterLoop((void (*)(void *)) &caerEventPacketContainerFree, state->merged);
+	}
+
+	caerEventPacketContainerSetEventPacket(state->merged, I32T(index), packet);
+
+	return (true);
+}
+
+/**
+ * Fall back to passing the only input with data through unmerged, once the
+ * others didn't send anything for 'maxSkew' µs since the first data.
+ */
+static bool checkPassThrough(caerModuleData moduleData) {
+	PacketMergeState state = moduleData->moduleState;
+
+	size_t sendingNumber = 0;
+	size_t sendingInput = 0;
+
+	for (size_t i = 0; i < state->inputsNumber; i++) {
+		if (state->inputs[i].sourceID >= 0) {
+			sendingNumber++;
+			sendingInput = i;
+		}
+	}
+
+	if (sendingNumber != 1) {
+		return (false);
+	}
+
+	int64_t lastTimestamp = INT64_MIN;
+
+	for (size_t type = 0; type < PACKETMERGE_TYPES; type++) {
+		if (state->inputs[sendingInput].queues[type].lastTimestamp > lastTimestamp) {
+			lastTimestamp = state->inputs[sendingInput].queues[type].lastTimestamp;
+		}
+	}
+
+	if (lastTimestamp == INT64_MIN || (lastTimestamp - state->layoutWaitStart) <= state->maxSkew) {
+		return (false);
+	}
+
+	// What was buffered while waiting is lost, the input's containers go on as they are.
+	for (size_t type = 0; type < PACKETMERGE_TYPES; type++) {
+		while (state->inputs[sendingInput].queues[type].length > 0) {
+			dropHeadPacket(&state->inputs[sendingInput].queues[type]);
+		}
+	}
+
+	state->passThrough = true;
+	state->passThroughInput = sendingInput;
+
+	caerLog(CAER_LOG_WARNING, moduleData->moduleSubSystemString,
+		"Only input %zu sends data, passing it through unmerged. Restart to merge again.", sendingInput);
+
+	return (true);
+}
+
+/**
+ * Advance the watermark of a type: events of all inputs up to the lowest of
+ * their latest timestamps of that type are complete, but never wait longer
+ * than maxSkew. Inputs that never sent the type, like cameras without APS for
+ * frames, don't hold it back.
+ */
+static void updateWatermark(PacketMergeState state, int16_t type) {
+	int64_t lowestTimestamp = INT64_MAX;
+	int64_t highestTimestamp = INT64_MIN;
+
+	for (size_t i = 0; i < state->inputsNumber; i++) {
+		int64_t lastTimestamp = state->inputs[i].queues[type].lastTimestamp;
+
+		if (lastTimestamp == INT64_MIN) {
+			continue;
+		}
+
+		if (lastTimestamp < lowestTimestamp) {
+			lowestTimestamp = lastTimestamp;
+		}
+		if (lastTimestamp > highestTimestamp) {
+			highestTimestamp = lastTimestamp;
+		}
+	}
+
+	// Nothing of this type yet.
+	if (highestTimestamp == INT64_MIN) {
+		return;
+	}
+
+	if ((highestTimestamp - state->maxSkew) > lowestTimestamp) {
+		lowestTimestamp = highestTimestamp - state->maxSkew;
+	}
+
+	if (lowestTimestamp > state->watermark[type]) {
+		state->watermark[type] = lowestTimestamp;
+	}
+}
+
+static void dropHeadPacket(struct packet_merge_queue *queue) {
+	caerEventPacketHeader packet = queue->packets[queue->head];
+
+	queue->eventsNumber -= caerEventPacketHeaderGetEventNumber(packet) - queue->eventIndex;
+
+	free(packet);
+	queue->packets[queue->head] = NULL;
+
+	queue->head = (queue->head + 1) % PACKETMERGE_QUEUE_SIZE;
+	queue->length--;
+	queue->eventIndex = 0;
+}
+
+static bool updateLayout(caerModuleData moduleData) {
+	PacketMergeState state = moduleData->moduleState;
+
+	for (size_t i = 0; i < state->inputsNumber; i++) {
+		if (state->inputs[i].sourceID < 0) {
+			return (false);
+		}
+	}
+
+	// Put the sensors of all inputs side by side, in input order.
+	int32_t dvsSizeX = 0, dvsSizeY = 0;
+	int32_t apsSizeX = 0, apsSizeY = 0;
+
+	sshsNode sourceInfoNode = sshsGetRelativeNode(moduleData->moduleNode, "sourceInfo/");
+
+	size_t sourceStringLength = (size_t) snprintf(NULL, 0, "#Source %" PRIu16 ": Processor,"
+	"dvsSizeX=%" PRIi16 ",dvsSizeY=%" PRIi16 ",apsSizeX=%" PRIi16 ",apsSizeY=%" PRIi16 ","
+	"dataSizeX=%" PRIi16 ",dataSizeY=%" PRIi16 ",visualizerSizeX=%" PRIi16 ",visualizerSizeY=%" PRIi16 "\r\n",
+		moduleData->moduleID, INT16_MAX, INT16_MAX, INT16_MAX, INT16_MAX, INT16_MAX, INT16_MAX, 0, 0);
+	char *inputSourceStrings[state->inputsNumber];
+
+	for (size_t i = 0; i < state->inputsNumber; i++) {
+		packetMergeInput input = &state->inputs[i];
+		sshsNode inputInfoNode = caerMainloopGetSourceInfo(U16T(input->sourceID));
+
+		int16_t inputDVSSizeX = 0, inputDVSSizeY = 0, inputAPSSizeX = 0, inputAPSSizeY = 0;
+
+		if (sshsNodeAttributeExists(inputInfoNode, "dvsSizeX", SHORT)) {
+			inputDVSSizeX = sshsNodeGetShort(inputInfoNode, "dvsSizeX");
+			inputDVSSizeY = sshsNodeGetShort(inputInfoNode, "dvsSizeY");
+		}
+
+		if (sshsNodeAttributeExists(inputInfoNode, "apsSizeX", SHORT)) {
+			inputAPSSizeX = sshsNodeGetShort(inputInfoNode, "apsSizeX");
+			inputAPSSizeY = sshsNodeGetShort(inputInfoNode, "apsSizeY");
+		}
+
+		if (state->stackAddresses) {
+			input->dvsOffsetX = U16T(dvsSizeX);
+			input->apsOffsetX = apsSizeX;
+
+			dvsSizeX += inputDVSSizeX;
+			apsSizeX += inputAPSSizeX;
+		}
+		else {
+			input->dvsOffsetX = 0;
+			input->apsOffsetX = 0;
+
+			dvsSizeX = (inputDVSSizeX > dvsSizeX) ? (inputDVSSizeX) : (dvsSizeX);
+			apsSizeX = (inputAPSSizeX > apsSizeX) ? (inputAPSSizeX) : (apsSizeX);
+		}
+
+		dvsSizeY = (inputDVSSizeY > dvsSizeY) ? (inputDVSSizeY) : (dvsSizeY);
+		apsSizeY = (inputAPSSizeY > apsSizeY) ? (inputAPSSizeY) : (apsSizeY);
+
+		// Keep the original source strings, marked as sub-sources.
+		inputSourceStrings[i] = sshsNodeGetString(inputInfoNode, "sourceString");
+		sourceStringLength += strlen(inputSourceStrings[i]) + 1;
+	}
+
+	if (dvsSizeX > INT16_MAX || apsSizeX > INT16_MAX) {
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString,
+			"Merged sensor size too big, disable 'stackAddresses'.");
+
+		for (size_t i = 0; i < state->inputsNumber; i++) {
+			free(inputSourceStrings[i]);
+		}
+
+		return (false);
+	}
+
+	int32_t dataSizeX = (dvsSizeX > apsSizeX) ? (dvsSizeX) : (apsSizeX);
+	int32_t dataSizeY = (dvsSizeY > apsSizeY) ? (dvsSizeY) : (apsSizeY);
+
+	if (dvsSizeX != 0 && dvsSizeY != 0) {
+		sshsNodePutShort(sourceInfoNode, "dvsSizeX", I16T(dvsSizeX));
+		sshsNodePutShort(sourceInfoNode, "dvsSizeY", I16T(dvsSizeY));
+	}
+
+	if (apsSizeX != 0 && apsSizeY != 0) {
+		sshsNodePutShort(sourceInfoNode, "apsSizeX", I16T(apsSizeX));
+		sshsNodePutShort(sourceInfoNode, "apsSizeY", I16T(apsSizeY));
+	}
+
+	sshsNodePutShort(sourceInfoNode, "dataSizeX", I16T(dataSizeX));
+	sshsNodePutShort(sourceInfoNode, "dataSizeY", I16T(dataSizeY));
+
+	// Generate source string for output modules.
+	char sourceString[sourceStringLength + 1];
+	size_t sourceStringPos = (size_t) snprintf(sourceString, sourceStringLength + 1, "#Source %" PRIu16 ": Processor,"
+	"dvsSizeX=%" PRIi16 ",dvsSizeY=%" PRIi16 ",apsSizeX=%" PRIi16 ",apsSizeY=%" PRIi16 ","
+	"dataSizeX=%" PRIi16 ",dataSizeY=%" PRIi16 ",visualizerSizeX=%" PRIi16 ",visualizerSizeY=%" PRIi16 "\r\n",
+		moduleData->moduleID, I16T(dvsSizeX), I16T(dvsSizeY), I16T(apsSizeX), I16T(apsSizeY), I16T(dataSizeX),
+		I16T(dataSizeY), 0, 0);
+
+	for (size_t i = 0; i < state->inputsNumber; i++) {
+		if (inputSourceStrings[i][0] == '#') {
+			sourceStringPos += (size_t) snprintf(sourceString + sourceStringPos,
+				sourceStringLength + 1 - sourceStringPos, "#-%s", inputSourceStrings[i] + 1);
+		}
+
+		free(inputSourceStrings[i]);
+	}
+
+	sourceString[sourceStringPos] = '\0';
+
+	sshsNodePutString(sourceInfoNode, "sourceString", sourceString);
+
+	state->layoutDone = true;
+
+	return (true);
+}
+
+static int64_t queueHeadTimestamp(struct packet_merge_queue *queue) {
+	caerEventPacketHeader packet = queue->packets[queue->head];
+
+	return (caerGenericEventGetTimestamp64(caerGenericEventGetEvent(packet, queue->eventIndex), packet));
+}
+
+static int32_t queueCountUpTo(struct packet_merge_queue *queue, int64_t limit, int32_t *maxEventSize) {
+	int32_t count = 0;
+
+	for (size_t i = 0; i < queue->length; i++) {
+		caerEventPacketHeader packet = queue->packets[(queue->head + i) % PACKETMERGE_QUEUE_SIZE];
+		int32_t eventNumber = caerEventPacketHeaderGetEventNumber(packet);
+		int32_t eventIndex = (i == 0) ? (queue->eventIndex) : (0);
+
+		if (caerGenericEventGetTimestamp64(caerGenericEventGetEvent(packet, eventIndex), packet) > limit) {
+			break;
+		}
+
+		if (caerEventPacketHeaderGetEventSize(packet) > *maxEventSize) {
+			*maxEventSize = caerEventPacketHeaderGetEventSize(packet);
+		}
+
+		if (caerGenericEventGetTimestamp64(caerGenericEventGetEvent(packet, eventNumber - 1), packet) <= limit) {
+			count += eventNumber - eventIndex;
+			continue;
+		}
+
+		// Partial packet: find the first event past the limit.
+		int32_t low = eventIndex, high = eventNumber - 1;
+
+		while (low < high) {
+			int32_t mid = low + ((high - low) / 2);
+
+			if (caerGenericEventGetTimestamp64(caerGenericEventGetEvent(packet, mid), packet) <= limit) {
+				low = mid + 1;
+			}
+			else {
+				high = mid;
+			}
+		}
+
+		count += low - eventIndex;
+		break;
+	}
+
+	return (count);
+}
+
+static caerEventPacketHeader mergeType(caerModuleData moduleData, int16_t type) {
+	PacketMergeState state = moduleData->moduleState;
+
+	// Output packets have a single timestamp overflow counter, so each
+	// only goes up to the end of the overflow epoch of its oldest event.
+	int64_t lowestHead = INT64_MAX;
+
+	for (size_t i = 0; i < state->inputsNumber; i++) {
+		struct packet_merge_queue *queue = &state->inputs[i].queues[type];
+
+		if (queue->length > 0 && queueHeadTimestamp(queue) < lowestHead) {
+			lowestHead = queueHeadTimestamp(queue);
+		}
+	}
+
+	if (lowestHead > state->watermark[type]) {
+		return (NULL);
+	}
+
+	int32_t tsOverflow = I32T(lowestHead >> TS_OVERFLOW_SHIFT);
+	int64_t limit = (I64T(tsOverflow + 1) << TS_OVERFLOW_SHIFT) - 1;
+	if (state->watermark[type] < limit) {
+		limit = state->watermark[type];
+	}
+
+	int32_t eventSize = 0;
+	int32_t eventNumber = 0;
+	caerEventPacketHeader template = NULL;
+
+	for (size_t i = 0; i < state->inputsNumber; i++) {
+		struct packet_merge_queue *queue = &state->inputs[i].queues[type];
+
+		state->inputs[i].mergeNumber = queueCountUpTo(queue, limit, &eventSize);
+		eventNumber += state->inputs[i].mergeNumber;
+
+		if (template == NULL && state->inputs[i].mergeNumber > 0) {
+			template = queue->packets[queue->head];
+		}
+	}
+
+	if (eventNumber == 0) {
+		return (NULL);
+	}
+
+	caerEventPacketHeader packet = malloc(CAER_EVENT_PACKET_HEADER_SIZE + ((size_t) eventNumber * (size_t) eventSize));
+	if (packet == NULL) {
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate merged packet of type %" PRIi16 ".",
+			type);
+		return (NULL);
+	}
+
+	memcpy(packet, template, CAER_EVENT_PACKET_HEADER_SIZE);
+	caerEventPacketHeaderSetEventSource(packet, I16T(moduleData->moduleID));
+	caerEventPacketHeaderSetEventSize(packet, eventSize);
+	caerEventPacketHeaderSetEventTSOverflow(packet, tsOverflow);
+	caerEventPacketHeaderSetEventCapacity(packet, eventNumber);
+	caerEventPacketHeaderSetEventNumber(packet, eventNumber);
+	caerEventPacketHeaderSetEventValid(packet, eventNumber);
+
+	// Build a min-heap of the inputs, keyed by the timestamp of their next event.
+	size_t heapSize = 0;
+
+	for (size_t i = 0; i < state->inputsNumber; i++) {
+		if (state->inputs[i].mergeNumber > 0) {
+			state->heap[heapSize].timestamp = queueHeadTimestamp(&state->inputs[i].queues[type]);
+			state->heap[heapSize].input = i;
+			heapSize++;
+
+			heapSiftUp(state->heap, heapSize - 1);
+		}
+	}
+
+	int32_t outIndex = 0;
+
+	while (heapSize > 0) {
+		packetMergeInput input = &state->inputs[state->heap[0].input];
+		struct packet_merge_queue *queue = &input->queues[type];
+
+		// The input on top can go on until it passes the next one on the heap.
+		int64_t runLimit = INT64_MAX;
+		if (heapSize > 1) {
+			runLimit = state->heap[1].timestamp;
+		}
+		if (heapSize > 2 && state->heap[2].timestamp < runLimit) {
+			runLimit = state->heap[2].timestamp;
+		}
+
+		caerEventPacketHeader source = queue->packets[queue->head];
+		int32_t sourceEventSize = caerEventPacketHeaderGetEventSize(source);
+		int32_t sourceEnd = queue->eventIndex + input->mergeNumber;
+		if (sourceEnd > caerEventPacketHeaderGetEventNumber(source)) {
+			sourceEnd = caerEventPacketHeaderGetEventNumber(source);
+		}
+
+		int32_t runStart = queue->eventIndex;
+		int32_t runEnd = runStart + 1;
+
+		while (runEnd < sourceEnd
+			&& caerGenericEventGetTimestamp64(caerGenericEventGetEvent(source, runEnd), source) <= runLimit) {
+			runEnd++;
+		}
+
+		int32_t runLength = runEnd - runStart;
+
+		// Copy the run, then move its addresses to where this input's sensor is.
+		if (sourceEventSize == eventSize) {
+			memcpy(caerGenericEventGetEvent(packet, outIndex), caerGenericEventGetEvent(source, runStart),
+				(size_t) (runLength * eventSize));
+		}
+		else {
+			for (int32_t i = 0; i < runLength; i++) {
+				uint8_t *outEvent = caerGenericEventGetEvent(packet, outIndex + i);
+
+				memcpy(outEvent, caerGenericEventGetEvent(source, runStart + i), (size_t) sourceEventSize);
+				memset(outEvent + sourceEventSize, 0, (size_t) (eventSize - sourceEventSize));
+			}
+		}
+
+		if (type == POLARITY_EVENT && input->dvsOffsetX != 0) {
+			for (int32_t i = 0; i < runLength; i++) {
+				caerPolarityEvent event = caerGenericEventGetEvent(packet, outIndex + i);
+
+				caerPolarityEventSetX(event, U16T(caerPolarityEventGetX(event) + input->dvsOffsetX));
+			}
+		}
+		else if (type == FRAME_EVENT && input->apsOffsetX != 0) {
+			for (int32_t i = 0; i < runLength; i++) {
+				caerFrameEvent event = caerGenericEventGetEvent(packet, outIndex + i);
+
+				caerFrameEventSetPositionX(event, caerFrameEventGetPositionX(event) + input->apsOffsetX);
+			}
+		}
+
+		outIndex += runLength;
+		input->mergeNumber -= runLength;
+		queue->eventIndex = runEnd;
+		queue->eventsNumber -= runLength;
+
+		if (queue->eventIndex == caerEventPacketHeaderGetEventNumber(source)) {
+			dropHeadPacket(queue);
+		}
+
+		if (input->mergeNumber > 0) {
+			state->heap[0].timestamp = queueHeadTimestamp(queue);
+		}
+		else {
+			heapSize--;
+			state->heap[0] = state->heap[heapSize];
+		}
+
+		heapSiftDown(state->heap, heapSize, 0);
+	}
+
+	return (packet);
+}
+
+static void heapSiftDown(struct packet_merge_heap_entry *heap, size_t size, size_t pos) {
+	while ((2 * pos) + 1 < size) {
+		size_t child = (2 * pos) + 1;
+
+		if (child + 1 < size && heap[child + 1].timestamp < heap[child].timestamp) {
+			child++;
+		}
+
+		if (heap[pos].timestamp <= heap[child].timestamp) {
+			break;
+		}
+
+		struct packet_merge_heap_entry tmp = heap[pos];
+		heap[pos] = heap[child];
+		heap[child] = tmp;
+
+		pos = child;
+	}
+}
+
+static void heapSiftUp(struct packet_merge_heap_entry *heap, size_t pos) {
+	while (pos > 0) {
+		size_t parent = (pos - 1) / 2;
+
+		if (heap[parent].timestamp <= heap[pos].timestamp) {
+			break;
+		}
+
+		struct packet_merge_heap_entry tmp = heap[pos];
+		heap[pos] = heap[parent];
+		heap[parent] = tmp;
+
+		pos = parent;
+	}
+}
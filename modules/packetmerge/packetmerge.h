@@ -0,0 +1,30 @@
+/*
+ * packetmerge.h
+ *
+ * Merges the event packet containers of several inputs (for example two
+ * cameras for stereo) into one stream of time-ordered containers, which
+ * looks to all later modules like it comes from a single, bigger source:
+ * its sensors are put side by side, in the order of the inputs.
+ */
+
+#ifndef PACKETMERGE_H_
+#define PACKETMERGE_H_
+
+#include "main.h"
+
+#include <libcaer/events/packetContainer.h>
+
+/**
+ * Takes 'inputsNumber' caerEventPacketContainer arguments, which may be NULL.
+ * Returns a container with a block of IMU6_EVENT + 1 packets per input, each
+ * at the index of its type inside the block, like device containers. The
+ * merged polarity and frame packets, holding all events that can no longer be
+ * preceded by events from any input, are in the first block. The special and
+ * IMU6 packets of each input are in its own block, unmerged and with their
+ * original source. Returns NULL if there is nothing yet. The container is
+ * freed at the end of the mainloop run. If only one input ever sends data,
+ * its containers are returned as they are.
+ */
+caerEventPacketContainer caerPacketMerge(uint16_t moduleID, size_t inputsNumber, ...);
+
+#endif /* PACKETMERGE_H_ */
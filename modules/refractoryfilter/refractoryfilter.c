@@ -0,0 +1,243 @@
+/*
+ * refractoryfilter.c
+ *
+ * Pixels are grouped into blocks of 2^subSampleBy x 2^subSampleBy. After
+ * an event passes, no other event from the same block passes for the next
+ * 'refractoryPeriod' µs. With 'rescaleAddresses', the surviving events are
+ * also moved to the down-sampled address space, for modules that want to
+ * work on the smaller resolution directly.
+ *
+ * Timestamps are stored relative to 'timestampBase', as 32-bit values, like
+ * in the corner detector: they are kept between 2^30 and 3 * 2^30 µs, and
+ * rebased by 2^31 µs when they grow too big, saturating the older ones to 0.
+ * A block that never passed an event (0) is thus always at least 2^30 µs
+ * (~18 minutes) in the past, longer than any sensible refractory period.
+ */
+
+#include "refractoryfilter.h"
+#include "base/mainloop.h"
+#include "base/module.h"
+#include "modules/misc/inout_compact.h"
+
+#define REFRACTORY_TIMESTAMP_REBASE_MIN INT64_C(0x40000000)
+#define REFRACTORY_TIMESTAMP_REBASE_THRESHOLD INT64_C(0xC0000000)
+#define REFRACTORY_TIMESTAMP_REBASE_SHIFT UINT32_C(0x80000000)
+
+struct RefractoryFilter_state {
+	/// Row-major map of the relative timestamp of the last event that passed,
+	/// per block.
+	uint32_t *timestampMap;
+	int64_t timestampBase;
+	size_t timestampMapSizeX;
+	size_t timestampMapSizeY;
+	int8_t timestampMapSubSampleBy;
+	int32_t refractoryPeriod;
+	int8_t subSampleBy;
+	bool rescaleAddresses;
+	bool compactPacket;
+};
+
+typedef struct RefractoryFilter_state *RefractoryFilterState;
+
+static bool caerRefractoryFilterInit(caerModuleData moduleData);
+static void caerRefractoryFilterRun(caerModuleData moduleData, size_t argsNumber, va_list args);
+static void caerRefractoryFilterConfig(caerModuleData moduleData);
+static void caerRefractoryFilterExit(caerModuleData moduleData);
+static bool allocateTimestampMap(RefractoryFilterState state, int16_t sourceID);
+static void rebaseTimestampMap(RefractoryFilterState state, int64_t timestamp);
+static inline uint32_t getRelativeTimestamp(RefractoryFilterState state, int64_t timestamp);
+
+static struct caer_module_functions caerRefractoryFilterFunctions = { .moduleInit = &caerRefractoryFilterInit,
+	.moduleRun = &caerRefractoryFilterRun, .moduleConfig = &caerRefractoryFilterConfig, .moduleExit =
+		&caerRefractoryFilterExit };
+
+void caerRefractoryFilter(uint16_t moduleID, caerPolarityEventPacket polarity) {
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "RefractoryFilter");
+	if (moduleData == NULL) {
+		return;
+	}
+
+	caerModuleSM(&caerRefractoryFilterFunctions, moduleData, sizeof(struct RefractoryFilter_state), 1, polarity);
+}
+
+static bool caerRefractoryFilterInit(caerModuleData moduleData) {
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "refractoryPeriod", 1000); // in µs, 0 to disable
+	sshsNodePutByteIfAbsent(moduleData->moduleNode, "subSampleBy", 0); // block size is 2^subSampleBy
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "rescaleAddresses", false);
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "compactPacket", true); // remove filtered events from packet
+
+	RefractoryFilterState state = moduleData->moduleState;
+
+	state->refractoryPeriod = sshsNodeGetInt(moduleData->moduleNode, "refractoryPeriod");
+	state->subSampleBy = sshsNodeGetByte(moduleData->moduleNode, "subSampleBy");
+	state->rescaleAddresses = sshsNodeGetBool(moduleData->moduleNode, "rescaleAddresses");
+	state->compactPacket = sshsNodeGetBool(moduleData->moduleNode, "compactPacket");
+
+	// Add config listeners last, to avoid having them dangling if Init doesn't succeed.
+	sshsNodeAddAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	// Nothing that can fail here.
+	return (true);
+}
+
+static void caerRefractoryFilterRun(caerModuleData moduleData, size_t argsNumber, va_list args) {
+	UNUSED_ARGUMENT(argsNumber);
+
+	// Interpret variable arguments (same as above in main function).
+	caerPolarityEventPacket polarity = va_arg(args, caerPolarityEventPacket);
+
+	// Only process packets with content.
+	if (polarity == NULL || caerEventPacketHeaderGetEventNumber(&polarity->packetHeader) == 0) {
+		return;
+	}
+
+	RefractoryFilterState state = moduleData->moduleState;
+
+	// If the map is not allocated yet, do it.
+	if (state->timestampMap == NULL) {
+		if (!allocateTimestampMap(state, caerEventPacketHeaderGetEventSource(&polarity->packetHeader))) {
+			// Failed to allocate memory, nothing to do.
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate memory for timestampMap.");
+			return;
+		}
+	}
+
+	uint32_t *timestampMap = state->timestampMap;
+	size_t sizeX = state->timestampMapSizeX;
+	uint32_t refractoryPeriod = (state->refractoryPeriod > 0) ? (U32T(state->refractoryPeriod)) : (0);
+	int8_t subSampleBy = state->subSampleBy;
+	bool rescaleAddresses = state->rescaleAddresses;
+	int32_t invalidNumber = 0;
+
+	CAER_POLARITY_ITERATOR_VALID_START(polarity)
+		uint32_t ts = getRelativeTimestamp(state, caerPolarityEventGetTimestamp64(caerPolarityIteratorElement, polarity));
+		uint16_t x = U16T(caerPolarityEventGetX(caerPolarityIteratorElement) >> subSampleBy);
+		uint16_t y = U16T(caerPolarityEventGetY(caerPolarityIteratorElement) >> subSampleBy);
+
+		size_t index = (size_t) y * sizeX + x;
+
+		// Without branching: only remember the event if it passes.
+		uint32_t lastTS = timestampMap[index];
+		uint32_t invalid = ((ts - lastTS) < refractoryPeriod);
+
+		timestampMap[index] = (invalid) ? (lastTS) : (ts);
+
+		// Filter out invalid, clearing the valid mark (bit 0) directly.
+		caerPolarityIteratorElement->data &= htole32(~invalid);
+		invalidNumber += I32T(invalid);
+
+		if (rescaleAddresses) {
+			caerPolarityEventSetX(caerPolarityIteratorElement, x);
+			caerPolarityEventSetY(caerPolarityIteratorElement, y);
+		}
+	CAER_POLARITY_ITERATOR_VALID_END
+
+	caerEventPacketHeaderSetEventValid(&polarity->packetHeader,
+		caerEventPacketHeaderGetEventValid(&polarity->packetHeader) - invalidNumber);
+
+	// Move all valid events to the front, and drop the rest, so that later
+	// modules don't even have to skip over them.
+	if (state->compactPacket) {
+		caerInOutCompactEventPacket(&polarity->packetHeader);
+	}
+}
+
+static void caerRefractoryFilterConfig(caerModuleData moduleData) {
+	caerModuleConfigUpdateReset(moduleData);
+
+	RefractoryFilterState state = moduleData->moduleState;
+
+	state->refractoryPeriod = sshsNodeGetInt(moduleData->moduleNode, "refractoryPeriod");
+	state->subSampleBy = sshsNodeGetByte(moduleData->moduleNode, "subSampleBy");
+	state->rescaleAddresses = sshsNodeGetBool(moduleData->moduleNode, "rescaleAddresses");
+	state->compactPacket = sshsNodeGetBool(moduleData->moduleNode, "compactPacket");
+
+	// Map size depends on sub-sampling, re-allocate it on next run.
+	if (state->timestampMap != NULL && state->subSampleBy != state->timestampMapSubSampleBy) {
+		free(state->timestampMap);
+		state->timestampMap = NULL;
+	}
+}
+
+static void caerRefractoryFilterExit(caerModuleData moduleData) {
+	// Remove listener, which can reference invalid memory in userData.
+	sshsNodeRemoveAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	RefractoryFilterState state = moduleData->moduleState;
+
+	// Ensure map is freed.
+	free(state->timestampMap);
+	state->timestampMap = NULL;
+}
+
+static bool allocateTimestampMap(RefractoryFilterState state, int16_t sourceID) {
+	// Get size information from source.
+	sshsNode sourceInfoNode = caerMainloopGetSourceInfo(U16T(sourceID));
+	if (sourceInfoNode == NULL) {
+		// This should never happen, but we handle it gracefully.
+		caerLog(CAER_LOG_ERROR, __func__, "Failed to get source info to allocate timestamp map.");
+		return (false);
+	}
+
+	int16_t sizeX = sshsNodeGetShort(sourceInfoNode, "dvsSizeX");
+	int16_t sizeY = sshsNodeGetShort(sourceInfoNode, "dvsSizeY");
+
+	// Sub-sampled coordinates go from 0 to ((size - 1) >> subSampleBy).
+	state->timestampMapSizeX = ((size_t) (sizeX - 1) >> state->subSampleBy) + 1;
+	state->timestampMapSizeY = ((size_t) (sizeY - 1) >> state->subSampleBy) + 1;
+
+	size_t mapSize = state->timestampMapSizeX * state->timestampMapSizeY;
+
+	// 0 is never, so the first events always pass.
+	state->timestampMap = calloc(mapSize, sizeof(uint32_t));
+	if (state->timestampMap == NULL) {
+		return (false);
+	}
+
+	state->timestampMapSubSampleBy = state->subSampleBy;
+	state->timestampBase = 0;
+
+	return (true);
+}
+
+/**
+ * Make 'timestamp' representable relative to the base again. Either shift
+ * everything down by REFRACTORY_TIMESTAMP_REBASE_SHIFT, or, if time jumped
+ * backwards (timestamp reset) or too far forward, just start over with an
+ * empty map.
+ */
+static void rebaseTimestampMap(RefractoryFilterState state, int64_t timestamp) {
+	int64_t relativeTimestamp = timestamp - state->timestampBase;
+	bool shift = (relativeTimestamp >= REFRACTORY_TIMESTAMP_REBASE_THRESHOLD
+		&& (relativeTimestamp - REFRACTORY_TIMESTAMP_REBASE_SHIFT) < REFRACTORY_TIMESTAMP_REBASE_THRESHOLD);
+
+	size_t mapSize = state->timestampMapSizeX * state->timestampMapSizeY;
+
+	if (shift) {
+		for (size_t i = 0; i < mapSize; i++) {
+			uint32_t value = state->timestampMap[i];
+
+			state->timestampMap[i] = (value > REFRACTORY_TIMESTAMP_REBASE_SHIFT) ?
+				(value - REFRACTORY_TIMESTAMP_REBASE_SHIFT) : (0);
+		}
+
+		state->timestampBase += REFRACTORY_TIMESTAMP_REBASE_SHIFT;
+	}
+	else {
+		memset(state->timestampMap, 0, mapSize * sizeof(uint32_t));
+
+		// Start in the middle of the range, so 'never' is old right away.
+		state->timestampBase = timestamp - REFRACTORY_TIMESTAMP_REBASE_SHIFT;
+	}
+}
+
+static inline uint32_t getRelativeTimestamp(RefractoryFilterState state, int64_t timestamp) {
+	int64_t relativeTimestamp = timestamp - state->timestampBase;
+
+	if (relativeTimestamp < REFRACTORY_TIMESTAMP_REBASE_MIN
+		|| relativeTimestamp >= REFRACTORY_TIMESTAMP_REBASE_THRESHOLD) {
+		rebaseTimestampMap(state, timestamp);
+	}
+
+	return (U32T(timestamp - state->timestampBase));
+}
@@ -0,0 +1,17 @@
+/*
+ * refractoryfilter.h
+ *
+ * Per-pixel refractory period and spatial down-sampling. Removes the
+ * filtered events from the packet, so all later modules see less of them.
+ */
+
+#ifndef REFRACTORYFILTER_H_
+#define REFRACTORYFILTER_H_
+
+#include "main.h"
+
+#include <libcaer/events/polarity.h>
+
+void caerRefractoryFilter(uint16_t moduleID, caerPolarityEventPacket polarity);
+
+#endif /* REFRACTORYFILTER_H_ */
@@ -0,0 +1,522 @@
+/*
+ * roifilter.c
+ *
+ * Regions are given in the 'rois' key as 'startX:startY:endX:endY,...'
+ * (inclusive, in pixels), and turned into a bitmap of the sensor, so the
+ * per-event check costs the same for any number of regions. An empty string
+ * means the whole sensor. With 'cropAddresses', events are moved so that the
+ * top-left corner of the regions' bounding box becomes (0, 0).
+ *
+ * The rate limiter is a token bucket, refilled at 'maxEventRate' events/s
+ * following event time, holding up to 'burstSize' events. Above the budget,
+ * events pass at a steady rate, and the rest is dropped.
+ *
+ * On DAVIS devices, the regions are also set as APS readout windows, so the
+ * pixels outside aren't even read out. DVS events can only be cut in software.
+ * The device is only touched while there are regions; the readout windows it
+ * had before are restored when the regions are removed, and on exit.
+ */
+
+#include "roifilter.h"
+#include "base/mainloop.h"
+#include "base/module.h"
+#include "modules/misc/inout_compact.h"
+
+#define ROI_MAX_REGIONS 16
+#define ROI_APS_WINDOWS 4
+
+/// Token bucket fixed point: one event is worth this many tokens, so refilling
+/// by 'maxEventRate' per µs of elapsed time stays exact.
+#define ROI_TOKENS_PER_EVENT INT64_C(1000000)
+
+struct ROIFilter_region {
+	uint16_t startX;
+	uint16_t startY;
+	uint16_t endX;
+	uint16_t endY;
+};
+
+struct ROIFilter_state {
+	/// One bit per pixel (row-major), set if inside any region.
+	uint64_t *roiMap;
+	size_t roiMapSizeX;
+	size_t roiMapSizeY;
+	struct ROIFilter_region regions[ROI_MAX_REGIONS];
+	size_t regionsNumber;
+	/// Top-left corner of the bounding box of all regions.
+	uint16_t cropX;
+	uint16_t cropY;
+	/// Token bucket state.
+	int64_t tokens;
+	int64_t lastTimestamp;
+	/// Device APS configuration node, if the device has readout windows.
+	sshsNode hardwareNode;
+	int16_t apsSizeX;
+	int16_t apsSizeY;
+	bool apsHasQuadROI;
+	/// Readout windows the device had before they were first set here, as
+	/// startX, startY, endX, endY, to restore them.
+	int16_t savedWindows[ROI_APS_WINDOWS][4];
+	bool savedWindowsValid;
+	/// Configuration.
+	bool cropAddresses;
+	bool compactPacket;
+	bool hardwareROI;
+	int32_t maxEventRate;
+	int32_t burstSize;
+};
+
+typedef struct ROIFilter_state *ROIFilterState;
+
+static bool caerROIFilterInit(caerModuleData moduleData);
+static void caerROIFilterRun(caerModuleData moduleData, size_t argsNumber, va_list args);
+static void caerROIFilterConfig(caerModuleData moduleData);
+static void caerROIFilterExit(caerModuleData moduleData);
+static bool allocateROIMap(caerModuleData moduleData, ROIFilterState state, int16_t sourceID);
+static void parseRegions(caerModuleData moduleData, ROIFilterState state);
+static void updateROIMap(ROIFilterState state);
+static sshsNode findHardwareNode(sshsNode sourceInfoNode);
+static void updateHardwareROI(ROIFilterState state, bool enable);
+static void saveHardwareWindows(ROIFilterState state);
+static void restoreHardwareWindows(ROIFilterState state);
+static void setHardwareWindow(ROIFilterState state, size_t window, int16_t startX, int16_t startY, int16_t endX,
+	int16_t endY);
+static inline bool takeToken(ROIFilterState state, int64_t timestamp);
+
+static struct caer_module_functions caerROIFilterFunctions = { .moduleInit = &caerROIFilterInit, .moduleRun =
+	&caerROIFilterRun, .moduleConfig = &caerROIFilterConfig, .moduleExit = &caerROIFilterExit };
+
+void caerROIFilter(uint16_t moduleID, caerPolarityEventPacket polarity) {
+	caerModuleData moduleData = caerMainloopFindModule(moduleID, "ROIFilter");
+	if (moduleData == NULL) {
+		return;
+	}
+
+	caerModuleSM(&caerROIFilterFunctions, moduleData, sizeof(struct ROIFilter_state), 1, polarity);
+}
+
+static bool caerROIFilterInit(caerModuleData moduleData) {
+	sshsNodePutStringIfAbsent(moduleData->moduleNode, "rois", ""); // 'startX:startY:endX:endY,...', empty for all
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "cropAddresses", false);
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "maxEventRate", 0); // in events/s, 0 to disable
+	sshsNodePutIntIfAbsent(moduleData->moduleNode, "burstSize", 10000); // in events
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "compactPacket", true); // remove filtered events from packet
+	sshsNodePutBoolIfAbsent(moduleData->moduleNode, "hardwareROI", true); // set APS readout windows if available
+
+	ROIFilterState state = moduleData->moduleState;
+
+	state->cropAddresses = sshsNodeGetBool(moduleData->moduleNode, "cropAddresses");
+	state->maxEventRate = sshsNodeGetInt(moduleData->moduleNode, "maxEventRate");
+	state->burstSize = sshsNodeGetInt(moduleData->moduleNode, "burstSize");
+	state->compactPacket = sshsNodeGetBool(moduleData->moduleNode, "compactPacket");
+	state->hardwareROI = sshsNodeGetBool(moduleData->moduleNode, "hardwareROI");
+
+	parseRegions(moduleData, state);
+
+	state->lastTimestamp = -1;
+
+	// Add config listeners last, to avoid having them dangling if Init doesn't succeed.
+	sshsNodeAddAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	// Nothing that can fail here.
+	return (true);
+}
+
+static void caerROIFilterRun(caerModuleData moduleData, size_t argsNumber, va_list args) {
+	UNUSED_ARGUMENT(argsNumber);
+
+	// Interpret variable arguments (same as above in main function).
+	caerPolarityEventPacket polarity = va_arg(args, caerPolarityEventPacket);
+
+	// Only process packets with content.
+	if (polarity == NULL) {
+		return;
+	}
+
+	ROIFilterState state = moduleData->moduleState;
+
+	// If the map is not allocated yet, do it.
+	if (state->roiMap == NULL) {
+		if (!allocateROIMap(moduleData, state, caerEventPacketHeaderGetEventSource(&polarity->packetHeader))) {
+			// Failed to allocate memory, nothing to do.
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to allocate memory for roiMap.");
+			return;
+		}
+	}
+
+	const uint64_t *roiMap = state->roiMap;
+	size_t sizeX = state->roiMapSizeX;
+	bool rateLimit = (state->maxEventRate > 0);
+	bool cropAddresses = state->cropAddresses;
+	int32_t invalidNumber = 0;
+
+	CAER_POLARITY_ITERATOR_VALID_START(polarity)
+		uint16_t x = caerPolarityEventGetX(caerPolarityIteratorElement);
+		uint16_t y = caerPolarityEventGetY(caerPolarityIteratorElement);
+
+		size_t index = (size_t) y * sizeX + x;
+
+		bool valid = (roiMap[index / 64] >> (index % 64)) & 0x01;
+
+		// Only events that made it through the ROI count towards the rate.
+		if (valid && rateLimit) {
+			valid = takeToken(state, caerPolarityEventGetTimestamp64(caerPolarityIteratorElement, polarity));
+		}
+
+		if (!valid) {
+			caerPolarityEventInvalidate(caerPolarityIteratorElement, polarity);
+			invalidNumber++;
+		}
+		else if (cropAddresses) {
+			caerPolarityEventSetX(caerPolarityIteratorElement, U16T(x - state->cropX));
+			caerPolarityEventSetY(caerPolarityIteratorElement, U16T(y - state->cropY));
+		}
+	CAER_POLARITY_ITERATOR_VALID_END
+
+	// Move all valid events to the front, and drop the rest, so that later
+	// modules don't even have to skip over them.
+	if (state->compactPacket && invalidNumber != 0) {
+		caerInOutCompactEventPacket(&polarity->packetHeader);
+	}
+}
+
+static void caerROIFilterConfig(caerModuleData moduleData) {
+	caerModuleConfigUpdateReset(moduleData);
+
+	ROIFilterState state = moduleData->moduleState;
+
+	state->cropAddresses = sshsNodeGetBool(moduleData->moduleNode, "cropAddresses");
+	state->maxEventRate = sshsNodeGetInt(moduleData->moduleNode, "maxEventRate");
+	state->burstSize = sshsNodeGetInt(moduleData->moduleNode, "burstSize");
+	state->compactPacket = sshsNodeGetBool(moduleData->moduleNode, "compactPacket");
+	state->hardwareROI = sshsNodeGetBool(moduleData->moduleNode, "hardwareROI");
+
+	parseRegions(moduleData, state);
+
+	// Restart rate limiting with a full bucket.
+	state->lastTimestamp = -1;
+
+	if (state->roiMap != NULL) {
+		updateROIMap(state);
+		updateHardwareROI(state, state->hardwareROI);
+	}
+}
+
+static void caerROIFilterExit(caerModuleData moduleData) {
+	// Remove listener, which can reference invalid memory in userData.
+	sshsNodeRemoveAttributeListener(moduleData->moduleNode, moduleData, &caerModuleConfigDefaultListener);
+
+	ROIFilterState state = moduleData->moduleState;
+
+	// Give the device back its own readout windows.
+	updateHardwareROI(state, false);
+	state->hardwareNode = NULL;
+
+	// Ensure map is freed.
+	free(state->roiMap);
+	state->roiMap = NULL;
+}
+
+static bool allocateROIMap(caerModuleData moduleData, ROIFilterState state, int16_t sourceID) {
+	// Get size information from source.
+	sshsNode sourceInfoNode = caerMainloopGetSourceInfo(U16T(sourceID));
+	if (sourceInfoNode == NULL) {
+		// This should never happen, but we handle it gracefully.
+		caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString, "Failed to get source info to allocate ROI map.");
+		return (false);
+	}
+
+	state->roiMapSizeX = (size_t) sshsNodeGetShort(sourceInfoNode, "dvsSizeX");
+	state->roiMapSizeY = (size_t) sshsNodeGetShort(sourceInfoNode, "dvsSizeY");
+
+	state->roiMap = calloc((state->roiMapSizeX * state->roiMapSizeY + 63) / 64, sizeof(uint64_t));
+	if (state->roiMap == NULL) {
+		return (false);
+	}
+
+	updateROIMap(state);
+
+	// Only DAVIS devices have APS readout windows, other sources don't even have the key.
+	if (sshsNodeAttributeExists(sourceInfoNode, "apsHasQuadROI", BOOL)) {
+		state->hardwareNode = findHardwareNode(sourceInfoNode);
+		state->apsSizeX = sshsNodeGetShort(sourceInfoNode, "apsSizeX");
+		state->apsSizeY = sshsNodeGetShort(sourceInfoNode, "apsSizeY");
+		state->apsHasQuadROI = sshsNodeGetBool(sourceInfoNode, "apsHasQuadROI");
+	}
+
+	updateHardwareROI(state, state->hardwareROI);
+
+	return (true);
+}
+
+static void parseRegions(caerModuleData moduleData, ROIFilterState state) {
+	char *roisStr = sshsNodeGetString(moduleData->moduleNode, "rois");
+	const char *str = roisStr;
+
+	state->regionsNumber = 0;
+
+	while (*str != '\0') {
+		long values[4];
+		size_t valuesNumber;
+
+		for (valuesNumber = 0; valuesNumber < 4; valuesNumber++) {
+			char *end;
+
+			values[valuesNumber] = strtol(str, &end, 10);
+			if (end == str || values[valuesNumber] < 0 || values[valuesNumber] > UINT16_MAX) {
+				break;
+			}
+			str = end;
+
+			if (valuesNumber < 3) {
+				if (*str != ':') {
+					break;
+				}
+				str++;
+			}
+		}
+
+		if (valuesNumber != 4 || values[2] < values[0] || values[3] < values[1]) {
+			caerLog(CAER_LOG_ERROR, moduleData->moduleSubSystemString,
+				"Invalid region in 'rois', expected 'startX:startY:endX:endY,...'. Ignoring the rest.");
+			break;
+		}
+
+		if (state->regionsNumber == ROI_MAX_REGIONS) {
+			caerLog(CAER_LOG_WARNING, moduleData->moduleSubSystemString,
+				"More than %d regions in 'rois', ignoring the rest.", ROI_MAX_REGIONS);
+			break;
+		}
+
+		state->regions[state->regionsNumber].startX = U16T(values[0]);
+		state->regions[state->regionsNumber].startY = U16T(values[1]);
+		state->regions[state->regionsNumber].endX = U16T(values[2]);
+		state->regions[state->regionsNumber].endY = U16T(values[3]);
+		state->regionsNumber++;
+
+		if (*str == ',') {
+			str++;
+		}
+	}
+
+	free(roisStr);
+}
+
+static void updateROIMap(ROIFilterState state) {
+	size_t sizeX = state->roiMapSizeX;
+	size_t sizeY = state->roiMapSizeY;
+
+	memset(state->roiMap, 0, ((sizeX * sizeY + 63) / 64) * sizeof(uint64_t));
+
+	// No regions means everything.
+	if (state->regionsNumber == 0) {
+		for (size_t i = 0; i < sizeX * sizeY; i++) {
+			state->roiMap[i / 64] |= (UINT64_C(1) << (i % 64));
+		}
+
+		state->cropX = 0;
+		state->cropY = 0;
+
+		return;
+	}
+
+	state->cropX = UINT16_MAX;
+	state->cropY = UINT16_MAX;
+
+	for (size_t r = 0; r < state->regionsNumber; r++) {
+		struct ROIFilter_region *region = &state->regions[r];
+
+		if (region->startX < state->cropX) {
+			state->cropX = region->startX;
+		}
+		if (region->startY < state->cropY) {
+			state->cropY = region->startY;
+		}
+
+		// Clip to sensor.
+		for (size_t y = region->startY; y <= region->endY && y < sizeY; y++) {
+			for (size_t x = region->startX; x <= region->endX && x < sizeX; x++) {
+				size_t index = y * sizeX + x;
+				state->roiMap[index / 64] |= (UINT64_C(1) << (index % 64));
+			}
+		}
+	}
+}
+
+/**
+ * The device keeps its APS settings in '<chip>/aps/' under its module node,
+ * which is also the parent of 'sourceInfo/'. The chip name isn't known here,
+ * so look for the node that has the readout window settings.
+ */
+static sshsNode findHardwareNode(sshsNode sourceInfoNode) {
+	sshsNode hardwareNode = NULL;
+
+	size_t chipNodesLength = 0;
+	sshsNode *chipNodes = sshsNodeGetChildren(sshsNodeGetParent(sourceInfoNode), &chipNodesLength);
+
+	for (size_t i = 0; i < chipNodesLength && hardwareNode == NULL; i++) {
+		size_t subNodesLength = 0;
+		sshsNode *subNodes = sshsNodeGetChildren(chipNodes[i], &subNodesLength);
+
+		for (size_t j = 0; j < subNodesLength; j++) {
+			if (caerStrEquals(sshsNodeGetName(subNodes[j]), "aps")
+				&& sshsNodeAttributeExists(subNodes[j], "StartColumn0", SHORT)) {
+				hardwareNode = subNodes[j];
+				break;
+			}
+		}
+
+		free(subNodes);
+	}
+
+	free(chipNodes);
+
+	return (hardwareNode);
+}
+
+/**
+ * Set the APS readout windows to the regions, if they fit in the available
+ * windows, else to their bounding box. Disabled, or without regions, the
+ * device gets back the readout windows it had before, if they were changed.
+ */
+static void updateHardwareROI(ROIFilterState state, bool enable) {
+	if (state->hardwareNode == NULL) {
+		return;
+	}
+
+	if (!enable || state->regionsNumber == 0) {
+		restoreHardwareWindows(state);
+		return;
+	}
+
+	if (!state->savedWindowsValid) {
+		saveHardwareWindows(state);
+	}
+
+	size_t windowsNumber = (state->apsHasQuadROI) ? (ROI_APS_WINDOWS) : (1);
+	size_t usedWindows = 1;
+
+	if (state->regionsNumber <= windowsNumber) {
+		for (size_t r = 0; r < state->regionsNumber; r++) {
+			setHardwareWindow(state, r, I16T(state->regions[r].startX), I16T(state->regions[r].startY),
+				I16T(state->regions[r].endX), I16T(state->regions[r].endY));
+		}
+
+		usedWindows = state->regionsNumber;
+	}
+	else {
+		uint16_t endX = 0;
+		uint16_t endY = 0;
+
+		for (size_t r = 0; r < state->regionsNumber; r++) {
+			if (state->regions[r].endX > endX) {
+				endX = state->regions[r].endX;
+			}
+			if (state->regions[r].endY > endY) {
+				endY = state->regions[r].endY;
+			}
+		}
+
+		setHardwareWindow(state, 0, I16T(state->cropX), I16T(state->cropY), I16T(endX), I16T(endY));
+	}
+
+	// Out of range coordinates disable a window.
+	for (size_t w = usedWindows; w < windowsNumber; w++) {
+		setHardwareWindow(state, w, state->apsSizeX, state->apsSizeY, state->apsSizeX, state->apsSizeY);
+	}
+}
+
+static void saveHardwareWindows(ROIFilterState state) {
+	size_t windowsNumber = (state->apsHasQuadROI) ? (ROI_APS_WINDOWS) : (1);
+	char key[32];
+
+	for (size_t w = 0; w < windowsNumber; w++) {
+		snprintf(key, 32, "StartColumn%zu", w);
+		state->savedWindows[w][0] = sshsNodeGetShort(state->hardwareNode, key);
+
+		snprintf(key, 32, "StartRow%zu", w);
+		state->savedWindows[w][1] = sshsNodeGetShort(state->hardwareNode, key);
+
+		snprintf(key, 32, "EndColumn%zu", w);
+		state->savedWindows[w][2] = sshsNodeGetShort(state->hardwareNode, key);
+
+		snprintf(key, 32, "EndRow%zu", w);
+		state->savedWindows[w][3] = sshsNodeGetShort(state->hardwareNode, key);
+	}
+
+	state->savedWindowsValid = true;
+}
+
+static void restoreHardwareWindows(ROIFilterState state) {
+	if (!state->savedWindowsValid) {
+		return;
+	}
+
+	size_t windowsNumber = (state->apsHasQuadROI) ? (ROI_APS_WINDOWS) : (1);
+
+	for (size_t w = 0; w < windowsNumber; w++) {
+		setHardwareWindow(state, w, state->savedWindows[w][0], state->savedWindows[w][1], state->savedWindows[w][2],
+			state->savedWindows[w][3]);
+	}
+
+	state->savedWindowsValid = false;
+}
+
+/**
+ * Write into the device configuration, its listener sends it to the device,
+ * the same way apsConfigSend() does at startup.
+ */
+static void setHardwareWindow(ROIFilterState state, size_t window, int16_t startX, int16_t startY, int16_t endX,
+	int16_t endY) {
+	// Clip to the APS size, regions are in DVS pixels.
+	if (endX >= state->apsSizeX && startX < state->apsSizeX) {
+		endX = I16T(state->apsSizeX - 1);
+	}
+	if (endY >= state->apsSizeY && startY < state->apsSizeY) {
+		endY = I16T(state->apsSizeY - 1);
+	}
+
+	char key[32];
+
+	snprintf(key, 32, "StartColumn%zu", window);
+	sshsNodePutShort(state->hardwareNode, key, startX);
+
+	snprintf(key, 32, "StartRow%zu", window);
+	sshsNodePutShort(state->hardwareNode, key, startY);
+
+	snprintf(key, 32, "EndColumn%zu", window);
+	sshsNodePutShort(state->hardwareNode, key, endX);
+
+	snprintf(key, 32, "EndRow%zu", window);
+	sshsNodePutShort(state->hardwareNode, key, endY);
+}
+
+/**
+ * Refill the bucket for the time passed since the last event, then try to
+ * take one event's worth of tokens from it.
+ */
+static inline bool takeToken(ROIFilterState state, int64_t timestamp) {
+	int64_t maxTokens = I64T((state->burstSize > 1) ? (state->burstSize) : (1)) * ROI_TOKENS_PER_EVENT;
+	int64_t elapsed = timestamp - state->lastTimestamp;
+
+	// First event, or time went backwards (timestamp reset): start full.
+	if (state->lastTimestamp < 0 || elapsed < 0) {
+		state->tokens = maxTokens;
+	}
+	else if (elapsed > ((maxTokens - state->tokens) / state->maxEventRate)) {
+		state->tokens = maxTokens;
+	}
+	else {
+		state->tokens += elapsed * state->maxEventRate;
+	}
+
+	state->lastTimestamp = timestamp;
+
+	if (state->tokens < ROI_TOKENS_PER_EVENT) {
+		return (false);
+	}
+
+	state->tokens -= ROI_TOKENS_PER_EVENT;
+
+	return (true);
+}
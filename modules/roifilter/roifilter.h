@@ -0,0 +1,17 @@
+/*
+ * roifilter.h
+ *
+ * Keeps only events inside a set of regions of interest, and limits the
+ * event rate to a fixed budget, so later modules have a bounded load.
+ */
+
+#ifndef ROIFILTER_H_
+#define ROIFILTER_H_
+
+#include "main.h"
+
+#include <libcaer/events/polarity.h>
+
+void caerROIFilter(uint16_t moduleID, caerPolarityEventPacket polarity);
+
+#endif /* ROIFILTER_H_ */
@@ -792,7 +792,7 @@ bool caerVisualizerRendererFlowEvents(caerVisualizerState state, caerEventPacket
 
 	// Render valid events.
 	for (int32_t i = 0; i < caerEventPacketHeaderGetEventNumber(flowEventPacketHeader); i++) {
-		FlowEvent e = &(flow->events[i]);
+		FlowEvent e = flowEventPacketGetEvent(flow, i);
 		if (!caerPolarityEventIsValid((caerPolarityEvent) e)) { continue; } // Skip invalid polarity events.
 		if (caerPolarityEventGetPolarity((caerPolarityEvent) e)) {
 			// ON polarity (green).
@@ -808,10 +808,10 @@ bool caerVisualizerRendererFlowEvents(caerVisualizerState state, caerEventPacket
 		if (e->hasFlow) {
 			float x1 = caerPolarityEventGetX((caerPolarityEvent) e);
 			float y1 = caerPolarityEventGetY((caerPolarityEvent) e);
-			float angle = (float) (atan2(e->v,e->u)/(2*M_PI)+0.5);
-			float magnitude = (float) sqrt(e->u*e->u + e->v*e->v);
-			float x2 = x1 + (float) e->u * .1f + 10*(float)e->u/magnitude;
-			float y2 = y1 + (float) e->v * .1f + 10*(float)e->v/magnitude;
+			float angle = atan2f(e->v,e->u)/(2*(float) M_PI)+0.5f;
+			float magnitude = sqrtf(e->u*e->u + e->v*e->v);
+			float x2 = x1 + e->u * .1f + 10*e->u/magnitude;
+			float y2 = y1 + e->v * .1f + 10*e->v/magnitude;
 
 			al_draw_line(x1,y1,x2,y2, al_map_rgb(
 					(unsigned char) (255*angle),
@@ -0,0 +1,121 @@
+/*
+ * flowcsv.c
+ *
+ * Convert a binary flow event log, as written by the optic flow module,
+ * to CSV (x,y,t,p,u,v), for offline analysis.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include "modules/opticflow/flowRecord.h"
+
+#define FLOWCSV_RECORD_BUFFER 4096
+
+static bool convertHeader(FILE *input, FILE *output);
+static bool convertRecords(FILE *input, FILE *output);
+
+int main(int argc, char *argv[]) {
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: %s <flow log> [CSV file]\n"
+			"Without a CSV file, the CSV is written to stdout.\n", argv[0]);
+		return (EXIT_FAILURE);
+	}
+
+	FILE *input = fopen(argv[1], "rb");
+	if (input == NULL) {
+		fprintf(stderr, "Failed to open '%s': %s.\n", argv[1], strerror(errno));
+		return (EXIT_FAILURE);
+	}
+
+	FILE *output = stdout;
+	if (argc == 3) {
+		output = fopen(argv[2], "w");
+		if (output == NULL) {
+			fclose(input);
+
+			fprintf(stderr, "Failed to open '%s': %s.\n", argv[2], strerror(errno));
+			return (EXIT_FAILURE);
+		}
+	}
+
+	bool converted = convertHeader(input, output) && convertRecords(input, output);
+
+	fclose(input);
+	if (output != stdout) {
+		fclose(output);
+	}
+
+	return ((converted) ? (EXIT_SUCCESS) : (EXIT_FAILURE));
+}
+
+static bool convertHeader(FILE *input, FILE *output) {
+	// Check format line, then copy the remaining header lines as comments.
+	char line[1024];
+	if (fgets(line, sizeof(line), input) == NULL || strcmp(line, FLOW_RECORD_FORMAT_LINE) != 0) {
+		fprintf(stderr, "Input is not a flow event log.\n");
+		return (false);
+	}
+
+	fprintf(output, "#cAER event data with optic flow values\n");
+	while (true) {
+		if (fgets(line, sizeof(line), input) == NULL) {
+			fprintf(stderr, "Flow event log header is not terminated.\n");
+			return (false);
+		}
+		if (strcmp(line, FLOW_RECORD_END_LINE) == 0) {
+			break;
+		}
+
+		line[strcspn(line, "\r\n")] = '\0';
+		fprintf(output, "%s\n", line);
+	}
+	fprintf(output, "#x,y,t,p,u,v\n");
+
+	return (true);
+}
+
+static bool convertRecords(FILE *input, FILE *output) {
+	struct flow_record *records = malloc(FLOWCSV_RECORD_BUFFER * sizeof(struct flow_record));
+	if (records == NULL) {
+		fprintf(stderr, "Failed to allocate memory for records.\n");
+		return (false);
+	}
+
+	// Go through the blocks until the end of the file.
+	uint64_t recordTotal = 0;
+	struct flow_record_block block;
+	while (fread(&block, sizeof(block), 1, input) == 1) {
+		int32_t tsOverflow = (int32_t) le32toh((uint32_t) block.tsOverflow);
+		int32_t recordNumber = (int32_t) le32toh((uint32_t) block.recordNumber);
+
+		while (recordNumber > 0) {
+			size_t chunk = (recordNumber < FLOWCSV_RECORD_BUFFER) ? (size_t) recordNumber : FLOWCSV_RECORD_BUFFER;
+			size_t read = fread(records, sizeof(struct flow_record), chunk, input);
+
+			for (size_t i = 0; i < read; i++) {
+				struct flow_record *r = &records[i];
+				fprintf(output, "%3" PRIu16 ",%3" PRIu16 ",%10" PRIi64 ",%d,%4.3f,%4.3f\n", flowRecordGetX(r),
+					flowRecordGetY(r), flowRecordGetTimestamp64(r, tsOverflow), flowRecordGetPolarity(r),
+					(double) flowRecordGetU(r), (double) flowRecordGetV(r));
+			}
+			recordTotal += read;
+
+			if (read != chunk) {
+				// A log cut short, e.g. by a crash, still gives all complete records.
+				fprintf(stderr, "Flow event log is truncated.\n");
+				break;
+			}
+			recordNumber -= (int32_t) chunk;
+		}
+	}
+
+	free(records);
+
+	fprintf(stderr, "Converted %" PRIu64 " flow events.\n", recordTotal);
+	return (true);
+}